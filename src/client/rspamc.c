@@ -699,9 +699,10 @@ rspamc_counters_sort (const ucl_object_t **o1, const ucl_object_t **o2)
 static void
 rspamc_counters_output (FILE *out, ucl_object_t *obj)
 {
-	const ucl_object_t *cur, *sym, *weight, *freq, *tim;
+	const ucl_object_t *cur, *sym, *weight, *freq, *tim, *lat, *elt;
 	ucl_object_iter_t iter = NULL;
-	gchar fmt_buf[64], dash_buf[82];
+	gchar fmt_buf[64], dash_buf[106];
+	gdouble p50, p99;
 	gint l, max_len = INT_MIN, i;
 
 	if (obj->type != UCL_ARRAY) {
@@ -726,21 +727,23 @@ rspamc_counters_output (FILE *out, ucl_object_t *obj)
 	}
 
 	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
-		"| %%3s | %%%ds | %%6s | %%9s | %%9s |\n", max_len);
-	memset (dash_buf, '-', 40 + max_len);
-	dash_buf[40 + max_len] = '\0';
+		"| %%3s | %%%ds | %%6s | %%9s | %%9s | %%9s | %%9s |\n", max_len);
+	memset (dash_buf, '-', 64 + max_len);
+	dash_buf[64 + max_len] = '\0';
 
 	printf ("Symbols cache\n");
 	printf (" %s \n", dash_buf);
 	if (tty) {
 		printf ("\033[1m");
 	}
-	printf (fmt_buf, "Pri", "Symbol", "Weight", "Frequency", "Avg. time");
+	printf (fmt_buf, "Pri", "Symbol", "Weight", "Frequency", "Avg. time",
+			"p50 time", "p99 time");
 	if (tty) {
 		printf ("\033[0m");
 	}
 	rspamd_snprintf (fmt_buf, sizeof (fmt_buf),
-		"| %%3d | %%%ds | %%6.1f | %%9d | %%9.3f |\n", max_len);
+		"| %%3d | %%%ds | %%6.1f | %%9d | %%9.3f | %%9.3f | %%9.3f |\n",
+		max_len);
 
 	iter = NULL;
 	i = 0;
@@ -750,12 +753,29 @@ rspamc_counters_output (FILE *out, ucl_object_t *obj)
 		weight = ucl_object_find_key (cur, "weight");
 		freq = ucl_object_find_key (cur, "frequency");
 		tim = ucl_object_find_key (cur, "time");
+		lat = ucl_object_find_key (cur, "latency");
+		p50 = 0;
+		p99 = 0;
+
+		if (lat) {
+			elt = ucl_object_find_key (lat, "p50");
+			if (elt) {
+				p50 = ucl_object_todouble (elt);
+			}
+			elt = ucl_object_find_key (lat, "p99");
+			if (elt) {
+				p99 = ucl_object_todouble (elt);
+			}
+		}
+
 		if (sym && weight && freq && tim) {
 			printf (fmt_buf, i,
 				ucl_object_tostring (sym),
 				ucl_object_todouble (weight),
 				(gint)ucl_object_toint (freq),
-				ucl_object_todouble (tim));
+				ucl_object_todouble (tim),
+				p50,
+				p99);
 		}
 		i++;
 	}
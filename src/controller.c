@@ -60,6 +60,7 @@
 #define PATH_STAT "/stat"
 #define PATH_STAT_RESET "/statreset"
 #define PATH_COUNTERS "/counters"
+#define PATH_METRICS "/metrics"
 
 
 #define msg_err_session(...) rspamd_default_log_function(G_LOG_LEVEL_CRITICAL, \
@@ -173,6 +174,11 @@ struct rspamd_controller_worker_ctx {
 	struct event *rrd_event;
 	struct rspamd_rrd_file *rrd;
 
+	/* Registry ids exported by /metrics sorted by name */
+	GArray *metrics_ids;
+	guint metrics_ids_count;
+	/* Size of the last /metrics reply */
+	gsize metrics_size;
 };
 
 static gboolean
@@ -486,7 +492,7 @@ rspamd_controller_handle_auth (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
-	struct rspamd_stat *st;
+	struct rspamd_stat *st, stat_copy;
 	int64_t uptime;
 	gulong data[4];
 	ucl_object_t *obj;
@@ -496,7 +502,8 @@ rspamd_controller_handle_auth (struct rspamd_http_connection_entry *conn_ent,
 	}
 
 	obj = ucl_object_typed_new (UCL_OBJECT);
-	st = session->ctx->srv->stat;
+	rspamd_worker_stat_snapshot (session->ctx->srv, &stat_copy);
+	st = &stat_copy;
 	data[0] = st->actions_stat[METRIC_ACTION_NOACTION];
 	data[1] = st->actions_stat[METRIC_ACTION_ADD_HEADER] +
 		st->actions_stat[METRIC_ACTION_REWRITE_SUBJECT];
@@ -853,6 +860,7 @@ rspamd_controller_handle_pie_chart (
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_stat stat_copy;
 	gdouble data[5], total;
 	ucl_object_t *top;
 
@@ -863,15 +871,16 @@ rspamd_controller_handle_pie_chart (
 	}
 
 	top = ucl_object_typed_new (UCL_ARRAY);
-	total = ctx->srv->stat->messages_scanned;
+	rspamd_worker_stat_snapshot (ctx->srv, &stat_copy);
+	total = stat_copy.messages_scanned;
 	if (total != 0) {
 
-		data[0] = ctx->srv->stat->actions_stat[METRIC_ACTION_NOACTION];
-		data[1] = ctx->srv->stat->actions_stat[METRIC_ACTION_SOFT_REJECT];
-		data[2] = (ctx->srv->stat->actions_stat[METRIC_ACTION_ADD_HEADER] +
-			ctx->srv->stat->actions_stat[METRIC_ACTION_REWRITE_SUBJECT]);
-		data[3] = ctx->srv->stat->actions_stat[METRIC_ACTION_GREYLIST];
-		data[4] = ctx->srv->stat->actions_stat[METRIC_ACTION_REJECT];
+		data[0] = stat_copy.actions_stat[METRIC_ACTION_NOACTION];
+		data[1] = stat_copy.actions_stat[METRIC_ACTION_SOFT_REJECT];
+		data[2] = (stat_copy.actions_stat[METRIC_ACTION_ADD_HEADER] +
+			stat_copy.actions_stat[METRIC_ACTION_REWRITE_SUBJECT]);
+		data[3] = stat_copy.actions_stat[METRIC_ACTION_GREYLIST];
+		data[4] = stat_copy.actions_stat[METRIC_ACTION_REJECT];
 	}
 	else {
 		memset (data, 0, sizeof (data));
@@ -1768,6 +1777,89 @@ rspamd_controller_stat_cleanup_task (void *ud)
 	ucl_object_unref (cbdata->top);
 }
 
+/* Resets statistics that are gathered by all processes */
+static void
+rspamd_controller_reset_counters (struct rspamd_main *srv)
+{
+	gint i;
+
+	srv->stat->messages_scanned = 0;
+	srv->stat->messages_learned = 0;
+	srv->stat->connections_count = 0;
+	srv->stat->control_connections_count = 0;
+	memset (srv->stat->actions_stat, 0, sizeof (srv->stat->actions_stat));
+
+	if (srv->counters != NULL) {
+		for (i = 0; i < RSPAMD_COUNTER_BUILTIN_MAX; i ++) {
+			rspamd_counters_reset (srv->counters, i);
+		}
+	}
+}
+
+static ucl_object_t *
+rspamd_controller_hist_ucl (struct rspamd_counters *reg, gint id)
+{
+	ucl_object_t *obj;
+	guint64 buckets[RSPAMD_COUNTERS_HIST_BUCKETS], count, sum;
+
+	count = rspamd_counters_hist_get (reg, id, buckets, &sum);
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (count), "count", 0, false);
+	/* Histograms are in microseconds, whilst we report milliseconds */
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (count > 0 ? sum / 1000.0 / count : 0.0),
+			"mean", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (
+					rspamd_counters_hist_quantile (buckets, count, 0.5) / 1000.0),
+			"p50", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (
+					rspamd_counters_hist_quantile (buckets, count, 0.9) / 1000.0),
+			"p90", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (
+					rspamd_counters_hist_quantile (buckets, count, 0.99) / 1000.0),
+			"p99", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (
+					rspamd_counters_hist_quantile (buckets, count, 0.999) / 1000.0),
+			"p999", 0, false);
+
+	return obj;
+}
+
+/* Scan and stages times read directly from the shared counters */
+static ucl_object_t *
+rspamd_controller_latency_ucl (struct rspamd_counters *reg)
+{
+	ucl_object_t *top, *stages;
+	const gchar *name;
+	gint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+
+	if (reg == NULL) {
+		return top;
+	}
+
+	ucl_object_insert_key (top,
+			rspamd_controller_hist_ucl (reg, RSPAMD_COUNTER_SCAN_TIME),
+			"scan", 0, false);
+	stages = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = RSPAMD_COUNTER_STAGE_TIME; i < RSPAMD_COUNTER_BUILTIN_MAX; i ++) {
+		name = rspamd_counters_name (reg, i);
+		name = strchr (name, ':') + 1;
+		ucl_object_insert_key (stages, rspamd_controller_hist_ucl (reg, i),
+				name, 0, true);
+	}
+
+	ucl_object_insert_key (top, stages, "stages", 0, false);
+
+	return top;
+}
+
 /*
  * Stat command handler:
  * request: /stat (/resetstat)
@@ -1791,7 +1883,7 @@ rspamd_controller_handle_stat_common (
 	struct rspamd_stat_cbdata *cbdata;
 
 	rspamd_mempool_stat (&mem_st);
-	memcpy (&stat_copy, session->ctx->worker->srv->stat, sizeof (stat_copy));
+	rspamd_worker_stat_snapshot (session->ctx->worker->srv, &stat_copy);
 	stat = &stat_copy;
 	task = rspamd_task_new (session->ctx->worker, session->cfg);
 
@@ -1830,14 +1922,6 @@ rspamd_controller_handle_stat_common (
 			else {
 				ham += stat->actions_stat[i];
 			}
-			if (do_reset) {
-#ifndef HAVE_ATOMIC_BUILTINS
-				session->ctx->worker->srv->stat->actions_stat[i] = 0;
-#else
-				__atomic_store_n(&session->ctx->worker->srv->stat->actions_stat[i],
-						0, __ATOMIC_RELEASE);
-#endif
-			}
 		}
 		ucl_object_insert_key (top, sub, "actions", 0, false);
 	}
@@ -1892,16 +1976,37 @@ rspamd_controller_handle_stat_common (
 	}
 
 	ucl_object_insert_key (top, sub, "fuzzy_found", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->fuzzy_updates_pending),
+		"fuzzy_updates_pending", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->fuzzy_updates_coalesced),
+		"fuzzy_updates_coalesced", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->fuzzy_commit_time),
+		"fuzzy_commit_time", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->fuzzy_commit_time_max),
+		"fuzzy_commit_time_max", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->fuzzy_replica_seq),
+		"fuzzy_replica_seq", 0, false);
+	ucl_object_insert_key (top,
+		ucl_object_fromint (stat->fuzzy_replica_lag),
+		"fuzzy_replica_lag", 0, false);
+
+	ucl_object_insert_key (top,
+			rspamd_controller_latency_ucl (session->ctx->srv->counters),
+			"latency", 0, false);
 
 	if (do_reset) {
-		session->ctx->srv->stat->messages_scanned = 0;
-		session->ctx->srv->stat->messages_learned = 0;
-		session->ctx->srv->stat->connections_count = 0;
-		session->ctx->srv->stat->control_connections_count = 0;
+		rspamd_controller_reset_counters (session->ctx->srv);
 		memset (stat->fuzzy_hashes_checked, 0,
 				sizeof (stat->fuzzy_hashes_checked));
 		memset (stat->fuzzy_hashes_found, 0,
 				sizeof (stat->fuzzy_hashes_found));
+		stat->fuzzy_updates_coalesced = 0;
+		stat->fuzzy_commit_time_max = 0;
 		rspamd_mempool_stat_reset ();
 	}
 
@@ -1977,6 +2082,456 @@ rspamd_controller_handle_counters (
 	return 0;
 }
 
+/* Elements of the counters registry are named as `base:label` */
+static const struct rspamd_controller_metric_family {
+	const gchar *base;
+	const gchar *label;
+	gboolean summary;
+} rspamd_controller_metric_families[] = {
+	{"actions", "action", FALSE},
+	{"stage_time", "stage", FALSE},
+	/* There are too many symbols to export full histograms for each one */
+	{"symbol_time", "symbol", TRUE},
+};
+
+static const struct {
+	const gchar *str;
+	gdouble q;
+} rspamd_controller_metric_quantiles[] = {
+	{"0.5", 0.5},
+	{"0.9", 0.9},
+	{"0.99", 0.99},
+};
+
+static void
+rspamd_controller_metrics_label (rspamd_fstring_t **buf, const gchar *label,
+		const gchar *value)
+{
+	const gchar *p, *c;
+
+	rspamd_printf_fstring (buf, "%s=\"", label);
+
+	for (p = value, c = value; *c != '\0'; c ++) {
+		if (*c == '\\' || *c == '"' || *c == '\n') {
+			*buf = rspamd_fstring_append (*buf, p, c - p);
+			*buf = rspamd_fstring_append (*buf,
+					*c == '\n' ? "\\n" : (*c == '"' ? "\\\"" : "\\\\"), 2);
+			p = c + 1;
+		}
+	}
+
+	*buf = rspamd_fstring_append (*buf, p, c - p);
+	*buf = rspamd_fstring_append (*buf, "\"", 1);
+}
+
+/* Writes metric name with optional labels and the following space */
+static void
+rspamd_controller_metrics_sample (rspamd_fstring_t **buf, const gchar *name,
+		const gchar *suffix, const gchar *label, const gchar *value,
+		const gchar *extra_label, const gchar *extra_value)
+{
+	rspamd_printf_fstring (buf, "%s%s", name, suffix);
+
+	if (label != NULL || extra_label != NULL) {
+		*buf = rspamd_fstring_append (*buf, "{", 1);
+
+		if (label != NULL) {
+			rspamd_controller_metrics_label (buf, label, value);
+
+			if (extra_label != NULL) {
+				*buf = rspamd_fstring_append (*buf, ",", 1);
+			}
+		}
+
+		if (extra_label != NULL) {
+			rspamd_controller_metrics_label (buf, extra_label, extra_value);
+		}
+
+		*buf = rspamd_fstring_append (*buf, "}", 1);
+	}
+
+	*buf = rspamd_fstring_append (*buf, " ", 1);
+}
+
+static void
+rspamd_controller_metrics_family (rspamd_fstring_t **buf, const gchar *name,
+		const gchar *type, const gchar *help)
+{
+	if (help != NULL) {
+		rspamd_printf_fstring (buf, "# HELP %s %s\n", name, help);
+	}
+
+	rspamd_printf_fstring (buf, "# TYPE %s %s\n", name, type);
+}
+
+static void
+rspamd_controller_metrics_counter (rspamd_fstring_t **buf, const gchar *name,
+		const gchar *help, guint64 value)
+{
+	rspamd_controller_metrics_family (buf, name, "counter", help);
+	rspamd_printf_fstring (buf, "%s_total %uL\n", name, value);
+}
+
+static void
+rspamd_controller_metrics_gauge (rspamd_fstring_t **buf, const gchar *name,
+		const gchar *help, guint64 value)
+{
+	rspamd_controller_metrics_family (buf, name, "gauge", help);
+	rspamd_printf_fstring (buf, "%s %uL\n", name, value);
+}
+
+/* Histograms store microseconds, but metrics are exported in seconds */
+static void
+rspamd_controller_metrics_hist (rspamd_fstring_t **buf,
+		struct rspamd_counters *reg, gint id, const gchar *name,
+		const gchar *label, const gchar *value, gboolean summary)
+{
+	guint64 buckets[RSPAMD_COUNTERS_HIST_BUCKETS], count, sum, acc = 0;
+	gchar le[32];
+	guint i;
+
+	count = rspamd_counters_hist_get (reg, id, buckets, &sum);
+
+	if (summary) {
+		for (i = 0; i < G_N_ELEMENTS (rspamd_controller_metric_quantiles);
+				i ++) {
+			rspamd_controller_metrics_sample (buf, name, "", label, value,
+					"quantile", rspamd_controller_metric_quantiles[i].str);
+			rspamd_printf_fstring (buf, "%.6f\n",
+					rspamd_counters_hist_quantile (buckets, count,
+							rspamd_controller_metric_quantiles[i].q) / 1e6);
+		}
+	}
+	else {
+		/* Export one bucket per power of two to keep output compact */
+		for (i = 0; i < RSPAMD_COUNTERS_HIST_BUCKETS - 1; i ++) {
+			acc += buckets[i];
+
+			if ((i + 1) % RSPAMD_COUNTERS_HIST_SUB_BUCKETS == 0) {
+				rspamd_snprintf (le, sizeof (le), "%.6f",
+						rspamd_counters_hist_bucket_max (i) / 1e6);
+				rspamd_controller_metrics_sample (buf, name, "_bucket",
+						label, value, "le", le);
+				rspamd_printf_fstring (buf, "%uL\n", acc);
+			}
+		}
+
+		rspamd_controller_metrics_sample (buf, name, "_bucket",
+				label, value, "le", "+Inf");
+		rspamd_printf_fstring (buf, "%uL\n", count);
+	}
+
+	rspamd_controller_metrics_sample (buf, name, "_count", label, value,
+			NULL, NULL);
+	rspamd_printf_fstring (buf, "%uL\n", count);
+	rspamd_controller_metrics_sample (buf, name, "_sum", label, value,
+			NULL, NULL);
+	rspamd_printf_fstring (buf, "%.6f\n", sum / 1e6);
+}
+
+static gint
+rspamd_controller_metrics_cmp (gconstpointer a, gconstpointer b, gpointer ud)
+{
+	struct rspamd_counters *reg = ud;
+
+	return strcmp (rspamd_counters_name (reg, *(const gint *)a),
+			rspamd_counters_name (reg, *(const gint *)b));
+}
+
+/*
+ * Registry elements are sorted by name, so elements of the same family are
+ * adjacent. Nothing is registered after fork, so the order is computed once
+ */
+static GArray *
+rspamd_controller_metrics_ids (struct rspamd_controller_worker_ctx *ctx,
+		struct rspamd_counters *reg)
+{
+	guint i, count;
+
+	count = rspamd_counters_count (reg);
+
+	if (ctx->metrics_ids != NULL && ctx->metrics_ids_count == count) {
+		return ctx->metrics_ids;
+	}
+
+	if (ctx->metrics_ids != NULL) {
+		g_array_free (ctx->metrics_ids, TRUE);
+	}
+
+	ctx->metrics_ids = g_array_sized_new (FALSE, FALSE, sizeof (gint), count);
+	ctx->metrics_ids_count = count;
+
+	for (i = 0; i < count; i ++) {
+		/* Builtin counters are exported with the saved statistics added */
+		if (i < RSPAMD_COUNTER_BUILTIN_MAX &&
+				rspamd_counters_type (reg, i) == RSPAMD_COUNTER_TYPE_COUNTER) {
+			continue;
+		}
+
+		g_array_append_val (ctx->metrics_ids, i);
+	}
+
+	g_array_sort_with_data (ctx->metrics_ids, rspamd_controller_metrics_cmp,
+			reg);
+
+	return ctx->metrics_ids;
+}
+
+static void
+rspamd_controller_metrics_registry (rspamd_fstring_t **buf,
+		struct rspamd_controller_worker_ctx *ctx, struct rspamd_counters *reg)
+{
+	const struct rspamd_controller_metric_family *fam;
+	const gchar *full, *colon, *value, *label, *prev = NULL;
+	gchar name[128];
+	GArray *ids;
+	gsize blen, prev_len = 0, nlen;
+	gboolean summary;
+	gint id;
+	guint i, j;
+
+	ids = rspamd_controller_metrics_ids (ctx, reg);
+
+	for (i = 0; i < ids->len; i ++) {
+		id = g_array_index (ids, gint, i);
+		full = rspamd_counters_name (reg, id);
+		colon = strchr (full, ':');
+
+		if (colon != NULL) {
+			blen = colon - full;
+			value = colon + 1;
+		}
+		else {
+			blen = strlen (full);
+			value = NULL;
+		}
+
+		fam = NULL;
+
+		for (j = 0; j < G_N_ELEMENTS (rspamd_controller_metric_families); j ++) {
+			if (strlen (rspamd_controller_metric_families[j].base) == blen &&
+					memcmp (rspamd_controller_metric_families[j].base, full,
+							blen) == 0) {
+				fam = &rspamd_controller_metric_families[j];
+				break;
+			}
+		}
+
+		label = value != NULL ? (fam ? fam->label : "name") : NULL;
+		summary = fam ? fam->summary : FALSE;
+
+		nlen = rspamd_strlcpy (name, "rspamd_", sizeof (name));
+
+		for (j = 0; j < blen && nlen < sizeof (name) - sizeof ("_seconds");
+				j ++) {
+			name[nlen ++] = g_ascii_isalnum (full[j]) ? full[j] : '_';
+		}
+
+		name[nlen] = '\0';
+
+		if (rspamd_counters_type (reg, id) == RSPAMD_COUNTER_TYPE_HISTOGRAM) {
+			rspamd_strlcpy (name + nlen, "_seconds", sizeof (name) - nlen);
+
+			if (prev == NULL || prev_len != blen ||
+					memcmp (prev, full, blen) != 0) {
+				rspamd_controller_metrics_family (buf, name,
+						summary ? "summary" : "histogram", NULL);
+			}
+
+			rspamd_controller_metrics_hist (buf, reg, id, name, label, value,
+					summary);
+		}
+		else {
+			if (prev == NULL || prev_len != blen ||
+					memcmp (prev, full, blen) != 0) {
+				rspamd_controller_metrics_family (buf, name, "counter", NULL);
+			}
+
+			rspamd_controller_metrics_sample (buf, name, "_total", label,
+					value, NULL, NULL);
+			rspamd_printf_fstring (buf, "%uL\n",
+					rspamd_counters_get (reg, id));
+		}
+
+		prev = full;
+		prev_len = blen;
+	}
+}
+
+static void
+rspamd_controller_metrics_symbol_hits (const struct rspamd_symbol_stat *st,
+		gpointer ud)
+{
+	rspamd_fstring_t **buf = ud;
+
+	rspamd_controller_metrics_sample (buf, "rspamd_symbol_hits", "_total",
+			"symbol", st->symbol, NULL, NULL);
+	rspamd_printf_fstring (buf, "%ud\n", st->frequency);
+}
+
+static void
+rspamd_controller_metrics_symbol_weight (const struct rspamd_symbol_stat *st,
+		gpointer ud)
+{
+	rspamd_fstring_t **buf = ud;
+
+	rspamd_controller_metrics_sample (buf, "rspamd_symbol_weight", "",
+			"symbol", st->symbol, NULL, NULL);
+	rspamd_printf_fstring (buf, "%.4f\n", st->weight);
+}
+
+/*
+ * Metrics command handler:
+ * request: /metrics
+ * headers: Password
+ * reply: OpenMetrics text exposition of all counters
+ */
+static int
+rspamd_controller_handle_metrics (
+	struct rspamd_http_connection_entry *conn_ent,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_controller_session *session = conn_ent->ud;
+	struct rspamd_controller_worker_ctx *ctx;
+	struct rspamd_http_message *reply;
+	struct rspamd_stat st;
+	rspamd_mempool_stat_t mem_st;
+	rspamd_fstring_t *buf;
+	gchar epoch[16];
+	gint i;
+
+	if (!rspamd_controller_check_password (conn_ent, session, msg, FALSE)) {
+		return 0;
+	}
+
+	ctx = session->ctx;
+	rspamd_worker_stat_snapshot (ctx->srv, &st);
+	rspamd_mempool_stat (&mem_st);
+	/* Output is written to the reply buffer directly */
+	buf = rspamd_fstring_sized_new (MAX (ctx->metrics_size, BUFSIZ));
+
+	rspamd_controller_metrics_family (&buf, "rspamd_info", "gauge",
+			"Version of rspamd");
+	rspamd_controller_metrics_sample (&buf, "rspamd_info", "", "version",
+			RVERSION, NULL, NULL);
+	rspamd_printf_fstring (&buf, "1\n");
+	rspamd_controller_metrics_gauge (&buf, "rspamd_uptime_seconds",
+			"Time since the controller has been started",
+			time (NULL) - ctx->start_time);
+
+	rspamd_controller_metrics_counter (&buf, "rspamd_scanned",
+			"Messages scanned", st.messages_scanned);
+	rspamd_controller_metrics_counter (&buf, "rspamd_learned",
+			"Messages learned", st.messages_learned);
+	rspamd_controller_metrics_counter (&buf, "rspamd_connections",
+			"Connections to scanners", st.connections_count);
+	rspamd_controller_metrics_counter (&buf, "rspamd_control_connections",
+			"Connections to the controller", st.control_connections_count);
+	rspamd_controller_metrics_family (&buf, "rspamd_actions", "counter",
+			"Messages by action");
+
+	for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i ++) {
+		rspamd_controller_metrics_sample (&buf, "rspamd_actions", "_total",
+				"action", rspamd_action_to_str (i), NULL, NULL);
+		rspamd_printf_fstring (&buf, "%ud\n", st.actions_stat[i]);
+	}
+
+	/* Latency histograms and custom counters */
+	if (ctx->srv->counters != NULL) {
+		rspamd_controller_metrics_registry (&buf, ctx, ctx->srv->counters);
+	}
+
+	if (ctx->cfg->cache != NULL) {
+		rspamd_controller_metrics_family (&buf, "rspamd_symbol_hits",
+				"counter", "Number of times symbol has been inserted");
+		rspamd_symbols_cache_foreach_stat (ctx->cfg->cache,
+				rspamd_controller_metrics_symbol_hits, &buf);
+		rspamd_controller_metrics_family (&buf, "rspamd_symbol_weight",
+				"gauge", "Weight of symbol");
+		rspamd_symbols_cache_foreach_stat (ctx->cfg->cache,
+				rspamd_controller_metrics_symbol_weight, &buf);
+	}
+
+	rspamd_controller_metrics_gauge (&buf, "rspamd_fuzzy_stored",
+			"Fuzzy hashes stored", st.fuzzy_hashes);
+	rspamd_controller_metrics_counter (&buf, "rspamd_fuzzy_expired",
+			"Fuzzy hashes expired", st.fuzzy_hashes_expired);
+	rspamd_controller_metrics_family (&buf, "rspamd_fuzzy_checked", "counter",
+			"Fuzzy check requests by protocol epoch");
+
+	for (i = RSPAMD_FUZZY_EPOCH6; i < RSPAMD_FUZZY_EPOCH_MAX; i ++) {
+		rspamd_snprintf (epoch, sizeof (epoch), "%d", i);
+		rspamd_controller_metrics_sample (&buf, "rspamd_fuzzy_checked",
+				"_total", "epoch", epoch, NULL, NULL);
+		rspamd_printf_fstring (&buf, "%uL\n", st.fuzzy_hashes_checked[i]);
+	}
+
+	rspamd_controller_metrics_family (&buf, "rspamd_fuzzy_found", "counter",
+			"Fuzzy hashes found by protocol epoch");
+
+	for (i = RSPAMD_FUZZY_EPOCH6; i < RSPAMD_FUZZY_EPOCH_MAX; i ++) {
+		rspamd_snprintf (epoch, sizeof (epoch), "%d", i);
+		rspamd_controller_metrics_sample (&buf, "rspamd_fuzzy_found",
+				"_total", "epoch", epoch, NULL, NULL);
+		rspamd_printf_fstring (&buf, "%uL\n", st.fuzzy_hashes_found[i]);
+	}
+
+	rspamd_controller_metrics_gauge (&buf, "rspamd_fuzzy_updates_pending",
+			"Fuzzy updates waiting for commit", st.fuzzy_updates_pending);
+	rspamd_controller_metrics_counter (&buf, "rspamd_fuzzy_updates_coalesced",
+			"Fuzzy updates merged with the pending ones",
+			st.fuzzy_updates_coalesced);
+	rspamd_controller_metrics_family (&buf, "rspamd_fuzzy_commit_seconds",
+			"gauge", "Duration of the last fuzzy commit");
+	rspamd_printf_fstring (&buf, "rspamd_fuzzy_commit_seconds %.3f\n",
+			st.fuzzy_commit_time / 1000.0);
+	rspamd_controller_metrics_family (&buf, "rspamd_fuzzy_commit_max_seconds",
+			"gauge", "Maximum duration of fuzzy commits");
+	rspamd_printf_fstring (&buf, "rspamd_fuzzy_commit_max_seconds %.3f\n",
+			st.fuzzy_commit_time_max / 1000.0);
+	rspamd_controller_metrics_gauge (&buf, "rspamd_fuzzy_replica_seq",
+			"Last update applied from replication master",
+			st.fuzzy_replica_seq);
+	rspamd_controller_metrics_gauge (&buf, "rspamd_fuzzy_replica_lag",
+			"Updates replica is behind master", st.fuzzy_replica_lag);
+
+	rspamd_controller_metrics_counter (&buf, "rspamd_mempool_pools_allocated",
+			"Memory pools allocated", mem_st.pools_allocated);
+	rspamd_controller_metrics_counter (&buf, "rspamd_mempool_pools_freed",
+			"Memory pools freed", mem_st.pools_freed);
+	/* Freed chunks are subtracted, so this is the current usage */
+	rspamd_controller_metrics_gauge (&buf, "rspamd_mempool_bytes_allocated",
+			"Bytes currently allocated by memory pools",
+			mem_st.bytes_allocated);
+	rspamd_controller_metrics_counter (&buf, "rspamd_mempool_chunks_allocated",
+			"Memory pool chunks allocated", mem_st.chunks_allocated);
+	rspamd_controller_metrics_counter (&buf,
+			"rspamd_mempool_shared_chunks_allocated",
+			"Shared memory pool chunks allocated",
+			mem_st.shared_chunks_allocated);
+	rspamd_controller_metrics_counter (&buf, "rspamd_mempool_chunks_freed",
+			"Memory pool chunks freed", mem_st.chunks_freed);
+	rspamd_controller_metrics_counter (&buf, "rspamd_mempool_chunks_oversized",
+			"Oversized memory pool chunks", mem_st.oversized_chunks);
+
+	rspamd_printf_fstring (&buf, "# EOF\n");
+	ctx->metrics_size = MAX (ctx->metrics_size, buf->len);
+
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+	reply->code = 200;
+	reply->status = rspamd_fstring_new_init ("OK", 2);
+	reply->body = buf;
+	rspamd_http_connection_reset (conn_ent->conn);
+	rspamd_http_connection_write_message (conn_ent->conn, reply, NULL,
+		"application/openmetrics-text; version=1.0.0; charset=utf-8",
+		conn_ent, conn_ent->conn->fd,
+		conn_ent->rt->ptv, conn_ent->rt->ev_base);
+	conn_ent->is_reply = TRUE;
+
+	return 0;
+}
+
 static int
 rspamd_controller_handle_custom (struct rspamd_http_connection_entry *conn_ent,
 	struct rspamd_http_message *msg)
@@ -2024,7 +2579,8 @@ rspamd_controller_finish_handler (struct rspamd_http_connection_entry *conn_ent)
 {
 	struct rspamd_controller_session *session = conn_ent->ud;
 
-	session->ctx->worker->srv->stat->control_connections_count++;
+	rspamd_counters_inc (session->ctx->worker->srv->counters,
+			RSPAMD_COUNTER_CONTROL_CONNECTIONS);
 	msg_debug_session ("destroy session %p", session);
 
 	if (session->task != NULL) {
@@ -2080,7 +2636,7 @@ static void
 rspamd_controller_rrd_update (gint fd, short what, void *arg)
 {
 	struct rspamd_controller_worker_ctx *ctx = arg;
-	struct rspamd_stat *stat;
+	struct rspamd_stat *stat, stat_copy;
 	GArray ar;
 	gdouble points[4];
 	GError *err = NULL;
@@ -2088,7 +2644,8 @@ rspamd_controller_rrd_update (gint fd, short what, void *arg)
 	gdouble val;
 
 	g_assert (ctx->rrd != NULL);
-	stat = ctx->srv->stat;
+	rspamd_worker_stat_snapshot (ctx->srv, &stat_copy);
+	stat = &stat_copy;
 
 	for (i = METRIC_ACTION_REJECT, j = 0;
 		 i <= METRIC_ACTION_NOACTION && j < G_N_ELEMENTS (points);
@@ -2229,13 +2786,15 @@ rspamd_controller_load_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 	}
 
 	ucl_object_unref (obj);
+	/* Loaded values replace the ones gathered by workers */
+	rspamd_controller_reset_counters (ctx->srv);
 	memcpy (stat, &stat_copy, sizeof (stat_copy));
 }
 
 static void
 rspamd_controller_store_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 {
-	struct rspamd_stat *stat;
+	struct rspamd_stat *stat, stat_copy;
 	ucl_object_t *top, *sub;
 	gint i, fd;
 
@@ -2257,7 +2816,8 @@ rspamd_controller_store_saved_stats (struct rspamd_controller_worker_ctx *ctx)
 		return;
 	}
 
-	stat = ctx->srv->stat;
+	rspamd_worker_stat_snapshot (ctx->srv, &stat_copy);
+	stat = &stat_copy;
 
 	top = ucl_object_typed_new (UCL_OBJECT);
 	ucl_object_insert_key (top, ucl_object_fromint (
@@ -2528,6 +3088,9 @@ start_controller_worker (struct rspamd_worker *worker)
 	rspamd_http_router_add_path (ctx->http,
 			PATH_COUNTERS,
 			rspamd_controller_handle_counters);
+	rspamd_http_router_add_path (ctx->http,
+			PATH_METRICS,
+			rspamd_controller_handle_metrics);
 
 	if (ctx->key) {
 		rspamd_http_router_set_key (ctx->http, ctx->key);
@@ -2574,6 +3137,10 @@ start_controller_worker (struct rspamd_worker *worker)
 		rspamd_rrd_close (ctx->rrd);
 	}
 
+	if (ctx->metrics_ids) {
+		g_array_free (ctx->metrics_ids, TRUE);
+	}
+
 	if (ctx->cached_password.len > 0) {
 		m = (gpointer)ctx->cached_password.begin;
 		munmap (m, ctx->cached_password.len);
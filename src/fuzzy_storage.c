@@ -39,12 +39,24 @@
 #include "keypairs_cache.h"
 #include "keypair_private.h"
 #include "ref.h"
+#include "http.h"
 
 /* This number is used as expire time in seconds for cache items  (2 days) */
 #define DEFAULT_EXPIRE 172800L
 /* Resync value in seconds */
 #define DEFAULT_SYNC_TIMEOUT 60.0
 #define DEFAULT_KEYPAIR_CACHE_SIZE 512
+/* Pending updates are committed when either of these limits is reached */
+#define DEFAULT_UPDATES_MAXLEN 1024
+#define DEFAULT_UPDATES_MAX_AGE 10.0
+/* Replication defaults */
+#define DEFAULT_REPLICATION_PORT 11336
+#define DEFAULT_REPLICATION_LOG_SIZE 1000000
+#define DEFAULT_REPLICATION_BATCH 1024
+#define MAX_REPLICATION_BATCH 65536
+#define DEFAULT_REPLICATION_INTERVAL 1.0
+#define DEFAULT_REPLICATION_TIMEOUT 10.0
+#define PATH_REPLICATION "/sync"
 
 
 #define INVALID_NODE_TIME (guint64) - 1
@@ -83,7 +95,37 @@ struct rspamd_fuzzy_storage_ctx {
 	gpointer key;
 	struct rspamd_keypair_cache *keypair_cache;
 	struct rspamd_fuzzy_backend *backend;
+	/* Updates in order of arrival, each digest is queued once */
 	GQueue *updates_pending;
+	GHashTable *updates_coalesced;
+	guint updates_maxlen;
+	gdouble updates_max_age;
+	guint updates_failures;
+	struct event updates_ev;
+	/* Replication master */
+	guint replication_log_size;
+	gboolean replication_log;
+	gchar *replication_map;
+	radix_compressed_t *replication_ips;
+	GList *replication_keys;
+	GHashTable *replication_pubkeys;
+	struct rspamd_http_connection_router *replication_router;
+	GList *replication_events;
+	/* Replica */
+	gchar *replication_master;
+	gchar *replication_master_key;
+	gdouble replication_interval;
+	guint replication_batch;
+	GPtrArray *replica_addrs;
+	guint replica_cur;
+	gpointer replica_peer_key;
+	gpointer replica_local_key;
+	struct rspamd_http_connection *replica_conn;
+	gint replica_fd;
+	guint64 replica_seq;
+	gboolean replica_diverged;
+	struct event replica_ev;
+	struct timeval replication_io_tv;
 };
 
 enum fuzzy_cmd_type {
@@ -128,7 +170,14 @@ struct fuzzy_peer_request {
 	struct fuzzy_peer_cmd cmd;
 };
 
+struct fuzzy_pending_update {
+	struct fuzzy_peer_cmd cmd;
+	gboolean delete_first; /* Digest has been deleted earlier in this batch */
+};
+
 static void rspamd_fuzzy_write_reply (struct fuzzy_session *session);
+static void rspamd_fuzzy_schedule_updates (struct rspamd_fuzzy_storage_ctx *ctx,
+		gdouble delay);
 
 static gboolean
 rspamd_fuzzy_check_client (struct fuzzy_session *session)
@@ -142,52 +191,225 @@ rspamd_fuzzy_check_client (struct fuzzy_session *session)
 	return TRUE;
 }
 
+static guint
+rspamd_fuzzy_digest_hash (gconstpointer p)
+{
+	guint h;
+
+	/* Digest is a cryptographic hash itself */
+	memcpy (&h, p, sizeof (h));
+
+	return h;
+}
+
+static gboolean
+rspamd_fuzzy_digest_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, rspamd_cryptobox_HASHBYTES) == 0;
+}
+
+static inline gsize
+rspamd_fuzzy_cmd_len (const struct rspamd_fuzzy_cmd *cmd)
+{
+	return cmd->shingles_count > 0 ?
+			sizeof (struct rspamd_fuzzy_shingle_cmd) : sizeof (*cmd);
+}
+
+/*
+ * Applies update to the backend, should be called within update transaction,
+ * so the updates log is consistent with the database
+ */
+static void
+rspamd_fuzzy_apply_cmd (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct rspamd_fuzzy_cmd *cmd)
+{
+	if (cmd->cmd == FUZZY_WRITE) {
+		rspamd_fuzzy_backend_add (ctx->backend, cmd);
+	}
+	else {
+		rspamd_fuzzy_backend_del (ctx->backend, cmd);
+	}
+
+	if (ctx->replication_log) {
+		rspamd_fuzzy_backend_log_update (ctx->backend, cmd,
+				rspamd_fuzzy_cmd_len (cmd));
+	}
+}
+
+static void
+rspamd_fuzzy_updates_free (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	struct fuzzy_pending_update *up;
+
+	while ((up = g_queue_pop_head (ctx->updates_pending)) != NULL) {
+		g_slice_free1 (sizeof (*up), up);
+	}
+
+	g_hash_table_remove_all (ctx->updates_coalesced);
+	server_stat->fuzzy_updates_pending = 0;
+}
+
 static void
 rspamd_fuzzy_process_updates_queue (struct rspamd_fuzzy_storage_ctx *ctx)
 {
 	GList *cur;
-	struct fuzzy_peer_cmd *cmd;
-	guint nupdates = 0;
+	struct fuzzy_pending_update *up;
+	struct rspamd_fuzzy_cmd del_cmd;
+	guint nupdates = 0, commit_time;
+	const gchar *reason;
+	gdouble t1;
+
+	if (ctx->updates_pending == NULL ||
+			g_queue_get_length (ctx->updates_pending) == 0) {
+		return;
+	}
+
+	if (evtimer_pending (&ctx->updates_ev, NULL)) {
+		event_del (&ctx->updates_ev);
+	}
+
+	t1 = rspamd_get_ticks ();
 
 	if (rspamd_fuzzy_backend_prepare_update (ctx->backend)) {
 		cur = ctx->updates_pending->head;
 		while (cur) {
-			cmd = cur->data;
+			up = cur->data;
 
-			if (cmd->cmd.normal.cmd == FUZZY_WRITE) {
-				rspamd_fuzzy_backend_add (ctx->backend, &cmd->cmd.normal);
-			}
-			else {
-				rspamd_fuzzy_backend_del (ctx->backend, &cmd->cmd.normal);
+			if (up->delete_first) {
+				memcpy (&del_cmd, &up->cmd.cmd.normal, sizeof (del_cmd));
+				del_cmd.cmd = FUZZY_DEL;
+				del_cmd.shingles_count = 0;
+				rspamd_fuzzy_apply_cmd (ctx, &del_cmd);
 			}
 
+			rspamd_fuzzy_apply_cmd (ctx, &up->cmd.cmd.normal);
+
 			nupdates++;
 			cur = g_list_next (cur);
 		}
 
 		if (rspamd_fuzzy_backend_finish_update (ctx->backend)) {
 			server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (ctx->backend);
-			cur = ctx->updates_pending->head;
+			rspamd_fuzzy_updates_free (ctx);
+			ctx->updates_failures = 0;
+			commit_time = (rspamd_get_ticks () - t1) * 1000.0;
+			server_stat->fuzzy_commit_time = commit_time;
 
-			while (cur) {
-				cmd = cur->data;
-				g_slice_free1 (sizeof (*cmd), cmd);
-				cur = g_list_next (cur);
+			if (commit_time > server_stat->fuzzy_commit_time_max) {
+				server_stat->fuzzy_commit_time_max = commit_time;
 			}
 
-			g_queue_clear (ctx->updates_pending);
-			msg_info ("updated fuzzy storage: %ud updates processed", nupdates);
+			msg_info ("updated fuzzy storage: %ud updates processed in %ud ms",
+					nupdates, commit_time);
+
+			return;
 		}
 		else {
-			msg_err ("cannot commit update transaction to fuzzy backend, "
-					"%ud updates are still pending",
-					g_queue_get_length (ctx->updates_pending));
+			reason = "commit update transaction";
 		}
 	}
 	else {
-		msg_err ("cannot start transaction in fuzzy backend, "
-				"%ud updates are still pending",
-				g_queue_get_length (ctx->updates_pending));
+		reason = "start transaction";
+	}
+
+	/* Updates are kept in memory and retried until the backend recovers */
+	ctx->updates_failures ++;
+	msg_err ("cannot %s in fuzzy backend, %ud updates are still pending "
+			"after %ud attempts, retry in %.1f seconds",
+			reason,
+			g_queue_get_length (ctx->updates_pending),
+			ctx->updates_failures,
+			ctx->updates_max_age);
+	rspamd_fuzzy_schedule_updates (ctx, ctx->updates_max_age);
+}
+
+static void
+rspamd_fuzzy_updates_cb (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+
+	rspamd_fuzzy_process_updates_queue (ctx);
+}
+
+static void
+rspamd_fuzzy_schedule_updates (struct rspamd_fuzzy_storage_ctx *ctx,
+		gdouble delay)
+{
+	struct timeval tv;
+
+	if (evtimer_pending (&ctx->updates_ev, NULL)) {
+		if (delay > 0) {
+			/* Do not postpone the already planned commit */
+			return;
+		}
+
+		event_del (&ctx->updates_ev);
+	}
+
+	double_to_tv (delay, &tv);
+	evtimer_add (&ctx->updates_ev, &tv);
+}
+
+/*
+ * Queues update merging it with the pending update of the same digest,
+ * so the whole batch touches each digest once
+ */
+static void
+rspamd_fuzzy_push_update (struct rspamd_fuzzy_storage_ctx *ctx,
+		const struct rspamd_fuzzy_cmd *cmd, gsize len)
+{
+	struct fuzzy_pending_update *up;
+	const struct rspamd_fuzzy_shingle_cmd *shcmd;
+
+	up = g_hash_table_lookup (ctx->updates_coalesced, cmd->digest);
+
+	if (up == NULL) {
+		up = g_slice_alloc0 (sizeof (*up));
+		memcpy (&up->cmd, cmd, len);
+		g_queue_push_tail (ctx->updates_pending, up);
+		g_hash_table_insert (ctx->updates_coalesced,
+				up->cmd.cmd.normal.digest, up);
+	}
+	else {
+		server_stat->fuzzy_updates_coalesced ++;
+
+		if (cmd->cmd == FUZZY_WRITE) {
+			if (up->cmd.cmd.normal.cmd == FUZZY_WRITE) {
+				/* Backend sums values and keeps flag of an existing digest */
+				up->cmd.cmd.normal.value += cmd->value;
+
+				if (up->cmd.cmd.normal.shingles_count == 0 &&
+						cmd->shingles_count > 0) {
+					shcmd = (const struct rspamd_fuzzy_shingle_cmd *)cmd;
+					memcpy (&up->cmd.cmd.shingle.sgl, &shcmd->sgl,
+							sizeof (shcmd->sgl));
+					up->cmd.cmd.normal.shingles_count = cmd->shingles_count;
+				}
+			}
+			else {
+				/* Digest is removed and then added again */
+				memset (&up->cmd, 0, sizeof (up->cmd));
+				memcpy (&up->cmd, cmd, len);
+				up->delete_first = TRUE;
+			}
+		}
+		else {
+			/* Deletion discards all previous updates of the digest */
+			memset (&up->cmd, 0, sizeof (up->cmd));
+			memcpy (&up->cmd, cmd, len);
+			up->delete_first = FALSE;
+		}
+	}
+
+	server_stat->fuzzy_updates_pending = g_queue_get_length (
+			ctx->updates_pending);
+
+	if (server_stat->fuzzy_updates_pending >= ctx->updates_maxlen &&
+			ctx->updates_failures == 0) {
+		rspamd_fuzzy_schedule_updates (ctx, 0.0);
+	}
+	else {
+		rspamd_fuzzy_schedule_updates (ctx, ctx->updates_max_age);
 	}
 }
 
@@ -258,7 +480,6 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 	gboolean encrypted = FALSE;
 	struct rspamd_fuzzy_cmd *cmd;
 	struct rspamd_fuzzy_reply result;
-	struct fuzzy_peer_cmd *up_cmd;
 	struct fuzzy_peer_request *up_req;
 	gsize up_len;
 
@@ -309,9 +530,7 @@ rspamd_fuzzy_process_command (struct fuzzy_session *session)
 
 			if (session->worker->index == 0 || session->ctx->peer_fd == -1) {
 				/* Just add to the queue */
-				up_cmd = g_slice_alloc (sizeof (*up_cmd));
-				memcpy (up_cmd, cmd, up_len);
-				g_queue_push_tail (session->ctx->updates_pending, up_cmd);
+				rspamd_fuzzy_push_update (session->ctx, cmd, up_len);
 			}
 			else {
 				/* We need to send request to the peer */
@@ -355,7 +574,13 @@ rspamd_fuzzy_command_valid (struct rspamd_fuzzy_cmd *cmd, gint r)
 {
 	enum rspamd_fuzzy_epoch ret = RSPAMD_FUZZY_EPOCH_MAX;
 
-	if (cmd->version == RSPAMD_FUZZY_VERSION) {
+	if (cmd->version == RSPAMD_FUZZY_VERSION ||
+			cmd->version == RSPAMD_FUZZY_VERSION_FAST_SHINGLES) {
+		/*
+		 * Shingles generated by different algorithms are not comparable but
+		 * they can safely live in the same storage, as they almost never
+		 * collide
+		 */
 		if (cmd->shingles_count > 0) {
 			if (r == sizeof (struct rspamd_fuzzy_shingle_cmd)) {
 				ret = RSPAMD_FUZZY_EPOCH9;
@@ -577,6 +802,449 @@ accept_fuzzy_socket (gint fd, short what, void *arg)
 	}
 }
 
+/*
+ * Sends records of the updates log following the `Seq` header of request
+ */
+static int
+rspamd_fuzzy_replication_handler (struct rspamd_http_connection_entry *conn_ent,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = conn_ent->ud;
+	struct rspamd_http_message *reply;
+	const rspamd_ftok_t *hdr;
+	GString *pubkey;
+	gulong from = 0, limit = DEFAULT_REPLICATION_BATCH;
+	gchar numbuf[64];
+	gboolean allowed;
+
+	if (!rspamd_http_connection_is_encrypted (conn_ent->conn)) {
+		msg_info ("deny unencrypted replication request");
+		rspamd_controller_send_error (conn_ent, 403, "Encryption required");
+
+		return 0;
+	}
+
+	if (ctx->replication_pubkeys != NULL) {
+		pubkey = rspamd_http_connection_print_key (msg->peer_key,
+				RSPAMD_KEYPAIR_PUBKEY | RSPAMD_KEYPAIR_BASE32);
+		allowed = g_hash_table_lookup (ctx->replication_pubkeys,
+				pubkey->str) != NULL;
+
+		if (!allowed) {
+			msg_info ("deny replication request from unknown key %s",
+					pubkey->str);
+		}
+
+		g_string_free (pubkey, TRUE);
+
+		if (!allowed) {
+			rspamd_controller_send_error (conn_ent, 403, "Forbidden");
+
+			return 0;
+		}
+	}
+
+	hdr = rspamd_http_message_find_header (msg, "Seq");
+
+	if (hdr != NULL && !rspamd_strtoul (hdr->begin, hdr->len, &from)) {
+		rspamd_controller_send_error (conn_ent, 400, "Invalid sequence");
+
+		return 0;
+	}
+
+	hdr = rspamd_http_message_find_header (msg, "Limit");
+
+	if (hdr != NULL && rspamd_strtoul (hdr->begin, hdr->len, &limit)) {
+		limit = MIN (limit, MAX_REPLICATION_BATCH);
+	}
+
+	reply = rspamd_http_new_message (HTTP_RESPONSE);
+	reply->date = time (NULL);
+	reply->code = 200;
+	reply->status = rspamd_fstring_new_init ("OK", 2);
+	reply->body = rspamd_fstring_sized_new (BUFSIZ);
+	rspamd_fuzzy_backend_log_fetch (ctx->backend, from, limit,
+			rspamd_fuzzy_backend_log_serialize, &reply->body);
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%uL",
+			rspamd_fuzzy_backend_log_last (ctx->backend));
+	rspamd_http_message_add_header (reply, "Last-Seq", numbuf);
+
+	rspamd_http_connection_reset (conn_ent->conn);
+	rspamd_http_connection_write_message (conn_ent->conn,
+			reply,
+			NULL,
+			"application/octet-stream",
+			conn_ent,
+			conn_ent->conn->fd,
+			conn_ent->rt->ptv,
+			conn_ent->rt->ev_base);
+	conn_ent->is_reply = TRUE;
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_replication_accept (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	rspamd_inet_addr_t *addr;
+	gint nfd;
+
+	if ((nfd = rspamd_accept_from_socket (fd, &addr)) == -1) {
+		msg_warn ("accept failed: %s", strerror (errno));
+		return;
+	}
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		return;
+	}
+
+	if (ctx->replication_ips != NULL &&
+			radix_find_compressed_addr (ctx->replication_ips, addr) ==
+			RADIX_NO_VALUE) {
+		msg_info ("deny replication request from %s",
+				rspamd_inet_address_to_string (addr));
+		rspamd_inet_address_destroy (addr);
+		close (nfd);
+
+		return;
+	}
+
+	rspamd_inet_address_destroy (addr);
+	rspamd_http_router_handle_socket (ctx->replication_router, nfd, ctx);
+}
+
+static gboolean
+rspamd_fuzzy_is_stream_socket (gint fd)
+{
+	gint type = 0;
+	socklen_t optlen = sizeof (type);
+
+	if (getsockopt (fd, SOL_SOCKET, SO_TYPE, &type, &optlen) == -1) {
+		return FALSE;
+	}
+
+	return type == SOCK_STREAM;
+}
+
+/*
+ * Serves replicas on stream sockets from `bind_socket`, these sockets are
+ * created by the main process as the worker has no privileges to bind them
+ */
+static gboolean
+rspamd_fuzzy_replication_listen (struct rspamd_worker *worker,
+		struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	GList *cur;
+	struct event *accept_event;
+	gpointer pk;
+	GString *pubkey;
+	gint sock;
+
+	for (cur = worker->cf->listen_socks; cur != NULL; cur = g_list_next (cur)) {
+		if (rspamd_fuzzy_is_stream_socket (GPOINTER_TO_INT (cur->data))) {
+			break;
+		}
+	}
+
+	if (cur == NULL) {
+		/* Replication is not configured */
+		return FALSE;
+	}
+
+	if (ctx->key == NULL) {
+		msg_err ("keypair is required for replication");
+		return FALSE;
+	}
+
+	if (ctx->replication_map == NULL && ctx->replication_keys == NULL) {
+		msg_err ("replication_allow or replication_keys must be set to "
+				"serve replicas, replication is disabled");
+		return FALSE;
+	}
+
+	if (ctx->replication_map != NULL) {
+		if (!rspamd_map_add (worker->srv->cfg, ctx->replication_map,
+				"Allow replication to specified addresses",
+				rspamd_radix_read, rspamd_radix_fin,
+				(void **)&ctx->replication_ips)) {
+			if (!radix_add_generic_iplist (ctx->replication_map,
+					&ctx->replication_ips)) {
+				msg_err ("cannot load or parse ip list from '%s', "
+						"replication is disabled", ctx->replication_map);
+				return FALSE;
+			}
+		}
+	}
+
+	if (ctx->replication_keys != NULL) {
+		ctx->replication_pubkeys = g_hash_table_new_full (rspamd_str_hash,
+				rspamd_str_equal, g_free, NULL);
+
+		for (cur = ctx->replication_keys; cur != NULL;
+				cur = g_list_next (cur)) {
+			pk = rspamd_http_connection_make_peer_key (cur->data);
+
+			if (pk == NULL) {
+				msg_err ("invalid replica key: %s", (const gchar *)cur->data);
+				continue;
+			}
+
+			/* Keys are compared in the canonical form */
+			pubkey = rspamd_http_connection_print_key (pk,
+					RSPAMD_KEYPAIR_PUBKEY | RSPAMD_KEYPAIR_BASE32);
+			g_hash_table_insert (ctx->replication_pubkeys,
+					g_string_free (pubkey, FALSE), GINT_TO_POINTER (1));
+			rspamd_http_connection_key_unref (pk);
+		}
+	}
+
+	ctx->replication_router = rspamd_http_router_new (NULL, NULL,
+			&ctx->replication_io_tv, ctx->ev_base, NULL,
+			rspamd_keypair_cache_new (32));
+	rspamd_http_router_set_key (ctx->replication_router, ctx->key);
+	rspamd_http_router_add_path (ctx->replication_router, PATH_REPLICATION,
+			rspamd_fuzzy_replication_handler);
+
+	for (cur = worker->cf->listen_socks; cur != NULL; cur = g_list_next (cur)) {
+		sock = GPOINTER_TO_INT (cur->data);
+
+		if (sock == -1 || !rspamd_fuzzy_is_stream_socket (sock)) {
+			continue;
+		}
+
+		accept_event = g_slice_alloc0 (sizeof (struct event));
+		event_set (accept_event, sock, EV_READ | EV_PERSIST,
+				rspamd_fuzzy_replication_accept, ctx);
+		event_base_set (ctx->ev_base, accept_event);
+		event_add (accept_event, NULL);
+		ctx->replication_events = g_list_prepend (ctx->replication_events,
+				accept_event);
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_replica_cleanup (struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	if (ctx->replica_conn != NULL) {
+		rspamd_http_connection_unref (ctx->replica_conn);
+		ctx->replica_conn = NULL;
+	}
+
+	if (ctx->replica_fd != -1) {
+		close (ctx->replica_fd);
+		ctx->replica_fd = -1;
+	}
+}
+
+static void
+rspamd_fuzzy_replica_schedule (struct rspamd_fuzzy_storage_ctx *ctx,
+		gdouble delay)
+{
+	struct timeval tv;
+
+	double_to_tv (delay, &tv);
+	evtimer_add (&ctx->replica_ev, &tv);
+}
+
+/*
+ * Applies the whole reply in one transaction together with the sequence
+ * number, so a restarted replica resumes from the last applied record
+ */
+static gboolean
+rspamd_fuzzy_replica_apply (struct rspamd_fuzzy_storage_ctx *ctx,
+		const guchar *p, gsize len, guint *nrecords)
+{
+	guint64 seq = ctx->replica_seq;
+	enum rspamd_fuzzy_replica_status status;
+
+	if (!rspamd_fuzzy_backend_prepare_update (ctx->backend)) {
+		return FALSE;
+	}
+
+	status = rspamd_fuzzy_backend_log_apply (ctx->backend, p, len,
+			ctx->replication_log, &seq, nrecords);
+
+	if (status == RSPAMD_FUZZY_REPLICA_INVALID) {
+		msg_err ("invalid replication stream from %s, applied updates up to "
+				"sequence %uL", ctx->replication_master, seq);
+	}
+	else if (status == RSPAMD_FUZZY_REPLICA_GAP) {
+		ctx->replica_diverged = TRUE;
+	}
+
+	if (seq != ctx->replica_seq) {
+		rspamd_fuzzy_backend_set_source_seq (ctx->backend,
+				ctx->replication_master, seq);
+	}
+
+	if (!rspamd_fuzzy_backend_finish_update (ctx->backend)) {
+		return FALSE;
+	}
+
+	ctx->replica_seq = seq;
+
+	return TRUE;
+}
+
+static void
+rspamd_fuzzy_replica_error (struct rspamd_http_connection *conn, GError *err)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = conn->ud;
+
+	msg_err ("replication request to %s failed: %e",
+			ctx->replication_master, err);
+	rspamd_fuzzy_replica_cleanup (ctx);
+	rspamd_fuzzy_replica_schedule (ctx, ctx->replication_interval);
+}
+
+static gint
+rspamd_fuzzy_replica_finish (struct rspamd_http_connection *conn,
+		struct rspamd_http_message *msg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = conn->ud;
+	const rspamd_ftok_t *hdr;
+	gulong master_seq = 0;
+	guint nrecords = 0;
+	gdouble delay = ctx->replication_interval;
+
+	if (msg->code != 200) {
+		msg_err ("replication master %s replied with code %d",
+				ctx->replication_master, msg->code);
+	}
+	else if (!rspamd_fuzzy_replica_apply (ctx,
+			(const guchar *)msg->body_buf.begin, msg->body_buf.len,
+			&nrecords)) {
+		msg_err ("cannot apply updates from %s", ctx->replication_master);
+	}
+	else {
+		hdr = rspamd_http_message_find_header (msg, "Last-Seq");
+
+		if (hdr != NULL) {
+			rspamd_strtoul (hdr->begin, hdr->len, &master_seq);
+		}
+
+		if (nrecords > 0) {
+			msg_info ("applied %ud updates from %s, sequence: %uL",
+					nrecords, ctx->replication_master, ctx->replica_seq);
+			server_stat->fuzzy_hashes = rspamd_fuzzy_backend_count (
+					ctx->backend);
+		}
+
+		server_stat->fuzzy_replica_seq = ctx->replica_seq;
+		server_stat->fuzzy_replica_lag = master_seq > ctx->replica_seq ?
+				master_seq - ctx->replica_seq : 0;
+
+		if (ctx->replica_diverged) {
+			/* Lag is kept as the number of updates that cannot be fetched */
+			msg_err ("updates following sequence %uL are no longer in the "
+					"updates log of %s, replication is stopped: copy the "
+					"database from master and restart the storage",
+					ctx->replica_seq, ctx->replication_master);
+			rspamd_fuzzy_replica_cleanup (ctx);
+
+			return 0;
+		}
+
+		if (nrecords >= ctx->replication_batch) {
+			/* Fetch the rest immediately */
+			delay = 0.0;
+		}
+	}
+
+	rspamd_fuzzy_replica_cleanup (ctx);
+	rspamd_fuzzy_replica_schedule (ctx, delay);
+
+	return 0;
+}
+
+static void
+rspamd_fuzzy_replica_request (gint fd, short what, void *arg)
+{
+	struct rspamd_fuzzy_storage_ctx *ctx = arg;
+	struct rspamd_http_message *msg;
+	rspamd_inet_addr_t *addr;
+	gchar numbuf[64];
+
+	addr = g_ptr_array_index (ctx->replica_addrs,
+			ctx->replica_cur ++ % ctx->replica_addrs->len);
+	ctx->replica_fd = rspamd_inet_address_connect (addr, SOCK_STREAM, TRUE);
+
+	if (ctx->replica_fd == -1) {
+		msg_err ("cannot connect to replication master %s: %s",
+				rspamd_inet_address_to_string (addr), strerror (errno));
+		rspamd_fuzzy_replica_schedule (ctx, ctx->replication_interval);
+
+		return;
+	}
+
+	ctx->replica_conn = rspamd_http_connection_new (NULL,
+			rspamd_fuzzy_replica_error,
+			rspamd_fuzzy_replica_finish,
+			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT,
+			NULL);
+	rspamd_http_connection_set_key (ctx->replica_conn, ctx->replica_local_key);
+
+	msg = rspamd_http_new_message (HTTP_REQUEST);
+	msg->url = rspamd_fstring_append (msg->url, PATH_REPLICATION,
+			sizeof (PATH_REPLICATION) - 1);
+	msg->peer_key = rspamd_http_connection_key_ref (ctx->replica_peer_key);
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%uL", ctx->replica_seq);
+	rspamd_http_message_add_header (msg, "Seq", numbuf);
+	rspamd_snprintf (numbuf, sizeof (numbuf), "%ud", ctx->replication_batch);
+	rspamd_http_message_add_header (msg, "Limit", numbuf);
+
+	rspamd_http_connection_write_message (ctx->replica_conn, msg, NULL, NULL,
+			ctx, ctx->replica_fd, &ctx->replication_io_tv, ctx->ev_base);
+}
+
+static gboolean
+rspamd_fuzzy_replica_init (struct rspamd_worker *worker,
+		struct rspamd_fuzzy_storage_ctx *ctx)
+{
+	if (ctx->replication_master_key == NULL ||
+			(ctx->replica_peer_key = rspamd_http_connection_make_peer_key (
+					ctx->replication_master_key)) == NULL) {
+		msg_err ("valid replication_master_key is required for replication");
+		return FALSE;
+	}
+
+	if (!rspamd_parse_host_port (ctx->replication_master, &ctx->replica_addrs,
+			NULL, DEFAULT_REPLICATION_PORT, worker->srv->cfg->cfg_pool)) {
+		msg_err ("cannot parse replication master address: %s",
+				ctx->replication_master);
+		return FALSE;
+	}
+
+	if (ctx->key) {
+		ctx->replica_local_key = rspamd_http_connection_key_ref (ctx->key);
+	}
+	else {
+		ctx->replica_local_key = rspamd_http_connection_gen_key ();
+	}
+
+	ctx->replica_seq = rspamd_fuzzy_backend_source_seq (ctx->backend,
+			ctx->replication_master);
+
+	if (ctx->replica_seq == 0) {
+		/* Database copied from master continues from the end of its log */
+		ctx->replica_seq = rspamd_fuzzy_backend_log_last (ctx->backend);
+	}
+
+	server_stat->fuzzy_replica_seq = ctx->replica_seq;
+	msg_info ("replicate updates from %s starting after sequence %uL",
+			ctx->replication_master, ctx->replica_seq);
+
+	evtimer_set (&ctx->replica_ev, rspamd_fuzzy_replica_request, ctx);
+	event_base_set (ctx->ev_base, &ctx->replica_ev);
+	rspamd_fuzzy_replica_schedule (ctx, 0.0);
+
+	return TRUE;
+}
+
 static void
 sync_callback (gint fd, short what, void *arg)
 {
@@ -597,6 +1265,13 @@ sync_callback (gint fd, short what, void *arg)
 		if (old_expired < new_expired) {
 			server_stat->fuzzy_hashes_expired += new_expired - old_expired;
 		}
+
+		if (ctx->replication_log) {
+			rspamd_fuzzy_backend_log_expire (ctx->backend,
+					ctx->replication_log_size);
+		}
+
+		rspamd_fuzzy_backend_checkpoint (ctx->backend);
 	}
 
 	/* Timer event */
@@ -661,6 +1336,11 @@ init_fuzzy (struct rspamd_config *cfg)
 	ctx->sync_timeout = DEFAULT_SYNC_TIMEOUT;
 	ctx->expire = DEFAULT_EXPIRE;
 	ctx->keypair_cache_size = DEFAULT_KEYPAIR_CACHE_SIZE;
+	ctx->updates_maxlen = DEFAULT_UPDATES_MAXLEN;
+	ctx->updates_max_age = DEFAULT_UPDATES_MAX_AGE;
+	ctx->replication_log_size = DEFAULT_REPLICATION_LOG_SIZE;
+	ctx->replication_batch = DEFAULT_REPLICATION_BATCH;
+	ctx->replication_interval = DEFAULT_REPLICATION_INTERVAL;
 
 	rspamd_rcl_register_worker_option (cfg, type, "hashfile",
 			rspamd_rcl_parse_struct_string, ctx,
@@ -688,6 +1368,54 @@ init_fuzzy (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
 					expire), RSPAMD_CL_FLAG_TIME_FLOAT);
 
+	rspamd_rcl_register_worker_option (cfg, type, "updates_maxlen",
+			rspamd_rcl_parse_struct_integer, ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					updates_maxlen),
+			RSPAMD_CL_FLAG_UINT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "updates_max_age",
+			rspamd_rcl_parse_struct_time, ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					updates_max_age), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_allow",
+			rspamd_rcl_parse_struct_string, ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					replication_map), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_keys",
+			rspamd_rcl_parse_struct_string_list, ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					replication_keys), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_log_size",
+			rspamd_rcl_parse_struct_integer, ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					replication_log_size),
+			RSPAMD_CL_FLAG_UINT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_master",
+			rspamd_rcl_parse_struct_string, ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					replication_master), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_master_key",
+			rspamd_rcl_parse_struct_string, ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					replication_master_key), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_interval",
+			rspamd_rcl_parse_struct_time, ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					replication_interval), RSPAMD_CL_FLAG_TIME_FLOAT);
+
+	rspamd_rcl_register_worker_option (cfg, type, "replication_batch",
+			rspamd_rcl_parse_struct_integer, ctx,
+			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx,
+					replication_batch),
+			RSPAMD_CL_FLAG_UINT);
+
 	rspamd_rcl_register_worker_option (cfg, type, "allow_update",
 			rspamd_rcl_parse_struct_string, ctx,
 			G_STRUCT_OFFSET (struct rspamd_fuzzy_storage_ctx, update_map), 0);
@@ -708,7 +1436,7 @@ init_fuzzy (struct rspamd_config *cfg)
 static void
 rspamd_fuzzy_peer_io (gint fd, gshort what, gpointer d)
 {
-	struct fuzzy_peer_cmd cmd, *pcmd;
+	struct fuzzy_peer_cmd cmd;
 	struct rspamd_fuzzy_storage_ctx *ctx = d;
 	gssize r;
 
@@ -718,9 +1446,7 @@ rspamd_fuzzy_peer_io (gint fd, gshort what, gpointer d)
 		msg_err ("cannot read command from peers: %s", strerror (errno));
 	}
 	else {
-		pcmd = g_slice_alloc (sizeof (*pcmd));
-		memcpy (pcmd, &cmd, sizeof (cmd));
-		g_queue_push_tail (ctx->updates_pending, pcmd);
+		rspamd_fuzzy_push_update (ctx, &cmd.cmd.normal, sizeof (cmd));
 	}
 }
 
@@ -745,7 +1471,9 @@ fuzzy_peer_rep (struct rspamd_worker *worker,
 	cur = worker->cf->listen_socks;
 	while (cur) {
 		listen_socket = GPOINTER_TO_INT (cur->data);
-		if (listen_socket != -1) {
+		/* Stream sockets are used for replication only */
+		if (listen_socket != -1 &&
+				!rspamd_fuzzy_is_stream_socket (listen_socket)) {
 			accept_event = g_slice_alloc0 (sizeof (struct event));
 			event_set (accept_event, listen_socket, EV_READ | EV_PERSIST,
 					accept_fuzzy_socket, worker);
@@ -757,13 +1485,20 @@ fuzzy_peer_rep (struct rspamd_worker *worker,
 		cur = g_list_next (cur);
 	}
 
-	if (worker->index == 0 && ctx->peer_fd != -1) {
-		/* Listen for peer requests */
-		event_set (&ctx->peer_ev, ctx->peer_fd, EV_READ | EV_PERSIST,
-				rspamd_fuzzy_peer_io, ctx);
-		event_base_set (ctx->ev_base, &ctx->peer_ev);
-		event_add (&ctx->peer_ev, NULL);
+	if (worker->index == 0) {
+		if (ctx->peer_fd != -1) {
+			/* Listen for peer requests */
+			event_set (&ctx->peer_ev, ctx->peer_fd, EV_READ | EV_PERSIST,
+					rspamd_fuzzy_peer_io, ctx);
+			event_base_set (ctx->ev_base, &ctx->peer_ev);
+			event_add (&ctx->peer_ev, NULL);
+		}
+
 		ctx->updates_pending = g_queue_new ();
+		ctx->updates_coalesced = g_hash_table_new (rspamd_fuzzy_digest_hash,
+				rspamd_fuzzy_digest_equal);
+		evtimer_set (&ctx->updates_ev, rspamd_fuzzy_updates_cb, ctx);
+		event_base_set (ctx->ev_base, &ctx->updates_ev);
 
 		/* Timer event */
 		evtimer_set (&tev, sync_callback, worker);
@@ -784,11 +1519,14 @@ start_fuzzy (struct rspamd_worker *worker)
 	struct rspamd_fuzzy_storage_ctx *ctx = worker->ctx;
 	GError *err = NULL;
 	struct rspamd_srv_command srv_cmd;
+	struct event *accept_event;
+	GList *cur;
 
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"fuzzy",
 			NULL);
 	ctx->peer_fd = -1;
+	ctx->replica_fd = -1;
 	server_stat = worker->srv->stat;
 
 	/*
@@ -827,6 +1565,17 @@ start_fuzzy (struct rspamd_worker *worker)
 		}
 	}
 
+	/* Replication is performed by the process that writes to the database */
+	if (worker->index == 0) {
+		double_to_tv (DEFAULT_REPLICATION_TIMEOUT, &ctx->replication_io_tv);
+
+		ctx->replication_log = rspamd_fuzzy_replication_listen (worker, ctx);
+
+		if (ctx->replication_master != NULL) {
+			rspamd_fuzzy_replica_init (worker, ctx);
+		}
+	}
+
 	/* Maps events */
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base);
 
@@ -845,10 +1594,44 @@ start_fuzzy (struct rspamd_worker *worker)
 	rspamd_worker_block_signals ();
 
 	if (worker->index == 0) {
-		rspamd_fuzzy_process_updates_queue (ctx);
+		if (ctx->updates_pending) {
+			rspamd_fuzzy_process_updates_queue (ctx);
+
+			if (g_queue_get_length (ctx->updates_pending) > 0) {
+				msg_err ("%ud pending updates are lost on shutdown",
+						g_queue_get_length (ctx->updates_pending));
+			}
+
+			rspamd_fuzzy_updates_free (ctx);
+			g_queue_free (ctx->updates_pending);
+			g_hash_table_unref (ctx->updates_coalesced);
+		}
+
 		rspamd_fuzzy_backend_sync (ctx->backend, ctx->expire, TRUE);
 	}
 
+	if (ctx->replica_local_key) {
+		rspamd_fuzzy_replica_cleanup (ctx);
+		rspamd_http_connection_key_unref (ctx->replica_local_key);
+		rspamd_http_connection_key_unref (ctx->replica_peer_key);
+	}
+
+	if (ctx->replication_router) {
+		for (cur = ctx->replication_events; cur != NULL;
+				cur = g_list_next (cur)) {
+			accept_event = cur->data;
+			event_del (accept_event);
+			g_slice_free1 (sizeof (*accept_event), accept_event);
+		}
+
+		g_list_free (ctx->replication_events);
+		rspamd_http_router_free (ctx->replication_router);
+	}
+
+	if (ctx->replication_pubkeys) {
+		g_hash_table_unref (ctx->replication_pubkeys);
+	}
+
 	rspamd_fuzzy_backend_close (ctx->backend);
 	rspamd_log_close (worker->srv->logger);
 
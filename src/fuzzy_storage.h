@@ -7,6 +7,8 @@
 #include "cryptobox.h"
 
 #define RSPAMD_FUZZY_VERSION 3
+/* The same as RSPAMD_FUZZY_VERSION but shingles are generated by the fast algorithm */
+#define RSPAMD_FUZZY_VERSION_FAST_SHINGLES 4
 
 /* Commands for fuzzy storage */
 #define FUZZY_CHECK 0
@@ -55,8 +55,38 @@ worker_t hs_helper_worker = {
  */
 struct hs_helper_ctx {
 	gchar *hs_dir;
+	guint max_processes;
 	struct rspamd_config *cfg;
 	struct event_base *ev_base;
+	struct rspamd_worker *worker;
+	/* Compiler processes that are running now */
+	GPtrArray *compilers;
+	/* Control socket waiting for recompile reply */
+	gint reply_fd;
+	gboolean failed;
+	gint ncompiled;
+	gdouble start_time;
+};
+
+/*
+ * Compiler process, each one compiles its own part of regexp classes
+ */
+struct hs_helper_compiler {
+	struct hs_helper_ctx *ctx;
+	pid_t pid;
+	gint fd;
+	gboolean finished;
+	struct event ev;
+};
+
+/*
+ * Sent by a compiler process after each class, the last notice has
+ * the total number of regexps compiled or -1 in case of error
+ */
+struct hs_helper_notice {
+	gint nre;
+	gboolean last;
+	gchar class_hash[rspamd_cryptobox_HASHBYTES + 1];
 };
 
 static gpointer
@@ -70,10 +100,20 @@ init_hs_helper (struct rspamd_config *cfg)
 
 	ctx->cfg = cfg;
 	ctx->hs_dir = RSPAMD_DBDIR "/";
+	ctx->reply_fd = -1;
+#ifdef HAVE_SC_NPROCESSORS_ONLN
+	ctx->max_processes = MAX (sysconf (_SC_NPROCESSORS_ONLN), 1);
+#else
+	ctx->max_processes = 1;
+#endif
 
 	rspamd_rcl_register_worker_option (cfg, type, "cache_dir",
 			rspamd_rcl_parse_struct_string, ctx,
 			G_STRUCT_OFFSET (struct hs_helper_ctx, hs_dir), 0);
+	rspamd_rcl_register_worker_option (cfg, type, "max_processes",
+			rspamd_rcl_parse_struct_integer, ctx,
+			G_STRUCT_OFFSET (struct hs_helper_ctx, max_processes),
+			RSPAMD_CL_FLAG_UINT);
 
 	return ctx;
 }
@@ -126,33 +166,232 @@ rspamd_hs_helper_cleanup_dir (struct hs_helper_ctx *ctx)
 	return ret;
 }
 
+static void
+rspamd_hs_helper_publish (struct hs_helper_ctx *ctx, const gchar *class_hash)
+{
+	struct rspamd_srv_command srv_cmd;
+
+	memset (&srv_cmd, 0, sizeof (srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_HYPERSCAN_LOADED;
+	srv_cmd.cmd.hs_loaded.cache_dir = ctx->hs_dir;
+
+	if (class_hash != NULL) {
+		rspamd_strlcpy (srv_cmd.cmd.hs_loaded.class_hash, class_hash,
+				sizeof (srv_cmd.cmd.hs_loaded.class_hash));
+	}
+
+	rspamd_srv_send_command (ctx->worker, ctx->ev_base, &srv_cmd, NULL, NULL);
+}
+
+static void
+rspamd_hs_helper_write_notice (gint fd, struct hs_helper_notice *notice)
+{
+	/* Notice is smaller than PIPE_BUF, so it is written atomically */
+	while (write (fd, notice, sizeof (*notice)) == -1) {
+		if (errno != EINTR) {
+			msg_err ("cannot write notice to the hs helper: %s",
+					strerror (errno));
+			break;
+		}
+	}
+}
+
+static void
+rspamd_hs_helper_class_compiled (struct rspamd_re_cache *cache,
+		const gchar *class_hash, gint nre, gpointer ud)
+{
+	struct hs_helper_notice notice;
+
+	if (nre > 0) {
+		memset (&notice, 0, sizeof (notice));
+		notice.nre = nre;
+		rspamd_strlcpy (notice.class_hash, class_hash,
+				sizeof (notice.class_hash));
+		rspamd_hs_helper_write_notice (GPOINTER_TO_INT (ud), &notice);
+	}
+}
+
+static void
+rspamd_hs_helper_compile_part (struct hs_helper_ctx *ctx, guint part,
+		guint nparts, gint fd)
+{
+	GError *err = NULL;
+	struct hs_helper_notice notice;
+
+	memset (&notice, 0, sizeof (notice));
+	notice.last = TRUE;
+	notice.nre = rspamd_re_cache_compile_hyperscan_part (ctx->cfg->re_cache,
+			ctx->hs_dir, part, nparts,
+			rspamd_hs_helper_class_compiled, GINT_TO_POINTER (fd),
+			&err);
+
+	if (notice.nre == -1) {
+		msg_err ("failed to compile re cache: %e", err);
+		g_error_free (err);
+	}
+
+	rspamd_hs_helper_write_notice (fd, &notice);
+	close (fd);
+
+	exit (notice.nre == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static void
+rspamd_hs_helper_finish (struct hs_helper_ctx *ctx)
+{
+	struct rspamd_control_reply rep;
+
+	g_ptr_array_free (ctx->compilers, TRUE);
+	ctx->compilers = NULL;
+
+	if (!ctx->failed) {
+		msg_info ("compiled %d regular expressions to the hyperscan tree "
+				"in %.3f seconds",
+				ctx->ncompiled, rspamd_get_ticks () - ctx->start_time);
+		/* Workers load all classes that are not yet published */
+		rspamd_hs_helper_publish (ctx, NULL);
+	}
+	else {
+		msg_err ("failed to compile re cache");
+	}
+
+	if (ctx->reply_fd != -1) {
+		memset (&rep, 0, sizeof (rep));
+		rep.type = RSPAMD_CONTROL_RECOMPILE;
+		rep.reply.recompile.status = !ctx->failed;
+
+		if (write (ctx->reply_fd, &rep, sizeof (rep)) != sizeof (rep)) {
+			msg_err ("cannot write reply to the control socket: %s",
+					strerror (errno));
+		}
+
+		ctx->reply_fd = -1;
+	}
+	else if (ctx->failed) {
+		/* Tell main not to respawn more workers */
+		exit (EXIT_SUCCESS);
+	}
+}
+
+static void
+rspamd_hs_helper_compiler_handler (gint fd, short what, gpointer ud)
+{
+	struct hs_helper_compiler *comp = ud;
+	struct hs_helper_ctx *ctx = comp->ctx;
+	struct hs_helper_notice notice;
+	gssize r;
+
+	r = read (fd, &notice, sizeof (notice));
+
+	if (r == sizeof (notice)) {
+		notice.class_hash[sizeof (notice.class_hash) - 1] = '\0';
+
+		if (notice.last) {
+			comp->finished = TRUE;
+
+			if (notice.nre == -1) {
+				ctx->failed = TRUE;
+			}
+			else {
+				ctx->ncompiled += notice.nre;
+			}
+		}
+		else {
+			/* Workers can use this class without waiting for others */
+			msg_debug ("publish re class %s of %d regexps",
+					notice.class_hash, notice.nre);
+			rspamd_hs_helper_publish (ctx, notice.class_hash);
+		}
+
+		return;
+	}
+	else if (r == -1 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	}
+
+	/* Compiler has finished */
+	if (!comp->finished) {
+		msg_err ("hyperscan compiler %P has terminated unexpectedly",
+				comp->pid);
+		ctx->failed = TRUE;
+	}
+
+	event_del (&comp->ev);
+	close (comp->fd);
+	g_ptr_array_remove_fast (ctx->compilers, comp);
+	g_slice_free1 (sizeof (*comp), comp);
+
+	if (ctx->compilers->len == 0) {
+		rspamd_hs_helper_finish (ctx);
+	}
+}
+
 static gboolean
 rspamd_rs_compile (struct hs_helper_ctx *ctx, struct rspamd_worker *worker)
 {
-	GError *err = NULL;
-	static struct rspamd_srv_command srv_cmd;
-	gint ncompiled;
+	struct hs_helper_compiler *comp;
+	guint i, nparts;
+	gint fds[2];
+	pid_t pid;
+
+	if (ctx->compilers != NULL) {
+		msg_info ("hyperscan compilation is already in progress");
+		return FALSE;
+	}
 
 	if (!rspamd_hs_helper_cleanup_dir (ctx)) {
 		msg_warn ("cannot cleanup cache dir '%s'", ctx->hs_dir);
 	}
 
-	if ((ncompiled = rspamd_re_cache_compile_hyperscan (ctx->cfg->re_cache,
-			ctx->hs_dir,
-			&err)) == -1) {
-		msg_err ("failed to compile re cache: %e", err);
-		g_error_free (err);
+	nparts = MAX (ctx->max_processes, 1);
+	ctx->compilers = g_ptr_array_sized_new (nparts);
+	ctx->failed = FALSE;
+	ctx->ncompiled = 0;
+	ctx->start_time = rspamd_get_ticks ();
+
+	/* Each process compiles its own part of classes */
+	for (i = 0; i < nparts; i ++) {
+		if (pipe (fds) == -1) {
+			msg_err ("cannot create pipe: %s", strerror (errno));
+			ctx->failed = TRUE;
+			break;
+		}
 
-		return FALSE;
+		pid = fork ();
+
+		if (pid == 0) {
+			close (fds[0]);
+			rspamd_hs_helper_compile_part (ctx, i, nparts, fds[1]);
+			/* Not reached */
+		}
+		else if (pid == -1) {
+			msg_err ("cannot fork hyperscan compiler: %s", strerror (errno));
+			close (fds[0]);
+			close (fds[1]);
+			ctx->failed = TRUE;
+			break;
+		}
+
+		close (fds[1]);
+		comp = g_slice_alloc0 (sizeof (*comp));
+		comp->ctx = ctx;
+		comp->pid = pid;
+		comp->fd = fds[0];
+		event_set (&comp->ev, comp->fd, EV_READ | EV_PERSIST,
+				rspamd_hs_helper_compiler_handler, comp);
+		event_base_set (ctx->ev_base, &comp->ev);
+		event_add (&comp->ev, NULL);
+		g_ptr_array_add (ctx->compilers, comp);
 	}
 
-	msg_info ("compiled %d regular expressions to the hyperscan tree",
-			ncompiled);
+	msg_info ("started %d hyperscan compilers", ctx->compilers->len);
 
-	srv_cmd.type = RSPAMD_SRV_HYPERSCAN_LOADED;
-	srv_cmd.cmd.hs_loaded.cache_dir = ctx->hs_dir;
+	if (ctx->compilers->len == 0) {
+		g_ptr_array_free (ctx->compilers, TRUE);
+		ctx->compilers = NULL;
 
-	rspamd_srv_send_command (worker, ctx->ev_base, &srv_cmd, NULL, NULL);
+		return FALSE;
+	}
 
 	return TRUE;
 }
@@ -167,14 +406,20 @@ rspamd_hs_helper_reload (struct rspamd_main *rspamd_main,
 	struct hs_helper_ctx *ctx = ud;
 
 	msg_info ("recompiling hyperscan expressions after receiving reload command");
-	memset (&rep, 0, sizeof (rep));
-	rep.type = RSPAMD_CONTROL_RECOMPILE;
-
-	rep.reply.recompile.status = rspamd_rs_compile (ctx, worker);
 
-	if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
-		msg_err ("cannot write reply to the control socket: %s",
-				strerror (errno));
+	if (rspamd_rs_compile (ctx, worker)) {
+		/* Reply is sent when all compilers are finished */
+		ctx->reply_fd = fd;
+	}
+	else {
+		memset (&rep, 0, sizeof (rep));
+		rep.type = RSPAMD_CONTROL_RECOMPILE;
+		rep.reply.recompile.status = FALSE;
+
+		if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
+			msg_err ("cannot write reply to the control socket: %s",
+					strerror (errno));
+		}
 	}
 
 	return TRUE;
@@ -188,6 +433,7 @@ start_hs_helper (struct rspamd_worker *worker)
 	ctx->ev_base = rspamd_prepare_worker (worker,
 			"hs_helper",
 			NULL);
+	ctx->worker = worker;
 
 	if (!rspamd_rs_compile (ctx, worker)) {
 		/* Tell main not to respawn more workers */
@@ -28,6 +28,7 @@ struct rspamd_stat_classifier;
 struct module_s;
 struct worker_s;
 struct rspamd_external_libs_ctx;
+struct rspamd_redis_pool;
 
 enum { VAL_UNDEF=0, VAL_TRUE, VAL_FALSE };
 
@@ -92,6 +93,8 @@ struct rspamd_symbols_group {
 
 #define RSPAMD_SYMBOL_FLAG_ONESHOT (1 << 0)
 #define RSPAMD_SYMBOL_FLAG_IGNORE (1 << 1)
+/* Score is defined in the metric section of the config */
+#define RSPAMD_SYMBOL_FLAG_CONFIG (1 << 2)
 
 /**
  * Symbol definition
@@ -150,6 +153,7 @@ struct rspamd_worker_bind_conf {
 	guint cnt;
 	gchar *name;
 	gboolean is_systemd;
+	gint socktype;                                  /**< socket type from `tcp:` or `udp:` prefix, 0 for default */
 	struct rspamd_worker_bind_conf *next;
 };
 
@@ -231,6 +235,8 @@ struct rspamd_config {
 	gboolean strict_protocol_headers;               /**< strictly check protocol headers					*/
 	gboolean check_all_filters;                     /**< check all filters									*/
 	gboolean allow_raw_input;                       /**< scan messages with invalid mime					*/
+	gboolean fast_reload;                           /**< apply changed scores without restarting workers	*/
+	gboolean prefork_warmup;                        /**< load shared data before spawning workers			*/
 
 	gsize max_diff;                                 /**< maximum diff size for text parts					*/
 
@@ -294,7 +300,12 @@ struct rspamd_config {
 
 	gchar * checksum;                               /**< real checksum of config file						*/
 	gchar * dump_checksum;                          /**< dump checksum of config file						*/
+	GHashTable *sections_checksums;                 /**< checksums of top level sections					*/
+	GHashTable *lua_deps;                           /**< lua files loaded by config and their checksums	*/
 	gpointer lua_state;                             /**< pointer to lua state								*/
+	gpointer lua_thread_pool;                       /**< pool of lua coroutines for rules					*/
+	guint lua_gc_step;                              /**< size of lua gc step performed between tasks (Kb)	*/
+	guint lua_gc_pause;                             /**< lua gc pause (percents), 0 means lua default		*/
 
 	gchar * rrd_file;                               /**< rrd file to store statistics						*/
 
@@ -314,6 +325,10 @@ struct rspamd_config {
 	gdouble upstream_error_time;					/**< rate of upstream errors							*/
 	gdouble upstream_revive_time;					/**< revive timeout for upstreams						*/
 	struct upstream_ctx *ups_ctx;					/**< upstream context									*/
+	struct rspamd_redis_pool *redis_pool;			/**< pool of redis connections							*/
+	gdouble redis_pool_timeout;						/**< timeout for idle redis connections					*/
+	guint redis_pool_max_idle;						/**< maximum idle redis connections per server			*/
+	guint redis_pool_max_pipeline;					/**< maximum clients of a single redis connection		*/
 
 	guint min_word_len;								/**< minimum length of the word to be considered		*/
 	guint max_word_len;								/**< maximum length of the word to be considered		*/
@@ -439,6 +454,39 @@ gboolean rspamd_config_read (struct rspamd_config *cfg,
 	rspamd_rcl_section_fin_t logger_fin, gpointer logger_ud,
 	GHashTable *vars);
 
+/*
+ * Read and parse configuration file to `rcl_obj` without processing it
+ */
+gboolean rspamd_config_read_ucl (struct rspamd_config *cfg,
+	const gchar *filename, GHashTable *vars);
+
+/**
+ * Checks whether any lua file loaded by the config has been changed since
+ * @param cfg
+ * @return TRUE if some file has been modified or removed
+ */
+gboolean rspamd_config_lua_deps_changed (struct rspamd_config *cfg);
+
+/**
+ * Returns names of top level sections that differ between two configs
+ * @param cfg
+ * @param other
+ * @return list of sections that should be freed by g_list_free
+ */
+GList * rspamd_config_changed_sections (struct rspamd_config *cfg,
+	struct rspamd_config *other);
+
+/**
+ * Update scores of symbols and actions from `metric` sections of a parsed
+ * config without reloading anything else
+ * @param cfg config to update
+ * @param top parsed config
+ * @param err
+ * @return TRUE if scores have been updated
+ */
+gboolean rspamd_config_update_scores (struct rspamd_config *cfg,
+	const ucl_object_t *top, GError **err);
+
 /*
  * Register symbols of classifiers inside metrics
  */
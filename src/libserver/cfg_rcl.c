@@ -32,6 +32,8 @@
 #include "libserver/worker_util.h"
 #include "unix-std.h"
 #include "cryptobox.h"
+#include "xxhash.h"
+#include "dynamic_cfg.h"
 
 #ifdef HAVE_SYSLOG_H
 #include <syslog.h>
@@ -233,9 +235,9 @@ rspamd_rcl_options_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 	const gchar *key, gpointer ud,
 	struct rspamd_rcl_section *section, GError **err)
 {
-	const ucl_object_t *dns, *upstream;
+	const ucl_object_t *dns, *upstream, *redis;
 	struct rspamd_config *cfg = ud;
-	struct rspamd_rcl_section *dns_section, *upstream_section;
+	struct rspamd_rcl_section *dns_section, *upstream_section, *redis_section;
 
 	HASH_FIND_STR (section->subsections, "dns", dns_section);
 
@@ -257,6 +259,16 @@ rspamd_rcl_options_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 		}
 	}
 
+	HASH_FIND_STR (section->subsections, "redis", redis_section);
+
+	redis = ucl_object_find_key (obj, "redis");
+	if (redis_section != NULL && redis != NULL) {
+		if (!rspamd_rcl_section_parse_defaults (redis_section, cfg->cfg_pool,
+			redis, cfg, err)) {
+			return FALSE;
+		}
+	}
+
 	return rspamd_rcl_section_parse_defaults (section, cfg->cfg_pool, obj,
 			cfg, err);
 }
@@ -379,6 +391,7 @@ rspamd_rcl_symbol_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 
 	if (ucl_object_find_any_key (obj, "score", "weight", NULL) != NULL) {
 		*sym_def->weight_ptr = sym_def->score;
+		sym_def->flags |= RSPAMD_SYMBOL_FLAG_CONFIG;
 	}
 
 	return TRUE;
@@ -640,6 +653,9 @@ rspamd_rcl_worker_handler (rspamd_mempool_t *pool, const ucl_object_t *obj,
 #define RSPAMD_PREFIX_INDEX "PREFIX"
 #define RSPAMD_VERSION_INDEX "VERSION"
 
+static void rspamd_config_track_lua_deps (struct rspamd_config *cfg,
+		lua_State *L);
+
 static void
 rspamd_rcl_set_lua_globals (struct rspamd_config *cfg, lua_State *L,
 		GHashTable *vars)
@@ -683,6 +699,7 @@ rspamd_rcl_set_lua_globals (struct rspamd_config *cfg, lua_State *L,
 	lua_pop (L, 4);
 
 	rspamd_lua_set_path (L, cfg);
+	rspamd_config_track_lua_deps (cfg, L);
 
 	/* Set known paths as rspamd_paths global */
 	lua_getglobal (L, "rspamd_paths");
@@ -1430,6 +1447,16 @@ rspamd_rcl_config_init (void)
 			rspamd_rcl_parse_struct_boolean,
 			G_STRUCT_OFFSET (struct rspamd_config, check_all_filters),
 			0);
+	rspamd_rcl_add_default_handler (sub,
+			"fast_reload",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, fast_reload),
+			0);
+	rspamd_rcl_add_default_handler (sub,
+			"prefork_warmup",
+			rspamd_rcl_parse_struct_boolean,
+			G_STRUCT_OFFSET (struct rspamd_config, prefork_warmup),
+			0);
 	rspamd_rcl_add_default_handler (sub,
 			"min_word_len",
 			rspamd_rcl_parse_struct_integer,
@@ -1460,6 +1487,16 @@ rspamd_rcl_config_init (void)
 			rspamd_rcl_parse_struct_integer,
 			G_STRUCT_OFFSET (struct rspamd_config, history_rows),
 			RSPAMD_CL_FLAG_UINT);
+	rspamd_rcl_add_default_handler (sub,
+			"lua_gc_step",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, lua_gc_step),
+			RSPAMD_CL_FLAG_UINT);
+	rspamd_rcl_add_default_handler (sub,
+			"lua_gc_pause",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, lua_gc_pause),
+			RSPAMD_CL_FLAG_UINT);
 
 	/* New DNS configuration */
 	ssub = rspamd_rcl_add_section (&sub->subsections, "dns", NULL, NULL,
@@ -1515,6 +1552,25 @@ rspamd_rcl_config_init (void)
 			G_STRUCT_OFFSET (struct rspamd_config, upstream_revive_time),
 			RSPAMD_CL_FLAG_TIME_FLOAT);
 
+	/* Pool of redis connections */
+	ssub = rspamd_rcl_add_section (&sub->subsections, "redis", NULL, NULL,
+			UCL_OBJECT, FALSE, TRUE);
+	rspamd_rcl_add_default_handler (ssub,
+			"idle_timeout",
+			rspamd_rcl_parse_struct_time,
+			G_STRUCT_OFFSET (struct rspamd_config, redis_pool_timeout),
+			RSPAMD_CL_FLAG_TIME_FLOAT);
+	rspamd_rcl_add_default_handler (ssub,
+			"max_idle",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, redis_pool_max_idle),
+			RSPAMD_CL_FLAG_UINT);
+	rspamd_rcl_add_default_handler (ssub,
+			"max_pipeline",
+			rspamd_rcl_parse_struct_integer,
+			G_STRUCT_OFFSET (struct rspamd_config, redis_pool_max_pipeline),
+			RSPAMD_CL_FLAG_UINT);
+
 	/**
 	 * Metric section
 	 */
@@ -2563,16 +2619,251 @@ rspamd_rcl_register_worker_parser (struct rspamd_config *cfg, gint type,
 	nparser->def_ud = ud;
 }
 
+/*
+ * Lua files are not a part of UCL, so their modification times and sizes
+ * are hashed as well to reload them in full when they are changed
+ */
+static guint64
+rspamd_config_hash_lua_file (const gchar *path, guint64 h)
+{
+	struct stat st;
+
+	h = XXH64 (path, strlen (path), h);
+
+	if (stat (path, &st) != -1) {
+		h = XXH64 (&st.st_mtime, sizeof (st.st_mtime), h);
+		h = XXH64 (&st.st_size, sizeof (st.st_size), h);
+	}
+
+	return h;
+}
+
+static void
+rspamd_config_add_lua_dep (struct rspamd_config *cfg, const gchar *path)
+{
+	guint64 *h;
+
+	if (cfg->lua_deps == NULL) {
+		cfg->lua_deps = g_hash_table_new_full (rspamd_str_hash,
+				rspamd_str_equal, g_free, g_free);
+	}
+
+	h = g_malloc (sizeof (*h));
+	*h = rspamd_config_hash_lua_file (path, 0);
+	g_hash_table_replace (cfg->lua_deps, g_strdup (path), h);
+}
+
+/*
+ * Wraps `dofile`, `loadfile` and `require`: records the file being loaded
+ * and calls the original function stored in the second upvalue
+ */
+static gint
+rspamd_config_lua_load_wrapper (lua_State *L)
+{
+	struct rspamd_config *cfg = lua_touserdata (L, lua_upvalueindex (1));
+	gboolean is_require = lua_toboolean (L, lua_upvalueindex (3));
+	gchar *name = NULL;
+	const gchar *path;
+	gint nargs = lua_gettop (L), nres;
+
+	if (lua_type (L, 1) == LUA_TSTRING) {
+		name = g_strdup (lua_tostring (L, 1));
+	}
+
+	if (name != NULL && !is_require) {
+		rspamd_config_add_lua_dep (cfg, name);
+	}
+
+	lua_pushvalue (L, lua_upvalueindex (2));
+	lua_insert (L, 1);
+
+	if (lua_pcall (L, nargs, LUA_MULTRET, 0) != 0) {
+		g_free (name);
+
+		return lua_error (L);
+	}
+
+	nres = lua_gettop (L);
+
+	if (name != NULL && is_require) {
+		/* C modules and modules from custom loaders are not found here */
+		lua_getglobal (L, "package");
+
+		if (lua_istable (L, -1)) {
+			lua_getfield (L, -1, "searchpath");
+
+			if (lua_isfunction (L, -1)) {
+				lua_pushstring (L, name);
+				lua_getfield (L, -3, "path");
+
+				if (lua_pcall (L, 2, 1, 0) == 0 &&
+						(path = lua_tostring (L, -1)) != NULL) {
+					rspamd_config_add_lua_dep (cfg, path);
+				}
+			}
+		}
+
+		lua_settop (L, nres);
+	}
+
+	g_free (name);
+
+	return nres;
+}
+
+/*
+ * Rules are split over many files loaded from the `lua` entries, so record
+ * all of them to reload the config in full when any of them changes
+ */
+static void
+rspamd_config_track_lua_deps (struct rspamd_config *cfg, lua_State *L)
+{
+	const gchar *funcs[] = {"dofile", "loadfile", "require"};
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (funcs); i ++) {
+		lua_pushlightuserdata (L, cfg);
+		lua_getglobal (L, funcs[i]);
+
+		if (!lua_isfunction (L, -1) ||
+				lua_tocfunction (L, -1) == rspamd_config_lua_load_wrapper) {
+			lua_pop (L, 2);
+			continue;
+		}
+
+		lua_pushboolean (L, strcmp (funcs[i], "require") == 0);
+		lua_pushcclosure (L, rspamd_config_lua_load_wrapper, 3);
+		lua_setglobal (L, funcs[i]);
+	}
+}
+
 gboolean
-rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
-	const gchar *convert_to, rspamd_rcl_section_fin_t logger_fin,
-	gpointer logger_ud, GHashTable *vars)
+rspamd_config_lua_deps_changed (struct rspamd_config *cfg)
+{
+	GHashTableIter it;
+	gpointer k, v;
+
+	if (cfg->lua_deps == NULL) {
+		return FALSE;
+	}
+
+	g_hash_table_iter_init (&it, cfg->lua_deps);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		if (rspamd_config_hash_lua_file (k, 0) != *(guint64 *)v) {
+			msg_debug_config ("lua file %s has been changed", (const gchar *)k);
+
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static guint64
+rspamd_config_hash_lua_path (const gchar *path, guint64 h)
+{
+	struct stat st;
+	glob_t globbuf;
+	gchar *pattern;
+	guint i;
+
+	if (stat (path, &st) != -1 && S_ISDIR (st.st_mode)) {
+		/* The same pattern as used by rspamd_rcl_add_module_path */
+		pattern = g_strconcat (path, "*.lua", NULL);
+		globbuf.gl_offs = 0;
+
+		if (glob (pattern, GLOB_DOOFFS, NULL, &globbuf) == 0) {
+			for (i = 0; i < globbuf.gl_pathc; i ++) {
+				h = rspamd_config_hash_lua_file (globbuf.gl_pathv[i], h);
+			}
+
+			globfree (&globbuf);
+		}
+
+		g_free (pattern);
+
+		/* Added and removed files change mtime of directory */
+		h = XXH64 (&st.st_mtime, sizeof (st.st_mtime), h);
+	}
+	else {
+		h = rspamd_config_hash_lua_file (path, h);
+	}
+
+	return h;
+}
+
+static guint64
+rspamd_config_hash_lua_sources (const ucl_object_t *elt, guint64 h)
+{
+	const ucl_object_t *val, *cur;
+	const gchar *data;
+
+	if (ucl_object_type (elt) == UCL_OBJECT) {
+		/* modules { path = ...; } */
+		val = ucl_object_find_key (elt, "path");
+
+		LL_FOREACH (val, cur) {
+			if (ucl_object_tostring_safe (cur, &data)) {
+				h = rspamd_config_hash_lua_path (data, h);
+			}
+		}
+	}
+	else if (ucl_object_tostring_safe (elt, &data)) {
+		h = rspamd_config_hash_lua_path (data, h);
+	}
+
+	return h;
+}
+
+static void
+rspamd_config_calculate_sections_checksums (struct rspamd_config *cfg)
+{
+	const ucl_object_t *cur, *elt;
+	ucl_object_iter_t it = NULL;
+	guint64 *h;
+	guchar *emitted;
+	gboolean is_lua;
+
+	if (cfg->sections_checksums == NULL) {
+		cfg->sections_checksums = g_hash_table_new_full (rspamd_str_hash,
+				rspamd_str_equal, g_free, g_free);
+	}
+	else {
+		g_hash_table_remove_all (cfg->sections_checksums);
+	}
+
+	while ((cur = ucl_iterate_object (cfg->rcl_obj, &it, false)) != NULL) {
+		h = g_malloc0 (sizeof (*h));
+		is_lua = strcmp (ucl_object_key (cur), "lua") == 0 ||
+				strcmp (ucl_object_key (cur), "modules") == 0;
+
+		/* Repeated sections are hashed in order of their definition */
+		LL_FOREACH (cur, elt) {
+			emitted = ucl_object_emit (elt, UCL_EMIT_JSON_COMPACT);
+
+			if (emitted != NULL) {
+				*h = XXH64 (emitted, strlen ((const gchar *)emitted), *h);
+				free (emitted);
+			}
+
+			if (is_lua) {
+				*h = rspamd_config_hash_lua_sources (elt, *h);
+			}
+		}
+
+		g_hash_table_insert (cfg->sections_checksums,
+				g_strdup (ucl_object_key (cur)), h);
+	}
+}
+
+gboolean
+rspamd_config_read_ucl (struct rspamd_config *cfg, const gchar *filename,
+	GHashTable *vars)
 {
 	struct stat st;
 	gint fd;
 	gchar *data;
-	GError *err = NULL;
-	struct rspamd_rcl_section *top, *logger;
 	struct ucl_parser *parser;
 	unsigned char cksumbuf[rspamd_cryptobox_HASHBYTES];
 
@@ -2615,6 +2906,25 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 	cfg->rcl_obj = ucl_parser_get_object (parser);
 	ucl_parser_free (parser);
 
+	/* Checksums of included files are covered as well */
+	rspamd_config_calculate_sections_checksums (cfg);
+
+	return TRUE;
+}
+
+gboolean
+rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
+	const gchar *convert_to, rspamd_rcl_section_fin_t logger_fin,
+	gpointer logger_ud, GHashTable *vars)
+{
+	GError *err = NULL;
+	struct rspamd_rcl_section *top, *logger;
+
+	/* Config might be already read to compare it with the running one */
+	if (cfg->rcl_obj == NULL && !rspamd_config_read_ucl (cfg, filename, vars)) {
+		return FALSE;
+	}
+
 	top = rspamd_rcl_config_init ();
 	rspamd_rcl_set_lua_globals (cfg, cfg->lua_state, vars);
 	err = NULL;
@@ -2635,3 +2945,147 @@ rspamd_config_read (struct rspamd_config *cfg, const gchar *filename,
 
 	return TRUE;
 }
+
+static void
+rspamd_config_copy_scores (struct rspamd_config *cfg,
+		struct rspamd_config *src)
+{
+	GHashTableIter mit, it;
+	gpointer k, v;
+	struct metric *m, *dm;
+	struct rspamd_symbols_group *gr, *dgr;
+	struct rspamd_symbol_def *sdef, *dsdef;
+	gint i;
+
+	g_hash_table_iter_init (&mit, src->metrics);
+
+	while (g_hash_table_iter_next (&mit, &k, &v)) {
+		m = v;
+		dm = g_hash_table_lookup (cfg->metrics, m->name);
+
+		if (dm == NULL) {
+			msg_warn_config ("cannot add metric %s without restart", m->name);
+			continue;
+		}
+
+		memcpy (dm->actions, m->actions, sizeof (dm->actions));
+		dm->unknown_weight = m->unknown_weight;
+		dm->grow_factor = m->grow_factor;
+
+		g_hash_table_iter_init (&it, m->groups);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			gr = v;
+			dgr = g_hash_table_lookup (dm->groups, gr->name);
+
+			if (dgr != NULL) {
+				dgr->max_score = gr->max_score;
+			}
+		}
+
+		g_hash_table_iter_init (&it, m->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			sdef = v;
+			dsdef = g_hash_table_lookup (dm->symbols, sdef->name);
+
+			if (dsdef != NULL) {
+				dsdef->score = sdef->score;
+				*dsdef->weight_ptr = sdef->score;
+			}
+			else {
+				rspamd_config_add_metric_symbol (cfg, dm->name, sdef->name,
+						sdef->score, sdef->description,
+						sdef->gr ? sdef->gr->name : NULL,
+						sdef->flags & RSPAMD_SYMBOL_FLAG_ONESHOT, FALSE);
+				dsdef = g_hash_table_lookup (dm->symbols, sdef->name);
+			}
+
+			if (dsdef != NULL) {
+				dsdef->flags |= RSPAMD_SYMBOL_FLAG_CONFIG;
+			}
+		}
+	}
+
+	/*
+	 * Scores removed from the config are reset to the values they would get
+	 * on a full reload: disabled actions, no group limits and zero scores
+	 */
+	g_hash_table_iter_init (&mit, cfg->metrics);
+
+	while (g_hash_table_iter_next (&mit, &k, &v)) {
+		dm = v;
+		m = g_hash_table_lookup (src->metrics, dm->name);
+
+		if (m == NULL) {
+			for (i = METRIC_ACTION_REJECT; i < METRIC_ACTION_MAX; i ++) {
+				dm->actions[i].score = -1.0;
+			}
+		}
+
+		g_hash_table_iter_init (&it, dm->groups);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			dgr = v;
+
+			if (m == NULL || g_hash_table_lookup (m->groups, dgr->name) == NULL) {
+				dgr->max_score = 0;
+			}
+		}
+
+		g_hash_table_iter_init (&it, dm->symbols);
+
+		while (g_hash_table_iter_next (&it, &k, &v)) {
+			dsdef = v;
+
+			if ((dsdef->flags & RSPAMD_SYMBOL_FLAG_CONFIG) && (m == NULL ||
+					g_hash_table_lookup (m->symbols, dsdef->name) == NULL)) {
+				msg_info_config ("reset score of symbol %s removed from "
+						"metric %s", dsdef->name, dm->name);
+				dsdef->score = 0;
+				*dsdef->weight_ptr = 0;
+				dsdef->flags &= ~RSPAMD_SYMBOL_FLAG_CONFIG;
+			}
+		}
+	}
+}
+
+gboolean
+rspamd_config_update_scores (struct rspamd_config *cfg,
+		const ucl_object_t *top, GError **err)
+{
+	struct rspamd_rcl_section *sections, *metric_section;
+	struct rspamd_config *tmp_cfg;
+	const ucl_object_t *val, *cur;
+
+	val = ucl_object_find_key (top, "metric");
+
+	if (val == NULL) {
+		return TRUE;
+	}
+
+	sections = rspamd_rcl_config_init ();
+	HASH_FIND_STR (sections, "metric", metric_section);
+	g_assert (metric_section != NULL);
+
+	/* Parse metrics to a scratch config and then copy just scores */
+	tmp_cfg = rspamd_config_new ();
+	tmp_cfg->libs_ctx = cfg->libs_ctx;
+	REF_RETAIN (tmp_cfg->libs_ctx);
+
+	LL_FOREACH (val, cur) {
+		if (!rspamd_rcl_process_section (metric_section, tmp_cfg, cur,
+				tmp_cfg->cfg_pool, err)) {
+			REF_RELEASE (tmp_cfg);
+
+			return FALSE;
+		}
+	}
+
+	rspamd_config_copy_scores (cfg, tmp_cfg);
+	REF_RELEASE (tmp_cfg);
+	/* Scores set via dynamic configuration override the ones from config */
+	reapply_dynamic_config (cfg);
+
+	return TRUE;
+}
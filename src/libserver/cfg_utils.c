@@ -30,7 +30,9 @@
 #include "uthash_strcase.h"
 #include "filter.h"
 #include "lua/lua_common.h"
+#include "lua/lua_thread_pool.h"
 #include "map.h"
+#include "redis_pool.h"
 #include "dynamic_cfg.h"
 #include "utlist.h"
 #include "stat_api.h"
@@ -45,6 +47,7 @@
 #define DEFAULT_MIN_WORD 4
 #define DEFAULT_MAX_WORD 40
 #define DEFAULT_WORDS_DECAY 200
+#define DEFAULT_LUA_THREADS 64
 
 struct rspamd_ucl_map_cbdata {
 	struct rspamd_config *cfg;
@@ -65,11 +68,22 @@ rspamd_parse_bind_line (struct rspamd_config *cfg,
 	struct rspamd_worker_bind_conf *cnf;
 	gchar **tokens, *err;
 	gboolean ret = TRUE;
+	gint socktype = 0;
 
 	if (str == NULL) {
 		return FALSE;
 	}
 
+	/* Socket type may be specified explicitly to override worker's default */
+	if (g_ascii_strncasecmp (str, "tcp:", sizeof ("tcp:") - 1) == 0) {
+		socktype = SOCK_STREAM;
+		str += sizeof ("tcp:") - 1;
+	}
+	else if (g_ascii_strncasecmp (str, "udp:", sizeof ("udp:") - 1) == 0) {
+		socktype = SOCK_DGRAM;
+		str += sizeof ("udp:") - 1;
+	}
+
 	if (str[0] == '[') {
 		/* This is an ipv6 address */
 		gsize len, ntok;
@@ -112,6 +126,7 @@ rspamd_parse_bind_line (struct rspamd_config *cfg,
 			sizeof (struct rspamd_worker_bind_conf));
 
 	cnf->cnt = 1024;
+	cnf->socktype = socktype;
 	if (strcmp (tokens[0], "systemd") == 0) {
 		/* The actual socket will be passed by systemd environment */
 		cnf->is_systemd = TRUE;
@@ -190,14 +205,19 @@ rspamd_config_new (void)
 			" $time_virtual virtual, dns req: $dns_req";
 	/* Allow non-mime input by default */
 	cfg->allow_raw_input = TRUE;
+	cfg->fast_reload = TRUE;
+	cfg->prefork_warmup = TRUE;
 	/* Default maximum words processed */
 	cfg->words_decay = DEFAULT_WORDS_DECAY;
 	cfg->min_word_len = DEFAULT_MIN_WORD;
 	cfg->max_word_len = DEFAULT_MAX_WORD;
 
 	cfg->lua_state = rspamd_lua_init (cfg);
+	cfg->lua_thread_pool = lua_thread_pool_new (cfg->lua_state,
+			DEFAULT_LUA_THREADS);
 	cfg->cache = rspamd_symbols_cache_new (cfg);
 	cfg->ups_ctx = rspamd_upstreams_library_init ();
+	cfg->redis_pool = rspamd_redis_pool_init ();
 	cfg->re_cache = rspamd_re_cache_new ();
 
 	REF_INIT_RETAIN (cfg, rspamd_config_free);
@@ -226,17 +246,66 @@ rspamd_config_free (struct rspamd_config *cfg)
 		g_free (cfg->checksum);
 	}
 
+	if (cfg->sections_checksums) {
+		g_hash_table_unref (cfg->sections_checksums);
+	}
+
+	if (cfg->lua_deps) {
+		g_hash_table_unref (cfg->lua_deps);
+	}
+
 	g_list_free (cfg->classifiers);
 	g_list_free (cfg->metrics_list);
 	rspamd_symbols_cache_destroy (cfg->cache);
 	REF_RELEASE (cfg->libs_ctx);
 	rspamd_re_cache_unref (cfg->re_cache);
 	rspamd_upstreams_library_unref (cfg->ups_ctx);
+	rspamd_redis_pool_destroy (cfg->redis_pool);
 	rspamd_mempool_delete (cfg->cfg_pool);
+	lua_thread_pool_free (cfg->lua_thread_pool);
 	lua_close (cfg->lua_state);
 	g_slice_free1 (sizeof (*cfg), cfg);
 }
 
+GList *
+rspamd_config_changed_sections (struct rspamd_config *cfg,
+		struct rspamd_config *other)
+{
+	GHashTableIter it;
+	gpointer k, v, ov;
+	GList *res = NULL;
+
+	g_assert (cfg->sections_checksums != NULL);
+	g_assert (other->sections_checksums != NULL);
+
+	g_hash_table_iter_init (&it, other->sections_checksums);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		ov = g_hash_table_lookup (cfg->sections_checksums, k);
+
+		if (ov == NULL || *(guint64 *)ov != *(guint64 *)v) {
+			res = g_list_prepend (res, k);
+		}
+	}
+
+	/* Removed sections */
+	g_hash_table_iter_init (&it, cfg->sections_checksums);
+
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		if (g_hash_table_lookup (other->sections_checksums, k) == NULL) {
+			res = g_list_prepend (res, k);
+		}
+	}
+
+	/* Files loaded by lua rules are not listed in any section */
+	if (rspamd_config_lua_deps_changed (cfg) &&
+			g_list_find_custom (res, "lua", (GCompareFunc)strcmp) == NULL) {
+		res = g_list_prepend (res, "lua");
+	}
+
+	return res;
+}
+
 const ucl_object_t *
 rspamd_config_get_module_opt (struct rspamd_config *cfg,
 	const gchar *module_name,
@@ -656,6 +725,7 @@ rspamd_config_post_load (struct rspamd_config *cfg, gboolean validate_cache)
 	}
 
 	init_dynamic_config (cfg);
+	rspamd_redis_pool_config (cfg->redis_pool, cfg);
 
 	rspamd_url_init (cfg->tld_file);
 
@@ -673,6 +743,11 @@ rspamd_config_post_load (struct rspamd_config *cfg, gboolean validate_cache)
 	/* Init re cache */
 	rspamd_re_cache_init (cfg->re_cache);
 
+	if (cfg->lua_gc_pause > 0) {
+		/* Collect less often while scanning, we perform steps between tasks */
+		lua_gc (cfg->lua_state, LUA_GCSETPAUSE, cfg->lua_gc_pause);
+	}
+
 	/* Validate cache */
 	if (validate_cache) {
 		return rspamd_symbols_cache_validate (cfg->cache, cfg, FALSE);
@@ -477,6 +477,65 @@ rspamd_dkim_parse_bodylength (rspamd_dkim_context_t * ctx,
 	return TRUE;
 }
 
+static rspamd_dkim_digest_t *
+rspamd_dkim_digest_new (gint sig_alg)
+{
+#ifdef HAVE_OPENSSL
+	EVP_MD_CTX *ck;
+
+	ck = EVP_MD_CTX_create ();
+
+	if (sig_alg == DKIM_SIGN_RSASHA1) {
+		EVP_DigestInit_ex (ck, EVP_sha1 (), NULL);
+	}
+	else {
+		EVP_DigestInit_ex (ck, EVP_sha256 (), NULL);
+	}
+
+	return ck;
+#else
+	if (sig_alg == DKIM_SIGN_RSASHA1) {
+		return g_checksum_new (G_CHECKSUM_SHA1);
+	}
+
+	return g_checksum_new (G_CHECKSUM_SHA256);
+#endif
+}
+
+static inline void
+rspamd_dkim_digest_update (rspamd_dkim_digest_t *ck, const void *data,
+		gsize len)
+{
+#ifdef HAVE_OPENSSL
+	EVP_DigestUpdate (ck, data, len);
+#else
+	g_checksum_update (ck, data, len);
+#endif
+}
+
+static void
+rspamd_dkim_digest_final (rspamd_dkim_digest_t *ck, guchar *out, gsize *outlen)
+{
+#ifdef HAVE_OPENSSL
+	guint dlen = *outlen;
+
+	EVP_DigestFinal_ex (ck, out, &dlen);
+	*outlen = dlen;
+#else
+	g_checksum_get_digest (ck, out, outlen);
+#endif
+}
+
+static void
+rspamd_dkim_digest_free (gpointer ck)
+{
+#ifdef HAVE_OPENSSL
+	EVP_MD_CTX_destroy (ck);
+#else
+	g_checksum_free (ck);
+#endif
+}
+
 /**
  * Create new dkim context from signature
  * @param sig message's signature
@@ -795,16 +854,9 @@ rspamd_create_dkim_context (const gchar *sig,
 		DKIM_DNSKEYNAME,
 		ctx->domain);
 
-	/* Create checksums for further operations */
-	if (ctx->sig_alg == DKIM_SIGN_RSASHA1) {
-		ctx->body_hash = g_checksum_new (G_CHECKSUM_SHA1);
-		ctx->headers_hash = g_checksum_new (G_CHECKSUM_SHA1);
-	}
-	else if (ctx->sig_alg == DKIM_SIGN_RSASHA256) {
-		ctx->body_hash = g_checksum_new (G_CHECKSUM_SHA256);
-		ctx->headers_hash = g_checksum_new (G_CHECKSUM_SHA256);
-	}
-	else {
+	/* Body hash is created on check as it can be shared between signatures */
+	if (ctx->sig_alg != DKIM_SIGN_RSASHA1 &&
+			ctx->sig_alg != DKIM_SIGN_RSASHA256) {
 		g_set_error (err,
 			DKIM_ERROR,
 			DKIM_SIGERROR_BADSIG,
@@ -812,11 +864,9 @@ rspamd_create_dkim_context (const gchar *sig,
 		return NULL;
 	}
 
+	ctx->headers_hash = rspamd_dkim_digest_new (ctx->sig_alg);
 	rspamd_mempool_add_destructor (ctx->pool,
-		(rspamd_mempool_destruct_t)g_checksum_free,
-		ctx->body_hash);
-	rspamd_mempool_add_destructor (ctx->pool,
-		(rspamd_mempool_destruct_t)g_checksum_free,
+		(rspamd_mempool_destruct_t)rspamd_dkim_digest_free,
 		ctx->headers_hash);
 
 	ctx->dkim_header = sig;
@@ -830,6 +880,42 @@ struct rspamd_dkim_key_cbdata {
 	gpointer ud;
 };
 
+static gboolean
+rspamd_dkim_load_key (rspamd_dkim_key_t *key, GError **err)
+{
+#ifdef HAVE_OPENSSL
+	key->key_bio = BIO_new_mem_buf (key->keydata, key->decoded_len);
+	if (key->key_bio == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot make ssl bio from key");
+		return FALSE;
+	}
+
+	key->key_evp = d2i_PUBKEY_bio (key->key_bio, NULL);
+	if (key->key_evp == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot extract pubkey from bio");
+		return FALSE;
+	}
+
+	key->key_rsa = EVP_PKEY_get1_RSA (key->key_evp);
+	if (key->key_rsa == NULL) {
+		g_set_error (err,
+			DKIM_ERROR,
+			DKIM_SIGERROR_KEYFAIL,
+			"cannot extract rsa key from evp key");
+		return FALSE;
+	}
+
+#endif
+
+	return TRUE;
+}
+
 static rspamd_dkim_key_t *
 rspamd_dkim_make_key (rspamd_dkim_context_t *ctx, const gchar *keydata,
 		guint keylen, GError **err)
@@ -855,39 +941,33 @@ rspamd_dkim_make_key (rspamd_dkim_context_t *ctx, const gchar *keydata,
 #else
 	g_base64_decode_inplace (key->keydata, &key->decoded_len);
 #endif
-#ifdef HAVE_OPENSSL
-	key->key_bio = BIO_new_mem_buf (key->keydata, key->decoded_len);
-	if (key->key_bio == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot make ssl bio from key");
-		rspamd_dkim_key_free (key);
-		return NULL;
-	}
 
-	key->key_evp = d2i_PUBKEY_bio (key->key_bio, NULL);
-	if (key->key_evp == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot extract pubkey from bio");
+	if (!rspamd_dkim_load_key (key, err)) {
 		rspamd_dkim_key_free (key);
 		return NULL;
 	}
 
-	key->key_rsa = EVP_PKEY_get1_RSA (key->key_evp);
-	if (key->key_rsa == NULL) {
-		g_set_error (err,
-			DKIM_ERROR,
-			DKIM_SIGERROR_KEYFAIL,
-			"cannot extract rsa key from evp key");
+	return key;
+}
+
+rspamd_dkim_key_t *
+rspamd_dkim_key_from_der (const guchar *der, gsize len, guint ttl,
+		GError **err)
+{
+	rspamd_dkim_key_t *key;
+
+	key = g_slice_alloc0 (sizeof (rspamd_dkim_key_t));
+	key->keydata = g_slice_alloc (len);
+	memcpy (key->keydata, der, len);
+	key->keylen = len;
+	key->decoded_len = len;
+	key->ttl = ttl;
+
+	if (!rspamd_dkim_load_key (key, err)) {
 		rspamd_dkim_key_free (key);
 		return NULL;
 	}
 
-#endif
-
 	return key;
 }
 
@@ -1039,199 +1119,312 @@ rspamd_get_dkim_key (rspamd_dkim_context_t *ctx,
 			   ctx->dns_key);
 }
 
-static gboolean
-rspamd_dkim_relaxed_body_step (rspamd_dkim_context_t *ctx, GChecksum *ck,
-		const gchar **start, guint size,
-		guint *remain)
+/*
+ * Canonicalized body is collected in a buffer to avoid calling digest
+ * update for each small chunk, while long chunks are hashed directly
+ */
+#define DKIM_CANON_BUFSIZ 16384
+
+struct rspamd_dkim_canon_state {
+	rspamd_dkim_digest_t *ck;
+	gsize pos;
+	gsize remain;
+	gsize total;
+	guint pending_crlf;
+	gboolean limited;
+	gchar buf[DKIM_CANON_BUFSIZ];
+};
+
+static inline void
+rspamd_dkim_canon_flush (struct rspamd_dkim_canon_state *st)
 {
-	const gchar *h;
-	static gchar buf[BUFSIZ];
-	gchar *t;
-	guint len, inlen, added = 0;
-	gboolean got_sp;
-
-	len = size;
-	inlen = sizeof (buf) - 1;
-	h = *start;
-	t = buf;
-	got_sp = FALSE;
+	if (st->pos > 0) {
+		rspamd_dkim_digest_update (st->ck, st->buf, st->pos);
+		st->pos = 0;
+	}
+}
 
-	while (len && inlen) {
-		if (*h == '\r' || *h == '\n') {
-			if (got_sp) {
-				/* Ignore spaces at the end of line */
-				t --;
-			}
-			*t++ = '\r';
-			*t++ = '\n';
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
-				h += 2;
-				len -= 2;
-			}
-			else {
-				h ++;
-				len --;
-				added ++;
-			}
-			break;
-		}
-		else if (g_ascii_isspace (*h)) {
-			if (got_sp) {
-				/* Ignore multiply spaces */
-				h++;
-				len--;
-				continue;
-			}
-			else {
-				*t++ = ' ';
-				h++;
-				inlen--;
-				len--;
-				got_sp = TRUE;
-				continue;
-			}
-		}
-		else {
-			got_sp = FALSE;
+static inline void
+rspamd_dkim_canon_emit (struct rspamd_dkim_canon_state *st,
+		const gchar *data, gsize len)
+{
+	st->total += len;
+
+	if (st->limited) {
+		/* l= tag limits the number of canonicalized octets */
+		len = MIN (len, st->remain);
+		st->remain -= len;
+	}
+
+	if (st->pos + len > sizeof (st->buf)) {
+		rspamd_dkim_canon_flush (st);
+
+		if (len >= sizeof (st->buf) / 2) {
+			rspamd_dkim_digest_update (st->ck, data, len);
+			return;
 		}
-		*t++ = *h++;
-		inlen--;
-		len--;
 	}
 
-	*start = h;
+	memcpy (st->buf + st->pos, data, len);
+	st->pos += len;
+}
 
-	if (*remain > 0) {
-		size_t cklen = MIN(t - buf, *remain + added);
-		g_checksum_update (ck, buf, cklen);
-		*remain = *remain - (cklen - added);
-#if 0
-		msg_debug_dkim ("update signature with buffer (%ud size, %ud remain, %ud added): %*s",
-				cklen, *remain, added, cklen, buf);
-#else
-		msg_debug_dkim ("update signature with body buffer "
-				"(%ud size, %ud remain, %ud added)",
-						cklen, *remain, added);
-#endif
+/* Empty lines are emitted only if some non-empty line follows them */
+static inline void
+rspamd_dkim_canon_line_start (struct rspamd_dkim_canon_state *st)
+{
+	while (st->pending_crlf > 0) {
+		rspamd_dkim_canon_emit (st, CRLF, sizeof (CRLF) - 1);
+		st->pending_crlf --;
+	}
+}
+
+/* Skips CRLF, CR or LF and returns the beginning of the next line */
+static inline const gchar *
+rspamd_dkim_skip_eol (const gchar *p, const gchar *end)
+{
+	if (*p == '\r' && p + 1 < end && p[1] == '\n') {
+		return p + 2;
 	}
 
-	return (len != 0);
+	return p + 1;
 }
 
-static gboolean
-rspamd_dkim_simple_body_step (rspamd_dkim_context_t *ctx,
-		GChecksum *ck, const gchar **start, guint size,
-		guint *remain)
+/* Non-zero if the word contains a byte less than `n` (n <= 128) */
+#define DKIM_WORD_HASLESS(w, n) \
+	(((w) - G_GUINT64_CONSTANT (0x0101010101010101) * (n)) & ~(w) & \
+	G_GUINT64_CONSTANT (0x8080808080808080))
+
+/*
+ * Returns the first character that is not a part of a line in simple mode,
+ * i.e. CR or LF, words without control characters are skipped at once
+ */
+static inline const gchar *
+rspamd_dkim_scan_simple (const gchar *p, const gchar *end)
 {
-	const gchar *h;
-	static gchar buf[BUFSIZ];
-	gchar *t;
-	guint len, inlen, added = 0;
-
-	len = size;
-	inlen = sizeof (buf) - 1;
-	h = *start;
-	t = &buf[0];
-
-	while (len && inlen) {
-		if (*h == '\r' || *h == '\n') {
-			*t++ = '\r';
-			*t++ = '\n';
-			if (len > 1 && (*h == '\r' && h[1] == '\n')) {
-				h += 2;
-				len -= 2;
-			}
-			else {
-				h ++;
-				len --;
-				added ++;
-			}
+	guint64 w;
+
+	while (end - p >= (gssize)sizeof (w)) {
+		memcpy (&w, p, sizeof (w));
+
+		if (DKIM_WORD_HASLESS (w, '\r' + 1)) {
 			break;
 		}
-		*t++ = *h++;
-		inlen--;
-		len--;
+
+		p += sizeof (w);
 	}
 
-	*start = h;
+	while (p < end && *p != '\r' && *p != '\n') {
+		p ++;
+	}
+
+	return p;
+}
+
+/*
+ * Returns the first space character, all spaces are less than 0x21, so
+ * words without such characters are skipped at once
+ */
+static inline const gchar *
+rspamd_dkim_scan_relaxed (const gchar *p, const gchar *end)
+{
+	guint64 w;
 
-	if (*remain > 0) {
-		size_t cklen = MIN(t - buf, *remain + added);
-		g_checksum_update (ck, buf, cklen);
-		*remain = *remain - (cklen - added);
-		msg_debug_dkim ("update signature with body buffer "
-				"(%ud size, %ud remain, %ud added)",
-				cklen, *remain, added);
+	while (end - p >= (gssize)sizeof (w)) {
+		memcpy (&w, p, sizeof (w));
+
+		if (DKIM_WORD_HASLESS (w, ' ' + 1)) {
+			break;
+		}
+
+		p += sizeof (w);
 	}
 
-	return (len != 0);
+	while (p < end && !g_ascii_isspace (*p)) {
+		p ++;
+	}
+
+	return p;
 }
 
-static gboolean
-rspamd_dkim_canonize_body (rspamd_dkim_context_t *ctx,
-	const gchar *start,
-	const gchar *end)
+static void
+rspamd_dkim_simple_body (struct rspamd_dkim_canon_state *st,
+		const gchar *p, const gchar *end)
 {
-	const gchar *p;
-	guint remain = ctx->len ? ctx->len : (guint)(end - start);
+	const gchar *c;
+	gboolean line_empty = TRUE;
 
-	if (start == NULL) {
-		/* Empty body */
-		if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-			g_checksum_update (ctx->body_hash, CRLF, sizeof (CRLF) - 1);
+	while (p < end) {
+		c = rspamd_dkim_scan_simple (p, end);
+
+		if (c > p) {
+			if (line_empty) {
+				rspamd_dkim_canon_line_start (st);
+				line_empty = FALSE;
+			}
+
+			rspamd_dkim_canon_emit (st, p, c - p);
+		}
+
+		if (c == end) {
+			break;
+		}
+
+		if (line_empty) {
+			st->pending_crlf ++;
 		}
 		else {
-			g_checksum_update (ctx->body_hash, "", 0);
+			rspamd_dkim_canon_emit (st, CRLF, sizeof (CRLF) - 1);
+			line_empty = TRUE;
 		}
+
+		p = rspamd_dkim_skip_eol (c, end);
 	}
-	else {
-		/* Strip extra ending CRLF */
-		p = end - 1;
-		while (p >= start + 2) {
-			if (*p == '\n' && *(p - 1) == '\r' && *(p - 2) == '\n') {
-				p -= 2;
-			}
-			else if (*p == '\n' && *(p - 1) == '\n') {
-				p--;
-			}
-			else if (*p == '\r' && *(p - 1) == '\r') {
-				p--;
+
+	if (!line_empty || st->total == 0) {
+		/* Add missing CRLF at the end, empty body is a single CRLF */
+		rspamd_dkim_canon_emit (st, CRLF, sizeof (CRLF) - 1);
+	}
+}
+
+static void
+rspamd_dkim_relaxed_body (struct rspamd_dkim_canon_state *st,
+		const gchar *p, const gchar *end)
+{
+	const gchar *c;
+	gboolean line_empty = TRUE, got_sp = FALSE;
+
+	while (p < end) {
+		c = rspamd_dkim_scan_relaxed (p, end);
+
+		if (c > p) {
+			if (line_empty) {
+				rspamd_dkim_canon_line_start (st);
+				line_empty = FALSE;
 			}
-			else {
-				break;
+
+			if (got_sp) {
+				/* Sequence of spaces is reduced to a single space */
+				rspamd_dkim_canon_emit (st, " ", 1);
+				got_sp = FALSE;
 			}
+
+			rspamd_dkim_canon_emit (st, p, c - p);
 		}
-		end = p + 1;
-		if (end == start) {
-			/* Empty body */
-			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-				g_checksum_update (ctx->body_hash, CRLF, sizeof (CRLF) - 1);
+
+		if (c == end) {
+			break;
+		}
+
+		if (*c == '\r' || *c == '\n') {
+			/* Spaces at the end of line are ignored */
+			if (line_empty) {
+				st->pending_crlf ++;
 			}
 			else {
-				g_checksum_update (ctx->body_hash, "", 0);
+				rspamd_dkim_canon_emit (st, CRLF, sizeof (CRLF) - 1);
+				line_empty = TRUE;
 			}
+
+			got_sp = FALSE;
+			p = rspamd_dkim_skip_eol (c, end);
 		}
 		else {
-			if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
-				/* Simple canonization */
-				while (rspamd_dkim_simple_body_step (ctx, ctx->body_hash,
-						&start, end - start, &remain)) ;
-			}
-			else {
-				while (rspamd_dkim_relaxed_body_step (ctx, ctx->body_hash,
-						&start, end - start, &remain)) ;
-			}
+			got_sp = TRUE;
+			p = c + 1;
 		}
-		return TRUE;
 	}
 
-	/* TODO: Implement relaxed algorithm */
-	return FALSE;
+	if (!line_empty) {
+		rspamd_dkim_canon_emit (st, CRLF, sizeof (CRLF) - 1);
+	}
+}
+
+static void
+rspamd_dkim_canonize_body (rspamd_dkim_context_t *ctx,
+	rspamd_dkim_digest_t *ck,
+	const gchar *start,
+	const gchar *end)
+{
+	struct rspamd_dkim_canon_state *st;
+
+	st = g_slice_alloc (sizeof (*st));
+	st->ck = ck;
+	st->pos = 0;
+	st->total = 0;
+	st->pending_crlf = 0;
+	st->limited = ctx->len > 0;
+	st->remain = ctx->len;
+
+	if (ctx->body_canon_type == DKIM_CANON_SIMPLE) {
+		rspamd_dkim_simple_body (st, start, end);
+	}
+	else {
+		rspamd_dkim_relaxed_body (st, start, end);
+	}
+
+	rspamd_dkim_canon_flush (st);
+	msg_debug_dkim ("update signature with body: %uz canonicalized bytes, "
+			"%uz hashed", st->total,
+			st->limited ? ctx->len - st->remain : st->total);
+	g_slice_free1 (sizeof (*st), st);
+}
+
+/*
+ * Returns body hash for the signature, hashes are shared between signatures
+ * with the same canonicalization, algorithm and body length in a task
+ */
+static const guchar *
+rspamd_dkim_body_hash (rspamd_dkim_context_t *ctx,
+	const gchar *start,
+	const gchar *end)
+{
+	rspamd_dkim_digest_t *ck;
+	guchar *digest;
+	gchar key[64];
+	gsize dlen = ctx->bhlen;
+
+	rspamd_snprintf (key, sizeof (key), "dkim_bh_%d_%d_%uz",
+			ctx->body_canon_type, ctx->sig_alg, ctx->len);
+	digest = rspamd_mempool_get_variable (ctx->pool, key);
+
+	if (digest != NULL) {
+		msg_debug_dkim ("reuse cached body hash %s", key);
+		return digest;
+	}
+
+	ck = rspamd_dkim_digest_new (ctx->sig_alg);
+	rspamd_dkim_canonize_body (ctx, ck, start, end);
+	digest = rspamd_mempool_alloc (ctx->pool, dlen);
+	rspamd_dkim_digest_final (ck, digest, &dlen);
+	rspamd_dkim_digest_free (ck);
+	rspamd_mempool_set_variable (ctx->pool, key, digest, NULL);
+
+	return digest;
+}
+
+gboolean
+rspamd_dkim_check_body_hash (rspamd_dkim_context_t *ctx,
+	const gchar *start,
+	const gchar *end)
+{
+	const guchar *body_digest;
+
+	body_digest = rspamd_dkim_body_hash (ctx, start, end);
+
+	/* Check bh field */
+	if (memcmp (ctx->bh, body_digest, ctx->bhlen) != 0) {
+		msg_debug_dkim ("bh value missmatch: %*xs versus %*xs", ctx->bhlen,
+				ctx->bh, ctx->bhlen, body_digest);
+		return FALSE;
+	}
+
+	return TRUE;
 }
 
 /* Update hash converting all CR and LF to CRLF */
 static void
-rspamd_dkim_hash_update (GChecksum *ck, const gchar *begin, gsize len)
+rspamd_dkim_hash_update (rspamd_dkim_digest_t *ck, const gchar *begin, gsize len)
 {
 	const gchar *p, *c, *end;
 
@@ -1240,8 +1433,8 @@ rspamd_dkim_hash_update (GChecksum *ck, const gchar *begin, gsize len)
 	c = p;
 	while (p != end) {
 		if (*p == '\r') {
-			g_checksum_update (ck, c,	 p - c);
-			g_checksum_update (ck, CRLF, sizeof (CRLF) - 1);
+			rspamd_dkim_digest_update (ck, c, p - c);
+			rspamd_dkim_digest_update (ck, CRLF, sizeof (CRLF) - 1);
 			p++;
 			if (*p == '\n') {
 				p++;
@@ -1249,8 +1442,8 @@ rspamd_dkim_hash_update (GChecksum *ck, const gchar *begin, gsize len)
 			c = p;
 		}
 		else if (*p == '\n') {
-			g_checksum_update (ck, c,	 p - c);
-			g_checksum_update (ck, CRLF, sizeof (CRLF) - 1);
+			rspamd_dkim_digest_update (ck, c, p - c);
+			rspamd_dkim_digest_update (ck, CRLF, sizeof (CRLF) - 1);
 			p++;
 			c = p;
 		}
@@ -1259,7 +1452,7 @@ rspamd_dkim_hash_update (GChecksum *ck, const gchar *begin, gsize len)
 		}
 	}
 	if (p != c) {
-		g_checksum_update (ck, c, p - c);
+		rspamd_dkim_digest_update (ck, c, p - c);
 	}
 }
 
@@ -1376,7 +1569,7 @@ rspamd_dkim_canonize_header_relaxed (rspamd_dkim_context_t *ctx,
 
 	if (!is_sign) {
 		msg_debug_dkim ("update signature with header: %s", buf);
-		g_checksum_update (ctx->headers_hash, buf, t - buf);
+		rspamd_dkim_digest_update (ctx->headers_hash, buf, t - buf);
 	}
 	else {
 		rspamd_dkim_signature_update (ctx, buf, t - buf);
@@ -1616,7 +1809,7 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 {
 	const gchar *p, *headers_end = NULL, *end, *body_end;
 	gboolean got_cr = FALSE, got_crlf = FALSE, got_lf = FALSE;
-	gchar *digest;
+	guchar *digest;
 	gsize dlen;
 	gint res = DKIM_CONTINUE;
 	guint i;
@@ -1696,11 +1889,20 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 		p++;
 	}
 
-	/* Start canonization of body part */
 	body_end = end;
-	if (!rspamd_dkim_canonize_body (ctx, headers_end, body_end)) {
-		return DKIM_RECORD_ERROR;
+
+	if (headers_end == NULL) {
+		/* Message without body separator has an empty body */
+		headers_end = body_end;
+	}
+
+	/* Start canonization of body part */
+	if (!rspamd_dkim_check_body_hash (ctx, headers_end, body_end)) {
+		return DKIM_REJECT;
 	}
+
+	dlen = ctx->bhlen;
+
 	/* Now canonize headers */
 	for (i = 0; i < ctx->hlist->len; i++) {
 		dh = g_ptr_array_index (ctx->hlist, i);
@@ -1710,18 +1912,8 @@ rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	/* Canonize dkim signature */
 	rspamd_dkim_canonize_header (ctx, task, DKIM_SIGNHEADER, 1, TRUE);
 
-	dlen = ctx->bhlen;
 	digest = g_alloca (dlen);
-	g_checksum_get_digest (ctx->body_hash, digest, &dlen);
-
-	/* Check bh field */
-	if (memcmp (ctx->bh, digest, dlen) != 0) {
-		msg_debug_dkim ("bh value missmatch: %*xs versus %*xs", dlen, ctx->bh,
-				dlen, digest);
-		return DKIM_REJECT;
-	}
-
-	g_checksum_get_digest (ctx->headers_hash, digest, &dlen);
+	rspamd_dkim_digest_final (ctx->headers_hash, digest, &dlen);
 #ifdef HAVE_OPENSSL
 	/* Check headers signature */
 
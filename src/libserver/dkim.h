@@ -31,6 +31,7 @@
 #ifdef HAVE_OPENSSL
 #include <openssl/rsa.h>
 #include <openssl/engine.h>
+#include <openssl/evp.h>
 #endif
 
 /* Main types and definitions */
@@ -56,6 +57,12 @@
 #define DKIM_SIGN_RSASHA1   0   /* an RSA-signed SHA1 digest */
 #define DKIM_SIGN_RSASHA256 1   /* an RSA-signed SHA256 digest */
 
+#ifdef HAVE_OPENSSL
+typedef EVP_MD_CTX rspamd_dkim_digest_t;
+#else
+typedef GChecksum rspamd_dkim_digest_t;
+#endif
+
 /* Params */
 #define DKIM_PARAM_UNKNOWN  (-1)    /* unknown */
 #define DKIM_PARAM_SIGNATURE    0   /* b */
@@ -148,8 +155,7 @@ typedef struct rspamd_dkim_context_s {
 	guint ver;
 	gchar *dns_key;
 	const gchar *dkim_header;
-	GChecksum *headers_hash;
-	GChecksum *body_hash;
+	rspamd_dkim_digest_t *headers_hash;
 } rspamd_dkim_context_t;
 
 typedef struct rspamd_dkim_key_s {
@@ -207,6 +213,30 @@ gint rspamd_dkim_check (rspamd_dkim_context_t *ctx,
 	rspamd_dkim_key_t *key,
 	struct rspamd_task *task);
 
+/**
+ * Check body hash (bh= tag) of dkim signature. Body is canonicalized
+ * according to the signature's canonicalization and length limit
+ * @param ctx dkim verify context
+ * @param start start of the body
+ * @param end end of the body
+ * @return TRUE if body hash matches
+ */
+gboolean rspamd_dkim_check_body_hash (rspamd_dkim_context_t *ctx,
+	const gchar *start,
+	const gchar *end);
+
+/**
+ * Create DKIM key from its DER representation, that is stored in `keydata`
+ * of a key after parsing
+ * @param der DER encoded public key
+ * @param len length of key
+ * @param ttl ttl of key
+ * @param err pointer to error object
+ * @return new key or NULL
+ */
+rspamd_dkim_key_t * rspamd_dkim_key_from_der (const guchar *der, gsize len,
+	guint ttl, GError **err);
+
 /**
  * Free DKIM key
  * @param key
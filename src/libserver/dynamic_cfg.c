@@ -217,6 +217,14 @@ json_config_fin_cb (rspamd_mempool_t * pool, struct map_cb_data *data)
 	jb->cfg->current_dynamic_conf = top;
 }
 
+void
+reapply_dynamic_config (struct rspamd_config *cfg)
+{
+	if (cfg->current_dynamic_conf != NULL) {
+		apply_dynamic_conf (cfg->current_dynamic_conf, cfg);
+	}
+}
+
 /**
  * Init dynamic configuration using map logic and specific configuration
  * @param cfg config file
@@ -34,6 +34,13 @@
  */
 void init_dynamic_config (struct rspamd_config *cfg);
 
+/**
+ * Apply the currently loaded dynamic configuration once again, it is used
+ * when scores are reset from the configuration file
+ * @param cfg config file
+ */
+void reapply_dynamic_config (struct rspamd_config *cfg);
+
 /**
  * Dump dynamic configuration to the disk
  * @param cfg
@@ -238,6 +238,14 @@ rspamd_session_destroy (struct rspamd_async_session *session)
 	return TRUE;
 }
 
+gboolean
+rspamd_session_is_destroying (struct rspamd_async_session *session)
+{
+	g_assert (session != NULL);
+
+	return RSPAMD_SESSION_IS_DESTROYING (session) ? TRUE : FALSE;
+}
+
 gboolean
 rspamd_session_pending (struct rspamd_async_session *session)
 {
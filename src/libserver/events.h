@@ -75,6 +75,14 @@ void rspamd_session_remove_event (struct rspamd_async_session *session,
  */
 gboolean rspamd_session_destroy (struct rspamd_async_session *session);
 
+/**
+ * Returns TRUE if the session is being destroyed, so events must not be
+ * removed from it explicitly
+ * @param session
+ * @return
+ */
+gboolean rspamd_session_is_destroying (struct rspamd_async_session *session);
+
 /**
  * Check session for events pending and call fin callback if no events are pending
  * @param session session object
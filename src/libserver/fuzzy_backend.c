@@ -82,13 +82,28 @@ static const char *create_index_sql =
 		"CREATE INDEX IF NOT EXISTS dgst_id ON shingles(digest_id);"
 		"CREATE UNIQUE INDEX IF NOT EXISTS s ON shingles(value, number);"
 		"COMMIT;";
+/* Tables used for replication are created for existing databases as well */
+static const char *create_replication_sql =
+		"BEGIN;"
+		"CREATE TABLE IF NOT EXISTS updates_log("
+		"seq INTEGER PRIMARY KEY AUTOINCREMENT,"
+		"cmd BLOB NOT NULL);"
+		"CREATE TABLE IF NOT EXISTS replication("
+		"source TEXT PRIMARY KEY,"
+		"seq INTEGER NOT NULL);"
+		"COMMIT;";
+
+/* All shingles of a digest are inserted by a single statement */
+#define SHINGLE_ROW(num, arg) "(?" #arg ", " #num ", ?33)"
+G_STATIC_ASSERT (RSPAMD_SHINGLE_SIZE == 32);
+
 enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_START = 0,
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT,
 	RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK,
 	RSPAMD_FUZZY_BACKEND_INSERT,
 	RSPAMD_FUZZY_BACKEND_UPDATE,
-	RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
+	RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
 	RSPAMD_FUZZY_BACKEND_CHECK,
 	RSPAMD_FUZZY_BACKEND_CHECK_SHINGLE,
 	RSPAMD_FUZZY_BACKEND_GET_DIGEST_BY_ID,
@@ -97,6 +112,12 @@ enum rspamd_fuzzy_statement_idx {
 	RSPAMD_FUZZY_BACKEND_EXPIRE,
 	RSPAMD_FUZZY_BACKEND_VACUUM,
 	RSPAMD_FUZZY_BACKEND_DELETE_ORPHANED,
+	RSPAMD_FUZZY_BACKEND_LOG_INSERT,
+	RSPAMD_FUZZY_BACKEND_LOG_FETCH,
+	RSPAMD_FUZZY_BACKEND_LOG_LAST,
+	RSPAMD_FUZZY_BACKEND_LOG_EXPIRE,
+	RSPAMD_FUZZY_BACKEND_SOURCE_GET,
+	RSPAMD_FUZZY_BACKEND_SOURCE_SET,
 	RSPAMD_FUZZY_BACKEND_MAX
 };
 static struct rspamd_fuzzy_stmts {
@@ -145,10 +166,26 @@ static struct rspamd_fuzzy_stmts {
 		.result = SQLITE_DONE
 	},
 	{
-		.idx = RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
+		.idx = RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
 		.sql = "INSERT OR REPLACE INTO shingles(value, number, digest_id) "
-				"VALUES (?1, ?2, ?3);",
-		.args = "III",
+				"VALUES "
+				SHINGLE_ROW(0, 1) "," SHINGLE_ROW(1, 2) ","
+				SHINGLE_ROW(2, 3) "," SHINGLE_ROW(3, 4) ","
+				SHINGLE_ROW(4, 5) "," SHINGLE_ROW(5, 6) ","
+				SHINGLE_ROW(6, 7) "," SHINGLE_ROW(7, 8) ","
+				SHINGLE_ROW(8, 9) "," SHINGLE_ROW(9, 10) ","
+				SHINGLE_ROW(10, 11) "," SHINGLE_ROW(11, 12) ","
+				SHINGLE_ROW(12, 13) "," SHINGLE_ROW(13, 14) ","
+				SHINGLE_ROW(14, 15) "," SHINGLE_ROW(15, 16) ","
+				SHINGLE_ROW(16, 17) "," SHINGLE_ROW(17, 18) ","
+				SHINGLE_ROW(18, 19) "," SHINGLE_ROW(19, 20) ","
+				SHINGLE_ROW(20, 21) "," SHINGLE_ROW(21, 22) ","
+				SHINGLE_ROW(22, 23) "," SHINGLE_ROW(23, 24) ","
+				SHINGLE_ROW(24, 25) "," SHINGLE_ROW(25, 26) ","
+				SHINGLE_ROW(26, 27) "," SHINGLE_ROW(27, 28) ","
+				SHINGLE_ROW(28, 29) "," SHINGLE_ROW(29, 30) ","
+				SHINGLE_ROW(30, 31) "," SHINGLE_ROW(31, 32) ";"
+		.args = "HI",
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
@@ -208,6 +245,50 @@ static struct rspamd_fuzzy_stmts {
 		.stmt = NULL,
 		.result = SQLITE_DONE
 	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOG_INSERT,
+		.sql = "INSERT INTO updates_log(cmd) VALUES (?1);",
+		.args = "B",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOG_FETCH,
+		.sql = "SELECT seq, cmd FROM updates_log WHERE seq > ?1 "
+				"ORDER BY seq LIMIT ?2;",
+		.args = "II",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOG_LAST,
+		.sql = "SELECT seq FROM updates_log ORDER BY seq DESC LIMIT 1;",
+		.args = "",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_LOG_EXPIRE,
+		.sql = "DELETE FROM updates_log WHERE seq <= ?1;",
+		.args = "I",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_SOURCE_GET,
+		.sql = "SELECT seq FROM replication WHERE source=?1;",
+		.args = "T",
+		.stmt = NULL,
+		.result = SQLITE_ROW
+	},
+	{
+		.idx = RSPAMD_FUZZY_BACKEND_SOURCE_SET,
+		.sql = "INSERT OR REPLACE INTO replication(source, seq) "
+				"VALUES (?1, ?2);",
+		.args = "TI",
+		.stmt = NULL,
+		.result = SQLITE_DONE
+	},
 };
 
 static GQuark
@@ -268,7 +349,9 @@ rspamd_fuzzy_backend_run_stmt (struct rspamd_fuzzy_backend *backend,
 	sqlite3_stmt *stmt;
 	int i;
 	const char *argtypes;
-	guint retries = 0;
+	const guint64 *hashes;
+	gconstpointer blob;
+	guint retries = 0, pos = 1, j;
 	struct timespec ts;
 
 	if (idx < 0 || idx >= RSPAMD_FUZZY_BACKEND_MAX) {
@@ -300,20 +383,33 @@ rspamd_fuzzy_backend_run_stmt (struct rspamd_fuzzy_backend *backend,
 	for (i = 0; argtypes[i] != '\0'; i++) {
 		switch (argtypes[i]) {
 		case 'T':
-			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), -1,
+			sqlite3_bind_text (stmt, pos++, va_arg (ap, const char*), -1,
 					SQLITE_STATIC);
 			break;
 		case 'I':
-			sqlite3_bind_int64 (stmt, i + 1, va_arg (ap, gint64));
+			sqlite3_bind_int64 (stmt, pos++, va_arg (ap, gint64));
 			break;
 		case 'S':
-			sqlite3_bind_int (stmt, i + 1, va_arg (ap, gint));
+			sqlite3_bind_int (stmt, pos++, va_arg (ap, gint));
 			break;
 		case 'D':
 			/* Special case for digests variable */
-			sqlite3_bind_text (stmt, i + 1, va_arg (ap, const char*), 64,
+			sqlite3_bind_text (stmt, pos++, va_arg (ap, const char*), 64,
 					SQLITE_STATIC);
 			break;
+		case 'B':
+			/* Blob followed by its length */
+			blob = va_arg (ap, gconstpointer);
+			sqlite3_bind_blob (stmt, pos++, blob, va_arg (ap, gint), SQLITE_STATIC);
+			break;
+		case 'H':
+			/* All shingles hashes bound to the subsequent arguments */
+			hashes = va_arg (ap, const guint64 *);
+
+			for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+				sqlite3_bind_int64 (stmt, pos++, hashes[j]);
+			}
+			break;
 		}
 	}
 
@@ -402,6 +498,12 @@ rspamd_fuzzy_backend_open_db (const gchar *path, GError **err)
 		return NULL;
 	}
 
+	if (!rspamd_fuzzy_backend_run_sql (create_replication_sql, bk, err)) {
+		rspamd_fuzzy_backend_close (bk);
+
+		return NULL;
+	}
+
 	if (!rspamd_fuzzy_backend_prepare_stmts (bk, err)) {
 		rspamd_fuzzy_backend_close (bk);
 
@@ -601,7 +703,7 @@ gboolean
 rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
 		const struct rspamd_fuzzy_cmd *cmd)
 {
-	int rc, i;
+	int rc;
 	gint64 id;
 	const struct rspamd_fuzzy_shingle_cmd *shcmd;
 
@@ -639,21 +741,14 @@ rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
 				id = sqlite3_last_insert_rowid (backend->db);
 				shcmd = (const struct rspamd_fuzzy_shingle_cmd *) cmd;
 
-				for (i = 0; i < RSPAMD_SHINGLE_SIZE; i++) {
-					rc = rspamd_fuzzy_backend_run_stmt (backend, TRUE,
-							RSPAMD_FUZZY_BACKEND_INSERT_SHINGLE,
-							shcmd->sgl.hashes[i], i, id);
-					msg_debug_fuzzy_backend ("add shingle %d -> %L: %L",
-							i,
-							shcmd->sgl.hashes[i],
-							id);
-
-					if (rc != SQLITE_OK) {
-						msg_warn_fuzzy_backend ("cannot add shingle %d -> "
-								"%L: %L: %s", i,
-								shcmd->sgl.hashes[i],
-								id, sqlite3_errmsg (backend->db));
-					}
+				rc = rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+						RSPAMD_FUZZY_BACKEND_INSERT_SHINGLES,
+						shcmd->sgl.hashes, id);
+				msg_debug_fuzzy_backend ("add shingles for %L", id);
+
+				if (rc != SQLITE_OK) {
+					msg_warn_fuzzy_backend ("cannot add shingles for "
+							"%L: %s", id, sqlite3_errmsg (backend->db));
 				}
 			}
 		}
@@ -674,7 +769,7 @@ rspamd_fuzzy_backend_add (struct rspamd_fuzzy_backend *backend,
 gboolean
 rspamd_fuzzy_backend_finish_update (struct rspamd_fuzzy_backend *backend)
 {
-	gint rc, wal_frames, wal_checkpointed, mode;
+	gint rc, wal_frames, wal_checkpointed;
 
 	rc = rspamd_fuzzy_backend_run_stmt (backend, TRUE,
 			RSPAMD_FUZZY_BACKEND_TRANSACTION_COMMIT);
@@ -686,30 +781,71 @@ rspamd_fuzzy_backend_finish_update (struct rspamd_fuzzy_backend *backend)
 				RSPAMD_FUZZY_BACKEND_TRANSACTION_ROLLBACK);
 		return FALSE;
 	}
+
+#ifdef SQLITE_OPEN_WAL
+	/*
+	 * Passive checkpoint does not wait for readers, so checks are not
+	 * blocked while a large batch is moved from the wal file
+	 */
+	if (sqlite3_wal_checkpoint_v2 (backend->db,
+			NULL,
+			SQLITE_CHECKPOINT_PASSIVE,
+			&wal_frames,
+			&wal_checkpointed) != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot commit checkpoint: %s",
+				sqlite3_errmsg (backend->db));
+	}
 	else {
+		msg_debug_fuzzy_backend ("total number of frames in the wal file: "
+				"%d, checkpointed: %d", wal_frames, wal_checkpointed);
+	}
+#endif
+
+	return TRUE;
+}
+
+gboolean
+rspamd_fuzzy_backend_checkpoint (struct rspamd_fuzzy_backend *backend)
+{
 #ifdef SQLITE_OPEN_WAL
+	gint rc, wal_frames = 0, wal_checkpointed = 0;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	/*
+	 * Passive checkpoints after commits never reset the wal file, so it grows
+	 * while checks are running; this one is called periodically and returns
+	 * the space taken by large batches
+	 */
+	rc = sqlite3_wal_checkpoint_v2 (backend->db,
+			NULL,
 #ifdef SQLITE_CHECKPOINT_TRUNCATE
-		mode = SQLITE_CHECKPOINT_TRUNCATE;
-#elif defined(SQLITE_CHECKPOINT_RESTART)
-		mode = SQLITE_CHECKPOINT_RESTART;
-#elif defined(SQLITE_CHECKPOINT_FULL)
-		mode = SQLITE_CHECKPOINT_FULL;
+			SQLITE_CHECKPOINT_TRUNCATE,
+#else
+			SQLITE_CHECKPOINT_RESTART,
 #endif
-		/* Perform wal checkpoint (might be long) */
-		if (sqlite3_wal_checkpoint_v2 (backend->db,
-				NULL,
-				mode,
-				&wal_frames,
-				&wal_checkpointed) != SQLITE_OK) {
-			msg_warn_fuzzy_backend ("cannot commit checkpoint: %s",
-					sqlite3_errmsg (backend->db));
-		}
-		else {
-			msg_info_fuzzy_backend ("total number of frames in the wal file: "
-					"%d, checkpointed: %d", wal_frames, wal_checkpointed);
-		}
+			&wal_frames,
+			&wal_checkpointed);
+
+	if (rc == SQLITE_BUSY) {
+		msg_info_fuzzy_backend ("wal checkpoint is blocked by readers, "
+				"checkpointed %d of %d frames", wal_checkpointed, wal_frames);
+
+		return FALSE;
+	}
+	else if (rc != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot checkpoint wal file: %s",
+				sqlite3_errmsg (backend->db));
+
+		return FALSE;
 	}
+
+	msg_debug_fuzzy_backend ("checkpointed %d frames of the wal file",
+			wal_checkpointed);
 #endif
+
 	return TRUE;
 }
 
@@ -877,6 +1013,229 @@ rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend,
 	return ret;
 }
 
+gboolean
+rspamd_fuzzy_backend_log_update (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gsize len)
+{
+	gint rc;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	rc = rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_LOG_INSERT,
+			cmd, (gint)len);
+
+	if (rc != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot log update of %*xs: %s",
+				(gint)sizeof (cmd->digest), cmd->digest,
+				sqlite3_errmsg (backend->db));
+	}
+
+	return (rc == SQLITE_OK);
+}
+
+guint
+rspamd_fuzzy_backend_log_fetch (struct rspamd_fuzzy_backend *backend,
+		guint64 from, guint limit,
+		rspamd_fuzzy_log_cb cb, gpointer ud)
+{
+	sqlite3_stmt *stmt;
+	guint nrecords = 0;
+	gint rc;
+
+	if (backend == NULL) {
+		return 0;
+	}
+
+	rc = rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+			RSPAMD_FUZZY_BACKEND_LOG_FETCH, (gint64)from, (gint64)limit);
+	stmt = prepared_stmts[RSPAMD_FUZZY_BACKEND_LOG_FETCH].stmt;
+
+	while (rc == SQLITE_OK) {
+		cb (sqlite3_column_int64 (stmt, 0),
+				sqlite3_column_blob (stmt, 1),
+				sqlite3_column_bytes (stmt, 1),
+				ud);
+		nrecords ++;
+		rc = sqlite3_step (stmt);
+		rc = (rc == SQLITE_ROW) ? SQLITE_OK : rc;
+	}
+
+	rspamd_fuzzy_backend_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_LOG_FETCH);
+
+	return nrecords;
+}
+
+guint64
+rspamd_fuzzy_backend_log_last (struct rspamd_fuzzy_backend *backend)
+{
+	guint64 seq = 0;
+
+	if (backend == NULL) {
+		return 0;
+	}
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+			RSPAMD_FUZZY_BACKEND_LOG_LAST) == SQLITE_OK) {
+		seq = sqlite3_column_int64 (
+				prepared_stmts[RSPAMD_FUZZY_BACKEND_LOG_LAST].stmt, 0);
+	}
+
+	rspamd_fuzzy_backend_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_LOG_LAST);
+
+	return seq;
+}
+
+void
+rspamd_fuzzy_backend_log_expire (struct rspamd_fuzzy_backend *backend,
+		guint64 keep)
+{
+	guint64 last;
+
+	last = rspamd_fuzzy_backend_log_last (backend);
+
+	if (last > keep) {
+		if (rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+				RSPAMD_FUZZY_BACKEND_LOG_EXPIRE,
+				(gint64)(last - keep)) != SQLITE_OK) {
+			msg_warn_fuzzy_backend ("cannot expire updates log: %s",
+					sqlite3_errmsg (backend->db));
+		}
+	}
+}
+
+guint64
+rspamd_fuzzy_backend_source_seq (struct rspamd_fuzzy_backend *backend,
+		const gchar *source)
+{
+	guint64 seq = 0;
+
+	if (backend == NULL) {
+		return 0;
+	}
+
+	if (rspamd_fuzzy_backend_run_stmt (backend, FALSE,
+			RSPAMD_FUZZY_BACKEND_SOURCE_GET, source) == SQLITE_OK) {
+		seq = sqlite3_column_int64 (
+				prepared_stmts[RSPAMD_FUZZY_BACKEND_SOURCE_GET].stmt, 0);
+	}
+
+	rspamd_fuzzy_backend_cleanup_stmt (backend, RSPAMD_FUZZY_BACKEND_SOURCE_GET);
+
+	return seq;
+}
+
+gboolean
+rspamd_fuzzy_backend_set_source_seq (struct rspamd_fuzzy_backend *backend,
+		const gchar *source, guint64 seq)
+{
+	gint rc;
+
+	if (backend == NULL) {
+		return FALSE;
+	}
+
+	rc = rspamd_fuzzy_backend_run_stmt (backend, TRUE,
+			RSPAMD_FUZZY_BACKEND_SOURCE_SET, source, (gint64)seq);
+
+	if (rc != SQLITE_OK) {
+		msg_warn_fuzzy_backend ("cannot save sequence of %s: %s",
+				source, sqlite3_errmsg (backend->db));
+	}
+
+	return (rc == SQLITE_OK);
+}
+
+/* Header of the replication stream record, little endian */
+RSPAMD_PACKED(rspamd_fuzzy_log_record) {
+	guint64 seq;
+	guint32 len;
+};
+
+void
+rspamd_fuzzy_backend_log_serialize (guint64 seq, gconstpointer cmd, gsize len,
+		gpointer ud)
+{
+	rspamd_fstring_t **pbuf = ud;
+	struct rspamd_fuzzy_log_record rec;
+
+	rec.seq = GUINT64_TO_LE (seq);
+	rec.len = GUINT32_TO_LE (len);
+	*pbuf = rspamd_fstring_append (*pbuf, (const gchar *)&rec, sizeof (rec));
+	*pbuf = rspamd_fstring_append (*pbuf, cmd, len);
+}
+
+enum rspamd_fuzzy_replica_status
+rspamd_fuzzy_backend_log_apply (struct rspamd_fuzzy_backend *backend,
+		const guchar *data, gsize len, gboolean log,
+		guint64 *seq, guint *nrecords)
+{
+	struct rspamd_fuzzy_log_record rec;
+	union {
+		struct rspamd_fuzzy_cmd normal;
+		struct rspamd_fuzzy_shingle_cmd shingle;
+	} cmd;
+	gsize cmdlen;
+
+	while (len > 0) {
+		if (len < sizeof (rec)) {
+			return RSPAMD_FUZZY_REPLICA_INVALID;
+		}
+
+		memcpy (&rec, data, sizeof (rec));
+		rec.seq = GUINT64_FROM_LE (rec.seq);
+		cmdlen = GUINT32_FROM_LE (rec.len);
+		data += sizeof (rec);
+		len -= sizeof (rec);
+
+		if (cmdlen > len || cmdlen > sizeof (cmd) ||
+				cmdlen < sizeof (cmd.normal)) {
+			msg_err_fuzzy_backend ("invalid record of size %uz in "
+					"replication stream", cmdlen);
+			return RSPAMD_FUZZY_REPLICA_INVALID;
+		}
+
+		memset (&cmd, 0, sizeof (cmd));
+		memcpy (&cmd, data, cmdlen);
+		data += cmdlen;
+		len -= cmdlen;
+
+		if (cmdlen != (cmd.normal.shingles_count > 0 ?
+				sizeof (cmd.shingle) : sizeof (cmd.normal)) ||
+				(cmd.normal.cmd != FUZZY_WRITE && cmd.normal.cmd != FUZZY_DEL)) {
+			msg_err_fuzzy_backend ("invalid command in replication stream");
+			return RSPAMD_FUZZY_REPLICA_INVALID;
+		}
+
+		if (rec.seq <= *seq) {
+			/* Already applied */
+			continue;
+		}
+
+		if (rec.seq != *seq + 1) {
+			/* Source has expired records we have not seen yet */
+			return RSPAMD_FUZZY_REPLICA_GAP;
+		}
+
+		if (cmd.normal.cmd == FUZZY_WRITE) {
+			rspamd_fuzzy_backend_add (backend, &cmd.normal);
+		}
+		else {
+			rspamd_fuzzy_backend_del (backend, &cmd.normal);
+		}
+
+		if (log) {
+			rspamd_fuzzy_backend_log_update (backend, &cmd.normal, cmdlen);
+		}
+
+		*seq = rec.seq;
+		(*nrecords) ++;
+	}
+
+	return RSPAMD_FUZZY_REPLICA_OK;
+}
 
 void
 rspamd_fuzzy_backend_close (struct rspamd_fuzzy_backend *backend)
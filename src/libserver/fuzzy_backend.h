@@ -29,6 +29,24 @@
 
 struct rspamd_fuzzy_backend;
 
+/**
+ * Callback for records of the updates log
+ * @param seq sequence number of the record
+ * @param cmd logged update command (might be a shingles command)
+ * @param len length of the command
+ */
+typedef void (*rspamd_fuzzy_log_cb) (guint64 seq, gconstpointer cmd, gsize len,
+		gpointer ud);
+
+/**
+ * Result of applying a replication stream
+ */
+enum rspamd_fuzzy_replica_status {
+	RSPAMD_FUZZY_REPLICA_OK = 0,    /**< all new records have been applied */
+	RSPAMD_FUZZY_REPLICA_INVALID,   /**< stream is malformed */
+	RSPAMD_FUZZY_REPLICA_GAP        /**< records following the last applied one are missing */
+};
+
 /**
  * Open fuzzy backend
  * @param path file to open (legacy file will be converted automatically)
@@ -80,6 +98,14 @@ gboolean rspamd_fuzzy_backend_del (
  */
 gboolean rspamd_fuzzy_backend_finish_update (struct rspamd_fuzzy_backend *backend);
 
+/**
+ * Moves the whole wal file to the database and truncates it, fails if
+ * there are active readers
+ * @param backend
+ * @return TRUE if the wal file has been reset
+ */
+gboolean rspamd_fuzzy_backend_checkpoint (struct rspamd_fuzzy_backend *backend);
+
 /**
  * Sync storage
  * @param backend
@@ -89,6 +115,90 @@ gboolean rspamd_fuzzy_backend_sync (struct rspamd_fuzzy_backend *backend,
 		gint64 expire,
 		gboolean clean_orphaned);
 
+/**
+ * Append update to the updates log, should be called within the update
+ * transaction, so the log is consistent with the database
+ * @param backend
+ * @param cmd
+ * @param len length of command (with shingles if any)
+ * @return TRUE if the update has been logged
+ */
+gboolean rspamd_fuzzy_backend_log_update (struct rspamd_fuzzy_backend *backend,
+		const struct rspamd_fuzzy_cmd *cmd, gsize len);
+
+/**
+ * Iterate over log records with sequence numbers greater than `from`
+ * @param backend
+ * @param from the last sequence number known by a caller
+ * @param limit maximum number of records
+ * @param cb callback for each record
+ * @param ud opaque data for callback
+ * @return number of records processed
+ */
+guint rspamd_fuzzy_backend_log_fetch (struct rspamd_fuzzy_backend *backend,
+		guint64 from, guint limit,
+		rspamd_fuzzy_log_cb cb, gpointer ud);
+
+/**
+ * Returns the sequence number of the latest record in the updates log
+ * @param backend
+ * @return sequence number or 0 if log is empty
+ */
+guint64 rspamd_fuzzy_backend_log_last (struct rspamd_fuzzy_backend *backend);
+
+/**
+ * Removes old records from the updates log
+ * @param backend
+ * @param keep number of the latest records to keep
+ */
+void rspamd_fuzzy_backend_log_expire (struct rspamd_fuzzy_backend *backend,
+		guint64 keep);
+
+/**
+ * Returns the last sequence number applied from the specified source
+ * @param backend
+ * @param source name of replication source
+ * @return sequence number or 0 if nothing has been applied
+ */
+guint64 rspamd_fuzzy_backend_source_seq (struct rspamd_fuzzy_backend *backend,
+		const gchar *source);
+
+/**
+ * Saves the last sequence number applied from the specified source, should be
+ * called within the update transaction
+ * @param backend
+ * @param source name of replication source
+ * @param seq sequence number
+ * @return TRUE if saved
+ */
+gboolean rspamd_fuzzy_backend_set_source_seq (
+		struct rspamd_fuzzy_backend *backend,
+		const gchar *source, guint64 seq);
+
+/**
+ * Log callback that appends a record to the replication stream
+ * @param ud pointer to `rspamd_fstring_t *` stream
+ */
+void rspamd_fuzzy_backend_log_serialize (guint64 seq, gconstpointer cmd,
+		gsize len, gpointer ud);
+
+/**
+ * Applies records of the replication stream following `*seq`, should be called
+ * within the update transaction. Records that precede an invalid record or a
+ * gap are still applied
+ * @param backend
+ * @param data stream produced by `rspamd_fuzzy_backend_log_serialize`
+ * @param len length of stream
+ * @param log append applied updates to the own updates log
+ * @param seq the last applied sequence number, updated on return
+ * @param nrecords number of applied records is added here
+ * @return status of the stream
+ */
+enum rspamd_fuzzy_replica_status rspamd_fuzzy_backend_log_apply (
+		struct rspamd_fuzzy_backend *backend,
+		const guchar *data, gsize len, gboolean log,
+		guint64 *seq, guint *nrecords);
+
 /**
  * Close storage
  * @param backend
@@ -64,6 +64,10 @@
  * Process this message as described above and return modified message
  */
 #define MSG_CMD_PROCESS "process"
+/*
+ * Check several length prefixed messages and return results for all of them
+ */
+#define MSG_CMD_BATCH "batch"
 
 /*
  * Learn specified statfile using message
@@ -183,6 +187,16 @@ rspamd_protocol_handle_url (struct rspamd_task *task,
 	}
 
 	switch (*p) {
+	case 'b':
+	case 'B':
+		/* batch */
+		if (g_ascii_strncasecmp (p, MSG_CMD_BATCH, pathlen) == 0) {
+			task->cmd = CMD_BATCH;
+		}
+		else {
+			goto err;
+		}
+		break;
 	case 'c':
 	case 'C':
 		/* check */
@@ -607,6 +621,70 @@ rspamd_protocol_handle_request (struct rspamd_task *task,
 	return ret;
 }
 
+/*
+ * Batch body consists of messages prefixed with their lengths:
+ * <len>\n<message><len>\n<message>...
+ * Line breaks between messages are ignored
+ */
+GArray *
+rspamd_protocol_parse_batch (const gchar *chunk, gsize len, guint max_batch,
+		GError **err)
+{
+	GArray *messages;
+	rspamd_ftok_t tok;
+	const gchar *p = chunk, *end = chunk + len, *c;
+	gsize llen;
+	gulong mlen;
+
+	messages = g_array_new (FALSE, FALSE, sizeof (rspamd_ftok_t));
+
+	while (p < end) {
+		if (*p == '\r' || *p == '\n') {
+			p ++;
+			continue;
+		}
+
+		if (max_batch > 0 && messages->len >= max_batch) {
+			g_set_error (err, rspamd_protocol_quark (), RSPAMD_LENGTH_ERROR,
+					"too many messages in batch, maximum is %u", max_batch);
+			g_array_free (messages, TRUE);
+
+			return NULL;
+		}
+
+		c = memchr (p, '\n', end - p);
+		llen = c != NULL ? c - p : 0;
+
+		if (llen > 0 && p[llen - 1] == '\r') {
+			llen --;
+		}
+
+		if (c == NULL || !rspamd_strtoul (p, llen, &mlen) || mlen == 0 ||
+				mlen > (gulong)(end - c - 1)) {
+			g_set_error (err, rspamd_protocol_quark (), RSPAMD_PROTOCOL_ERROR,
+					"invalid length of message %u in batch", messages->len + 1);
+			g_array_free (messages, TRUE);
+
+			return NULL;
+		}
+
+		tok.begin = c + 1;
+		tok.len = mlen;
+		g_array_append_val (messages, tok);
+		p = c + 1 + mlen;
+	}
+
+	if (messages->len == 0) {
+		g_set_error (err, rspamd_protocol_quark (), RSPAMD_PROTOCOL_ERROR,
+				"empty batch");
+		g_array_free (messages, TRUE);
+
+		return NULL;
+	}
+
+	return messages;
+}
+
 /* Structure for writing tree data */
 struct tree_cb_data {
 	ucl_object_t *top;
@@ -1035,22 +1113,17 @@ rspamd_protocol_http_reply (struct rspamd_http_message *msg,
 			action = rspamd_check_action_metric (task, metric_res->score, &required_score,
 					metric_res->metric);
 			if (action <= METRIC_ACTION_NOACTION) {
-#ifndef HAVE_ATOMIC_BUILTINS
-				task->worker->srv->stat->actions_stat[action]++;
-#else
-				__atomic_add_fetch (&task->worker->srv->stat->actions_stat[action],
-						1, __ATOMIC_RELEASE);
-#endif
+				rspamd_counters_inc (task->worker->srv->counters,
+						RSPAMD_COUNTER_ACTIONS + action);
 			}
 		}
 
 		/* Increase counters */
-#ifndef HAVE_ATOMIC_BUILTINS
-		task->worker->srv->stat->messages_scanned++;
-#else
-		__atomic_add_fetch (&task->worker->srv->stat->messages_scanned,
-				1, __ATOMIC_RELEASE);
-#endif
+		rspamd_counters_inc (task->worker->srv->counters,
+				RSPAMD_COUNTER_SCANNED);
+		rspamd_counters_hist_add (task->worker->srv->counters,
+				RSPAMD_COUNTER_SCAN_TIME,
+				(rspamd_get_ticks () - task->time_real) * 1000000.0);
 	}
 }
 
@@ -1108,6 +1181,7 @@ rspamd_protocol_write_reply (struct rspamd_task *task)
 			msg->body = rspamd_fstring_new_init ("pong" CRLF, 6);
 			ctype = "text/plain";
 			break;
+		case CMD_BATCH:
 		case CMD_OTHER:
 			msg_err_task ("BROKEN");
 			break;
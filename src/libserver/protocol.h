@@ -47,6 +47,17 @@ gboolean rspamd_protocol_handle_control (struct rspamd_task *task,
 gboolean rspamd_protocol_handle_request (struct rspamd_task *task,
 	struct rspamd_http_message *msg);
 
+/**
+ * Split body of a batch request to the length prefixed messages
+ * @param chunk body of request
+ * @param len length of body
+ * @param max_batch maximum number of messages, 0 means no limit
+ * @param err error pointer
+ * @return array of rspamd_ftok_t pointing to `chunk` or NULL on error
+ */
+GArray * rspamd_protocol_parse_batch (const gchar *chunk, gsize len,
+		guint max_batch, GError **err);
+
 /**
  * Write task results to http message
  * @param msg
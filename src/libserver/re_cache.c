@@ -549,76 +549,71 @@ rspamd_re_cache_finish_class (struct rspamd_re_runtime *rt,
 #endif
 }
 
-/*
- * Calculates the specified regexp for the specified class if it's not calculated
- */
-static guint
-rspamd_re_cache_exec_re (struct rspamd_task *task,
-		struct rspamd_re_runtime *rt,
-		rspamd_regexp_t *re,
-		struct rspamd_re_class *re_class,
-		gboolean is_strong,
-		gboolean is_multiple)
+static inline void
+rspamd_re_cache_push_input (GArray *inputs, const gchar *begin, gsize len,
+		gboolean raw)
 {
-	guint ret = 0, i;
+	struct rspamd_re_input in;
+
+	in.begin = begin;
+	in.len = len;
+	in.raw = raw;
+	g_array_append_val (inputs, in);
+}
+
+GArray *
+rspamd_re_cache_get_inputs (struct rspamd_task *task,
+		enum rspamd_re_type type,
+		gconstpointer type_data,
+		gboolean is_strong)
+{
+	GArray *inputs;
 	GList *cur, *headerlist;
 	GHashTableIter it;
 	struct raw_header *rh;
-	const gchar *in;
-	gboolean raw = FALSE;
 	struct mime_text_part *part;
 	struct rspamd_url *url;
-
 	gpointer k, v;
-	gsize len;
+	gboolean raw = FALSE;
+	guint i;
+
+	g_assert (task != NULL);
 
-	switch (re_class->type) {
+	inputs = g_array_sized_new (FALSE, FALSE, sizeof (struct rspamd_re_input),
+			4);
+
+	switch (type) {
 	case RSPAMD_RE_HEADER:
 	case RSPAMD_RE_RAWHEADER:
+		if (type_data == NULL) {
+			break;
+		}
+
 		/* Get list of specified headers */
-		headerlist = rspamd_message_get_header (task,
-				re_class->type_data,
+		headerlist = rspamd_message_get_header (task, (const gchar *)type_data,
 				is_strong);
 
-		if (headerlist) {
-			cur = headerlist;
+		for (cur = headerlist; cur != NULL; cur = g_list_next (cur)) {
+			rh = cur->data;
 
-			while (cur) {
-				rh = cur->data;
-				if (re_class->type == RSPAMD_RE_RAWHEADER) {
-					in = rh->value;
-					raw = TRUE;
-				}
-				else {
-					in = rh->decoded;
-					/* Validate input */
-					if (!in || !g_utf8_validate (in, -1, NULL)) {
-						cur = g_list_next (cur);
-						continue;
-					}
+			if (type == RSPAMD_RE_RAWHEADER) {
+				if (rh->value) {
+					rspamd_re_cache_push_input (inputs, rh->value,
+							strlen (rh->value), TRUE);
 				}
-
-				/* Match re */
-				if (in) {
-					ret += rspamd_re_cache_process_regexp_data (rt, re, in,
-							strlen (in), raw, is_multiple);
-					debug_task ("checking header %s regexp: %s -> %d",
-							re_class->type_data,
-							rspamd_regexp_get_pattern (re), ret);
+			}
+			else {
+				/* Validate input */
+				if (rh->decoded && g_utf8_validate (rh->decoded, -1, NULL)) {
+					rspamd_re_cache_push_input (inputs, rh->decoded,
+							strlen (rh->decoded), FALSE);
 				}
-
-				cur = g_list_next (cur);
 			}
 		}
 		break;
 	case RSPAMD_RE_ALLHEADER:
-		raw = TRUE;
-		in = task->raw_headers_content.begin;
-		len = task->raw_headers_content.len;
-		ret = rspamd_re_cache_process_regexp_data (rt, re, in,
-				len, raw, is_multiple);
-		debug_task ("checking allheader regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
+		rspamd_re_cache_push_input (inputs, task->raw_headers_content.begin,
+				task->raw_headers_content.len, TRUE);
 		break;
 	case RSPAMD_RE_MIME:
 		/* Iterate throught text parts */
@@ -630,25 +625,24 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 				continue;
 			}
 
-			/* Check raw flags */
+			/*
+			 * Check raw flags: once a non utf part is found, this and all
+			 * the following parts are matched raw
+			 */
 			if (!IS_PART_UTF (part)) {
 				raw = TRUE;
 			}
+
 			/* Select data for regexp */
 			if (raw) {
-				in = part->orig->data;
-				len = part->orig->len;
-			}
-			else {
-				in = part->content->data;
-				len = part->content->len;
+				if (part->orig->len > 0) {
+					rspamd_re_cache_push_input (inputs, part->orig->data,
+							part->orig->len, TRUE);
+				}
 			}
-
-			if (len > 0) {
-				ret += rspamd_re_cache_process_regexp_data (rt, re, in,
-						len, raw, is_multiple);
-				debug_task ("checking mime regexp: %s -> %d",
-						rspamd_regexp_get_pattern (re), ret);
+			else if (part->content->len > 0) {
+				rspamd_re_cache_push_input (inputs, part->content->data,
+						part->content->len, FALSE);
 			}
 		}
 		break;
@@ -657,45 +651,65 @@ rspamd_re_cache_exec_re (struct rspamd_task *task,
 
 		while (g_hash_table_iter_next (&it, &k, &v)) {
 			url = v;
-			in = url->string;
-			len = url->urllen;
-			raw = FALSE;
-
-			ret += rspamd_re_cache_process_regexp_data (rt, re, in,
-					len, raw, is_multiple);
+			rspamd_re_cache_push_input (inputs, url->string, url->urllen,
+					FALSE);
 		}
 
 		g_hash_table_iter_init (&it, task->emails);
 
 		while (g_hash_table_iter_next (&it, &k, &v)) {
 			url = v;
-			in = url->string;
-			len = url->urllen;
-			raw = FALSE;
-
-			ret += rspamd_re_cache_process_regexp_data (rt, re, in,
-					len, raw, is_multiple);
+			rspamd_re_cache_push_input (inputs, url->string, url->urllen,
+					FALSE);
 		}
-
-		debug_task ("checking url regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
 		break;
 	case RSPAMD_RE_BODY:
-		raw = TRUE;
-		in = task->msg.begin;
-		len = task->msg.len;
-
-		ret = rspamd_re_cache_process_regexp_data (rt, re, in,
-				len, raw, is_multiple);
-		debug_task ("checking rawbody regexp: %s -> %d",
-				rspamd_regexp_get_pattern (re), ret);
+		rspamd_re_cache_push_input (inputs, task->msg.begin, task->msg.len,
+				TRUE);
 		break;
 	case RSPAMD_RE_MAX:
+		break;
+	}
+
+	return inputs;
+}
+
+/*
+ * Calculates the specified regexp for the specified class if it's not calculated
+ */
+static guint
+rspamd_re_cache_exec_re (struct rspamd_task *task,
+		struct rspamd_re_runtime *rt,
+		rspamd_regexp_t *re,
+		struct rspamd_re_class *re_class,
+		gboolean is_strong,
+		gboolean is_multiple)
+{
+	guint ret = 0, i;
+	GArray *inputs;
+	struct rspamd_re_input *in;
+
+	if (re_class->type == RSPAMD_RE_MAX) {
 		msg_err_task ("regexp of class invalid has been called: %s",
 				rspamd_regexp_get_pattern (re));
-		break;
+
+		return 0;
 	}
 
+	inputs = rspamd_re_cache_get_inputs (task, re_class->type,
+			re_class->type_data, is_strong);
+
+	for (i = 0; i < inputs->len; i ++) {
+		in = &g_array_index (inputs, struct rspamd_re_input, i);
+		ret += rspamd_re_cache_process_regexp_data (rt, re, in->begin,
+				in->len, in->raw, is_multiple);
+	}
+
+	debug_task ("checking %s regexp: %s -> %d",
+			rspamd_re_cache_type_to_string (re_class->type),
+			rspamd_regexp_get_pattern (re), ret);
+
+	g_array_free (inputs, TRUE);
 	rspamd_re_cache_finish_class (rt, re_class);
 
 	return ret;
@@ -927,21 +941,221 @@ rspamd_re_cache_is_finite (struct rspamd_re_cache *cache,
 }
 #endif
 
-gint
-rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
+#ifdef WITH_HYPERSCAN
+/*
+ * Hyperscan flags for patterns are cached between compilations in the
+ * `cache_dir`, so unchanged patterns are not probed again
+ */
+#define RSPAMD_HS_COMPAT_UNSUPPORTED G_MAXUINT32
+
+RSPAMD_PACKED(rspamd_hs_compat_record) {
+	guint64 id;
+	guint32 flags;
+};
+
+static void
+rspamd_re_cache_compat_path (struct rspamd_re_cache *cache,
+		const gchar *cache_dir, gchar *path, gsize len)
+{
+	XXH64_state_t st;
+	const gchar *version = hs_version ();
+
+	/* Probe results are valid only for the same platform and library */
+	XXH64_reset (&st, 0xdeadbabe);
+	XXH64_update (&st, &cache->plt, sizeof (cache->plt));
+	XXH64_update (&st, version, strlen (version));
+
+	rspamd_snprintf (path, len, "%s%chs_compat_%016xL.cache", cache_dir,
+			G_DIR_SEPARATOR, XXH64_digest (&st));
+}
+
+static GHashTable *
+rspamd_re_cache_compat_load (struct rspamd_re_cache *cache, const gchar *path)
+{
+	GHashTable *compat;
+	gchar *data = NULL;
+	gsize len = 0, i;
+	struct rspamd_hs_compat_record *rec;
+	guint64 *id;
+
+	compat = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+
+	if (g_file_get_contents (path, &data, &len, NULL)) {
+		/* The latest record wins, if there are several for a pattern */
+		for (i = 0; i + sizeof (*rec) <= len; i += sizeof (*rec)) {
+			rec = (struct rspamd_hs_compat_record *)(data + i);
+			id = g_malloc (sizeof (*id));
+			memcpy (id, &rec->id, sizeof (*id));
+			g_hash_table_replace (compat, id, GUINT_TO_POINTER (rec->flags));
+		}
+
+		msg_debug_re_cache ("loaded %d cached hyperscan probes from %s",
+				g_hash_table_size (compat), path);
+		g_free (data);
+	}
+
+	return compat;
+}
+
+static guint64
+rspamd_re_cache_compat_id (rspamd_regexp_t *re)
+{
+	const gchar *pattern = rspamd_regexp_get_pattern (re);
+
+	return XXH64 (pattern, strlen (pattern), 0xdeadbabe);
+}
+
+/*
+ * Merges new probes with the ones stored by other compilers and rewrites the
+ * file with records for the current patterns only, so it does not grow with
+ * every recompilation
+ */
+static void
+rspamd_re_cache_compat_save (struct rspamd_re_cache *cache, const gchar *path,
+		GArray *records)
+{
+	struct rspamd_hs_compat_record rec;
+	struct rspamd_re_cache_elt *elt;
+	GHashTable *merged;
+	GArray *out;
+	struct stat st;
+	gchar *data = NULL;
+	gpointer flags;
+	guint64 *id;
+	gsize i, len = 0;
+	gint fd;
+
+	fd = open (path, O_RDWR|O_CREAT, 00600);
+
+	if (fd == -1) {
+		msg_warn_re_cache ("cannot open %s: %s", path, strerror (errno));
+		return;
+	}
+
+	/* Concurrent compilers rewrite the file one by one */
+	if (!rspamd_file_lock (fd, FALSE)) {
+		msg_warn_re_cache ("cannot lock %s: %s", path, strerror (errno));
+		close (fd);
+		return;
+	}
+
+	merged = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+
+	if (fstat (fd, &st) != -1 && st.st_size > 0) {
+		data = g_malloc (st.st_size);
+
+		if (pread (fd, data, st.st_size, 0) == st.st_size) {
+			len = st.st_size;
+		}
+	}
+
+	for (i = 0; i + sizeof (rec) <= len + records->len * sizeof (rec);
+			i += sizeof (rec)) {
+		/* Probes of this compiler go after the stored ones and replace them */
+		if (i < len) {
+			memcpy (&rec, data + i, sizeof (rec));
+		}
+		else {
+			rec = g_array_index (records, struct rspamd_hs_compat_record,
+					(i - len) / sizeof (rec));
+		}
+
+		id = g_malloc (sizeof (*id));
+		*id = rec.id;
+		g_hash_table_replace (merged, id, GUINT_TO_POINTER (rec.flags));
+	}
+
+	out = g_array_sized_new (FALSE, FALSE, sizeof (rec),
+			g_hash_table_size (merged));
+
+	/* Records of patterns that are no longer configured are dropped */
+	for (i = 0; i < cache->re->len; i ++) {
+		elt = g_ptr_array_index (cache->re, i);
+		rec.id = rspamd_re_cache_compat_id (elt->re);
+
+		if (g_hash_table_lookup_extended (merged, &rec.id, NULL, &flags)) {
+			rec.flags = GPOINTER_TO_UINT (flags);
+			g_array_append_val (out, rec);
+			/* Same pattern could be registered in several classes */
+			g_hash_table_remove (merged, &rec.id);
+		}
+	}
+
+	if (records->len > 0 || out->len * sizeof (rec) != len) {
+		if (pwrite (fd, out->data, out->len * sizeof (rec), 0) == -1 ||
+				ftruncate (fd, out->len * sizeof (rec)) == -1) {
+			msg_warn_re_cache ("cannot write %s: %s", path, strerror (errno));
+		}
+	}
+
+	g_array_free (out, TRUE);
+	g_hash_table_unref (merged);
+	g_free (data);
+	rspamd_file_unlock (fd, FALSE);
+	close (fd);
+}
+
+static guint32
+rspamd_re_cache_hs_flags (struct rspamd_re_cache *cache, rspamd_regexp_t *re,
+		GHashTable *compat, GArray *records)
+{
+	struct rspamd_hs_compat_record rec;
+	hs_database_t *test_db;
+	hs_compile_error_t *hs_errors;
+	const gchar *pattern;
+	gpointer cached;
+	guint64 *id;
+
+	pattern = rspamd_regexp_get_pattern (re);
+	rec.id = rspamd_re_cache_compat_id (re);
+
+	if ((cached = g_hash_table_lookup (compat, &rec.id)) != NULL) {
+		return GPOINTER_TO_UINT (cached);
+	}
+
+	if (hs_compile (pattern,
+			HS_FLAG_ALLOWEMPTY,
+			HS_MODE_BLOCK,
+			&cache->plt,
+			&test_db,
+			&hs_errors) != HS_SUCCESS) {
+		msg_info_re_cache ("cannot compile %s to hyperscan, try prefilter match",
+				pattern);
+		hs_free_compile_error (hs_errors);
+
+		/* The approximation operation might take a significant
+		 * amount of time, so we need to check if it's finite
+		 */
+		if (rspamd_re_cache_is_finite (cache, re)) {
+			rec.flags = HS_FLAG_ALLOWEMPTY | HS_FLAG_PREFILTER;
+		}
+		else {
+			rec.flags = RSPAMD_HS_COMPAT_UNSUPPORTED;
+		}
+	}
+	else {
+		rec.flags = HS_FLAG_ALLOWEMPTY;
+		hs_free_database (test_db);
+	}
+
+	id = g_malloc (sizeof (*id));
+	*id = rec.id;
+	g_hash_table_replace (compat, id, GUINT_TO_POINTER (rec.flags));
+	g_array_append_val (records, rec);
+
+	return rec.flags;
+}
+
+static gint
+rspamd_re_cache_compile_class (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
 		const char *cache_dir,
+		GHashTable *compat,
+		GArray *records,
 		GError **err)
 {
-	g_assert (cache != NULL);
-	g_assert (cache_dir != NULL);
-
-#ifndef WITH_HYPERSCAN
-	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
-	return -1;
-#else
-	GHashTableIter it, cit;
+	GHashTableIter cit;
 	gpointer k, v;
-	struct rspamd_re_class *re_class;
 	gchar path[PATH_MAX];
 	hs_database_t *test_db;
 	gint fd, i, n, *hs_ids = NULL;
@@ -949,173 +1163,246 @@ rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 	rspamd_regexp_t *re;
 	hs_compile_error_t *hs_errors;
 	guint *hs_flags = NULL;
+	guint32 flags;
 	const gchar **hs_pats = NULL;
 	gchar *hs_serialized;
-	gsize serialized_len, total = 0;
+	gsize serialized_len;
 	struct iovec iov[6];
 
-	g_hash_table_iter_init (&it, cache->re_classes);
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
 
-	while (g_hash_table_iter_next (&it, &k, &v)) {
-		re_class = v;
-		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
+	if (rspamd_re_cache_is_valid_hyperscan_file (cache, path)) {
+		msg_info_re_cache ("skip already valid file for re class '%s'",
+				re_class->hash);
 
-		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path)) {
-			msg_info_re_cache ("skip already valid file for re class '%s'",
-					re_class->hash);
+		fd = open (path, O_RDONLY, 00600);
+
+		/* Read number of regexps */
+		g_assert (fd != -1);
+		lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
+		read (fd, &n, sizeof (n));
+		close (fd);
 
-			fd = open (path, O_RDONLY, 00600);
+		return n;
+	}
+
+	fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
+
+	if (fd == -1) {
+		g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
+				"%s: %s", path, strerror (errno));
+		return -1;
+	}
+
+	g_hash_table_iter_init (&cit, re_class->re);
+	n = g_hash_table_size (re_class->re);
+	hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
+	hs_ids = g_malloc (sizeof (*hs_ids) * n);
+	hs_pats = g_malloc (sizeof (*hs_pats) * n);
+	i = 0;
+
+	while (g_hash_table_iter_next (&cit, &k, &v)) {
+		re = v;
+		flags = rspamd_re_cache_hs_flags (cache, re, compat, records);
+
+		if (flags != RSPAMD_HS_COMPAT_UNSUPPORTED) {
+			hs_flags[i] = flags;
+			hs_ids[i] = rspamd_regexp_get_cache_id (re);
+			hs_pats[i] = rspamd_regexp_get_pattern (re);
+			i ++;
+		}
+	}
+	/* Adjust real re number */
+	n = i;
+
+	if (n > 0) {
+		/* Create the hs tree */
+		if (hs_compile_multi (hs_pats,
+				hs_flags,
+				hs_ids,
+				n,
+				HS_MODE_BLOCK,
+				&cache->plt,
+				&test_db,
+				&hs_errors) != HS_SUCCESS) {
 
-			/* Read number of regexps */
-			g_assert (fd != -1);
-			lseek (fd, RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt), SEEK_SET);
-			read (fd, &n, sizeof (n));
-			total += n;
+			g_set_error (err, rspamd_re_cache_quark (), EINVAL,
+					"cannot create tree of regexp when processing '%s': %s",
+					hs_pats[hs_errors->expression], hs_errors->message);
+			g_free (hs_flags);
+			g_free (hs_ids);
+			g_free (hs_pats);
 			close (fd);
-			continue;
+			unlink (path);
+			hs_free_compile_error (hs_errors);
+
+			return -1;
 		}
 
-		fd = open (path, O_CREAT|O_TRUNC|O_EXCL|O_WRONLY, 00600);
+		g_free (hs_flags);
+		g_free (hs_pats);
+
+		if (hs_serialize_database (test_db, &hs_serialized,
+				&serialized_len) != HS_SUCCESS) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp for %s",
+					re_class->hash);
+
+			close (fd);
+			unlink (path);
+			g_free (hs_ids);
+			hs_free_database (test_db);
 
-		if (fd == -1) {
-			g_set_error (err, rspamd_re_cache_quark (), errno, "cannot open file "
-					"%s: %s", path, strerror (errno));
 			return -1;
 		}
 
-		g_hash_table_iter_init (&cit, re_class->re);
-		n = g_hash_table_size (re_class->re);
-		hs_flags = g_malloc0 (sizeof (*hs_flags) * n);
-		hs_ids = g_malloc (sizeof (*hs_ids) * n);
-		hs_pats = g_malloc (sizeof (*hs_pats) * n);
-		i = 0;
-
-		while (g_hash_table_iter_next (&cit, &k, &v)) {
-			re = v;
-
-			if (hs_compile (rspamd_regexp_get_pattern (re),
-					HS_FLAG_ALLOWEMPTY,
-					HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
-				msg_info_re_cache ("cannot compile %s to hyperscan, try prefilter match",
-						rspamd_regexp_get_pattern (re));
-				hs_free_compile_error (hs_errors);
-
-				/* The approximation operation might take a significant
-				 * amount of time, so we need to check if it's finite
-				 */
-				if (rspamd_re_cache_is_finite (cache, re)) {
-						hs_flags[i] = HS_FLAG_ALLOWEMPTY | HS_FLAG_PREFILTER;
-					hs_ids[i] = rspamd_regexp_get_cache_id (re);
-					hs_pats[i] = rspamd_regexp_get_pattern (re);
-					i++;
-				}
-			}
-			else {
-				hs_flags[i] = HS_FLAG_ALLOWEMPTY;
-				hs_ids[i] = rspamd_regexp_get_cache_id (re);
-				hs_pats[i] = rspamd_regexp_get_pattern (re);
-				i ++;
-				hs_free_database (test_db);
-			}
+		hs_free_database (test_db);
+
+		/*
+		 * Magic - 8 bytes
+		 * Platform - sizeof (platform)
+		 * n - number of regexps
+		 * n * <regexp ids>
+		 * crc - 8 bytes checksum
+		 * <hyperscan blob>
+		 */
+		crc = XXH64 (hs_serialized, serialized_len, 0xdeadbabe);
+		iov[0].iov_base = (void *)rspamd_hs_magic;
+		iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
+		iov[1].iov_base = &cache->plt;
+		iov[1].iov_len = sizeof (cache->plt);
+		iov[2].iov_base = &n;
+		iov[2].iov_len = sizeof (n);
+		iov[3].iov_base = hs_ids;
+		iov[3].iov_len = sizeof (*hs_ids) * n;
+		iov[4].iov_base = &crc;
+		iov[4].iov_len = sizeof (crc);
+		iov[5].iov_base = hs_serialized;
+		iov[5].iov_len = serialized_len;
+
+		if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
+			g_set_error (err,
+					rspamd_re_cache_quark (),
+					errno,
+					"cannot serialize tree of regexp to %s: %s",
+					path, strerror (errno));
+			close (fd);
+			unlink (path);
+			g_free (hs_ids);
+			g_free (hs_serialized);
+
+			return -1;
 		}
-		/* Adjust real re number */
-		n = i;
-
-		if (n > 0) {
-			/* Create the hs tree */
-			if (hs_compile_multi (hs_pats,
-					hs_flags,
-					hs_ids,
-					n,
-					HS_MODE_BLOCK,
-					&cache->plt,
-					&test_db,
-					&hs_errors) != HS_SUCCESS) {
-
-				g_set_error (err, rspamd_re_cache_quark (), EINVAL,
-						"cannot create tree of regexp when processing '%s': %s",
-						hs_pats[hs_errors->expression], hs_errors->message);
-				g_free (hs_flags);
-				g_free (hs_ids);
-				g_free (hs_pats);
-				close (fd);
-				hs_free_compile_error (hs_errors);
 
-				return -1;
-			}
+		g_free (hs_serialized);
+		g_free (hs_ids);
+	}
+	else {
+		g_free (hs_flags);
+		g_free (hs_ids);
+		g_free (hs_pats);
+	}
 
-			g_free (hs_flags);
-			g_free (hs_pats);
+	close (fd);
 
-			if (hs_serialize_database (test_db, &hs_serialized,
-					&serialized_len) != HS_SUCCESS) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp for %s",
-						re_class->hash);
+	return n;
+}
 
-				close (fd);
-				g_free (hs_ids);
-				hs_free_database (test_db);
+static gint
+rspamd_re_cache_class_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_re_class *c1 = *(const struct rspamd_re_class **)a,
+			*c2 = *(const struct rspamd_re_class **)b;
+	guint n1 = g_hash_table_size (c1->re), n2 = g_hash_table_size (c2->re);
 
-				return -1;
-			}
+	/* Larger classes first, the order must be the same in all compilers */
+	if (n1 != n2) {
+		return n1 > n2 ? -1 : 1;
+	}
 
-			hs_free_database (test_db);
+	return strcmp (c1->hash, c2->hash);
+}
+#endif
 
-			/*
-			 * Magic - 8 bytes
-			 * Platform - sizeof (platform)
-			 * n - number of regexps
-			 * n * <regexp ids>
-			 * crc - 8 bytes checksum
-			 * <hyperscan blob>
-			 */
-			crc = XXH64 (hs_serialized, serialized_len, 0xdeadbabe);
-			iov[0].iov_base = (void *)rspamd_hs_magic;
-			iov[0].iov_len = RSPAMD_HS_MAGIC_LEN;
-			iov[1].iov_base = &cache->plt;
-			iov[1].iov_len = sizeof (cache->plt);
-			iov[2].iov_base = &n;
-			iov[2].iov_len = sizeof (n);
-			iov[3].iov_base = hs_ids;
-			iov[3].iov_len = sizeof (*hs_ids) * n;
-			iov[4].iov_base = &crc;
-			iov[4].iov_len = sizeof (crc);
-			iov[5].iov_base = hs_serialized;
-			iov[5].iov_len = serialized_len;
-
-			if (writev (fd, iov, G_N_ELEMENTS (iov)) == -1) {
-				g_set_error (err,
-						rspamd_re_cache_quark (),
-						errno,
-						"cannot serialize tree of regexp to %s: %s",
-						path, strerror (errno));
-				close (fd);
-				g_free (hs_ids);
-				g_free (hs_serialized);
+gint
+rspamd_re_cache_compile_hyperscan_part (struct rspamd_re_cache *cache,
+		const char *cache_dir,
+		guint part,
+		guint nparts,
+		rspamd_re_cache_compiled_cb cb,
+		gpointer ud,
+		GError **err)
+{
+	g_assert (cache != NULL);
+	g_assert (cache_dir != NULL);
+	g_assert (nparts > 0 && part < nparts);
 
-				return -1;
-			}
+#ifndef WITH_HYPERSCAN
+	g_set_error (err, rspamd_re_cache_quark (), EINVAL, "hyperscan is disabled");
+	return -1;
+#else
+	GHashTableIter it;
+	gpointer k, v;
+	GPtrArray *classes;
+	GHashTable *compat;
+	GArray *records;
+	struct rspamd_re_class *re_class;
+	gchar compat_path[PATH_MAX];
+	gint n, total = 0;
+	guint i;
 
-			total += n;
+	classes = g_ptr_array_sized_new (g_hash_table_size (cache->re_classes));
+	g_hash_table_iter_init (&it, cache->re_classes);
 
-			g_free (hs_serialized);
-			g_free (hs_ids);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		g_ptr_array_add (classes, v);
+	}
+
+	g_ptr_array_sort (classes, rspamd_re_cache_class_cmp);
+	rspamd_re_cache_compat_path (cache, cache_dir, compat_path,
+			sizeof (compat_path));
+	compat = rspamd_re_cache_compat_load (cache, compat_path);
+	records = g_array_new (FALSE, FALSE, sizeof (struct rspamd_hs_compat_record));
+
+	for (i = part; i < classes->len; i += nparts) {
+		re_class = g_ptr_array_index (classes, i);
+		n = rspamd_re_cache_compile_class (cache, re_class, cache_dir,
+				compat, records, err);
+
+		if (n == -1) {
+			total = -1;
+			break;
 		}
 
-		close (fd);
+		total += n;
+
+		if (cb) {
+			cb (cache, re_class->hash, n, ud);
+		}
 	}
 
+	/* Probes are saved even on failure as they are still valid */
+	rspamd_re_cache_compat_save (cache, compat_path, records);
+	g_array_free (records, TRUE);
+	g_hash_table_unref (compat);
+	g_ptr_array_free (classes, TRUE);
+
 	return total;
 #endif
 }
 
+gint
+rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
+		const char *cache_dir,
+		GError **err)
+{
+	return rspamd_re_cache_compile_hyperscan_part (cache, cache_dir, 0, 1,
+			NULL, NULL, err);
+}
+
 gboolean
 rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 		const char *path)
@@ -1208,6 +1495,130 @@ rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
 }
 
 
+#ifdef WITH_HYPERSCAN
+static void
+rspamd_re_cache_unload_class (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class)
+{
+	struct rspamd_re_cache_elt *elt;
+	guint i;
+
+	if (re_class->hs_db) {
+		for (i = 0; i < re_class->nhs; i ++) {
+			elt = g_ptr_array_index (cache->re, re_class->hs_ids[i]);
+			elt->match_type = RSPAMD_RE_CACHE_PCRE;
+		}
+
+		hs_free_database (re_class->hs_db);
+		re_class->hs_db = NULL;
+	}
+	if (re_class->hs_scratch) {
+		hs_free_scratch (re_class->hs_scratch);
+		re_class->hs_scratch = NULL;
+	}
+	if (re_class->hs_ids) {
+		g_free (re_class->hs_ids);
+		re_class->hs_ids = NULL;
+	}
+
+	re_class->nhs = 0;
+}
+
+static gint
+rspamd_re_cache_load_class (struct rspamd_re_cache *cache,
+		struct rspamd_re_class *re_class,
+		const char *cache_dir)
+{
+	gchar path[PATH_MAX];
+	gint fd, i, n, *hs_ids = NULL;
+	guint8 *map, *p, *end;
+	struct rspamd_re_cache_elt *elt;
+	struct stat st;
+
+	rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
+			G_DIR_SEPARATOR, re_class->hash);
+
+	if (!rspamd_re_cache_is_valid_hyperscan_file (cache, path)) {
+		msg_err_re_cache ("invalid hyperscan hash file '%s'",
+				path);
+		return -1;
+	}
+
+	msg_debug_re_cache ("load hyperscan database from '%s'",
+			re_class->hash);
+
+	fd = open (path, O_RDONLY);
+
+	/* Read number of regexps */
+	g_assert (fd != -1);
+	fstat (fd, &st);
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (map == MAP_FAILED) {
+		msg_err_re_cache ("cannot mmap %s: %s", path, strerror (errno));
+		close (fd);
+		return -1;
+	}
+
+	close (fd);
+	end = map + st.st_size;
+	p = map + RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt);
+	n = *(gint *)p;
+
+	if (n <= 0 || n * sizeof (gint) + /* IDs */
+					sizeof (guint64) + /* crc */
+					RSPAMD_HS_MAGIC_LEN + /* header */
+					sizeof (cache->plt) > (gsize)st.st_size) {
+		/* Some wrong amount of regexps */
+		msg_err_re_cache ("bad number of expressions in %s: %d",
+				path, n);
+		munmap (map, st.st_size);
+		return -1;
+	}
+
+	/* Class might be already loaded when it has been published separately */
+	rspamd_re_cache_unload_class (cache, re_class);
+
+	p += sizeof (n);
+	hs_ids = g_malloc (n * sizeof (*hs_ids));
+	memcpy (hs_ids, p, n * sizeof (*hs_ids));
+
+	/* Skip crc */
+	p += n * sizeof (*hs_ids) + sizeof (guint64);
+
+	if (hs_deserialize_database (p, end - p, &re_class->hs_db)
+			!= HS_SUCCESS) {
+		msg_err_re_cache ("bad hs database in %s", path);
+		munmap (map, st.st_size);
+		g_free (hs_ids);
+		re_class->hs_db = NULL;
+
+		return -1;
+	}
+
+	munmap (map, st.st_size);
+	re_class->hs_scratch = NULL;
+	g_assert (hs_alloc_scratch (re_class->hs_db,
+			&re_class->hs_scratch) == HS_SUCCESS);
+
+	/*
+	 * Now find hyperscan elts that are successfully compiled and
+	 * specify that they should be matched using hyperscan
+	 */
+	for (i = 0; i < n; i ++) {
+		g_assert ((gint)cache->re->len > hs_ids[i] && hs_ids[i] >= 0);
+		elt = g_ptr_array_index (cache->re, hs_ids[i]);
+		elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN;
+	}
+
+	re_class->hs_ids = hs_ids;
+	re_class->nhs = n;
+
+	return n;
+}
+#endif
+
 gboolean
 rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir)
@@ -1218,100 +1629,73 @@ rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 #ifndef WITH_HYPERSCAN
 	return FALSE;
 #else
-	gchar path[PATH_MAX];
-	gint fd, i, n, *hs_ids = NULL, total = 0;
+	gint n, total = 0;
 	GHashTableIter it;
 	gpointer k, v;
-	guint8 *map, *p, *end;
 	struct rspamd_re_class *re_class;
-	struct rspamd_re_cache_elt *elt;
-	struct stat st;
 
 	g_hash_table_iter_init (&it, cache->re_classes);
 
 	while (g_hash_table_iter_next (&it, &k, &v)) {
 		re_class = v;
-		rspamd_snprintf (path, sizeof (path), "%s%c%s.hs", cache_dir,
-				G_DIR_SEPARATOR, re_class->hash);
 
-		if (rspamd_re_cache_is_valid_hyperscan_file (cache, path)) {
-			msg_debug_re_cache ("load hyperscan database from '%s'",
-					re_class->hash);
+		if (re_class->hs_db != NULL) {
+			/* Has been loaded when its compilation was finished */
+			total += re_class->nhs;
+			continue;
+		}
 
-			fd = open (path, O_RDONLY);
+		if ((n = rspamd_re_cache_load_class (cache, re_class, cache_dir)) == -1) {
+			return FALSE;
+		}
 
-			/* Read number of regexps */
-			g_assert (fd != -1);
-			fstat (fd, &st);
+		total += n;
+	}
 
-			map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	msg_info_re_cache ("hyperscan database of %d regexps has been loaded", total);
 
-			if (map == MAP_FAILED) {
-				msg_err_re_cache ("cannot mmap %s: %s", path, strerror (errno));
-				close (fd);
-				return FALSE;
-			}
+	return TRUE;
+#endif
+}
 
-			close (fd);
-			end = map + st.st_size;
-			p = map + RSPAMD_HS_MAGIC_LEN + sizeof (cache->plt);
-			n = *(gint *)p;
-
-			if (n <= 0 || n * sizeof (gint) + /* IDs */
-							sizeof (guint64) + /* crc */
-							RSPAMD_HS_MAGIC_LEN + /* header */
-							sizeof (cache->plt) > (gsize)st.st_size) {
-				/* Some wrong amount of regexps */
-				msg_err_re_cache ("bad number of expressions in %s: %d",
-						path, n);
-				munmap (map, st.st_size);
-				return FALSE;
-			}
+gboolean
+rspamd_re_cache_load_hyperscan_class (struct rspamd_re_cache *cache,
+		const char *cache_dir,
+		const gchar *class_hash)
+{
+	g_assert (cache != NULL);
+	g_assert (cache_dir != NULL);
+	g_assert (class_hash != NULL);
 
-			total += n;
-			p += sizeof (n);
-			hs_ids = g_malloc (n * sizeof (*hs_ids));
-			memcpy (hs_ids, p, n * sizeof (*hs_ids));
+#ifndef WITH_HYPERSCAN
+	return FALSE;
+#else
+	GHashTableIter it;
+	gpointer k, v;
+	struct rspamd_re_class *re_class;
+	gint n;
 
-			/* Skip crc */
-			p += n * sizeof (*hs_ids) + sizeof (guint64);
+	g_hash_table_iter_init (&it, cache->re_classes);
 
-			if (hs_deserialize_database (p, end - p, &re_class->hs_db)
-					!= HS_SUCCESS) {
-				msg_err_re_cache ("bad hs database in %s", path);
-				munmap (map, st.st_size);
-				g_free (hs_ids);
+	while (g_hash_table_iter_next (&it, &k, &v)) {
+		re_class = v;
 
+		if (strcmp (re_class->hash, class_hash) == 0) {
+			if ((n = rspamd_re_cache_load_class (cache, re_class,
+					cache_dir)) == -1) {
 				return FALSE;
 			}
 
-			munmap (map, st.st_size);
-			re_class->hs_scratch = NULL;
-			g_assert (hs_alloc_scratch (re_class->hs_db,
-					&re_class->hs_scratch) == HS_SUCCESS);
+			msg_info_re_cache ("hyperscan database of %d regexps has been "
+					"loaded for re class '%s'", n, class_hash);
 
-			/*
-			 * Now find hyperscan elts that are successfully compiled and
-			 * specify that they should be matched using hyperscan
-			 */
-			for (i = 0; i < n; i ++) {
-				g_assert ((gint)cache->re->len > hs_ids[i] && hs_ids[i] >= 0);
-				elt = g_ptr_array_index (cache->re, hs_ids[i]);
-				elt->match_type = RSPAMD_RE_CACHE_HYPERSCAN;
-			}
-
-			re_class->hs_ids = hs_ids;
-			re_class->nhs = n;
-		}
-		else {
-			msg_err_re_cache ("invalid hyperscan hash file '%s'",
-					path);
-			return FALSE;
+			return TRUE;
 		}
 	}
 
-	msg_info_re_cache ("hyperscan database of %d regexps has been loaded", total);
+	/* Might be compiled for another configuration */
+	msg_info_re_cache ("unknown re class '%s'", class_hash);
 
-	return TRUE;
+	return FALSE;
 #endif
 }
@@ -41,6 +41,13 @@ enum rspamd_re_type {
 	RSPAMD_RE_MAX
 };
 
+/* A single chunk of task content that is matched against regexps */
+struct rspamd_re_input {
+	const gchar *begin;
+	gsize len;
+	gboolean raw;
+};
+
 /**
  * Initialize re_cache persistent structure
  */
@@ -97,6 +104,20 @@ gint rspamd_re_cache_process (struct rspamd_task *task,
 		gboolean is_strong,
 		gboolean is_multiple);
 
+/**
+ * Collect all chunks of task content that are matched by regexps of the
+ * specified type
+ * @param task task object
+ * @param type type of content
+ * @param type_data associated data with the type (e.g. header name)
+ * @param is_strong use case sensitive match when looking for headers
+ * @return array of `struct rspamd_re_input`, must be freed by a caller
+ */
+GArray *rspamd_re_cache_get_inputs (struct rspamd_task *task,
+		enum rspamd_re_type type,
+		gconstpointer type_data,
+		gboolean is_strong);
+
 /**
  * Destroy runtime data
  */
@@ -126,6 +147,16 @@ const gchar * rspamd_re_cache_type_to_string (enum rspamd_re_type type);
  */
 enum rspamd_re_type rspamd_re_cache_type_from_string (const char *str);
 
+/**
+ * Called when a regexp class has been compiled to the hyperscan database
+ * @param cache cache object
+ * @param class_hash hash of the class (name of the database file)
+ * @param nre number of regexps compiled for this class
+ * @param ud opaque data
+ */
+typedef void (*rspamd_re_cache_compiled_cb) (struct rspamd_re_cache *cache,
+		const gchar *class_hash, gint nre, gpointer ud);
+
 /**
  * Compile expressions to the hyperscan tree and store in the `cache_dir`
  */
@@ -133,6 +164,28 @@ gint rspamd_re_cache_compile_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir,
 		GError **err);
 
+/**
+ * Compile a part of regexp classes to the hyperscan tree and store in the
+ * `cache_dir`. Classes are split between `nparts` compilers in the same order
+ * for all of them, so each compiler could work in a separate process.
+ * Hyperscan compatibility of patterns is cached in the `cache_dir`.
+ * @param cache cache object
+ * @param cache_dir directory to store databases
+ * @param part number of this part
+ * @param nparts total number of parts
+ * @param cb callback that is called after each class is compiled (or NULL)
+ * @param ud opaque data for callback
+ * @param err error returned
+ * @return number of regexps compiled or -1 in case of error
+ */
+gint rspamd_re_cache_compile_hyperscan_part (struct rspamd_re_cache *cache,
+		const char *cache_dir,
+		guint part,
+		guint nparts,
+		rspamd_re_cache_compiled_cb cb,
+		gpointer ud,
+		GError **err);
+
 
 /**
  * Returns TRUE if the specified file is valid hyperscan cache
@@ -145,4 +198,11 @@ gboolean rspamd_re_cache_is_valid_hyperscan_file (struct rspamd_re_cache *cache,
  */
 gboolean rspamd_re_cache_load_hyperscan (struct rspamd_re_cache *cache,
 		const char *cache_dir);
+
+/**
+ * Loads precompiled hyperscan database for a single regexp class
+ */
+gboolean rspamd_re_cache_load_hyperscan_class (struct rspamd_re_cache *cache,
+		const char *cache_dir,
+		const gchar *class_hash);
 #endif
@@ -0,0 +1,424 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+#include "redis_pool.h"
+#include "util.h"
+#include "logger.h"
+#include "cfg_file.h"
+
+#ifdef WITH_HIREDIS
+#include "hiredis/hiredis.h"
+#include "hiredis/async.h"
+#include "hiredis/adapters/libevent.h"
+#endif
+
+/* Idle connections are closed after this timeout */
+#define DEFAULT_REDIS_POOL_IDLE_TIMEOUT 10.0
+/* Maximum number of idle connections per server */
+#define DEFAULT_REDIS_POOL_MAX_IDLE 16
+/* Maximum number of clients that share one active connection */
+#define DEFAULT_REDIS_POOL_MAX_PIPELINE 8
+
+#ifdef WITH_HIREDIS
+enum rspamd_redis_pool_connection_state {
+	RSPAMD_REDIS_POOL_CONN_ACTIVE = 0,
+	RSPAMD_REDIS_POOL_CONN_INACTIVE,
+};
+
+struct rspamd_redis_pool_elt;
+
+struct rspamd_redis_pool_connection {
+	struct redisAsyncContext *ctx;
+	struct rspamd_redis_pool_elt *elt;
+	GList *entry;
+	struct event_base *ev_base;
+	struct event timeout;
+	guint refs;
+	enum rspamd_redis_pool_connection_state state;
+};
+
+/* Connections to a single server */
+struct rspamd_redis_pool_elt {
+	struct rspamd_redis_pool *pool;
+	gchar *key;
+	GQueue *active;
+	GQueue *inactive;
+};
+
+struct rspamd_redis_pool {
+	GHashTable *elts_by_key;
+	GHashTable *elts_by_ctx;
+	gdouble idle_timeout;
+	guint max_idle;
+	guint max_pipeline;
+};
+
+static void
+rspamd_redis_pool_conn_free (struct rspamd_redis_pool_connection *conn)
+{
+	struct rspamd_redis_pool_elt *elt = conn->elt;
+
+	if (conn->state == RSPAMD_REDIS_POOL_CONN_INACTIVE) {
+		event_del (&conn->timeout);
+		g_queue_unlink (elt->inactive, conn->entry);
+	}
+	else {
+		g_queue_unlink (elt->active, conn->entry);
+	}
+
+	g_list_free (conn->entry);
+	g_hash_table_remove (elt->pool->elts_by_ctx, conn->ctx);
+	g_slice_free1 (sizeof (*conn), conn);
+}
+
+/*
+ * Detaches connection from the pool and closes it, all pending callbacks are
+ * called with NULL reply by hiredis, so they can release their references
+ */
+static void
+rspamd_redis_pool_conn_close (struct rspamd_redis_pool_connection *conn)
+{
+	struct redisAsyncContext *ctx = conn->ctx;
+
+	msg_debug ("close redis connection to %s, %ud clients attached",
+			conn->elt->key, conn->refs);
+	rspamd_redis_pool_conn_free (conn);
+	redisAsyncFree (ctx);
+}
+
+static void
+rspamd_redis_pool_elt_free (gpointer p)
+{
+	struct rspamd_redis_pool_elt *elt = p;
+	struct rspamd_redis_pool_connection *conn;
+
+	while ((conn = g_queue_peek_head (elt->inactive)) != NULL) {
+		rspamd_redis_pool_conn_close (conn);
+	}
+
+	while ((conn = g_queue_peek_head (elt->active)) != NULL) {
+		rspamd_redis_pool_conn_close (conn);
+	}
+
+	g_queue_free (elt->active);
+	g_queue_free (elt->inactive);
+	g_free (elt->key);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+static void
+rspamd_redis_pool_conn_timeout (gint fd, short what, gpointer p)
+{
+	struct rspamd_redis_pool_connection *conn = p;
+
+	g_assert (conn->state == RSPAMD_REDIS_POOL_CONN_INACTIVE);
+	rspamd_redis_pool_conn_close (conn);
+}
+
+/*
+ * Called by hiredis when a connection is closed by server or due to errors,
+ * the context is freed by hiredis itself afterwards
+ */
+static void
+rspamd_redis_pool_conn_dead (const struct redisAsyncContext *ac)
+{
+	struct rspamd_redis_pool *pool = ac->data;
+	struct rspamd_redis_pool_connection *conn;
+
+	conn = g_hash_table_lookup (pool->elts_by_ctx, ac);
+
+	if (conn != NULL) {
+		msg_info ("redis connection to %s has been terminated: %s",
+				conn->elt->key, ac->errstr[0] ? ac->errstr : "closed");
+		rspamd_redis_pool_conn_free (conn);
+	}
+}
+
+static void
+rspamd_redis_pool_on_connect (const struct redisAsyncContext *ac, gint status)
+{
+	if (status == REDIS_ERR) {
+		/*
+		 * Workaround to prevent double close:
+		 * https://groups.google.com/forum/#!topic/redis-db/mQm46XkIPOY
+		 */
+#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR == 0 && HIREDIS_MINOR <= 11
+		struct redisAsyncContext *nc = (struct redisAsyncContext *)ac;
+		nc->c.fd = -1;
+#endif
+		rspamd_redis_pool_conn_dead (ac);
+	}
+}
+
+static void
+rspamd_redis_pool_on_disconnect (const struct redisAsyncContext *ac,
+		gint status)
+{
+	rspamd_redis_pool_conn_dead (ac);
+}
+
+static struct rspamd_redis_pool_connection *
+rspamd_redis_pool_new_connection (struct rspamd_redis_pool_elt *elt,
+		struct event_base *ev_base,
+		const gchar *ip, gint port)
+{
+	struct rspamd_redis_pool_connection *conn;
+	struct redisAsyncContext *ctx;
+
+	ctx = redisAsyncConnect (ip, port);
+
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	if (ctx->err != REDIS_OK) {
+		msg_err ("cannot connect to redis %s: %s", elt->key, ctx->errstr);
+		redisAsyncFree (ctx);
+
+		return NULL;
+	}
+
+	conn = g_slice_alloc0 (sizeof (*conn));
+	conn->ctx = ctx;
+	conn->elt = elt;
+	conn->ev_base = ev_base;
+	conn->state = RSPAMD_REDIS_POOL_CONN_ACTIVE;
+	conn->refs = 1;
+	ctx->data = elt->pool;
+
+	g_queue_push_tail (elt->active, conn);
+	conn->entry = g_queue_peek_tail_link (elt->active);
+	g_hash_table_insert (elt->pool->elts_by_ctx, ctx, conn);
+
+	redisLibeventAttach (ctx, ev_base);
+	redisAsyncSetConnectCallback (ctx, rspamd_redis_pool_on_connect);
+	redisAsyncSetDisconnectCallback (ctx, rspamd_redis_pool_on_disconnect);
+	msg_debug ("created new redis connection to %s", elt->key);
+
+	return conn;
+}
+
+struct rspamd_redis_pool *
+rspamd_redis_pool_init (void)
+{
+	struct rspamd_redis_pool *pool;
+
+	pool = g_slice_alloc0 (sizeof (*pool));
+	pool->elts_by_key = g_hash_table_new_full (g_str_hash, g_str_equal,
+			NULL, rspamd_redis_pool_elt_free);
+	pool->elts_by_ctx = g_hash_table_new (g_direct_hash, g_direct_equal);
+	pool->idle_timeout = DEFAULT_REDIS_POOL_IDLE_TIMEOUT;
+	pool->max_idle = DEFAULT_REDIS_POOL_MAX_IDLE;
+	pool->max_pipeline = DEFAULT_REDIS_POOL_MAX_PIPELINE;
+
+	return pool;
+}
+
+void
+rspamd_redis_pool_config (struct rspamd_redis_pool *pool,
+		struct rspamd_config *cfg)
+{
+	g_assert (pool != NULL);
+	g_assert (cfg != NULL);
+
+	if (cfg->redis_pool_timeout > 0) {
+		pool->idle_timeout = cfg->redis_pool_timeout;
+	}
+	if (cfg->redis_pool_max_idle > 0) {
+		pool->max_idle = cfg->redis_pool_max_idle;
+	}
+	if (cfg->redis_pool_max_pipeline > 0) {
+		pool->max_pipeline = cfg->redis_pool_max_pipeline;
+	}
+}
+
+struct redisAsyncContext *
+rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
+		struct event_base *ev_base,
+		const gchar *ip, gint port)
+{
+	struct rspamd_redis_pool_elt *elt;
+	struct rspamd_redis_pool_connection *conn;
+	GList *cur;
+	gchar *key;
+
+	g_assert (pool != NULL);
+	g_assert (ip != NULL);
+
+	key = g_strdup_printf ("%s:%d", ip, port);
+	elt = g_hash_table_lookup (pool->elts_by_key, key);
+
+	if (elt == NULL) {
+		elt = g_slice_alloc0 (sizeof (*elt));
+		elt->pool = pool;
+		elt->key = key;
+		elt->active = g_queue_new ();
+		elt->inactive = g_queue_new ();
+		g_hash_table_insert (pool->elts_by_key, elt->key, elt);
+	}
+	else {
+		g_free (key);
+	}
+
+	/* Reuse idle connection first: the most recently used one is the warmest */
+	conn = g_queue_peek_tail (elt->inactive);
+
+	if (conn != NULL) {
+		event_del (&conn->timeout);
+		g_queue_unlink (elt->inactive, conn->entry);
+		g_queue_push_tail_link (elt->active, conn->entry);
+		conn->state = RSPAMD_REDIS_POOL_CONN_ACTIVE;
+		conn->refs = 1;
+		msg_debug ("reused idle redis connection to %s", elt->key);
+
+		return conn->ctx;
+	}
+
+	/*
+	 * Pipeline commands over an active connection, hiredis queues replies'
+	 * callbacks in order, so several clients can share the same connection
+	 */
+	cur = elt->active->head;
+
+	while (cur) {
+		conn = cur->data;
+
+		if (conn->refs < pool->max_pipeline && conn->ev_base == ev_base) {
+			conn->refs ++;
+			/* Move to the tail to distribute load among connections */
+			g_queue_unlink (elt->active, cur);
+			g_queue_push_tail_link (elt->active, cur);
+
+			return conn->ctx;
+		}
+
+		cur = g_list_next (cur);
+	}
+
+	conn = rspamd_redis_pool_new_connection (elt, ev_base, ip, port);
+
+	return conn ? conn->ctx : NULL;
+}
+
+void
+rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, gboolean is_fatal)
+{
+	struct rspamd_redis_pool_connection *conn;
+	struct rspamd_redis_pool_elt *elt;
+	struct timeval tv;
+
+	g_assert (pool != NULL);
+
+	conn = g_hash_table_lookup (pool->elts_by_ctx, ctx);
+
+	if (conn == NULL) {
+		/* Connection has been already closed */
+		return;
+	}
+
+	g_assert (conn->state == RSPAMD_REDIS_POOL_CONN_ACTIVE);
+	g_assert (conn->refs > 0);
+	elt = conn->elt;
+
+	if (is_fatal || ctx->err != REDIS_OK) {
+		rspamd_redis_pool_conn_close (conn);
+
+		return;
+	}
+
+	conn->refs --;
+
+	if (conn->refs == 0) {
+		if (g_queue_get_length (elt->inactive) >= pool->max_idle) {
+			rspamd_redis_pool_conn_close (conn);
+
+			return;
+		}
+
+		g_queue_unlink (elt->active, conn->entry);
+		g_queue_push_tail_link (elt->inactive, conn->entry);
+		conn->state = RSPAMD_REDIS_POOL_CONN_INACTIVE;
+
+		double_to_tv (rspamd_time_jitter (pool->idle_timeout, 0),
+				&tv);
+		event_set (&conn->timeout, -1, EV_TIMEOUT,
+				rspamd_redis_pool_conn_timeout, conn);
+		event_base_set (conn->ev_base, &conn->timeout);
+		event_add (&conn->timeout, &tv);
+	}
+}
+
+void
+rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool)
+{
+	if (pool) {
+		g_hash_table_unref (pool->elts_by_key);
+		g_hash_table_unref (pool->elts_by_ctx);
+		g_slice_free1 (sizeof (*pool), pool);
+	}
+}
+
+#else /* WITH_HIREDIS */
+
+struct rspamd_redis_pool {
+	gint unused;
+};
+
+struct rspamd_redis_pool *
+rspamd_redis_pool_init (void)
+{
+	return g_slice_alloc0 (sizeof (struct rspamd_redis_pool));
+}
+
+void
+rspamd_redis_pool_config (struct rspamd_redis_pool *pool,
+		struct rspamd_config *cfg)
+{
+}
+
+struct redisAsyncContext *
+rspamd_redis_pool_connect (struct rspamd_redis_pool *pool,
+		struct event_base *ev_base,
+		const gchar *ip, gint port)
+{
+	msg_err ("rspamd is compiled with no redis support");
+
+	return NULL;
+}
+
+void
+rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, gboolean is_fatal)
+{
+}
+
+void
+rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool)
+{
+	if (pool) {
+		g_slice_free1 (sizeof (*pool), pool);
+	}
+}
+#endif
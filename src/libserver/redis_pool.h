@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef REDIS_POOL_H_
+#define REDIS_POOL_H_
+
+#include "config.h"
+
+struct rspamd_redis_pool;
+struct rspamd_config;
+struct redisAsyncContext;
+struct event_base;
+
+/**
+ * Creates new redis connections pool, the pool is not shared between processes
+ * @return new pool
+ */
+struct rspamd_redis_pool *rspamd_redis_pool_init (void);
+
+/**
+ * Applies limits from `options.redis` section of the configuration
+ * @param pool
+ * @param cfg
+ */
+void rspamd_redis_pool_config (struct rspamd_redis_pool *pool,
+		struct rspamd_config *cfg);
+
+/**
+ * Returns a connection to the specified server. An idle connection is reused
+ * if possible, otherwise commands are pipelined over an already active
+ * connection and a new connection is created only if all active connections
+ * are busy
+ * @param pool
+ * @param ev_base event base used for the new connections
+ * @param ip server address
+ * @param port server port
+ * @return redis async context or NULL
+ */
+struct redisAsyncContext *rspamd_redis_pool_connect (
+		struct rspamd_redis_pool *pool,
+		struct event_base *ev_base,
+		const gchar *ip, gint port);
+
+/**
+ * Returns connection to the pool. If `is_fatal` is true or the connection
+ * is in error state, then it is closed immediately, and all pending commands
+ * pipelined over it are aborted.
+ * @param pool
+ * @param ctx
+ * @param is_fatal
+ */
+void rspamd_redis_pool_release_connection (struct rspamd_redis_pool *pool,
+		struct redisAsyncContext *ctx, gboolean is_fatal);
+
+/**
+ * Closes all connections and destroys the pool
+ * @param pool
+ */
+void rspamd_redis_pool_destroy (struct rspamd_redis_pool *pool);
+
+#endif /* REDIS_POOL_H_ */
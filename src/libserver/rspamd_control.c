@@ -394,6 +394,45 @@ struct rspamd_worker_control_data {
 	} handlers[RSPAMD_CONTROL_MAX];
 };
 
+static guint
+rspamd_control_update_scores (struct rspamd_config *cfg, const gchar *path)
+{
+	struct ucl_parser *parser;
+	ucl_object_t *obj;
+	GError *err = NULL;
+	guint status = 0;
+
+	if (cfg == NULL) {
+		return EINVAL;
+	}
+
+	parser = ucl_parser_new (0);
+
+	if (!ucl_parser_add_file (parser, path)) {
+		msg_err_config ("cannot parse scores from %s: %s", path,
+				ucl_parser_get_error (parser));
+		ucl_parser_free (parser);
+
+		return EINVAL;
+	}
+
+	obj = ucl_parser_get_object (parser);
+	ucl_parser_free (parser);
+
+	if (!rspamd_config_update_scores (cfg, obj, &err)) {
+		msg_err_config ("cannot update scores: %e", err);
+		g_error_free (err);
+		status = EINVAL;
+	}
+	else {
+		msg_info_config ("scores have been updated");
+	}
+
+	ucl_object_unref (obj);
+
+	return status;
+}
+
 static void
 rspamd_control_default_cmd_handler (gint fd,
 		struct rspamd_worker_control_data *cd,
@@ -426,6 +465,10 @@ rspamd_control_default_cmd_handler (gint fd,
 	case RSPAMD_CONTROL_RECOMPILE:
 	case RSPAMD_CONTROL_HYPERSCAN_LOADED:
 		break;
+	case RSPAMD_CONTROL_SCORES_UPDATE:
+		rep.reply.scores_update.status = rspamd_control_update_scores (
+				cd->worker->srv->cfg, cmd->cmd.scores_update.path);
+		break;
 	case RSPAMD_CONTROL_RERESOLVE:
 		if (cd->worker->srv->cfg) {
 			REF_RETAIN (cd->worker->srv->cfg);
@@ -531,9 +574,145 @@ rspamd_control_hs_io_handler (gint fd, short what, gpointer ud)
 {
 	struct rspamd_control_reply_elt *elt = ud;
 
-	/* At this point we just ignore replies from the workers */
+	/*
+	 * Replies carry no data, but they must be drained from the pipe anyway,
+	 * otherwise the next command sharing it would read a stale reply
+	 */
+	if (what == EV_READ) {
+		if (read (fd, &elt->reply, sizeof (elt->reply)) != sizeof (elt->reply)) {
+			msg_err ("cannot read hyperscan reply from the worker %P (%s): %s",
+					elt->wrk->pid, g_quark_to_string (elt->wrk->type),
+					strerror (errno));
+		}
+	}
+	else {
+		msg_warn ("%s process %P has not confirmed hyperscan load in time",
+				g_quark_to_string (elt->wrk->type), elt->wrk->pid);
+	}
+
+	event_del (&elt->io_ev);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+struct rspamd_control_scores_data {
+	gchar *path;
+	guint replies_remain;
+};
+
+static void
+rspamd_control_scores_data_free (struct rspamd_control_scores_data *sd)
+{
+	/* All workers have read the file */
+	unlink (sd->path);
+	g_free (sd->path);
+	g_slice_free1 (sizeof (*sd), sd);
+}
+
+static void
+rspamd_control_scores_io_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_control_reply_elt *elt = ud;
+	struct rspamd_control_scores_data *sd = elt->ud;
+
+	if (what == EV_READ) {
+		if (read (fd, &elt->reply, sizeof (elt->reply)) == sizeof (elt->reply) &&
+				elt->reply.reply.scores_update.status != 0) {
+			msg_err ("%s process %P cannot update scores",
+					g_quark_to_string (elt->wrk->type), elt->wrk->pid);
+		}
+	}
+	else {
+		msg_warn ("%s process %P has not updated scores in time",
+				g_quark_to_string (elt->wrk->type), elt->wrk->pid);
+	}
+
 	event_del (&elt->io_ev);
 	g_slice_free1 (sizeof (*elt), elt);
+
+	if (--sd->replies_remain == 0) {
+		rspamd_control_scores_data_free (sd);
+	}
+}
+
+gboolean
+rspamd_control_broadcast_scores (struct rspamd_main *rspamd_main,
+		const ucl_object_t *top)
+{
+	struct rspamd_control_command cmd;
+	struct rspamd_control_reply_elt *replies, *cur;
+	struct rspamd_control_scores_data *sd;
+	ucl_object_t *obj;
+	guchar *emitted;
+	gchar *path;
+	const ucl_object_t *metric;
+	gsize len;
+	gint fd;
+
+	metric = ucl_object_find_key (top, "metric");
+
+	if (metric == NULL) {
+		return FALSE;
+	}
+
+	path = g_strdup_printf ("%s%crspamd-scores-XXXXXX",
+			rspamd_main->cfg->temp_dir, G_DIR_SEPARATOR);
+
+	if (strlen (path) >= sizeof (cmd.cmd.scores_update.path)) {
+		msg_err ("temporary path is too long: %s", path);
+		g_free (path);
+
+		return FALSE;
+	}
+
+	if ((fd = mkstemp (path)) == -1) {
+		msg_err ("cannot create temporary file %s: %s", path, strerror (errno));
+		g_free (path);
+
+		return FALSE;
+	}
+
+	/* Workers usually run as an unprivileged user */
+	(void)fchmod (fd, 00644);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj,
+			ucl_object_copy (metric), "metric", 0, false);
+	emitted = ucl_object_emit (obj, UCL_EMIT_JSON_COMPACT);
+	ucl_object_unref (obj);
+	len = strlen ((const gchar *)emitted);
+
+	if (write (fd, emitted, len) != (gssize)len) {
+		msg_err ("cannot write temporary file %s: %s", path, strerror (errno));
+		free (emitted);
+		close (fd);
+		unlink (path);
+		g_free (path);
+
+		return FALSE;
+	}
+
+	free (emitted);
+	close (fd);
+
+	memset (&cmd, 0, sizeof (cmd));
+	cmd.type = RSPAMD_CONTROL_SCORES_UPDATE;
+	rspamd_strlcpy (cmd.cmd.scores_update.path, path,
+			sizeof (cmd.cmd.scores_update.path));
+
+	sd = g_slice_alloc0 (sizeof (*sd));
+	sd->path = path;
+	replies = rspamd_control_broadcast_cmd (rspamd_main, &cmd,
+			rspamd_control_scores_io_handler, sd);
+
+	DL_FOREACH (replies, cur) {
+		sd->replies_remain ++;
+	}
+
+	if (sd->replies_remain == 0) {
+		rspamd_control_scores_data_free (sd);
+	}
+
+	return TRUE;
 }
 
 static void
@@ -612,10 +791,33 @@ rspamd_srv_handler (gint fd, short what, gpointer ud)
 				 * workers
 				 */
 				wcmd.cmd.hs_loaded.cache_dir = cmd.cmd.hs_loaded.cache_dir;
+				memcpy (wcmd.cmd.hs_loaded.class_hash,
+						cmd.cmd.hs_loaded.class_hash,
+						sizeof (wcmd.cmd.hs_loaded.class_hash));
 				rspamd_control_broadcast_cmd (srv, &wcmd,
 						rspamd_control_hs_io_handler, NULL);
 				rdata->rep.reply.hs_loaded.unused = 0;
 				break;
+			case RSPAMD_SRV_READY:
+				worker->ready = TRUE;
+				msg_info ("%s process %P is ready to accept connections, "
+						"initialized in %.2f ms",
+						g_quark_to_string (worker->type), worker->pid,
+						cmd.cmd.ready.init_time);
+
+				if (srv->workers_starting > 0) {
+					srv->workers_starting --;
+				}
+
+				if (srv->workers_starting == 0 && srv->spawn_time > 0) {
+					msg_info ("all workers are ready in %.2f ms after spawning",
+							(rspamd_get_ticks () - srv->spawn_time) * 1000.0);
+					srv->spawn_time = 0;
+				}
+
+				/* Worker does not wait for a reply */
+				g_slice_free1 (sizeof (*rdata), rdata);
+				return;
 			default:
 				msg_err ("unknown command type: %d", cmd.type);
 				break;
@@ -714,6 +916,11 @@ rspamd_srv_request_handler (gint fd, short what, gpointer ud)
 			goto cleanup;
 		}
 
+		if (rd->cmd.type == RSPAMD_SRV_READY) {
+			/* This is a notice, so there is no reply to read */
+			goto cleanup;
+		}
+
 		event_del (&rd->io_ev);
 		event_set (&rd->io_ev, rd->worker->srv_pipe[1], EV_READ,
 				rspamd_srv_request_handler, rd);
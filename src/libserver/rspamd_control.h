@@ -26,6 +26,8 @@
 #define RSPAMD_RSPAMD_CONTROL_H
 
 #include "config.h"
+#include "cryptobox.h"
+#include "ucl.h"
 #include <event.h>
 
 struct rspamd_main;
@@ -37,12 +39,14 @@ enum rspamd_control_type {
 	RSPAMD_CONTROL_RERESOLVE,
 	RSPAMD_CONTROL_RECOMPILE,
 	RSPAMD_CONTROL_HYPERSCAN_LOADED,
+	RSPAMD_CONTROL_SCORES_UPDATE,
 	RSPAMD_CONTROL_MAX
 };
 
 enum rspamd_srv_type {
 	RSPAMD_SRV_SOCKETPAIR = 0,
 	RSPAMD_SRV_HYPERSCAN_LOADED,
+	RSPAMD_SRV_READY,
 };
 
 struct rspamd_control_command {
@@ -62,7 +66,13 @@ struct rspamd_control_command {
 		} recompile;
 		struct {
 			gpointer cache_dir;
+			/* Empty for all classes */
+			gchar class_hash[rspamd_cryptobox_HASHBYTES + 1];
 		} hs_loaded;
+		struct {
+			/* File with the new metric sections */
+			gchar path[256];
+		} scores_update;
 	} cmd;
 };
 
@@ -88,6 +98,9 @@ struct rspamd_control_reply {
 		struct {
 			guint status;
 		} hs_loaded;
+		struct {
+			guint status;
+		} scores_update;
 	} reply;
 };
 
@@ -103,7 +116,13 @@ struct rspamd_srv_command {
 		} spair;
 		struct {
 			gpointer cache_dir;
+			/* Empty for all classes */
+			gchar class_hash[rspamd_cryptobox_HASHBYTES + 1];
 		} hs_loaded;
+		struct {
+			/* Milliseconds since fork */
+			gdouble init_time;
+		} ready;
 	} cmd;
 };
 
@@ -149,6 +168,15 @@ void rspamd_control_worker_add_cmd_handler (struct rspamd_worker *worker,
 		rspamd_worker_control_handler handler,
 		gpointer ud);
 
+/**
+ * Send new scores to all workers, so they can apply them without restart
+ * @param rspamd_main
+ * @param top parsed config with the new `metric` sections
+ * @return TRUE if scores have been sent
+ */
+gboolean rspamd_control_broadcast_scores (struct rspamd_main *rspamd_main,
+		const ucl_object_t *top);
+
 /**
  * Start watching on srv pipe
  */
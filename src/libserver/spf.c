@@ -48,6 +48,8 @@
 /** SPF limits for avoiding abuse **/
 #define SPF_MAX_NESTING 10
 #define SPF_MAX_DNS_REQUESTS 30
+/* Records with less addresses are checked by a linear scan */
+#define SPF_INDEX_MIN_ELTS 8
 
 struct spf_resolved_element {
 	GPtrArray *elts;
@@ -229,12 +231,37 @@ spf_record_destructor (gpointer r)
 	}
 }
 
+/*
+ * Address space is split to ranges, each range holds the index of the first
+ * element that matches addresses in it. `all` elements are matched separately
+ * for each address family
+ */
+struct spf_addr_index {
+	GArray *ranges4;
+	GArray *ranges6;
+	guint any4;
+	guint any6;
+	guint any;
+};
+
+static void
+spf_addr_index_free (struct spf_addr_index *idx)
+{
+	g_array_free (idx->ranges4, TRUE);
+	g_array_free (idx->ranges6, TRUE);
+	g_slice_free1 (sizeof (*idx), idx);
+}
+
 static void
 rspamd_flatten_record_dtor (struct spf_resolved *r)
 {
 	struct spf_addr *addr;
 	guint i;
 
+	if (r->index) {
+		spf_addr_index_free (r->index);
+	}
+
 	for (i = 0; i < r->elts->len; i++) {
 		addr = &g_array_index (r->elts, struct spf_addr, i);
 		g_free (addr->spf_string);
@@ -316,6 +343,374 @@ rspamd_spf_process_reference (struct spf_resolved *target,
 	}
 }
 
+/* IPv4 addresses are placed to the highest bits */
+struct spf_index_ip {
+	guint64 hi;
+	guint64 lo;
+};
+
+struct spf_index_range {
+	struct spf_index_ip start;
+	guint idx;
+};
+
+struct spf_index_elt {
+	struct spf_index_ip start;
+	struct spf_index_ip end;
+	guint idx;
+	guint min;
+};
+
+static inline gint
+spf_index_ip_cmp (const struct spf_index_ip *a, const struct spf_index_ip *b)
+{
+	if (a->hi != b->hi) {
+		return a->hi < b->hi ? -1 : 1;
+	}
+	if (a->lo != b->lo) {
+		return a->lo < b->lo ? -1 : 1;
+	}
+
+	return 0;
+}
+
+static inline void
+spf_index_ip_load (struct spf_index_ip *ip, const guchar *addr, gsize len)
+{
+	guchar buf[sizeof (struct in6_addr)];
+	guint i;
+
+	memset (buf, 0, sizeof (buf));
+	memcpy (buf, addr, len);
+	ip->hi = 0;
+	ip->lo = 0;
+
+	for (i = 0; i < sizeof (guint64); i ++) {
+		ip->hi = (ip->hi << NBBY) | buf[i];
+		ip->lo = (ip->lo << NBBY) | buf[i + sizeof (guint64)];
+	}
+}
+
+/* Returns FALSE on overflow */
+static inline gboolean
+spf_index_ip_inc (struct spf_index_ip *ip)
+{
+	if (++ip->lo == 0) {
+		if (++ip->hi == 0) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Wider networks go first, elements order is kept for equal networks */
+static gint
+spf_index_elt_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct spf_index_elt *e1 = a, *e2 = b;
+	gint r;
+
+	if ((r = spf_index_ip_cmp (&e1->start, &e2->start)) != 0) {
+		return r;
+	}
+	if ((r = spf_index_ip_cmp (&e2->end, &e1->end)) != 0) {
+		return r;
+	}
+
+	return e1->idx < e2->idx ? -1 : (e1->idx > e2->idx);
+}
+
+static void
+spf_index_add_elt (GArray *elts, const guchar *addr, gsize len, guint mask,
+		guint idx)
+{
+	struct spf_index_elt elt;
+	guint64 mhi, mlo;
+
+	spf_index_ip_load (&elt.start, addr, len);
+
+	if (mask == 0) {
+		mhi = 0;
+		mlo = 0;
+	}
+	else if (mask <= 64) {
+		mhi = G_MAXUINT64 << (64 - mask);
+		mlo = 0;
+	}
+	else {
+		mhi = G_MAXUINT64;
+		mlo = G_MAXUINT64 << (128 - mask);
+	}
+
+	elt.start.hi &= mhi;
+	elt.start.lo &= mlo;
+	elt.end.hi = elt.start.hi | ~mhi;
+	elt.end.lo = elt.start.lo | ~mlo;
+	elt.idx = idx;
+	elt.min = idx;
+	g_array_append_val (elts, elt);
+}
+
+static inline void
+spf_index_emit (GArray *ranges, const struct spf_index_ip *start, guint idx)
+{
+	struct spf_index_range r;
+
+	if (ranges->len > 0 &&
+			g_array_index (ranges, struct spf_index_range, ranges->len - 1).idx
+			== idx) {
+		/* Merge with the previous range */
+		return;
+	}
+
+	r.start = *start;
+	r.idx = idx;
+	g_array_append_val (ranges, r);
+}
+
+/*
+ * Networks are either nested or disjoint, so they are processed as a stack
+ * of nested networks in the order of their starts. Each range gets the
+ * minimal index of networks that cover it
+ */
+static GArray *
+spf_index_build_ranges (GArray *elts)
+{
+	GArray *ranges;
+	GPtrArray *stack;
+	struct spf_index_elt *elt, *top;
+	struct spf_index_ip pos = {0, 0};
+	gboolean done = FALSE;
+	guint i;
+
+	ranges = g_array_new (FALSE, FALSE, sizeof (struct spf_index_range));
+	stack = g_ptr_array_new ();
+	g_array_sort (elts, spf_index_elt_cmp);
+
+	for (i = 0; i <= elts->len; i ++) {
+		elt = i < elts->len ?
+				&g_array_index (elts, struct spf_index_elt, i) : NULL;
+
+		while (stack->len > 0) {
+			top = g_ptr_array_index (stack, stack->len - 1);
+
+			if (elt != NULL && spf_index_ip_cmp (&top->end, &elt->start) >= 0) {
+				break;
+			}
+
+			if (!done && spf_index_ip_cmp (&pos, &top->end) <= 0) {
+				spf_index_emit (ranges, &pos, top->min);
+				pos = top->end;
+				done = !spf_index_ip_inc (&pos);
+			}
+
+			g_ptr_array_remove_index (stack, stack->len - 1);
+		}
+
+		top = stack->len > 0 ? g_ptr_array_index (stack, stack->len - 1) : NULL;
+
+		if (elt == NULL) {
+			if (!done) {
+				spf_index_emit (ranges, &pos, G_MAXUINT);
+			}
+			break;
+		}
+
+		if (spf_index_ip_cmp (&pos, &elt->start) < 0) {
+			spf_index_emit (ranges, &pos, top ? top->min : G_MAXUINT);
+			pos = elt->start;
+		}
+
+		if (top != NULL && top->min < elt->min) {
+			elt->min = top->min;
+		}
+
+		g_ptr_array_add (stack, elt);
+	}
+
+	g_ptr_array_free (stack, TRUE);
+
+	return ranges;
+}
+
+static guint
+spf_index_find (GArray *ranges, const guchar *addr, gsize len)
+{
+	struct spf_index_ip ip;
+	struct spf_index_range *r;
+	guint lo = 0, hi = ranges->len, mid;
+
+	spf_index_ip_load (&ip, addr, len);
+
+	/* Find the last range that starts before the address */
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		r = &g_array_index (ranges, struct spf_index_range, mid);
+
+		if (spf_index_ip_cmp (&r->start, &ip) <= 0) {
+			lo = mid;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	return g_array_index (ranges, struct spf_index_range, lo).idx;
+}
+
+/*
+ * Build index for large records, so the first matching element is found
+ * by a binary search instead of checking elements one by one
+ */
+static void
+spf_record_build_index (struct spf_resolved *rec)
+{
+	struct spf_addr_index *idx;
+	struct spf_addr *addr;
+	GArray *elts4, *elts6;
+	guint i;
+
+	if (rec->elts->len < SPF_INDEX_MIN_ELTS) {
+		return;
+	}
+
+	idx = g_slice_alloc0 (sizeof (*idx));
+	idx->any4 = G_MAXUINT;
+	idx->any6 = G_MAXUINT;
+	idx->any = G_MAXUINT;
+	elts4 = g_array_new (FALSE, FALSE, sizeof (struct spf_index_elt));
+	elts6 = g_array_new (FALSE, FALSE, sizeof (struct spf_index_elt));
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+
+		if (addr->flags & RSPAMD_SPF_FLAG_IPV4) {
+			if (addr->m.dual.mask_v4 <= sizeof (addr->addr4) * NBBY) {
+				spf_index_add_elt (elts4, addr->addr4, sizeof (addr->addr4),
+						addr->m.dual.mask_v4, i);
+			}
+		}
+		else if ((addr->flags & RSPAMD_SPF_FLAG_ANY) && idx->any4 == G_MAXUINT) {
+			idx->any4 = i;
+		}
+
+		if (addr->flags & RSPAMD_SPF_FLAG_IPV6) {
+			if (addr->m.dual.mask_v6 <= sizeof (addr->addr6) * NBBY) {
+				spf_index_add_elt (elts6, addr->addr6, sizeof (addr->addr6),
+						addr->m.dual.mask_v6, i);
+			}
+		}
+		else if ((addr->flags & RSPAMD_SPF_FLAG_ANY) && idx->any6 == G_MAXUINT) {
+			idx->any6 = i;
+		}
+
+		if ((addr->flags & RSPAMD_SPF_FLAG_ANY) && idx->any == G_MAXUINT) {
+			idx->any = i;
+		}
+	}
+
+	idx->ranges4 = spf_index_build_ranges (elts4);
+	idx->ranges6 = spf_index_build_ranges (elts6);
+	g_array_free (elts4, TRUE);
+	g_array_free (elts6, TRUE);
+
+	rec->index = idx;
+}
+
+static gboolean
+spf_addr_match (struct spf_addr *addr, rspamd_inet_addr_t *from)
+{
+	gboolean res = FALSE;
+	const guint8 *s, *d;
+	guint af, mask, bmask, addrlen;
+
+	af = rspamd_inet_address_get_af (from);
+	/* Basic comparing algorithm */
+	if (((addr->flags & RSPAMD_SPF_FLAG_IPV6) && af == AF_INET6) ||
+		((addr->flags & RSPAMD_SPF_FLAG_IPV4) && af == AF_INET)) {
+		d = rspamd_inet_address_get_radix_key (from, &addrlen);
+
+		if (af == AF_INET6) {
+			s = (const guint8 *)addr->addr6;
+			mask = addr->m.dual.mask_v6;
+		}
+		else {
+			s = (const guint8 *)addr->addr4;
+			mask = addr->m.dual.mask_v4;
+		}
+
+		/* Compare the first bytes */
+		bmask = mask / CHAR_BIT;
+		if (mask > addrlen * CHAR_BIT) {
+			msg_info ("bad mask length: %d", mask);
+		}
+		else if (memcmp (s, d, bmask) == 0) {
+
+			if (bmask * CHAR_BIT != mask) {
+				/* Compare the remaining bits */
+				s += bmask;
+				d += bmask;
+				mask = (0xff << (CHAR_BIT - (mask - bmask * 8))) & 0xff;
+				if ((*s & mask) == (*d & mask)) {
+					res = TRUE;
+				}
+			}
+			else {
+				res = TRUE;
+			}
+		}
+	}
+	else if (addr->flags & RSPAMD_SPF_FLAG_ANY) {
+		res = TRUE;
+	}
+
+	return res;
+}
+
+struct spf_addr *
+spf_record_find_addr (struct spf_resolved *rec, rspamd_inet_addr_t *addr)
+{
+	struct spf_addr_index *idx = rec->index;
+	const guchar *key;
+	guint i, first, klen;
+
+	if (addr == NULL) {
+		return NULL;
+	}
+
+	if (idx != NULL) {
+		key = rspamd_inet_address_get_radix_key (addr, &klen);
+
+		switch (rspamd_inet_address_get_af (addr)) {
+		case AF_INET:
+			first = MIN (idx->any4, spf_index_find (idx->ranges4, key, klen));
+			break;
+		case AF_INET6:
+			first = MIN (idx->any6, spf_index_find (idx->ranges6, key, klen));
+			break;
+		default:
+			first = idx->any;
+			break;
+		}
+
+		if (first < rec->elts->len) {
+			return &g_array_index (rec->elts, struct spf_addr, first);
+		}
+
+		return NULL;
+	}
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		if (spf_addr_match (&g_array_index (rec->elts, struct spf_addr, i),
+				addr)) {
+			return &g_array_index (rec->elts, struct spf_addr, i);
+		}
+	}
+
+	return NULL;
+}
+
 /*
  * Parse record and flatten it to a simple structure
  */
@@ -331,12 +726,15 @@ rspamd_spf_record_flatten (struct spf_record *rec)
 			rec->resolved->len);
 	res->domain = g_strdup (rec->sender_domain);
 	res->ttl = rec->ttl;
+	res->index = NULL;
 	REF_INIT_RETAIN (res, rspamd_flatten_record_dtor);
 
 	if (rec->resolved->len > 0) {
 		rspamd_spf_process_reference (res, NULL, rec, TRUE);
 	}
 
+	spf_record_build_index (res);
+
 	return res;
 }
 
@@ -1740,3 +2138,111 @@ spf_record_unref (struct spf_resolved *rec)
 {
 	REF_RELEASE (rec);
 }
+
+/* Serialized element, followed by spf string */
+struct spf_addr_serialized {
+	guchar addr6[sizeof (struct in6_addr)];
+	guchar addr4[sizeof (struct in_addr)];
+	guint32 m;
+	guint32 flags;
+	guint32 mech;
+	guint32 slen;
+};
+
+guchar *
+spf_record_serialize (struct spf_resolved *rec, gsize *len)
+{
+	struct spf_addr_serialized selt;
+	struct spf_addr *addr;
+	guint32 hdr[2];
+	GByteArray *ar;
+	guint i;
+
+	g_assert (rec != NULL);
+
+	ar = g_byte_array_sized_new (sizeof (hdr) +
+			rec->elts->len * (sizeof (selt) + 16));
+	hdr[0] = rec->ttl;
+	hdr[1] = rec->elts->len;
+	g_byte_array_append (ar, (const guint8 *)hdr, sizeof (hdr));
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+		memset (&selt, 0, sizeof (selt));
+		memcpy (selt.addr6, addr->addr6, sizeof (selt.addr6));
+		memcpy (selt.addr4, addr->addr4, sizeof (selt.addr4));
+		selt.m = addr->m.idx;
+		selt.flags = addr->flags;
+		selt.mech = addr->mech;
+		selt.slen = addr->spf_string ? strlen (addr->spf_string) : 0;
+		g_byte_array_append (ar, (const guint8 *)&selt, sizeof (selt));
+
+		if (selt.slen > 0) {
+			g_byte_array_append (ar, (const guint8 *)addr->spf_string,
+					selt.slen);
+		}
+	}
+
+	*len = ar->len;
+
+	return g_byte_array_free (ar, FALSE);
+}
+
+struct spf_resolved *
+spf_record_deserialize (const gchar *domain, const guchar *data, gsize len)
+{
+	struct spf_addr_serialized selt;
+	struct spf_resolved *res;
+	struct spf_addr addr;
+	const guchar *p = data, *end = data + len;
+	guint32 hdr[2];
+	guint i;
+
+	if (len < sizeof (hdr)) {
+		return NULL;
+	}
+
+	memcpy (hdr, p, sizeof (hdr));
+	p += sizeof (hdr);
+
+	res = g_slice_alloc (sizeof (*res));
+	res->elts = g_array_sized_new (FALSE, FALSE, sizeof (struct spf_addr),
+			hdr[1]);
+	res->domain = g_strdup (domain);
+	res->ttl = hdr[0];
+	res->index = NULL;
+	REF_INIT_RETAIN (res, rspamd_flatten_record_dtor);
+
+	for (i = 0; i < hdr[1]; i ++) {
+		if (end - p < (gssize)sizeof (selt)) {
+			spf_record_unref (res);
+			return NULL;
+		}
+
+		memcpy (&selt, p, sizeof (selt));
+		p += sizeof (selt);
+
+		if (end - p < (gssize)selt.slen) {
+			spf_record_unref (res);
+			return NULL;
+		}
+
+		memset (&addr, 0, sizeof (addr));
+		memcpy (addr.addr6, selt.addr6, sizeof (addr.addr6));
+		memcpy (addr.addr4, selt.addr4, sizeof (addr.addr4));
+		addr.m.idx = selt.m;
+		addr.flags = selt.flags;
+		addr.mech = selt.mech;
+
+		if (selt.slen > 0) {
+			addr.spf_string = g_strndup ((const gchar *)p, selt.slen);
+			p += selt.slen;
+		}
+
+		g_array_append_val (res->elts, addr);
+	}
+
+	spf_record_build_index (res);
+
+	return res;
+}
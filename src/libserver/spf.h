@@ -7,6 +7,7 @@
 
 struct rspamd_task;
 struct spf_resolved;
+struct spf_addr_index;
 
 typedef void (*spf_cb_t)(struct spf_resolved *record, struct rspamd_task *task);
 
@@ -55,6 +56,7 @@ struct spf_resolved {
 	gchar *domain;
 	guint ttl;
 	GArray *elts; /* Flat list of struct spf_addr */
+	struct spf_addr_index *index; /* Index of elts for large records */
 	ref_entry_t ref; /* Refcounting */
 };
 
@@ -80,4 +82,23 @@ struct spf_resolved * spf_record_ref (struct spf_resolved *rec);
  */
 void spf_record_unref (struct spf_resolved *rec);
 
+/*
+ * Find the first element of the record that matches the specified address,
+ * returns NULL if no elements match
+ */
+struct spf_addr * spf_record_find_addr (struct spf_resolved *rec,
+		rspamd_inet_addr_t *addr);
+
+/*
+ * Serialize flattened record to a compact form suitable for shared caches,
+ * result must be freed by g_free
+ */
+guchar * spf_record_serialize (struct spf_resolved *rec, gsize *len);
+
+/*
+ * Restore flattened record from its serialized form
+ */
+struct spf_resolved * spf_record_deserialize (const gchar *domain,
+		const guchar *data, gsize len);
+
 #endif
@@ -73,19 +73,39 @@ struct symbols_cache {
 	rspamd_mempool_mutex_t *mtx;
 	gdouble reload_time;
 	struct event resort_ev;
+	/* Shared registry of execution times, NULL if not registered */
+	struct rspamd_counters *counters;
 };
 
+/*
+ * Execution times histogram: bucket `n` holds times in range
+ * [2^(n - 1), 2^n) microseconds, bucket 0 holds times less than 1 microsecond
+ */
+#define CACHE_HIST_BUCKETS 24
+
+/* Allocated from the process memory, so it is never shared */
 struct counter_data {
 	gdouble value;
 	gint number;
+	/* Samples of this process that are not merged to `item->hist` yet */
+	guint32 hist[CACHE_HIST_BUCKETS];
 };
 
 struct cache_item {
-	/* This block is likely shared */
+	/*
+	 * This block is shared: items are allocated from the shared chunks of
+	 * the static pool, so processes forked after registration see the same
+	 * item. Symbols registered by a worker after fork are process local.
+	 */
 	gdouble avg_time;
 	gdouble weight;
 	guint32 frequency;
 	guint32 avg_counter;
+	/* Decaying histogram of execution times, updated under `cache->mtx` */
+	gdouble hist[CACHE_HIST_BUCKETS];
+	gdouble hist_ts;
+	gdouble p50;
+	gdouble p99;
 
 	/* Per process counter */
 	struct counter_data *cd;
@@ -104,6 +124,8 @@ struct cache_item {
 	/* Priority */
 	gint priority;
 	gint id;
+	/* Histogram of execution times in the counters registry */
+	gint counter_id;
 
 	/* Dependencies */
 	GPtrArray *deps;
@@ -137,6 +159,8 @@ struct cache_savepoint {
 
 /* XXX: Maybe make it configurable */
 #define CACHE_RELOAD_TIME 60.0
+/* Weight of old samples in the histogram is multiplied by this each reload */
+#define CACHE_HIST_DECAY 0.8
 /* weight, frequency, time */
 #define TIME_ALPHA (1.0)
 #define WEIGHT_ALPHA (0.001)
@@ -154,6 +178,72 @@ static gboolean rspamd_symbols_cache_check_deps (struct rspamd_task *task,
 		struct cache_item *item,
 		struct cache_savepoint *checkpoint);
 
+static inline guint
+rspamd_symbols_cache_hist_bucket (gdouble value)
+{
+	gint exp;
+
+	if (value < 1.0) {
+		return 0;
+	}
+
+	frexp (value, &exp);
+
+	return MIN (exp, CACHE_HIST_BUCKETS - 1);
+}
+
+/* Returns approximate value of the specified quantile of histogram */
+static gdouble
+rspamd_symbols_cache_hist_quantile (const gdouble *hist, gdouble q)
+{
+	gdouble total = 0, acc = 0, target, lo, hi;
+	guint i;
+
+	for (i = 0; i < CACHE_HIST_BUCKETS; i ++) {
+		total += hist[i];
+	}
+
+	if (total <= 0) {
+		return 0;
+	}
+
+	target = total * q;
+
+	for (i = 0; i < CACHE_HIST_BUCKETS; i ++) {
+		if (hist[i] > 0 && acc + hist[i] >= target) {
+			lo = i == 0 ? 0 : ldexp (1.0, i - 1);
+			hi = ldexp (1.0, i);
+
+			return lo + (hi - lo) * (target - acc) / hist[i];
+		}
+
+		acc += hist[i];
+	}
+
+	return ldexp (1.0, CACHE_HIST_BUCKETS - 1);
+}
+
+static void
+rspamd_symbols_cache_update_quantiles (struct cache_item *item)
+{
+	item->p50 = rspamd_symbols_cache_hist_quantile (item->hist, 0.5);
+	item->p99 = rspamd_symbols_cache_hist_quantile (item->hist, 0.99);
+}
+
+/*
+ * Expected cost of a symbol: median penalized by the tail latency, so rules
+ * with slow outliers (e.g. network ones) are moved towards the end
+ */
+static inline gdouble
+rspamd_symbols_cache_item_cost (const struct cache_item *item)
+{
+	if (item->p99 > 0) {
+		return (item->p50 + item->p99) / 2.0;
+	}
+
+	return item->avg_time;
+}
+
 gint
 cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 {
@@ -174,8 +264,8 @@ cache_logic_cmp (const void *p1, const void *p2, gpointer ud)
 		f2 = (double)i2->frequency / (double)cache->total_freq;
 		weight1 = fabs (i1->weight) / cache->max_weight;
 		weight2 = fabs (i2->weight) / cache->max_weight;
-		t1 = i1->avg_time;
-		t2 = i2->avg_time;
+		t1 = rspamd_symbols_cache_item_cost (i1);
+		t2 = rspamd_symbols_cache_item_cost (i2);
 		w1 = SCORE_FUN (weight1, f1, t1);
 		w2 = SCORE_FUN (weight2, f2, t2);
 		msg_debug_cache ("%s -> %.2f, %s -> %.2f", i1->symbol, w1 * 1000.0,
@@ -214,6 +304,7 @@ rspamd_set_counter (struct cache_item *item, gdouble value)
 	}
 
 	cd->value = cd->value + (value - cd->value) / (gdouble)(++cd->number);
+	cd->hist[rspamd_symbols_cache_hist_bucket (value)] ++;
 
 	return cd->value;
 }
@@ -423,6 +514,21 @@ rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
 				item->frequency = ucl_object_toint (elt);
 			}
 
+			elt = ucl_object_find_key (cur, "hist");
+			if (elt && ucl_object_type (elt) == UCL_ARRAY) {
+				const ucl_object_t *bucket;
+				ucl_object_iter_t hit = NULL;
+				guint nb = 0;
+
+				while ((bucket = ucl_iterate_object (elt, &hit, true)) != NULL &&
+						nb < CACHE_HIST_BUCKETS) {
+					item->hist[nb ++] = ucl_object_todouble (bucket);
+				}
+
+				item->hist_ts = rspamd_get_calendar_ticks ();
+				rspamd_symbols_cache_update_quantiles (item);
+			}
+
 			if ((item->type & SYMBOL_TYPE_VIRTUAL) && item->parent != -1) {
 				g_assert (item->parent < (gint)cache->items_by_id->len);
 				parent = g_ptr_array_index (cache->items_by_id, item->parent);
@@ -437,6 +543,9 @@ rspamd_symbols_cache_load_items (struct symbols_cache *cache, const gchar *name)
 				 */
 				parent->avg_time = item->avg_time;
 				parent->avg_counter = item->avg_counter;
+				memcpy (parent->hist, item->hist, sizeof (parent->hist));
+				parent->hist_ts = item->hist_ts;
+				rspamd_symbols_cache_update_quantiles (parent);
 			}
 
 			if (fabs (item->weight) > cache->max_weight) {
@@ -458,10 +567,12 @@ rspamd_symbols_cache_save_items (struct symbols_cache *cache, const gchar *name)
 {
 	struct rspamd_symbols_cache_header hdr;
 	ucl_object_t *top, *elt;
+	ucl_object_t *hist;
 	GHashTableIter it;
 	struct cache_item *item;
 	struct ucl_emitter_functions *efunc;
 	gpointer k, v;
+	guint i;
 	gint fd;
 	FILE *f;
 	bool ret;
@@ -501,6 +612,14 @@ rspamd_symbols_cache_save_items (struct symbols_cache *cache, const gchar *name)
 		ucl_object_insert_key (elt, ucl_object_fromint (item->frequency),
 				"frequency", 0, false);
 
+		hist = ucl_object_typed_new (UCL_ARRAY);
+
+		for (i = 0; i < CACHE_HIST_BUCKETS; i ++) {
+			ucl_array_append (hist, ucl_object_fromdouble (item->hist[i]));
+		}
+
+		ucl_object_insert_key (elt, hist, "hist", 0, false);
+
 		ucl_object_insert_key (top, elt, k, 0, false);
 	}
 
@@ -546,6 +665,7 @@ rspamd_symbols_cache_add_symbol (struct symbols_cache *cache,
 	item = rspamd_mempool_alloc0_shared (cache->static_pool,
 			sizeof (struct cache_item));
 	item->condition_cb = -1;
+	item->counter_id = -1;
 	/*
 	 * We do not share cd to skip locking, instead we'll just calculate it on
 	 * save or accumulate
@@ -1072,6 +1192,7 @@ rspamd_symbols_cache_check_symbol (struct rspamd_task *task,
 			t2 = rspamd_get_ticks ();
 			diff = (t2 - t1) * 1000000.;
 			rspamd_set_counter (item, diff);
+			rspamd_counters_hist_add (cache->counters, item->counter_id, diff);
 			rspamd_session_watch_stop (task->s);
 			pending_after = rspamd_session_events_pending (task->s);
 
@@ -1255,6 +1376,29 @@ struct counters_cbdata {
 	struct symbols_cache *cache;
 };
 
+static ucl_object_t *
+rspamd_symbols_cache_hist_ucl (const struct cache_item *item)
+{
+	ucl_object_t *obj, *hist;
+	guint i;
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (item->p50),
+			"p50", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (item->p99),
+			"p99", 0, false);
+
+	hist = ucl_object_typed_new (UCL_ARRAY);
+
+	for (i = 0; i < CACHE_HIST_BUCKETS; i ++) {
+		ucl_array_append (hist, ucl_object_fromdouble (item->hist[i]));
+	}
+
+	ucl_object_insert_key (obj, hist, "hist", 0, false);
+
+	return obj;
+}
+
 static void
 rspamd_symbols_cache_counters_cb (gpointer v, gpointer ud)
 {
@@ -1279,6 +1423,8 @@ rspamd_symbols_cache_counters_cb (gpointer v, gpointer ud)
 					"frequency", 0, false);
 			ucl_object_insert_key (obj, ucl_object_fromdouble (parent->avg_time),
 					"time", 0, false);
+			ucl_object_insert_key (obj, rspamd_symbols_cache_hist_ucl (parent),
+					"latency", 0, false);
 		}
 		else {
 			ucl_object_insert_key (obj, ucl_object_fromdouble (item->weight),
@@ -1287,6 +1433,8 @@ rspamd_symbols_cache_counters_cb (gpointer v, gpointer ud)
 					"frequency", 0, false);
 			ucl_object_insert_key (obj, ucl_object_fromdouble (item->avg_time),
 					"time", 0, false);
+			ucl_object_insert_key (obj, rspamd_symbols_cache_hist_ucl (item),
+					"latency", 0, false);
 		}
 
 		ucl_array_append (top, obj);
@@ -1309,6 +1457,30 @@ rspamd_symbols_cache_counters (struct symbols_cache * cache)
 	return top;
 }
 
+void
+rspamd_symbols_cache_foreach_stat (struct symbols_cache *cache,
+		rspamd_symbols_cache_stat_cb cb, gpointer ud)
+{
+	struct rspamd_symbol_stat st;
+	struct cache_item *item;
+	guint i;
+
+	g_assert (cache != NULL);
+
+	for (i = 0; i < cache->items_by_order->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_order, i);
+
+		if ((item->type & SYMBOL_TYPE_CALLBACK) || item->symbol == NULL) {
+			continue;
+		}
+
+		st.symbol = item->symbol;
+		st.weight = item->weight;
+		st.frequency = item->frequency;
+		cb (&st, ud);
+	}
+}
+
 static void
 rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 {
@@ -1316,7 +1488,8 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 	gdouble tm;
 	struct symbols_cache *cache = ud;
 	struct cache_item *item, *parent;
-	guint i;
+	gdouble now, decay;
+	guint i, j;
 
 	/* Plan new event */
 	tm = rspamd_time_jitter (cache->reload_time, 0);
@@ -1327,6 +1500,7 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 	event_add (&cache->resort_ev, &tv);
 
 	rspamd_mempool_lock_mutex (cache->mtx);
+	now = rspamd_get_calendar_ticks ();
 
 	/* Gather stats from shared execution times */
 	for (i = 0; i < cache->items_by_order->len; i ++) {
@@ -1341,14 +1515,38 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 				item->cd->value = item->avg_time;
 				item->cd->number = item->avg_counter;
 			}
+
+			/*
+			 * Decay depends on the time passed and not on the number of
+			 * workers that merge their samples to the shared histogram
+			 */
+			if (item->hist_ts > 0 && now > item->hist_ts) {
+				decay = pow (CACHE_HIST_DECAY,
+						(now - item->hist_ts) / cache->reload_time);
+			}
+			else {
+				decay = 1.0;
+			}
+
+			for (j = 0; j < CACHE_HIST_BUCKETS; j ++) {
+				item->hist[j] = item->hist[j] * decay + item->cd->hist[j];
+				item->cd->hist[j] = 0;
+			}
+
+			item->hist_ts = now;
+			rspamd_symbols_cache_update_quantiles (item);
 		}
 	}
 	/* Sync virtual symbols */
 	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
 		if (item->parent != -1) {
 			parent = g_ptr_array_index (cache->items_by_id, item->parent);
 			item->avg_time = parent->avg_time;
 			item->avg_counter = parent->avg_counter;
+			item->p50 = parent->p50;
+			item->p99 = parent->p99;
 		}
 	}
 
@@ -1357,6 +1555,32 @@ rspamd_symbols_cache_resort_cb (gint fd, short what, gpointer ud)
 	g_ptr_array_sort_with_data (cache->items_by_order, cache_logic_cmp, cache);
 }
 
+void
+rspamd_symbols_cache_register_counters (struct symbols_cache *cache,
+		struct rspamd_counters *counters)
+{
+	struct cache_item *item;
+	gchar name[256];
+	guint i;
+
+	g_assert (cache != NULL);
+	g_assert (counters != NULL);
+
+	for (i = 0; i < cache->items_by_id->len; i ++) {
+		item = g_ptr_array_index (cache->items_by_id, i);
+
+		if (item->symbol != NULL &&
+				(item->type & (SYMBOL_TYPE_CALLBACK|SYMBOL_TYPE_NORMAL))) {
+			rspamd_snprintf (name, sizeof (name), "symbol_time:%s",
+					item->symbol);
+			item->counter_id = rspamd_counters_register (counters, name,
+					RSPAMD_COUNTER_TYPE_HISTOGRAM);
+		}
+	}
+
+	cache->counters = counters;
+}
+
 void
 rspamd_symbols_cache_start_refresh (struct symbols_cache * cache,
 		struct event_base *ev_base)
@@ -1453,3 +1677,34 @@ rspamd_symbols_cache_find_symbol (struct symbols_cache *cache, const gchar *name
 
 	return -1;
 }
+
+gboolean
+rspamd_symbols_cache_get_callback (struct symbols_cache *cache,
+		const gchar *symbol, symbol_func_t *pfunc, gpointer *pud)
+{
+	struct cache_item *item;
+	gint id;
+
+	g_assert (cache != NULL);
+
+	id = rspamd_symbols_cache_find_symbol (cache, symbol);
+
+	if (id == -1) {
+		return FALSE;
+	}
+
+	item = g_ptr_array_index (cache->items_by_id, id);
+
+	if (item->func == NULL) {
+		return FALSE;
+	}
+
+	if (pfunc) {
+		*pfunc = item->func;
+	}
+	if (pud) {
+		*pud = item->user_data;
+	}
+
+	return TRUE;
+}
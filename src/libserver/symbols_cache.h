@@ -33,9 +33,22 @@
 struct rspamd_task;
 struct rspamd_config;
 struct symbols_cache;
+struct rspamd_counters;
 
 typedef void (*symbol_func_t)(struct rspamd_task *task, gpointer user_data);
 
+/**
+ * Statistics of a single symbol
+ */
+struct rspamd_symbol_stat {
+	const gchar *symbol;
+	gdouble weight;
+	guint32 frequency;
+};
+
+typedef void (*rspamd_symbols_cache_stat_cb)(const struct rspamd_symbol_stat *st,
+		gpointer ud);
+
 enum rspamd_symbol_type {
 	SYMBOL_TYPE_NORMAL = (1 << 0),
 	SYMBOL_TYPE_VIRTUAL = (1 << 1),
@@ -142,6 +155,25 @@ gboolean rspamd_symbols_cache_validate (struct symbols_cache *cache,
  */
 ucl_object_t *rspamd_symbols_cache_counters (struct symbols_cache * cache);
 
+/**
+ * Calls `cb` for each named symbol in the cache without building any
+ * intermediate objects
+ * @param cache
+ * @param cb
+ * @param ud
+ */
+void rspamd_symbols_cache_foreach_stat (struct symbols_cache *cache,
+		rspamd_symbols_cache_stat_cb cb, gpointer ud);
+
+/**
+ * Registers histograms of execution times for all symbols in the shared
+ * counters registry, should be called before workers are forked
+ * @param cache
+ * @param counters
+ */
+void rspamd_symbols_cache_register_counters (struct symbols_cache *cache,
+		struct rspamd_counters *counters);
+
 /**
  * Start cache reloading
  * @param cache
@@ -177,4 +209,16 @@ void rspamd_symbols_cache_add_dependency (struct symbols_cache *cache,
 void rspamd_symbols_cache_add_delayed_dependency (struct symbols_cache *cache,
 		const gchar *from, const gchar *to);
 
+/**
+ * Returns callback and its data for a symbol (virtual symbols are resolved
+ * to their parents)
+ * @param cache
+ * @param symbol
+ * @param pfunc output callback
+ * @param pud output callback data
+ * @return TRUE if a symbol has been found and it has a callback
+ */
+gboolean rspamd_symbols_cache_get_callback (struct symbols_cache *cache,
+		const gchar *symbol, symbol_func_t *pfunc, gpointer *pud);
+
 #endif
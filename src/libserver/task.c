@@ -27,6 +27,7 @@
 #include "protocol.h"
 #include "message.h"
 #include "lua/lua_common.h"
+#include "lua/lua_thread_pool.h"
 #include "composites.h"
 #include "stat_api.h"
 #include "unix-std.h"
@@ -224,6 +225,9 @@ rspamd_task_free (struct rspamd_task *task)
 		}
 
 		rspamd_re_cache_runtime_destroy (task->re_rt);
+		/* Perform lua gc between tasks and not during the scan */
+		lua_thread_pool_gc_step (task->cfg->lua_thread_pool,
+				task->cfg->lua_gc_step);
 		REF_RELEASE (task->cfg);
 
 		rspamd_mempool_delete (task->task_pool);
@@ -401,6 +405,27 @@ rspamd_process_filters (struct rspamd_task *task)
 	return rspamd_symbols_cache_process_symbols (task, task->cfg->cache);
 }
 
+/* Accounts time of a finished stage including its asynchronous events */
+static void
+rspamd_task_count_stage (struct rspamd_task *task, gint st)
+{
+	gdouble now;
+	gint idx;
+
+	now = rspamd_get_ticks ();
+
+	if (task->worker != NULL && st >= RSPAMD_TASK_STAGE_READ_MESSAGE &&
+			st <= RSPAMD_TASK_STAGE_POST_FILTERS) {
+		idx = g_bit_nth_lsf (st, -1) -
+				g_bit_nth_lsf (RSPAMD_TASK_STAGE_READ_MESSAGE, -1);
+		rspamd_counters_hist_add (task->worker->srv->counters,
+				RSPAMD_COUNTER_STAGE_TIME + idx,
+				(now - task->stage_start) * 1000000.0);
+	}
+
+	task->stage_start = now;
+}
+
 gboolean
 rspamd_task_process (struct rspamd_task *task, guint stages)
 {
@@ -420,6 +445,10 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 
 	task->flags |= RSPAMD_TASK_FLAG_PROCESSING;
 
+	if (task->stage_start == 0) {
+		task->stage_start = rspamd_get_ticks ();
+	}
+
 	st = rspamd_task_select_processing_stage (task, stages);
 
 	switch (st) {
@@ -489,6 +518,7 @@ rspamd_task_process (struct rspamd_task *task, guint stages)
 		/* Mark the current stage as done and go to the next stage */
 		msg_debug_task ("completed stage %d", st);
 		task->processed_stages |= st;
+		rspamd_task_count_stage (task, st);
 
 		/* Reset checkpoint */
 		task->checkpoint = NULL;
@@ -41,6 +41,7 @@ enum rspamd_command {
 	CMD_SKIP,
 	CMD_PING,
 	CMD_PROCESS,
+	CMD_BATCH,
 	CMD_OTHER
 };
 
@@ -159,6 +160,7 @@ struct rspamd_task {
 	rspamd_mempool_t *task_pool;					/**< memory pool for task							*/
 	double time_real;
 	double time_virtual;
+	double stage_start;								/**< start of the current processing stage			*/
 	struct timeval tv;
 	gboolean (*fin_callback)(struct rspamd_task *task, void *arg);
 													/**< calback for filters finalizing					*/
@@ -224,12 +224,48 @@ rspamd_worker_init_signals (struct rspamd_worker *worker, struct event_base *bas
 	sigprocmask (SIG_UNBLOCK, &signals.sa_mask, NULL);
 }
 
+struct rspamd_worker_ready_data {
+	struct rspamd_worker *worker;
+	struct event_base *ev_base;
+	struct event ev;
+};
+
+/*
+ * Called on the first iteration of the event loop, so all initialization
+ * performed by a worker after rspamd_prepare_worker is finished
+ */
+static void
+rspamd_worker_ready_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_worker_ready_data *rd = ud;
+	struct rspamd_worker *worker = rd->worker;
+	struct rspamd_srv_command srv_cmd;
+	GList *cur;
+
+	cur = worker->accept_events;
+	while (cur) {
+		event_add ((struct event *)cur->data, NULL);
+		cur = g_list_next (cur);
+	}
+
+	memset (&srv_cmd, 0, sizeof (srv_cmd));
+	srv_cmd.type = RSPAMD_SRV_READY;
+	srv_cmd.cmd.ready.init_time = (rspamd_get_calendar_ticks () -
+			worker->start_time) * 1000.0;
+	rspamd_srv_send_command (worker, rd->ev_base, &srv_cmd, NULL, NULL);
+
+	event_del (&rd->ev);
+	g_slice_free1 (sizeof (*rd), rd);
+}
+
 struct event_base *
 rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	void (*accept_handler)(int, short, void *))
 {
 	struct event_base *ev_base;
 	struct event *accept_event;
+	struct rspamd_worker_ready_data *rd;
+	struct timeval tv;
 	GList *cur;
 	gint listen_socket;
 
@@ -249,7 +285,7 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 	rspamd_worker_init_signals (worker, ev_base);
 	rspamd_control_worker_add_default_handler (worker, ev_base);
 
-	/* Accept all sockets */
+	/* Accept all sockets, events are added when the worker is ready */
 	if (accept_handler) {
 		cur = worker->cf->listen_socks;
 		while (cur) {
@@ -259,7 +295,6 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 				event_set (accept_event, listen_socket, EV_READ | EV_PERSIST,
 						accept_handler, worker);
 				event_base_set (ev_base, accept_event);
-				event_add (accept_event, NULL);
 				worker->accept_events = g_list_prepend (worker->accept_events,
 						accept_event);
 			}
@@ -267,6 +302,15 @@ rspamd_prepare_worker (struct rspamd_worker *worker, const char *name,
 		}
 	}
 
+	rd = g_slice_alloc0 (sizeof (*rd));
+	rd->worker = worker;
+	rd->ev_base = ev_base;
+	evtimer_set (&rd->ev, rspamd_worker_ready_cb, rd);
+	event_base_set (ev_base, &rd->ev);
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	evtimer_add (&rd->ev, &tv);
+
 	return ev_base;
 }
 
@@ -462,6 +506,7 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 	memcpy (wrk->cf, cf, sizeof (struct rspamd_worker_conf));
 	wrk->index = index;
 	wrk->ctx = cf->ctx;
+	wrk->counters_slot = rspamd_counters_acquire_slot (rspamd_main->counters);
 
 	wrk->pid = fork ();
 
@@ -481,6 +526,7 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		}
 
 		g_random_set_seed (ottery_rand_uint32 ());
+		rspamd_counters_use_slot (rspamd_main->counters, wrk->counters_slot);
 		/* Drop privilleges */
 		rspamd_worker_drop_priv (rspamd_main);
 		/* Set limits */
@@ -524,6 +570,7 @@ rspamd_fork_worker (struct rspamd_main *rspamd_main,
 		rspamd_socket_nonblocking (wrk->control_pipe[0]);
 		rspamd_socket_nonblocking (wrk->srv_pipe[0]);
 		rspamd_srv_start_watching (wrk, ev_base);
+		rspamd_main->workers_starting ++;
 		/* Insert worker into worker's table, pid is index */
 		g_hash_table_insert (rspamd_main->workers, GSIZE_TO_POINTER (
 				wrk->pid), wrk);
@@ -546,3 +593,120 @@ rspamd_worker_block_signals (void)
 	sigaddset (&set, SIGUSR2);
 	sigprocmask (SIG_BLOCK, &set, NULL);
 }
+
+/* Stages are counted from RSPAMD_TASK_STAGE_READ_MESSAGE */
+static const gchar *rspamd_counters_stages[] = {
+	"read_message",
+	"pre_filters",
+	"filters",
+	"classifiers",
+	"composites",
+	"post_filters",
+};
+
+static void
+rspamd_worker_register_builtin (struct rspamd_counters *reg,
+		const gchar *name, enum rspamd_counter_type type, gint expected)
+{
+	gint id;
+
+	id = rspamd_counters_register (reg, name, type);
+	g_assert (id == expected);
+}
+
+void
+rspamd_worker_counters_init (struct rspamd_main *rspamd_main)
+{
+	struct rspamd_counters *reg;
+	struct rspamd_worker_conf *cf;
+	GList *cur;
+	gchar name[64];
+	guint i, nslots = 0;
+
+	G_STATIC_ASSERT (G_N_ELEMENTS (rspamd_counters_stages) ==
+			RSPAMD_COUNTER_BUILTIN_MAX - RSPAMD_COUNTER_STAGE_TIME);
+
+	if (rspamd_main->counters != NULL) {
+		/* Registry is already shared with workers */
+		rspamd_symbols_cache_register_counters (rspamd_main->cfg->cache,
+				rspamd_main->counters);
+		return;
+	}
+
+	reg = rspamd_counters_new ();
+	rspamd_worker_register_builtin (reg, "scanned",
+			RSPAMD_COUNTER_TYPE_COUNTER, RSPAMD_COUNTER_SCANNED);
+	rspamd_worker_register_builtin (reg, "learned",
+			RSPAMD_COUNTER_TYPE_COUNTER, RSPAMD_COUNTER_LEARNED);
+	rspamd_worker_register_builtin (reg, "connections",
+			RSPAMD_COUNTER_TYPE_COUNTER, RSPAMD_COUNTER_CONNECTIONS);
+	rspamd_worker_register_builtin (reg, "control_connections",
+			RSPAMD_COUNTER_TYPE_COUNTER, RSPAMD_COUNTER_CONTROL_CONNECTIONS);
+
+	for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i ++) {
+		rspamd_snprintf (name, sizeof (name), "actions:%s",
+				rspamd_action_to_str (i));
+		rspamd_worker_register_builtin (reg, name,
+				RSPAMD_COUNTER_TYPE_COUNTER, RSPAMD_COUNTER_ACTIONS + i);
+	}
+
+	rspamd_worker_register_builtin (reg, "scan_time",
+			RSPAMD_COUNTER_TYPE_HISTOGRAM, RSPAMD_COUNTER_SCAN_TIME);
+
+	for (i = 0; i < G_N_ELEMENTS (rspamd_counters_stages); i ++) {
+		rspamd_snprintf (name, sizeof (name), "stage_time:%s",
+				rspamd_counters_stages[i]);
+		rspamd_worker_register_builtin (reg, name,
+				RSPAMD_COUNTER_TYPE_HISTOGRAM, RSPAMD_COUNTER_STAGE_TIME + i);
+	}
+
+	rspamd_symbols_cache_register_counters (rspamd_main->cfg->cache, reg);
+
+	/*
+	 * Old workers are still alive when new ones are spawned on reload, so
+	 * we need twice more slots than workers. Slot 0 is used by the main
+	 * process and by workers spawned when all other slots are busy
+	 */
+	for (cur = rspamd_main->cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		cf = cur->data;
+		nslots += (cf->worker && (cf->worker->unique || cf->worker->threaded)) ?
+				1 : cf->count;
+	}
+
+	nslots = nslots * 2 + 2;
+
+	if (!rspamd_counters_map (reg, nslots, 0)) {
+		msg_err_main ("cannot allocate shared counters for %ud processes",
+				nslots);
+		rspamd_counters_destroy (reg);
+		return;
+	}
+
+	rspamd_main->counters = reg;
+}
+
+void
+rspamd_worker_stat_snapshot (struct rspamd_main *rspamd_main,
+		struct rspamd_stat *st)
+{
+	struct rspamd_counters *reg = rspamd_main->counters;
+	guint i;
+
+	memcpy (st, rspamd_main->stat, sizeof (*st));
+
+	if (reg == NULL) {
+		return;
+	}
+
+	st->messages_scanned += rspamd_counters_get (reg, RSPAMD_COUNTER_SCANNED);
+	st->messages_learned += rspamd_counters_get (reg, RSPAMD_COUNTER_LEARNED);
+	st->connections_count += rspamd_counters_get (reg,
+			RSPAMD_COUNTER_CONNECTIONS);
+	st->control_connections_count += rspamd_counters_get (reg,
+			RSPAMD_COUNTER_CONTROL_CONNECTIONS);
+
+	for (i = METRIC_ACTION_REJECT; i <= METRIC_ACTION_NOACTION; i ++) {
+		st->actions_stat[i] += rspamd_counters_get (reg,
+				RSPAMD_COUNTER_ACTIONS + i);
+	}
+}
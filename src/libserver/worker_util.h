@@ -38,7 +38,13 @@ struct rspamd_worker;
 struct rspamd_worker_signal_handler;
 
 /**
- * Prepare worker's startup
+ * Set when a worker is going to terminate after receiving a signal
+ */
+extern sig_atomic_t wanna_die;
+
+/**
+ * Prepare worker's startup. Listen sockets are accepted merely when the event
+ * loop is started, then the main process is notified that a worker is ready
  * @param worker worker structure
  * @param name name of the worker
  * @param sig_handler handler of main signals
@@ -135,6 +141,21 @@ void rspamd_worker_block_signals (void);
 struct rspamd_worker *rspamd_fork_worker (struct rspamd_main *,
 		struct rspamd_worker_conf *, guint idx, struct event_base *ev_base);
 
+/**
+ * Creates the shared counters registry with built-in counters and histograms
+ * of symbols from the current configuration, should be called by the main
+ * process before spawning workers. Symbols from a reloaded configuration
+ * are registered in the existing registry
+ */
+void rspamd_worker_counters_init (struct rspamd_main *rspamd_main);
+
+/**
+ * Copies server statistics adding values of built-in counters gathered by
+ * all processes
+ */
+void rspamd_worker_stat_snapshot (struct rspamd_main *rspamd_main,
+		struct rspamd_stat *st);
+
 #define msg_err_main(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         rspamd_main->server_pool->tag.tagname, rspamd_main->server_pool->tag.uid, \
         G_STRFUNC, \
@@ -49,6 +49,8 @@ struct rspamd_stat_backend {
 			struct rspamd_token_result *res, gpointer ctx);
 	void (*finalize_process)(struct rspamd_task *task,
 			gpointer runtime, gpointer ctx);
+	void (*prefetch_token)(struct rspamd_task *task, struct token_node_s *tok,
+			gpointer runtime, gpointer ctx);
 	gboolean (*learn_token)(struct rspamd_task *task, struct token_node_s *tok,
 			struct rspamd_token_result *res, gpointer ctx);
 	gulong (*total_learns)(struct rspamd_task *task,
@@ -78,6 +80,10 @@ struct rspamd_stat_backend {
 		void rspamd_##name##_finalize_process (struct rspamd_task *task, \
 				gpointer runtime, \
 				gpointer ctx); \
+		void rspamd_##name##_prefetch_token (struct rspamd_task *task, \
+				struct token_node_s *tok, \
+				gpointer runtime, \
+				gpointer ctx); \
 		gboolean rspamd_##name##_learn_token (struct rspamd_task *task, \
 				struct token_node_s *tok, \
 				struct rspamd_token_result *res, \
@@ -37,6 +37,13 @@
 #define DEFAULT_STATFILE_INVALIDATE_TIME 30
 #define DEFAULT_STATFILE_INVALIDATE_JITTER 30
 
+/* Statfile is grown when it is filled more than this */
+#define STATFILE_RESIZE_LOAD 0.75
+/* Blocks copied to a new statfile per event loop iteration */
+#define STATFILE_MIGRATION_BATCH 16384
+/* How often processes check whether a statfile has been replaced */
+#define STATFILE_RELOAD_CHECK_INTERVAL 1.0
+
 #define MMAPED_BACKEND_TYPE "mmap"
 
 /**
@@ -81,6 +88,66 @@ struct stat_file {
 	struct stat_file_block blocks[1];       /**< first block of data				*/
 };
 
+/*
+ * Combined statfile stores counters of all classes of a classifier in a
+ * single slot, so a token lookup touches a single cache line regardless of
+ * classes count
+ */
+#define COMBINED_MAX_CLASSES 3
+#define COMBINED_SLOTS_PER_BUCKET 2
+#define COMBINED_CHAIN_LENGTH 16
+
+/**
+ * Token slot in combined statfile
+ */
+struct stat_file_slot {
+	guint32 hash1;                          /**< hash1 (also acts as index)			*/
+	guint32 hash2;                          /**< hash2								*/
+	double values[COMBINED_MAX_CLASSES];    /**< values for each class				*/
+};
+
+/**
+ * Bucket of combined statfile, exactly one cache line
+ */
+struct stat_file_bucket {
+	struct stat_file_slot slots[COMBINED_SLOTS_PER_BUCKET];
+};
+
+/**
+ * Header of combined statfile, buckets start right after it
+ */
+struct stat_file_combined_header {
+	u_char magic[3];                        /**< magic signature ('r' 's' 'd')      */
+	u_char version[2];                      /**< version of statfile				*/
+	u_char padding[3];                      /**< padding							*/
+	guint64 create_time;                    /**< create time (time_t->guint64)		*/
+	guint64 nclasses;                       /**< number of classes used				*/
+	guint64 used_slots;                     /**< used slots number					*/
+	guint64 total_buckets;                  /**< total number of buckets			*/
+	guint64 tokenizer_conf_len;             /**< length of tokenizer configuration	*/
+	guint64 revisions[COMBINED_MAX_CLASSES];    /**< revision of each class			*/
+	guint64 rev_times[COMBINED_MAX_CLASSES];    /**< revision time of each class		*/
+	gchar symbols[COMBINED_MAX_CLASSES][64];    /**< symbols of classes				*/
+	u_char tokenizer_conf[224];             /**< tokenizer configuration			*/
+};
+
+/**
+ * Combined file shared by all statfiles of a classifier
+ */
+typedef struct {
+#ifdef HAVE_PATH_MAX
+	gchar filename[PATH_MAX];               /**< name of file						*/
+#else
+	gchar filename[MAXPATHLEN];             /**< name of file						*/
+#endif
+	gint fd;                                /**< descriptor							*/
+	void *map;                              /**< mmaped area						*/
+	size_t len;                             /**< length of file(in bytes)			*/
+	struct stat_file_bucket *buckets;       /**< first bucket						*/
+	guint64 nbuckets;                       /**< number of buckets					*/
+	guint ref;                              /**< number of statfiles using file		*/
+} rspamd_mmaped_combined_t;
+
 /**
  * Common view of statfile object
  */
@@ -96,6 +163,14 @@ typedef struct {
 	struct stat_file_section cur_section;   /**< current section					*/
 	size_t len;                             /**< length of file(in bytes)			*/
 	struct rspamd_statfile_config *cf;
+	rspamd_mmaped_combined_t *combined;     /**< combined file if used				*/
+	guint class_idx;                        /**< index of class in combined file	*/
+	ino_t inode;                            /**< inode of mapped file				*/
+	gdouble last_check;                     /**< last check for file replacement	*/
+	gsize max_size;                         /**< maximum size for auto resize		*/
+	guint64 expired;                        /**< blocks expired due to full chains	*/
+	guint64 max_chain;                      /**< longest chain used on insert		*/
+	struct rspamd_mmaped_migration *migration;  /**< resize in progress			*/
 } rspamd_mmaped_file_t;
 
 /**
@@ -103,14 +178,39 @@ typedef struct {
  */
 typedef struct  {
 	GHashTable *files;                     /**< hash table of opened files indexed by name	*/
+	GHashTable *combined;                  /**< combined files indexed by path		*/
 	rspamd_mempool_t *pool;                 /**< memory pool object					*/
 	rspamd_mempool_mutex_t *lock;               /**< mutex								*/
 	gboolean mlock_ok;                      /**< whether it is possible to use mlock (2) to avoid statfiles unloading */
 } rspamd_mmaped_file_ctx;
 
+/**
+ * Incremental copy of statfile to a larger file
+ */
+struct rspamd_mmaped_migration {
+	rspamd_mmaped_file_ctx *ctx;            /**< statfiles pool						*/
+	rspamd_mmaped_file_t *file;             /**< source statfile					*/
+	rspamd_mmaped_file_t *target;           /**< new statfile						*/
+	gchar *tmp_name;                        /**< name of new file until switch		*/
+	gint lock_fd;                           /**< flock preventing parallel resizes	*/
+	guint64 pos;                            /**< next block to copy					*/
+	struct event ev;
+	struct event_base *ev_base;
+};
+
 #define RSPAMD_STATFILE_VERSION {'1', '2'}
+#define RSPAMD_STATFILE_COMBINED_VERSION {'2', '0'}
 #define BACKUP_SUFFIX ".old"
 
+G_STATIC_ASSERT (sizeof (struct stat_file_bucket) == 64);
+G_STATIC_ASSERT (sizeof (struct stat_file_combined_header) % 64 == 0);
+
+#if defined(__GNUC__) || defined(__clang__)
+#define STATFILE_PREFETCH(p) __builtin_prefetch ((p), 0, 1)
+#else
+#define STATFILE_PREFETCH(p) (void)(p)
+#endif
+
 static void rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 	   rspamd_mmaped_file_ctx *statfiles_pool, rspamd_mmaped_file_t *file,
 	   guint32 h1, guint32 h2, double value);
@@ -122,6 +222,103 @@ rspamd_mmaped_file_t * rspamd_mmaped_file_open (rspamd_mmaped_file_ctx *statfile
 gint rspamd_mmaped_file_create (rspamd_mmaped_file_ctx *statfile_pool,
 		const gchar *filename, size_t size, struct rspamd_statfile_config *stcf,
 		rspamd_mempool_t *pool);
+static void rspamd_mmaped_file_migration_free (
+		struct rspamd_mmaped_migration *m);
+
+static struct stat_file_slot *
+rspamd_mmaped_combined_find (rspamd_mmaped_combined_t *cf,
+	guint32 h1,
+	guint32 h2)
+{
+	struct stat_file_slot *slot;
+	guint64 i, j, bucketnum;
+
+	bucketnum = h1 % cf->nbuckets;
+
+	for (i = 0; i < COMBINED_CHAIN_LENGTH; i++) {
+		if (i + bucketnum >= cf->nbuckets) {
+			break;
+		}
+
+		for (j = 0; j < COMBINED_SLOTS_PER_BUCKET; j++) {
+			slot = &cf->buckets[bucketnum + i].slots[j];
+
+			if (slot->hash1 == h1 && slot->hash2 == h2) {
+				return slot;
+			}
+			if (slot->hash1 == 0 && slot->hash2 == 0) {
+				/* Slots are never freed, so the chain ends here */
+				return NULL;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static void
+rspamd_mmaped_combined_set (rspamd_mempool_t *pool,
+	rspamd_mmaped_combined_t *cf,
+	guint class_idx,
+	guint32 h1,
+	guint32 h2,
+	double value)
+{
+	struct stat_file_combined_header *header;
+	struct stat_file_slot *slot, *to_expire = NULL;
+	guint64 i, j, k, bucketnum;
+	double min = G_MAXDOUBLE, sum;
+
+	header = (struct stat_file_combined_header *)cf->map;
+	bucketnum = h1 % cf->nbuckets;
+
+	for (i = 0; i < COMBINED_CHAIN_LENGTH; i++) {
+		if (i + bucketnum >= cf->nbuckets) {
+			msg_info_pool ("chain %uL is full in statfile %s, starting expire",
+					bucketnum,
+					cf->filename);
+			break;
+		}
+
+		for (j = 0; j < COMBINED_SLOTS_PER_BUCKET; j++) {
+			slot = &cf->buckets[bucketnum + i].slots[j];
+
+			if (slot->hash1 == h1 && slot->hash2 == h2) {
+				slot->values[class_idx] = value;
+				return;
+			}
+			if (slot->hash1 == 0 && slot->hash2 == 0) {
+				/* Write new slot here */
+				memset (slot->values, 0, sizeof (slot->values));
+				slot->hash1 = h1;
+				slot->hash2 = h2;
+				slot->values[class_idx] = value;
+				header->used_slots++;
+
+				return;
+			}
+
+			/* Expire the least used slot otherwise */
+			for (k = 0, sum = 0; k < COMBINED_MAX_CLASSES; k++) {
+				sum += slot->values[k];
+			}
+
+			if (sum < min) {
+				to_expire = slot;
+				min = sum;
+			}
+		}
+	}
+
+	if (to_expire == NULL) {
+		to_expire = &cf->buckets[bucketnum].slots[0];
+	}
+
+	memset (to_expire->values, 0, sizeof (to_expire->values));
+	to_expire->hash1 = h1;
+	to_expire->hash2 = h2;
+	to_expire->values[class_idx] = value;
+}
 
 double
 rspamd_mmaped_file_get_block (rspamd_mmaped_file_ctx * pool,
@@ -133,6 +330,14 @@ rspamd_mmaped_file_get_block (rspamd_mmaped_file_ctx * pool,
 	guint i, blocknum;
 	u_char *c;
 
+	if (file->combined) {
+		struct stat_file_slot *slot;
+
+		slot = rspamd_mmaped_combined_find (file->combined, h1, h2);
+
+		return slot ? slot->values[file->class_idx] : 0;
+	}
+
 	if (!file->map) {
 		return 0;
 	}
@@ -210,6 +415,10 @@ rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 			block->value = value;
 			header->used_blocks++;
 
+			if (i + 1 > file->max_chain) {
+				file->max_chain = i + 1;
+			}
+
 			return;
 		}
 
@@ -222,6 +431,8 @@ rspamd_mmaped_file_set_block_common (rspamd_mempool_t *pool,
 		block = (struct stat_file_block *)c;
 	}
 
+	file->expired++;
+
 	/* Try expire some block */
 	if (to_expire) {
 		block = to_expire;
@@ -246,7 +457,20 @@ rspamd_mmaped_file_set_block (rspamd_mempool_t *pool,
 		guint32 h2,
 		double value)
 {
-	rspamd_mmaped_file_set_block_common (pool, statfile_pool, file, h1, h2, value);
+	if (file->combined) {
+		rspamd_mmaped_combined_set (pool, file->combined, file->class_idx,
+				h1, h2, value);
+	}
+	else {
+		rspamd_mmaped_file_set_block_common (pool, statfile_pool, file, h1, h2,
+				value);
+
+		if (file->migration) {
+			/* Blocks that have been already copied must be updated as well */
+			rspamd_mmaped_file_set_block_common (pool, statfile_pool,
+					file->migration->target, h1, h2, value);
+		}
+	}
 }
 
 rspamd_mmaped_file_t *
@@ -258,19 +482,50 @@ rspamd_mmaped_file_is_open (rspamd_mmaped_file_ctx * pool,
 
 
 
-gboolean
-rspamd_mmaped_file_set_revision (rspamd_mmaped_file_t *file, guint64 rev, time_t time)
+/*
+ * Returns pointers to revision fields of a statfile in either format
+ */
+static gboolean
+rspamd_mmaped_file_revision_ptr (rspamd_mmaped_file_t *file, guint64 **rev,
+		guint64 **rev_time)
 {
 	struct stat_file_header *header;
+	struct stat_file_combined_header *cheader;
 
-	if (file == NULL || file->map == NULL) {
+	if (file == NULL) {
+		return FALSE;
+	}
+
+	if (file->combined) {
+		cheader = (struct stat_file_combined_header *)file->combined->map;
+		*rev = &cheader->revisions[file->class_idx];
+		*rev_time = &cheader->rev_times[file->class_idx];
+
+		return TRUE;
+	}
+
+	if (file->map == NULL) {
 		return FALSE;
 	}
 
 	header = (struct stat_file_header *)file->map;
+	*rev = &header->revision;
+	*rev_time = &header->rev_time;
+
+	return TRUE;
+}
+
+gboolean
+rspamd_mmaped_file_set_revision (rspamd_mmaped_file_t *file, guint64 rev, time_t time)
+{
+	guint64 *prev, *ptime;
+
+	if (!rspamd_mmaped_file_revision_ptr (file, &prev, &ptime)) {
+		return FALSE;
+	}
 
-	header->revision = rev;
-	header->rev_time = time;
+	*prev = rev;
+	*ptime = time;
 
 	return TRUE;
 }
@@ -278,15 +533,13 @@ rspamd_mmaped_file_set_revision (rspamd_mmaped_file_t *file, guint64 rev, time_t
 gboolean
 rspamd_mmaped_file_inc_revision (rspamd_mmaped_file_t *file)
 {
-	struct stat_file_header *header;
+	guint64 *prev, *ptime;
 
-	if (file == NULL || file->map == NULL) {
+	if (!rspamd_mmaped_file_revision_ptr (file, &prev, &ptime)) {
 		return FALSE;
 	}
 
-	header = (struct stat_file_header *)file->map;
-
-	header->revision++;
+	(*prev)++;
 
 	return TRUE;
 }
@@ -294,15 +547,13 @@ rspamd_mmaped_file_inc_revision (rspamd_mmaped_file_t *file)
 gboolean
 rspamd_mmaped_file_dec_revision (rspamd_mmaped_file_t *file)
 {
-	struct stat_file_header *header;
+	guint64 *prev, *ptime;
 
-	if (file == NULL || file->map == NULL) {
+	if (!rspamd_mmaped_file_revision_ptr (file, &prev, &ptime)) {
 		return FALSE;
 	}
 
-	header = (struct stat_file_header *)file->map;
-
-	header->revision--;
+	(*prev)--;
 
 	return TRUE;
 }
@@ -311,19 +562,17 @@ rspamd_mmaped_file_dec_revision (rspamd_mmaped_file_t *file)
 gboolean
 rspamd_mmaped_file_get_revision (rspamd_mmaped_file_t *file, guint64 *rev, time_t *time)
 {
-	struct stat_file_header *header;
+	guint64 *prev, *ptime;
 
-	if (file == NULL || file->map == NULL) {
+	if (!rspamd_mmaped_file_revision_ptr (file, &prev, &ptime)) {
 		return FALSE;
 	}
 
-	header = (struct stat_file_header *)file->map;
-
 	if (rev != NULL) {
-		*rev = header->revision;
+		*rev = *prev;
 	}
 	if (time != NULL) {
-		*time = header->rev_time;
+		*time = *ptime;
 	}
 
 	return TRUE;
@@ -334,6 +583,11 @@ rspamd_mmaped_file_get_used (rspamd_mmaped_file_t *file)
 {
 	struct stat_file_header *header;
 
+	if (file != NULL && file->combined) {
+		return ((struct stat_file_combined_header *)
+				file->combined->map)->used_slots;
+	}
+
 	if (file == NULL || file->map == NULL) {
 		return (guint64) - 1;
 	}
@@ -348,6 +602,10 @@ rspamd_mmaped_file_get_total (rspamd_mmaped_file_t *file)
 {
 	struct stat_file_header *header;
 
+	if (file != NULL && file->combined) {
+		return file->combined->nbuckets * COMBINED_SLOTS_PER_BUCKET;
+	}
+
 	if (file == NULL || file->map == NULL) {
 		return (guint64) - 1;
 	}
@@ -420,6 +678,41 @@ rspamd_mmaped_file_check (rspamd_mempool_t *pool, rspamd_mmaped_file_t * file)
 }
 
 
+/*
+ * Opens `<filename>.lock` and takes an exclusive flock on it. The lock is
+ * released by the kernel if its owner dies, so a crashed resize cannot block
+ * further ones. The lock file itself is never removed, as another process
+ * might be waiting for it. Returns -1 if the lock is held by another process
+ * and `wait` is FALSE
+ */
+static gint
+rspamd_mmaped_file_lock_exclusive (rspamd_mempool_t *pool,
+		const gchar *filename, gboolean wait)
+{
+	gchar *lock;
+	gint lock_fd;
+
+	lock = g_strconcat (filename, ".lock", NULL);
+	lock_fd = open (lock, O_WRONLY|O_CREAT, 00600);
+
+	if (lock_fd == -1) {
+		msg_err_pool ("cannot open lock %s: %s", lock, strerror (errno));
+		g_free (lock);
+
+		return -1;
+	}
+
+	g_free (lock);
+
+	if (!rspamd_file_lock (lock_fd, !wait)) {
+		close (lock_fd);
+
+		return -1;
+	}
+
+	return lock_fd;
+}
+
 static rspamd_mmaped_file_t *
 rspamd_mmaped_file_reindex (rspamd_mmaped_file_ctx *statfiles_pool,
 	const gchar *filename,
@@ -427,7 +720,8 @@ rspamd_mmaped_file_reindex (rspamd_mmaped_file_ctx *statfiles_pool,
 	size_t size,
 	struct rspamd_statfile_config *stcf)
 {
-	gchar *backup, *lock;
+	gchar *backup;
+	struct stat st;
 	gint fd, lock_fd;
 	rspamd_mmaped_file_t *new;
 	u_char *map, *pos;
@@ -444,40 +738,31 @@ rspamd_mmaped_file_reindex (rspamd_mmaped_file_ctx *statfiles_pool,
 		return NULL;
 	}
 
-	lock = g_strconcat (filename, ".lock", NULL);
-	lock_fd = open (lock, O_WRONLY|O_CREAT|O_EXCL, 00600);
+	lock_fd = rspamd_mmaped_file_lock_exclusive (pool, filename, FALSE);
 
 	if (lock_fd == -1) {
-		/* Wait for lock */
-		lock_fd = open (lock, O_RDONLY, 00600);
-		if (lock_fd != -1) {
-			if (!rspamd_file_lock (lock_fd, FALSE)) {
-				g_free (lock);
+		/* Wait for another process to finish reindexing */
+		lock_fd = rspamd_mmaped_file_lock_exclusive (pool, filename, TRUE);
 
-				return rspamd_mmaped_file_open (statfiles_pool, filename, size, stcf);
-			}
-		}
-		else {
-			return rspamd_mmaped_file_open (statfiles_pool, filename, size, stcf);
+		if (lock_fd != -1) {
+			rspamd_file_unlock (lock_fd, FALSE);
+			close (lock_fd);
 		}
-	}
-
-	if (!rspamd_file_lock (lock_fd, FALSE)) {
-		close (lock_fd);
-		unlink (lock);
-		g_free (lock);
 
 		return rspamd_mmaped_file_open (statfiles_pool, filename, size, stcf);
 	}
 
-
 	backup = g_strconcat (filename, ".old", NULL);
-	if (rename (filename, backup) == -1) {
+
+	if (stat (backup, &st) != -1) {
+		/* Previous reindex has been interrupted, so restart it from backup */
+		msg_warn_pool ("restore %s left by an interrupted reindex", backup);
+		old_size = st.st_size;
+	}
+	else if (rename (filename, backup) == -1) {
 		msg_err_pool ("cannot rename %s to %s: %s", filename, backup, strerror (
 				errno));
 		g_free (backup);
-		unlink (lock);
-		g_free (lock);
 		rspamd_file_unlock (lock_fd, FALSE);
 		close (lock_fd);
 
@@ -488,8 +773,6 @@ rspamd_mmaped_file_reindex (rspamd_mmaped_file_ctx *statfiles_pool,
 	if (rspamd_mmaped_file_create (statfiles_pool, filename, size, stcf, statfiles_pool->pool) != 0) {
 		msg_err_pool ("cannot create new file");
 		g_free (backup);
-		unlink (lock);
-		g_free (lock);
 		rspamd_file_unlock (lock_fd, FALSE);
 		close (lock_fd);
 
@@ -505,8 +788,6 @@ rspamd_mmaped_file_reindex (rspamd_mmaped_file_ctx *statfiles_pool,
 		}
 
 		msg_err_pool ("cannot open file: %s", strerror (errno));
-		unlink (lock);
-		g_free (lock);
 		rspamd_file_unlock (lock_fd, FALSE);
 		close (lock_fd);
 		g_free (backup);
@@ -520,8 +801,6 @@ rspamd_mmaped_file_reindex (rspamd_mmaped_file_ctx *statfiles_pool,
 		mmap (NULL, old_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
 		msg_err_pool ("cannot mmap file: %s", strerror (errno));
 		close (fd);
-		unlink (lock);
-		g_free (lock);
 		rspamd_file_unlock (lock_fd, FALSE);
 		close (lock_fd);
 		g_free (backup);
@@ -550,8 +829,6 @@ rspamd_mmaped_file_reindex (rspamd_mmaped_file_ctx *statfiles_pool,
 	close (fd);
 	unlink (backup);
 	g_free (backup);
-	unlink (lock);
-	g_free (lock);
 	rspamd_file_unlock (lock_fd, FALSE);
 	close (lock_fd);
 
@@ -565,14 +842,14 @@ rspamd_mmaped_file_reindex (rspamd_mmaped_file_ctx *statfiles_pool,
  * Pre-load mmaped file into memory
  */
 static void
-rspamd_mmaped_file_preload (rspamd_mmaped_file_t *file)
+rspamd_mmaped_file_preload (void *map, gsize len)
 {
 	guint8 *pos, *end;
 	volatile guint8 t;
 	gsize size;
 
-	pos = (guint8 *)file->map;
-	end = (guint8 *)file->map + file->len;
+	pos = (guint8 *)map;
+	end = (guint8 *)map + len;
 
 	if (madvise (pos, end - pos, MADV_SEQUENTIAL) == -1) {
 		msg_info ("madvise failed: %s", strerror (errno));
@@ -592,42 +869,31 @@ rspamd_mmaped_file_preload (rspamd_mmaped_file_t *file)
 	}
 }
 
-rspamd_mmaped_file_t *
-rspamd_mmaped_file_open (rspamd_mmaped_file_ctx *statfiles_pool,
-		const gchar *filename, size_t size,
+/*
+ * Maps and checks statfile without registering it in the pool
+ */
+static rspamd_mmaped_file_t *
+rspamd_mmaped_file_map (rspamd_mmaped_file_ctx *statfiles_pool,
+		const gchar *filename,
 		struct rspamd_statfile_config *stcf)
 {
 	struct stat st;
 	rspamd_mmaped_file_t *new_file;
+	const ucl_object_t *maxsizeo;
 	rspamd_mempool_t *pool = statfiles_pool->pool;
 
-	if ((new_file = rspamd_mmaped_file_is_open (statfiles_pool, stcf)) != NULL) {
-		return new_file;
-	}
-
-	if (stat (filename, &st) == -1) {
-		msg_info_pool ("cannot stat file %s, error %s, %d", filename, strerror (
-				errno), errno);
-		return NULL;
-	}
-
-	if (labs ((glong)size - st.st_size) > (long)sizeof (struct stat_file) * 2
-		&& size > sizeof (struct stat_file)) {
-		msg_warn_pool ("need to reindex statfile old size: %Hz, new size: %Hz",
-			(size_t)st.st_size, size);
-		return rspamd_mmaped_file_reindex (statfiles_pool, filename, st.st_size, size, stcf);
-	}
-	else if (size < sizeof (struct stat_file)) {
-		msg_err_pool ("requested to shrink statfile to %Hz but it is too small",
-			size);
-	}
-
 	new_file = g_slice_alloc0 (sizeof (rspamd_mmaped_file_t));
-	if ((new_file->fd = open (filename, O_RDWR)) == -1) {
+	if ((new_file->fd = open (filename, O_RDWR)) == -1 ||
+			fstat (new_file->fd, &st) == -1) {
 		msg_info_pool ("cannot open file %s, error %d, %s",
 			filename,
 			errno,
 			strerror (errno));
+
+		if (new_file->fd != -1) {
+			close (new_file->fd);
+		}
+
 		g_slice_free1 (sizeof (*new_file), new_file);
 		return NULL;
 	}
@@ -647,6 +913,8 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx *statfiles_pool,
 
 	rspamd_strlcpy (new_file->filename, filename, sizeof (new_file->filename));
 	new_file->len = st.st_size;
+	new_file->inode = st.st_ino;
+	new_file->last_check = rspamd_get_ticks ();
 	/* Try to lock pages in RAM */
 	if (statfiles_pool->mlock_ok) {
 		if (mlock (new_file->map, new_file->len) == -1) {
@@ -661,6 +929,7 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx *statfiles_pool,
 	if (rspamd_mmaped_file_check (statfiles_pool->pool, new_file) == -1) {
 		rspamd_file_unlock (new_file->fd, FALSE);
 		munmap (new_file->map, st.st_size);
+		close (new_file->fd);
 		g_slice_free1 (sizeof (*new_file), new_file);
 		return NULL;
 	}
@@ -668,45 +937,600 @@ rspamd_mmaped_file_open (rspamd_mmaped_file_ctx *statfiles_pool,
 	rspamd_file_unlock (new_file->fd, FALSE);
 
 	new_file->cf = stcf;
+	maxsizeo = ucl_object_find_key (stcf->opts, "max_size");
 
-	rspamd_mmaped_file_preload (new_file);
-
-	g_assert (stcf->clcf != NULL);
+	if (maxsizeo != NULL && ucl_object_type (maxsizeo) == UCL_INT) {
+		new_file->max_size = ucl_object_toint (maxsizeo);
+	}
 
-	g_hash_table_insert (statfiles_pool->files, stcf, new_file);
+	rspamd_mmaped_file_preload (new_file->map, new_file->len);
 
 	return new_file;
 }
 
-gint
-rspamd_mmaped_file_close_file (rspamd_mmaped_file_ctx *statfile_pool,
-	rspamd_mmaped_file_t * file)
+rspamd_mmaped_file_t *
+rspamd_mmaped_file_open (rspamd_mmaped_file_ctx *statfiles_pool,
+		const gchar *filename, size_t size,
+		struct rspamd_statfile_config *stcf)
 {
-	rspamd_mmaped_file_t *pos;
-	rspamd_mempool_t *pool = statfile_pool->pool;
+	struct stat st;
+	rspamd_mmaped_file_t *new_file;
+	const ucl_object_t *maxsizeo;
+	gsize max_size = 0;
+	rspamd_mempool_t *pool = statfiles_pool->pool;
 
-	if ((pos = rspamd_mmaped_file_is_open (statfile_pool, file->cf)) == NULL) {
-		msg_info_pool ("file %s is not opened", file->filename);
-		return -1;
+	if ((new_file = rspamd_mmaped_file_is_open (statfiles_pool, stcf)) != NULL) {
+		return new_file;
 	}
 
-	if (file->map) {
-		msg_info_pool ("syncing statfile %s", file->filename);
-		msync (file->map, file->len, MS_ASYNC);
-		munmap (file->map, file->len);
+	if (stat (filename, &st) == -1) {
+		msg_info_pool ("cannot stat file %s, error %s, %d", filename, strerror (
+				errno), errno);
+		return NULL;
 	}
-	if (file->fd != -1) {
-		close (file->fd);
+
+	maxsizeo = ucl_object_find_key (stcf->opts, "max_size");
+
+	if (maxsizeo != NULL && ucl_object_type (maxsizeo) == UCL_INT) {
+		max_size = ucl_object_toint (maxsizeo);
 	}
 
-	g_slice_free1 (sizeof (*file), file);
+	if ((gsize)st.st_size > size && (gsize)st.st_size <= max_size) {
+		/* Statfile has been grown automatically, so do not shrink it */
+		msg_debug_pool ("statfile %s has been resized to %Hz", filename,
+				(gsize)st.st_size);
+	}
+	else if (labs ((glong)size - st.st_size) > (long)sizeof (struct stat_file) * 2
+		&& size > sizeof (struct stat_file)) {
+		msg_warn_pool ("need to reindex statfile old size: %Hz, new size: %Hz",
+			(size_t)st.st_size, size);
+		return rspamd_mmaped_file_reindex (statfiles_pool, filename, st.st_size, size, stcf);
+	}
+	else if (size < sizeof (struct stat_file)) {
+		msg_err_pool ("requested to shrink statfile to %Hz but it is too small",
+			size);
+	}
 
-	return 0;
+	new_file = rspamd_mmaped_file_map (statfiles_pool, filename, stcf);
+
+	if (new_file == NULL) {
+		return NULL;
+	}
+
+	g_assert (stcf->clcf != NULL);
+
+	g_hash_table_insert (statfiles_pool->files, stcf, new_file);
+
+	return new_file;
 }
 
-gint
-rspamd_mmaped_file_create (rspamd_mmaped_file_ctx *statfile_pool, const gchar *filename,
-		size_t size, struct rspamd_statfile_config *stcf, rspamd_mempool_t *pool)
+static void
+rspamd_mmaped_combined_unref (rspamd_mmaped_file_ctx *statfile_pool,
+	rspamd_mmaped_combined_t *cf)
+{
+	rspamd_mempool_t *pool = statfile_pool->pool;
+
+	if (--cf->ref == 0) {
+		g_hash_table_remove (statfile_pool->combined, cf->filename);
+		msg_info_pool ("syncing statfile %s", cf->filename);
+		msync (cf->map, cf->len, MS_ASYNC);
+		munmap (cf->map, cf->len);
+		close (cf->fd);
+		g_slice_free1 (sizeof (*cf), cf);
+	}
+}
+
+/*
+ * Returns path of combined statfile for a classifier or NULL if classifier
+ * uses separate statfiles
+ */
+static const gchar *
+rspamd_mmaped_file_combined_path (struct rspamd_classifier_config *clcf,
+	gsize *size)
+{
+	const ucl_object_t *filenameo, *sizeo;
+	GList *cur;
+	struct rspamd_statfile_config *stcf;
+	gsize total = 0;
+
+	if (clcf == NULL || clcf->opts == NULL) {
+		return NULL;
+	}
+
+	filenameo = ucl_object_find_key (clcf->opts, "combined_file");
+
+	if (filenameo == NULL || ucl_object_type (filenameo) != UCL_STRING) {
+		return NULL;
+	}
+
+	sizeo = ucl_object_find_key (clcf->opts, "combined_size");
+
+	if (sizeo != NULL && ucl_object_type (sizeo) == UCL_INT) {
+		total = ucl_object_toint (sizeo);
+	}
+	else {
+		/* Use the sum of sizes of statfiles by default */
+		for (cur = clcf->statfiles; cur != NULL; cur = g_list_next (cur)) {
+			stcf = cur->data;
+			sizeo = ucl_object_find_key (stcf->opts, "size");
+
+			if (sizeo != NULL && ucl_object_type (sizeo) == UCL_INT) {
+				total += ucl_object_toint (sizeo);
+			}
+		}
+	}
+
+	if (size) {
+		*size = total;
+	}
+
+	return ucl_object_tostring (filenameo);
+}
+
+/* Finds or allocates index of a class in a combined statfile */
+static gint
+rspamd_mmaped_combined_class (rspamd_mmaped_combined_t *cf,
+	const gchar *symbol)
+{
+	struct stat_file_combined_header *header = cf->map;
+	guint i;
+
+	for (i = 0; i < COMBINED_MAX_CLASSES; i++) {
+		if (header->symbols[i][0] == '\0') {
+			rspamd_strlcpy (header->symbols[i], symbol,
+					sizeof (header->symbols[i]));
+			header->nclasses = i + 1;
+
+			return i;
+		}
+		if (strncmp (header->symbols[i], symbol,
+				sizeof (header->symbols[i]) - 1) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static gint
+rspamd_mmaped_combined_create (rspamd_mmaped_file_ctx *statfile_pool,
+	const gchar *filename,
+	size_t size,
+	struct rspamd_classifier_config *clcf,
+	rspamd_mempool_t *pool)
+{
+	struct stat_file_combined_header header = {
+		.magic = {'r', 's', 'd'},
+		.version = RSPAMD_STATFILE_COMBINED_VERSION,
+		.padding = {0, 0, 0},
+	};
+	struct rspamd_stat_tokenizer *tokenizer;
+	guint64 nbuckets, nwrite;
+	gchar *buf;
+	gsize buflen, tok_conf_len;
+	gpointer tok_conf;
+	gint fd;
+
+	if (size < sizeof (header) + sizeof (struct stat_file_bucket)) {
+		msg_err_pool ("file %s is too small to carry any statistic: %z",
+			filename,
+			size);
+		return -1;
+	}
+
+	nbuckets = (size - sizeof (header)) / sizeof (struct stat_file_bucket);
+	header.total_buckets = nbuckets;
+	header.create_time = (guint64) time (NULL);
+	g_assert (clcf->tokenizer != NULL);
+	tokenizer = rspamd_stat_get_tokenizer (clcf->tokenizer->name);
+	g_assert (tokenizer != NULL);
+	tok_conf = tokenizer->get_config (pool, clcf->tokenizer, &tok_conf_len);
+	header.tokenizer_conf_len = tok_conf_len;
+	g_assert (tok_conf_len <= sizeof (header.tokenizer_conf));
+	memcpy (header.tokenizer_conf, tok_conf, tok_conf_len);
+
+	if ((fd =
+		open (filename, O_RDWR | O_TRUNC | O_CREAT, S_IWUSR | S_IRUSR)) == -1) {
+		msg_info_pool ("cannot create file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+		return -1;
+	}
+
+	rspamd_fallocate (fd,
+		0,
+		sizeof (header) + sizeof (struct stat_file_bucket) * nbuckets);
+
+	if (write (fd, &header, sizeof (header)) == -1) {
+		msg_info_pool ("cannot write header to file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+		close (fd);
+
+		return -1;
+	}
+
+	/* Write 256 buckets at once */
+	buflen = sizeof (struct stat_file_bucket) * 256;
+	buf = g_malloc0 (buflen);
+
+	while (nbuckets) {
+		nwrite = MIN (nbuckets, 256);
+
+		if (write (fd, buf, nwrite * sizeof (struct stat_file_bucket)) == -1) {
+			msg_info_pool ("cannot write buckets to file %s, error %d, %s",
+				filename,
+				errno,
+				strerror (errno));
+			close (fd);
+			g_free (buf);
+
+			return -1;
+		}
+
+		nbuckets -= nwrite;
+	}
+
+	close (fd);
+	g_free (buf);
+
+	return 0;
+}
+
+/*
+ * Imports statfile of the old format to the specified class of combined file
+ */
+static gboolean
+rspamd_mmaped_combined_convert (rspamd_mmaped_file_ctx *statfile_pool,
+	rspamd_mmaped_combined_t *cf,
+	struct rspamd_statfile_config *stcf)
+{
+	struct stat_file *f;
+	struct stat_file_block *block;
+	struct stat_file_combined_header *header = cf->map;
+	const ucl_object_t *filenameo;
+	static gchar valid_version[] = RSPAMD_STATFILE_VERSION;
+	rspamd_mempool_t *pool = statfile_pool->pool;
+	const gchar *filename;
+	struct stat st;
+	guint64 i, nblocks, converted = 0;
+	gpointer map;
+	gint fd, class_idx;
+
+	filenameo = ucl_object_find_key (stcf->opts, "filename");
+
+	if (filenameo == NULL || ucl_object_type (filenameo) != UCL_STRING) {
+		filenameo = ucl_object_find_key (stcf->opts, "path");
+
+		if (filenameo == NULL || ucl_object_type (filenameo) != UCL_STRING) {
+			return FALSE;
+		}
+	}
+
+	filename = ucl_object_tostring (filenameo);
+
+	if ((fd = open (filename, O_RDONLY)) == -1) {
+		return FALSE;
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size < (off_t)sizeof (struct stat_file)) {
+		close (fd);
+		return FALSE;
+	}
+
+	if ((map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))
+			== MAP_FAILED) {
+		msg_err_pool ("cannot mmap file %s: %s", filename, strerror (errno));
+		close (fd);
+		return FALSE;
+	}
+
+	f = map;
+	nblocks = f->section.length;
+
+	if (memcmp (f->header.magic, "rsd", 3) != 0 ||
+			memcmp (f->header.version, valid_version,
+					sizeof (valid_version)) != 0 ||
+			nblocks * sizeof (struct stat_file_block) +
+			sizeof (struct stat_file) - sizeof (struct stat_file_block) >
+			(guint64)st.st_size) {
+		msg_info_pool ("file %s is not a valid statfile, skip conversion",
+				filename);
+		munmap (map, st.st_size);
+		close (fd);
+		return FALSE;
+	}
+
+	class_idx = rspamd_mmaped_combined_class (cf, stcf->symbol);
+
+	if (class_idx == -1) {
+		munmap (map, st.st_size);
+		close (fd);
+		return FALSE;
+	}
+
+	for (i = 0; i < nblocks; i++) {
+		block = &f->blocks[i];
+
+		if (block->hash1 != 0 && block->value != 0) {
+			rspamd_mmaped_combined_set (pool, cf, class_idx, block->hash1,
+					block->hash2, block->value);
+			converted++;
+		}
+	}
+
+	header->revisions[class_idx] = f->header.revision;
+	header->rev_times[class_idx] = f->header.rev_time;
+	msg_info_pool ("converted %uL tokens of statfile %s to combined statfile %s, "
+			"old file is kept intact", converted, filename, cf->filename);
+
+	munmap (map, st.st_size);
+	close (fd);
+
+	return TRUE;
+}
+
+static rspamd_mmaped_combined_t *
+rspamd_mmaped_combined_map (rspamd_mmaped_file_ctx *statfile_pool,
+	const gchar *filename)
+{
+	struct stat_file_combined_header *header;
+	static gchar valid_version[] = RSPAMD_STATFILE_COMBINED_VERSION;
+	rspamd_mmaped_combined_t *cf;
+	rspamd_mempool_t *pool = statfile_pool->pool;
+	struct stat st;
+
+	cf = g_slice_alloc0 (sizeof (*cf));
+
+	if ((cf->fd = open (filename, O_RDWR)) == -1 || fstat (cf->fd, &st) == -1) {
+		msg_info_pool ("cannot open file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+
+		if (cf->fd != -1) {
+			close (cf->fd);
+		}
+
+		g_slice_free1 (sizeof (*cf), cf);
+		return NULL;
+	}
+
+	cf->len = st.st_size;
+
+	if (cf->len < sizeof (*header) ||
+			(cf->map = mmap (NULL, cf->len, PROT_READ | PROT_WRITE, MAP_SHARED,
+					cf->fd, 0)) == MAP_FAILED) {
+		msg_info_pool ("cannot mmap file %s, error %d, %s",
+			filename,
+			errno,
+			strerror (errno));
+		close (cf->fd);
+		g_slice_free1 (sizeof (*cf), cf);
+		return NULL;
+	}
+
+	header = cf->map;
+
+	if (memcmp (header->magic, "rsd", 3) != 0 ||
+			memcmp (header->version, valid_version, sizeof (valid_version)) != 0 ||
+			header->total_buckets == 0 ||
+			sizeof (*header) + header->total_buckets *
+			sizeof (struct stat_file_bucket) > cf->len) {
+		msg_info_pool ("file %s is invalid combined stat file", filename);
+		munmap (cf->map, cf->len);
+		close (cf->fd);
+		g_slice_free1 (sizeof (*cf), cf);
+		return NULL;
+	}
+
+	rspamd_strlcpy (cf->filename, filename, sizeof (cf->filename));
+	cf->buckets = (struct stat_file_bucket *)(header + 1);
+	cf->nbuckets = header->total_buckets;
+
+	if (statfile_pool->mlock_ok) {
+		if (mlock (cf->map, cf->len) == -1) {
+			msg_warn_pool (
+				"mlock of statfile failed, maybe you need to increase RLIMIT_MEMLOCK limit for a process: %s",
+				strerror (errno));
+			statfile_pool->mlock_ok = FALSE;
+		}
+	}
+
+	rspamd_mmaped_file_preload (cf->map, cf->len);
+
+	return cf;
+}
+
+/*
+ * Creates combined statfile converting all existing statfiles of the
+ * classifier. Lock file is used to perform conversion in a single process
+ */
+static gboolean
+rspamd_mmaped_combined_create_convert (rspamd_mmaped_file_ctx *statfile_pool,
+	const gchar *filename,
+	size_t size,
+	struct rspamd_classifier_config *clcf,
+	gboolean learn)
+{
+	rspamd_mmaped_combined_t *cf;
+	rspamd_mempool_t *pool = statfile_pool->pool;
+	gchar *tmp;
+	gint lock_fd;
+	GList *cur;
+	gboolean has_old = FALSE, ret = FALSE;
+	const ucl_object_t *filenameo;
+	struct rspamd_statfile_config *stcf;
+
+	for (cur = clcf->statfiles; cur != NULL; cur = g_list_next (cur)) {
+		stcf = cur->data;
+		filenameo = ucl_object_find_key (stcf->opts, "filename");
+
+		if (filenameo == NULL) {
+			filenameo = ucl_object_find_key (stcf->opts, "path");
+		}
+
+		if (filenameo != NULL && ucl_object_type (filenameo) == UCL_STRING &&
+				access (ucl_object_tostring (filenameo), R_OK) == 0) {
+			has_old = TRUE;
+		}
+	}
+
+	if (!has_old && !learn) {
+		/* Nothing to convert, the file is created on the first learn */
+		return FALSE;
+	}
+
+	lock_fd = rspamd_mmaped_file_lock_exclusive (pool, filename, FALSE);
+
+	if (lock_fd == -1) {
+		/* Another process is creating the file now */
+		return FALSE;
+	}
+
+	/* Drop leftovers of a conversion that has been interrupted */
+	tmp = g_strconcat (filename, ".new", NULL);
+	unlink (tmp);
+
+	if (rspamd_mmaped_combined_create (statfile_pool, tmp, size, clcf,
+			statfile_pool->pool) == 0 &&
+			(cf = rspamd_mmaped_combined_map (statfile_pool, tmp)) != NULL) {
+		for (cur = clcf->statfiles; cur != NULL; cur = g_list_next (cur)) {
+			rspamd_mmaped_combined_convert (statfile_pool, cf, cur->data);
+		}
+
+		msync (cf->map, cf->len, MS_SYNC);
+		munmap (cf->map, cf->len);
+		close (cf->fd);
+		g_slice_free1 (sizeof (*cf), cf);
+
+		/* Make the complete file visible atomically */
+		if (rename (tmp, filename) == -1) {
+			msg_err_pool ("cannot rename %s to %s: %s", tmp, filename,
+					strerror (errno));
+			unlink (tmp);
+		}
+		else {
+			ret = TRUE;
+		}
+	}
+	else {
+		unlink (tmp);
+	}
+
+	rspamd_file_unlock (lock_fd, FALSE);
+	close (lock_fd);
+	g_free (tmp);
+
+	return ret;
+}
+
+static rspamd_mmaped_file_t *
+rspamd_mmaped_file_open_combined (rspamd_mmaped_file_ctx *statfile_pool,
+	struct rspamd_statfile_config *stcf,
+	gboolean learn)
+{
+	rspamd_mmaped_file_t *new_file;
+	rspamd_mmaped_combined_t *cf;
+	rspamd_mempool_t *pool = statfile_pool->pool;
+	const gchar *filename;
+	gsize size = 0;
+	gint class_idx;
+
+	if ((new_file = rspamd_mmaped_file_is_open (statfile_pool, stcf)) != NULL) {
+		return new_file;
+	}
+
+	filename = rspamd_mmaped_file_combined_path (stcf->clcf, &size);
+	g_assert (filename != NULL);
+	cf = g_hash_table_lookup (statfile_pool->combined, filename);
+
+	if (cf == NULL) {
+		if (access (filename, R_OK) == -1 &&
+				!rspamd_mmaped_combined_create_convert (statfile_pool, filename,
+						size, stcf->clcf, learn)) {
+			return NULL;
+		}
+
+		if ((cf = rspamd_mmaped_combined_map (statfile_pool, filename)) == NULL) {
+			return NULL;
+		}
+
+		g_hash_table_insert (statfile_pool->combined, cf->filename, cf);
+	}
+
+	rspamd_file_lock (cf->fd, FALSE);
+	class_idx = rspamd_mmaped_combined_class (cf, stcf->symbol);
+	rspamd_file_unlock (cf->fd, FALSE);
+
+	if (class_idx == -1) {
+		msg_err_pool ("cannot add statfile %s to %s: too many classes, "
+				"%d at most are supported", stcf->symbol, filename,
+				COMBINED_MAX_CLASSES);
+
+		if (cf->ref == 0) {
+			cf->ref = 1;
+			rspamd_mmaped_combined_unref (statfile_pool, cf);
+		}
+
+		return NULL;
+	}
+
+	new_file = g_slice_alloc0 (sizeof (rspamd_mmaped_file_t));
+	rspamd_strlcpy (new_file->filename, filename, sizeof (new_file->filename));
+	new_file->fd = -1;
+	new_file->len = cf->len;
+	new_file->cf = stcf;
+	new_file->combined = cf;
+	new_file->class_idx = class_idx;
+	cf->ref ++;
+
+	g_hash_table_insert (statfile_pool->files, stcf, new_file);
+
+	return new_file;
+}
+
+gint
+rspamd_mmaped_file_close_file (rspamd_mmaped_file_ctx *statfile_pool,
+	rspamd_mmaped_file_t * file)
+{
+	rspamd_mmaped_file_t *pos;
+	rspamd_mempool_t *pool = statfile_pool->pool;
+
+	if ((pos = rspamd_mmaped_file_is_open (statfile_pool, file->cf)) == NULL) {
+		msg_info_pool ("file %s is not opened", file->filename);
+		return -1;
+	}
+
+	if (file->combined) {
+		rspamd_mmaped_combined_unref (statfile_pool, file->combined);
+		file->combined = NULL;
+	}
+
+	if (file->migration) {
+		/* Resize is not finished, so just drop the new file */
+		rspamd_mmaped_file_migration_free (file->migration);
+	}
+
+	if (file->map) {
+		msg_info_pool ("syncing statfile %s", file->filename);
+		msync (file->map, file->len, MS_ASYNC);
+		munmap (file->map, file->len);
+	}
+	if (file->fd != -1) {
+		close (file->fd);
+	}
+
+	g_slice_free1 (sizeof (*file), file);
+
+	return 0;
+}
+
+gint
+rspamd_mmaped_file_create (rspamd_mmaped_file_ctx *statfile_pool, const gchar *filename,
+		size_t size, struct rspamd_statfile_config *stcf, rspamd_mempool_t *pool)
 {
 	struct stat_file_header header = {
 		.magic = {'r', 's', 'd'},
@@ -727,7 +1551,8 @@ rspamd_mmaped_file_create (rspamd_mmaped_file_ctx *statfile_pool, const gchar *f
 	gpointer tok_conf;
 	gsize tok_conf_len;
 
-	if (rspamd_mmaped_file_is_open (statfile_pool, stcf) != NULL) {
+	if (statfile_pool != NULL &&
+			rspamd_mmaped_file_is_open (statfile_pool, stcf) != NULL) {
 		msg_info_pool ("file %s is already opened", filename);
 		return 0;
 	}
@@ -837,6 +1662,268 @@ rspamd_mmaped_file_create (rspamd_mmaped_file_ctx *statfile_pool, const gchar *f
 	return 0;
 }
 
+static void
+rspamd_mmaped_file_unmap (rspamd_mmaped_file_t *file)
+{
+	if (file->map) {
+		msync (file->map, file->len, MS_ASYNC);
+		munmap (file->map, file->len);
+		file->map = NULL;
+	}
+	if (file->fd != -1) {
+		close (file->fd);
+		file->fd = -1;
+	}
+}
+
+/*
+ * Replaces mapping of a statfile keeping the statfile object itself, as it
+ * is referenced by runtimes
+ */
+static void
+rspamd_mmaped_file_swap (rspamd_mmaped_file_t *file, rspamd_mmaped_file_t *nfile)
+{
+	rspamd_mmaped_file_unmap (file);
+
+	file->fd = nfile->fd;
+	file->map = nfile->map;
+	file->len = nfile->len;
+	file->seek_pos = nfile->seek_pos;
+	file->cur_section = nfile->cur_section;
+	file->inode = nfile->inode;
+	file->last_check = nfile->last_check;
+	file->expired = nfile->expired;
+	file->max_chain = nfile->max_chain;
+
+	g_slice_free1 (sizeof (*nfile), nfile);
+}
+
+static void
+rspamd_mmaped_file_migration_free (struct rspamd_mmaped_migration *m)
+{
+	if (m->ev_base) {
+		event_del (&m->ev);
+	}
+
+	if (m->target) {
+		rspamd_mmaped_file_unmap (m->target);
+		g_slice_free1 (sizeof (*m->target), m->target);
+	}
+
+	/* Has no effect if the new file has been already renamed */
+	unlink (m->tmp_name);
+	rspamd_file_unlock (m->lock_fd, FALSE);
+	close (m->lock_fd);
+
+	m->file->migration = NULL;
+	g_free (m->tmp_name);
+	g_slice_free1 (sizeof (*m), m);
+}
+
+/*
+ * Copies the next batch of blocks to the new statfile and switches to it
+ * once all blocks are copied. Returns TRUE if migration is finished
+ */
+static gboolean
+rspamd_mmaped_file_migration_step (struct rspamd_mmaped_migration *m)
+{
+	rspamd_mmaped_file_t *file = m->file, *target = m->target;
+	struct stat_file_block *blocks;
+	struct stat_file_header *header, *nh;
+	rspamd_mempool_t *pool = m->ctx->pool;
+	gsize old_len;
+	guint i;
+
+	blocks = (struct stat_file_block *)((u_char *)file->map + file->seek_pos);
+
+	for (i = 0; i < STATFILE_MIGRATION_BATCH &&
+			m->pos < file->cur_section.length; i++, m->pos++) {
+		if (blocks[m->pos].hash1 != 0 && blocks[m->pos].value != 0) {
+			rspamd_mmaped_file_set_block_common (pool, m->ctx, target,
+					blocks[m->pos].hash1, blocks[m->pos].hash2,
+					blocks[m->pos].value);
+		}
+	}
+
+	if (m->pos < file->cur_section.length) {
+		return FALSE;
+	}
+
+	header = (struct stat_file_header *)file->map;
+	nh = (struct stat_file_header *)target->map;
+	nh->revision = header->revision;
+	nh->rev_time = header->rev_time;
+	memcpy (nh->unused, header->unused, sizeof (header->unused));
+	nh->tokenizer_conf_len = header->tokenizer_conf_len;
+	msync (target->map, target->len, MS_SYNC);
+
+	/* Other processes keep using the old file until they notice new inode */
+	if (rename (m->tmp_name, file->filename) == -1) {
+		msg_err_pool ("cannot rename %s to %s: %s", m->tmp_name,
+				file->filename, strerror (errno));
+	}
+	else {
+		old_len = file->len;
+		m->target = NULL;
+		rspamd_mmaped_file_swap (file, target);
+		msg_info_pool ("statfile %s has been resized from %Hz to %Hz",
+				file->filename, old_len, file->len);
+	}
+
+	rspamd_mmaped_file_migration_free (m);
+
+	return TRUE;
+}
+
+static void
+rspamd_mmaped_file_migration_cb (gint fd, short what, gpointer ud)
+{
+	struct rspamd_mmaped_migration *m = ud;
+	struct timeval tv = {0, 0};
+
+	if (!rspamd_mmaped_file_migration_step (m)) {
+		/* Let other events to be processed before the next batch */
+		evtimer_add (&m->ev, &tv);
+	}
+}
+
+/*
+ * Starts growing of a statfile if it is too full and `max_size` allows it.
+ * Blocks are copied incrementally from the event loop, and learned tokens
+ * are written to both files until the switch
+ */
+static void
+rspamd_mmaped_file_maybe_resize (rspamd_mmaped_file_ctx *statfile_pool,
+		rspamd_mmaped_file_t *file,
+		struct event_base *ev_base)
+{
+	struct stat_file_header *header;
+	struct rspamd_mmaped_migration *m;
+	rspamd_mmaped_file_t *nfile;
+	rspamd_mempool_t *pool = statfile_pool->pool;
+	struct timeval tv = {0, 0};
+	struct stat st;
+	gint lock_fd;
+	gsize new_size;
+
+	if (file->combined || file->map == NULL || file->migration != NULL ||
+			file->max_size <= file->len) {
+		return;
+	}
+
+	header = (struct stat_file_header *)file->map;
+
+	if (header->used_blocks < file->cur_section.length * STATFILE_RESIZE_LOAD &&
+			file->expired == 0) {
+		return;
+	}
+
+	lock_fd = rspamd_mmaped_file_lock_exclusive (pool, file->filename, FALSE);
+
+	if (lock_fd == -1) {
+		/* Statfile is being resized by another process */
+		return;
+	}
+
+	/*
+	 * Another process might have finished resizing before we took the lock,
+	 * so our mapping is stale and must be replaced rather than resized again
+	 */
+	if (stat (file->filename, &st) == -1 || st.st_ino != file->inode) {
+		nfile = rspamd_mmaped_file_map (statfile_pool, file->filename,
+				file->cf);
+
+		if (nfile != NULL) {
+			msg_info_pool ("statfile %s has been resized by another process, "
+					"switch to the new file of size %Hz", file->filename,
+					nfile->len);
+			rspamd_mmaped_file_swap (file, nfile);
+		}
+
+		rspamd_file_unlock (lock_fd, FALSE);
+		close (lock_fd);
+
+		return;
+	}
+
+	new_size = MIN (file->len * 2, file->max_size);
+
+	m = g_slice_alloc0 (sizeof (*m));
+	m->ctx = statfile_pool;
+	m->file = file;
+	m->lock_fd = lock_fd;
+	m->tmp_name = g_strconcat (file->filename, ".new", NULL);
+	file->migration = m;
+
+	/* Nobody holds the lock, so this file is left by an interrupted resize */
+	if (unlink (m->tmp_name) == 0) {
+		msg_warn_pool ("removed stale %s left by an interrupted resize",
+				m->tmp_name);
+	}
+
+	if (rspamd_mmaped_file_create (NULL, m->tmp_name, new_size, file->cf,
+			pool) == -1 ||
+			(m->target = rspamd_mmaped_file_map (statfile_pool, m->tmp_name,
+					file->cf)) == NULL) {
+		msg_err_pool ("cannot create %s to resize statfile", m->tmp_name);
+		rspamd_mmaped_file_migration_free (m);
+
+		return;
+	}
+
+	msg_info_pool ("statfile %s has %uL of %uL blocks used and %uL blocks "
+			"expired, resizing from %Hz to %Hz", file->filename,
+			header->used_blocks, file->cur_section.length, file->expired,
+			file->len, new_size);
+
+	if (ev_base != NULL) {
+		m->ev_base = ev_base;
+		evtimer_set (&m->ev, rspamd_mmaped_file_migration_cb, m);
+		event_base_set (ev_base, &m->ev);
+		evtimer_add (&m->ev, &tv);
+	}
+	else {
+		while (!rspamd_mmaped_file_migration_step (m));
+	}
+}
+
+/*
+ * Switches to a statfile that has been replaced by another process
+ */
+static void
+rspamd_mmaped_file_check_reload (rspamd_mmaped_file_ctx *statfile_pool,
+		rspamd_mmaped_file_t *file)
+{
+	rspamd_mmaped_file_t *nfile;
+	rspamd_mempool_t *pool = statfile_pool->pool;
+	struct stat st;
+	gdouble now;
+
+	if (file->combined || file->migration != NULL) {
+		return;
+	}
+
+	now = rspamd_get_ticks ();
+
+	if (now - file->last_check < STATFILE_RELOAD_CHECK_INTERVAL) {
+		return;
+	}
+
+	file->last_check = now;
+
+	if (stat (file->filename, &st) == -1 || st.st_ino == file->inode) {
+		return;
+	}
+
+	nfile = rspamd_mmaped_file_map (statfile_pool, file->filename, file->cf);
+
+	if (nfile != NULL) {
+		msg_info_pool ("statfile %s has been replaced, switch to the new "
+				"file of size %Hz", file->filename, nfile->len);
+		rspamd_mmaped_file_swap (file, nfile);
+	}
+}
+
 gpointer
 rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 {
@@ -854,6 +1941,7 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 	new->lock = rspamd_mempool_get_mutex (new->pool);
 	new->mlock_ok = cfg->mlock_statfile_pool;
 	new->files = g_hash_table_new (g_direct_hash, g_direct_equal);
+	new->combined = g_hash_table_new (rspamd_str_hash, rspamd_str_equal);
 
 	/* Iterate over all classifiers and load matching statfiles */
 	cur = cfg->classifiers;
@@ -873,6 +1961,14 @@ rspamd_mmaped_file_init (struct rspamd_stat_ctx *ctx, struct rspamd_config *cfg)
 		if (strcmp (clf->backend, MMAPED_BACKEND_TYPE) == 0) {
 			while (curst) {
 				stf = curst->data;
+
+				if (rspamd_mmaped_file_combined_path (clf, NULL) != NULL) {
+					rspamd_mmaped_file_open_combined (new, stf, FALSE);
+					ctx->statfiles ++;
+					curst = curst->next;
+					continue;
+				}
+
 				/*
 				 * Check configuration sanity
 				 */
@@ -933,6 +2029,7 @@ rspamd_mmaped_file_close (gpointer p)
 	}
 
 	g_hash_table_unref (ctx->files);
+	g_hash_table_unref (ctx->combined);
 	rspamd_mempool_unlock_mutex (ctx->lock);
 	/* XXX: we don't delete pool here to avoid deadlocks */
 }
@@ -953,7 +2050,13 @@ rspamd_mmaped_file_runtime (struct rspamd_task *task,
 
 	mf = rspamd_mmaped_file_is_open (ctx, stcf);
 
-	if (mf == NULL) {
+	if (mf != NULL) {
+		rspamd_mmaped_file_check_reload (ctx, mf);
+	}
+	else if (rspamd_mmaped_file_combined_path (stcf->clcf, NULL)) {
+		mf = rspamd_mmaped_file_open_combined (ctx, stcf, learn);
+	}
+	else if (mf == NULL) {
 		/* Create file here */
 
 		filenameo = ucl_object_find_key (stcf->opts, "filename");
@@ -1116,9 +2219,19 @@ rspamd_mmaped_file_get_stat (gpointer runtime,
 				rspamd_mmaped_file_get_total (mf)), "total",  0, false);
 		ucl_object_insert_key (res, ucl_object_fromint (
 				rspamd_mmaped_file_get_used (mf)), "used", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromdouble (
+				(gdouble)rspamd_mmaped_file_get_used (mf) /
+				MAX (rspamd_mmaped_file_get_total (mf), 1)), "load", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromint (mf->expired),
+				"expired", 0, false);
+		ucl_object_insert_key (res, ucl_object_fromint (mf->max_chain),
+				"max_chain", 0, false);
+		ucl_object_insert_key (res, ucl_object_frombool (mf->migration != NULL),
+				"resizing", 0, false);
 		ucl_object_insert_key (res, ucl_object_fromstring (mf->cf->symbol),
 				"symbol", 0, false);
-		ucl_object_insert_key (res, ucl_object_fromstring ("mmap"),
+		ucl_object_insert_key (res, ucl_object_fromstring (
+				mf->combined ? "mmap-combined" : "mmap"),
 				"type", 0, false);
 		ucl_object_insert_key (res, ucl_object_fromint (0),
 				"languages", 0, false);
@@ -1140,8 +2253,12 @@ rspamd_mmaped_file_finalize_learn (struct rspamd_task *task, gpointer runtime,
 {
 	rspamd_mmaped_file_t *mf = (rspamd_mmaped_file_t *)runtime;
 
-	if (mf != NULL) {
+	if (mf != NULL && mf->combined) {
+		msync (mf->combined->map, mf->combined->len, MS_INVALIDATE | MS_ASYNC);
+	}
+	else if (mf != NULL) {
 		msync (mf->map, mf->len, MS_INVALIDATE | MS_ASYNC);
+		rspamd_mmaped_file_maybe_resize (ctx, mf, task->ev_base);
 	}
 }
 
@@ -1151,14 +2268,49 @@ rspamd_mmaped_file_finalize_process (struct rspamd_task *task, gpointer runtime,
 {
 }
 
+void
+rspamd_mmaped_file_prefetch_token (struct rspamd_task *task, rspamd_token_t *tok,
+		gpointer runtime,
+		gpointer ctx)
+{
+	rspamd_mmaped_file_t *mf = (rspamd_mmaped_file_t *)runtime;
+	guint32 h1;
+
+	if (mf == NULL || tok->datalen < sizeof (guint32) * 2) {
+		return;
+	}
+
+	memcpy (&h1, tok->data, sizeof (h1));
+
+	if (mf->combined) {
+		STATFILE_PREFETCH (&mf->combined->buckets[h1 % mf->combined->nbuckets]);
+	}
+	else if (mf->map) {
+		STATFILE_PREFETCH ((u_char *)mf->map + mf->seek_pos +
+				(h1 % mf->cur_section.length) * sizeof (struct stat_file_block));
+	}
+}
+
 gpointer
 rspamd_mmaped_file_load_tokenizer_config (gpointer runtime,
 		gsize *len)
 {
 	rspamd_mmaped_file_t *mf = runtime;
 	struct stat_file_header *header;
+	struct stat_file_combined_header *cheader;
 
 	g_assert (mf != NULL);
+
+	if (mf->combined) {
+		cheader = mf->combined->map;
+
+		if (len) {
+			*len = cheader->tokenizer_conf_len;
+		}
+
+		return cheader->tokenizer_conf;
+	}
+
 	header = mf->map;
 
 	if (len) {
@@ -25,6 +25,7 @@
 #include "rspamd.h"
 #include "stat_internal.h"
 #include "upstream.h"
+#include "redis_pool.h"
 
 #ifdef WITH_HIREDIS
 #include "hiredis/hiredis.h"
@@ -54,6 +55,7 @@ struct redis_stat_runtime {
 	struct upstream *selected;
 	GArray *results;
 	gchar *redis_object_expanded;
+	struct rspamd_redis_pool *pool;
 	redisAsyncContext *redis;
 };
 
@@ -70,7 +72,7 @@ rspamd_redis_fin (gpointer data)
 {
 	struct redis_stat_runtime *rt = REDIS_RUNTIME (data);
 
-	redisAsyncFree (rt->redis);
+	rspamd_redis_pool_release_connection (rt->pool, rt->redis, FALSE);
 }
 
 /*
@@ -421,13 +423,22 @@ rspamd_redis_runtime (struct rspamd_task *task,
 	rt->selected = up;
 	rt->task = task;
 
+	rt->pool = task->cfg->redis_pool;
+
 	addr = rspamd_upstream_addr (up);
 	g_assert (addr != NULL);
-	rt->redis = redisAsyncConnect (rspamd_inet_address_to_string (addr),
+	rt->redis = rspamd_redis_pool_connect (rt->pool, task->ev_base,
+			rspamd_inet_address_to_string (addr),
 			rspamd_inet_address_get_port (addr));
-	g_assert (rt->redis != NULL);
 
-	redisLibeventAttach (rt->redis, task->ev_base);
+	if (rt->redis == NULL) {
+		msg_err ("cannot connect to redis server %s",
+				rspamd_upstream_name (up));
+		rspamd_upstream_fail (up);
+
+		return NULL;
+	}
+
 	rspamd_session_add_event (task->s, rspamd_redis_fin, rt,
 			rspamd_redis_stat_quark ());
 
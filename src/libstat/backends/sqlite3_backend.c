@@ -813,6 +813,13 @@ rspamd_sqlite3_finalize_process (struct rspamd_task *task, gpointer runtime,
 	return;
 }
 
+void
+rspamd_sqlite3_prefetch_token (struct rspamd_task *task,
+		struct token_node_s *tok, gpointer runtime, gpointer ctx)
+{
+	/* Tokens are fetched by sqlite itself */
+}
+
 gboolean
 rspamd_sqlite3_learn_token (struct rspamd_task *task, struct token_node_s *tok,
 		struct rspamd_token_result *res, gpointer p)
@@ -65,6 +65,7 @@ static struct rspamd_stat_tokenizer stat_tokenizers[] = {
 		.runtime = rspamd_##eltn##_runtime, \
 		.process_token = rspamd_##eltn##_process_token, \
 		.finalize_process = rspamd_##eltn##_finalize_process, \
+		.prefetch_token = rspamd_##eltn##_prefetch_token, \
 		.learn_token = rspamd_##eltn##_learn_token, \
 		.finalize_learn = rspamd_##eltn##_finalize_learn, \
 		.total_learns = rspamd_##eltn##_total_learns, \
@@ -34,6 +34,8 @@
 #define RSPAMD_CLASSIFY_OP 0
 #define RSPAMD_LEARN_OP 1
 #define RSPAMD_UNLEARN_OP 2
+/* How many tokens ahead backends are asked to prefetch */
+#define RSPAMD_STAT_PREFETCH_DISTANCE 8
 
 static const gint similarity_treshold = 80;
 
@@ -345,6 +347,70 @@ preprocess_init_stat_token (gpointer k, gpointer v, gpointer d)
 	return FALSE;
 }
 
+static gboolean
+preprocess_collect_token (gpointer k, gpointer v, gpointer d)
+{
+	g_ptr_array_add ((GPtrArray *)d, v);
+
+	return FALSE;
+}
+
+static void
+preprocess_prefetch_token (struct preprocess_cb_data *cbdata,
+		rspamd_token_t *t)
+{
+	struct rspamd_classifier_runtime *cl_runtime;
+	struct rspamd_statfile_runtime *st_runtime;
+	GList *cur, *curst;
+
+	for (cur = cbdata->classifier_runtimes; cur != NULL; cur = g_list_next (cur)) {
+		cl_runtime = (struct rspamd_classifier_runtime *)cur->data;
+
+		if (cl_runtime->skipped) {
+			continue;
+		}
+
+		for (curst = cl_runtime->st_runtime; curst != NULL;
+				curst = g_list_next (curst)) {
+			st_runtime = (struct rspamd_statfile_runtime *)curst->data;
+			cl_runtime->backend->prefetch_token (cbdata->task, t,
+					st_runtime->backend_runtime, cl_runtime->backend->ctx);
+		}
+	}
+}
+
+/*
+ * Process tokens in the same order as in the tree, but ask backends to
+ * prefetch data for the following tokens to hide memory latency
+ */
+static void
+preprocess_init_stat_tokens (struct preprocess_cb_data *cbdata)
+{
+	GPtrArray *tokens;
+	guint i;
+
+	tokens = g_ptr_array_sized_new (g_tree_nnodes (cbdata->tok->tokens));
+	g_tree_foreach (cbdata->tok->tokens, preprocess_collect_token, tokens);
+
+	for (i = 0; i < MIN (tokens->len, RSPAMD_STAT_PREFETCH_DISTANCE); i ++) {
+		preprocess_prefetch_token (cbdata, g_ptr_array_index (tokens, i));
+	}
+
+	for (i = 0; i < tokens->len; i ++) {
+		if (i + RSPAMD_STAT_PREFETCH_DISTANCE < tokens->len) {
+			preprocess_prefetch_token (cbdata, g_ptr_array_index (tokens,
+					i + RSPAMD_STAT_PREFETCH_DISTANCE));
+		}
+
+		if (preprocess_init_stat_token (NULL, g_ptr_array_index (tokens, i),
+				cbdata)) {
+			break;
+		}
+	}
+
+	g_ptr_array_free (tokens, TRUE);
+}
+
 static GList*
 rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 		struct rspamd_task *task,
@@ -529,8 +595,7 @@ rspamd_stat_preprocess (struct rspamd_stat_ctx *st_ctx,
 			cbdata.classifier_runtimes = cl_runtimes;
 			cbdata.task = task;
 			cbdata.tok = cl_runtime->tok;
-			g_tree_foreach (cbdata.tok->tokens, preprocess_init_stat_token,
-					&cbdata);
+			preprocess_init_stat_tokens (&cbdata);
 
 			cur = g_list_next (cur);
 		}
@@ -811,7 +876,8 @@ rspamd_stat_learn (struct rspamd_task *task,
 				" for any classifier defined");
 	}
 	else {
-		g_atomic_int_inc (&task->worker->srv->stat->messages_learned);
+		rspamd_counters_inc (task->worker->srv->counters,
+				RSPAMD_COUNTER_LEARNED);
 	}
 
 	return ret;
@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "counters.h"
+#include "mem_pool.h"
+#include "logger.h"
+
+/* Slots are aligned to cache lines to avoid false sharing */
+#define COUNTERS_LINE_CELLS (64 / sizeof (guint64))
+#define COUNTERS_HIST_SUB_BITS 3
+#define COUNTERS_HIST_SUB RSPAMD_COUNTERS_HIST_SUB_BUCKETS
+#define COUNTERS_HIST_MAX_BITS 32
+/* Buckets and the sum of values */
+#define COUNTERS_HIST_CELLS (RSPAMD_COUNTERS_HIST_BUCKETS + 1)
+/* Reserved cells when nothing is specified: new symbols added by reloads */
+#define COUNTERS_DEFAULT_RESERVE (COUNTERS_HIST_CELLS * 16)
+
+struct rspamd_counter_elt {
+	gchar *name;
+	enum rspamd_counter_type type;
+	gsize offset;
+};
+
+struct rspamd_counters {
+	rspamd_mempool_t *pool;
+	GPtrArray *elts;
+	GHashTable *names;
+	/* Placed in shared memory */
+	guint64 *slots;
+	/* Slot of the current process */
+	guint64 *cur;
+	gsize slot_cells;
+	gsize used_cells;
+	guint nslots;
+	/* Used by the main process to distribute slots */
+	gboolean *slots_busy;
+};
+
+static inline guint
+rspamd_counters_msb (guint64 v)
+{
+#ifdef __GNUC__
+	return 63 - __builtin_clzll (v);
+#else
+	guint r = 0;
+
+	while (v >>= 1) {
+		r ++;
+	}
+
+	return r;
+#endif
+}
+
+static inline guint
+rspamd_counters_hist_bucket (guint64 v)
+{
+	guint e;
+
+	if (v >= (G_GUINT64_CONSTANT (1) << COUNTERS_HIST_MAX_BITS)) {
+		v = (G_GUINT64_CONSTANT (1) << COUNTERS_HIST_MAX_BITS) - 1;
+	}
+
+	if (v < COUNTERS_HIST_SUB) {
+		return v;
+	}
+
+	e = rspamd_counters_msb (v);
+
+	return (e - COUNTERS_HIST_SUB_BITS + 1) * COUNTERS_HIST_SUB +
+			((v >> (e - COUNTERS_HIST_SUB_BITS)) & (COUNTERS_HIST_SUB - 1));
+}
+
+static inline guint64
+rspamd_counters_hist_bucket_min (guint bucket)
+{
+	guint e, m;
+
+	if (bucket < COUNTERS_HIST_SUB) {
+		return bucket;
+	}
+
+	e = bucket / COUNTERS_HIST_SUB + COUNTERS_HIST_SUB_BITS - 1;
+	m = bucket % COUNTERS_HIST_SUB;
+
+	return (guint64)(COUNTERS_HIST_SUB + m) << (e - COUNTERS_HIST_SUB_BITS);
+}
+
+guint64
+rspamd_counters_hist_bucket_max (guint bucket)
+{
+	guint e;
+
+	g_assert (bucket < RSPAMD_COUNTERS_HIST_BUCKETS);
+
+	if (bucket < COUNTERS_HIST_SUB) {
+		return bucket;
+	}
+
+	e = bucket / COUNTERS_HIST_SUB + COUNTERS_HIST_SUB_BITS - 1;
+
+	return rspamd_counters_hist_bucket_min (bucket) +
+			(G_GUINT64_CONSTANT (1) << (e - COUNTERS_HIST_SUB_BITS)) - 1;
+}
+
+static inline void
+rspamd_counters_cell_add (struct rspamd_counters *reg, guint64 *cell,
+		guint64 value)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	if (reg->cur == reg->slots) {
+		/* Slot 0 can be shared by several processes */
+		__atomic_fetch_add (cell, value, __ATOMIC_RELAXED);
+	}
+	else {
+		/* Own slot has a single writer, readers must not see torn values */
+		__atomic_store_n (cell, *cell + value, __ATOMIC_RELAXED);
+	}
+#else
+	*cell += value;
+#endif
+}
+
+static inline guint64
+rspamd_counters_cell_get (guint64 *cell)
+{
+#ifdef HAVE_ATOMIC_BUILTINS
+	return __atomic_load_n (cell, __ATOMIC_RELAXED);
+#else
+	return *cell;
+#endif
+}
+
+static inline guint64 *
+rspamd_counters_slot (struct rspamd_counters *reg, guint slot)
+{
+	return reg->slots + (gsize)slot * reg->slot_cells;
+}
+
+static inline struct rspamd_counter_elt *
+rspamd_counters_elt (struct rspamd_counters *reg, gint id)
+{
+	g_assert (id >= 0 && id < (gint)reg->elts->len);
+
+	return g_ptr_array_index (reg->elts, id);
+}
+
+struct rspamd_counters *
+rspamd_counters_new (void)
+{
+	struct rspamd_counters *reg;
+
+	reg = g_slice_alloc0 (sizeof (*reg));
+	reg->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "counters");
+	reg->elts = g_ptr_array_new ();
+	reg->names = g_hash_table_new (g_str_hash, g_str_equal);
+
+	return reg;
+}
+
+gint
+rspamd_counters_register (struct rspamd_counters *reg,
+		const gchar *name, enum rspamd_counter_type type)
+{
+	struct rspamd_counter_elt *elt;
+	gsize ncells;
+	gpointer p;
+
+	g_assert (reg != NULL);
+	g_assert (name != NULL);
+
+	if ((p = g_hash_table_lookup (reg->names, name)) != NULL) {
+		elt = rspamd_counters_elt (reg, GPOINTER_TO_INT (p) - 1);
+
+		if (elt->type != type) {
+			msg_err ("counter %s is already registered with another type",
+					name);
+			return -1;
+		}
+
+		return GPOINTER_TO_INT (p) - 1;
+	}
+
+	ncells = type == RSPAMD_COUNTER_TYPE_HISTOGRAM ? COUNTERS_HIST_CELLS : 1;
+
+	if (reg->slots != NULL && reg->used_cells + ncells > reg->slot_cells) {
+		msg_err ("cannot register counter %s: no space left", name);
+		return -1;
+	}
+
+	elt = rspamd_mempool_alloc (reg->pool, sizeof (*elt));
+	elt->name = rspamd_mempool_strdup (reg->pool, name);
+	elt->type = type;
+	elt->offset = reg->used_cells;
+	reg->used_cells += ncells;
+	g_ptr_array_add (reg->elts, elt);
+	g_hash_table_insert (reg->names, elt->name,
+			GINT_TO_POINTER (reg->elts->len));
+
+	return reg->elts->len - 1;
+}
+
+gint
+rspamd_counters_find (struct rspamd_counters *reg, const gchar *name)
+{
+	gpointer p;
+
+	g_assert (reg != NULL);
+
+	if ((p = g_hash_table_lookup (reg->names, name)) != NULL) {
+		return GPOINTER_TO_INT (p) - 1;
+	}
+
+	return -1;
+}
+
+gboolean
+rspamd_counters_map (struct rspamd_counters *reg, guint nslots,
+		gsize reserve)
+{
+	guchar *map;
+
+	g_assert (reg != NULL);
+	g_assert (nslots > 0);
+
+	if (reg->slots != NULL) {
+		return FALSE;
+	}
+
+	if (reserve == 0) {
+		reserve = COUNTERS_DEFAULT_RESERVE;
+	}
+
+	reg->slot_cells = reg->used_cells + reserve;
+	/* Round slot size up to the cache line */
+	reg->slot_cells = (reg->slot_cells + COUNTERS_LINE_CELLS - 1) /
+			COUNTERS_LINE_CELLS * COUNTERS_LINE_CELLS;
+
+	if (reg->slot_cells == 0) {
+		reg->slot_cells = COUNTERS_LINE_CELLS;
+	}
+
+	/*
+	 * Shared chunks are mapped from /dev/zero, so they are already zeroed and
+	 * pages of unused slots are not touched until some process writes there
+	 */
+	map = rspamd_mempool_alloc_shared (reg->pool,
+			reg->slot_cells * nslots * sizeof (guint64) + 64);
+
+	if (map == NULL) {
+		return FALSE;
+	}
+
+	/* Align the first slot to the cache line */
+	reg->slots = (guint64 *)(((guintptr)map + 63) & ~(guintptr)63);
+	reg->nslots = nslots;
+	reg->cur = reg->slots;
+	reg->slots_busy = rspamd_mempool_alloc0 (reg->pool,
+			sizeof (gboolean) * nslots);
+
+	return TRUE;
+}
+
+guint
+rspamd_counters_acquire_slot (struct rspamd_counters *reg)
+{
+	guint i;
+
+	if (reg == NULL || reg->slots == NULL) {
+		return 0;
+	}
+
+	for (i = 1; i < reg->nslots; i ++) {
+		if (!reg->slots_busy[i]) {
+			reg->slots_busy[i] = TRUE;
+
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+void
+rspamd_counters_release_slot (struct rspamd_counters *reg, guint slot)
+{
+	if (reg != NULL && reg->slots != NULL && slot < reg->nslots) {
+		reg->slots_busy[slot] = FALSE;
+	}
+}
+
+void
+rspamd_counters_use_slot (struct rspamd_counters *reg, guint slot)
+{
+	if (reg != NULL && reg->slots != NULL) {
+		g_assert (slot < reg->nslots);
+		reg->cur = rspamd_counters_slot (reg, slot);
+	}
+}
+
+void
+rspamd_counters_add (struct rspamd_counters *reg, gint id, guint64 value)
+{
+	struct rspamd_counter_elt *elt;
+
+	if (reg == NULL || reg->slots == NULL || id < 0) {
+		return;
+	}
+
+	elt = rspamd_counters_elt (reg, id);
+	rspamd_counters_cell_add (reg, &reg->cur[elt->offset], value);
+}
+
+void
+rspamd_counters_hist_add (struct rspamd_counters *reg, gint id,
+		guint64 value)
+{
+	struct rspamd_counter_elt *elt;
+	guint64 *cells;
+
+	if (reg == NULL || reg->slots == NULL || id < 0) {
+		return;
+	}
+
+	elt = rspamd_counters_elt (reg, id);
+	g_assert (elt->type == RSPAMD_COUNTER_TYPE_HISTOGRAM);
+	cells = &reg->cur[elt->offset];
+	rspamd_counters_cell_add (reg, &cells[rspamd_counters_hist_bucket (value)], 1);
+	rspamd_counters_cell_add (reg, &cells[RSPAMD_COUNTERS_HIST_BUCKETS], value);
+}
+
+guint64
+rspamd_counters_get (struct rspamd_counters *reg, gint id)
+{
+	struct rspamd_counter_elt *elt;
+	guint64 res = 0;
+	guint i;
+
+	if (reg == NULL || reg->slots == NULL || id < 0) {
+		return 0;
+	}
+
+	elt = rspamd_counters_elt (reg, id);
+
+	for (i = 0; i < reg->nslots; i ++) {
+		res += rspamd_counters_cell_get (
+				&rspamd_counters_slot (reg, i)[elt->offset]);
+	}
+
+	return res;
+}
+
+guint64
+rspamd_counters_hist_get (struct rspamd_counters *reg, gint id,
+		guint64 *buckets, guint64 *sum)
+{
+	struct rspamd_counter_elt *elt;
+	guint64 *cells, count = 0, total = 0, v;
+	guint i, j;
+
+	memset (buckets, 0, sizeof (*buckets) * RSPAMD_COUNTERS_HIST_BUCKETS);
+
+	if (reg != NULL && reg->slots != NULL && id >= 0) {
+		elt = rspamd_counters_elt (reg, id);
+		g_assert (elt->type == RSPAMD_COUNTER_TYPE_HISTOGRAM);
+
+		for (i = 0; i < reg->nslots; i ++) {
+			cells = &rspamd_counters_slot (reg, i)[elt->offset];
+
+			for (j = 0; j < RSPAMD_COUNTERS_HIST_BUCKETS; j ++) {
+				v = rspamd_counters_cell_get (&cells[j]);
+				buckets[j] += v;
+				count += v;
+			}
+
+			total += rspamd_counters_cell_get (
+					&cells[RSPAMD_COUNTERS_HIST_BUCKETS]);
+		}
+	}
+
+	if (sum) {
+		*sum = total;
+	}
+
+	return count;
+}
+
+void
+rspamd_counters_reset (struct rspamd_counters *reg, gint id)
+{
+	struct rspamd_counter_elt *elt;
+	guint64 *cells;
+	gsize ncells, j;
+	guint i;
+
+	if (reg == NULL || reg->slots == NULL || id < 0) {
+		return;
+	}
+
+	elt = rspamd_counters_elt (reg, id);
+	ncells = elt->type == RSPAMD_COUNTER_TYPE_HISTOGRAM ?
+			COUNTERS_HIST_CELLS : 1;
+
+	for (i = 0; i < reg->nslots; i ++) {
+		cells = &rspamd_counters_slot (reg, i)[elt->offset];
+
+		for (j = 0; j < ncells; j ++) {
+#ifdef HAVE_ATOMIC_BUILTINS
+			__atomic_store_n (&cells[j], 0, __ATOMIC_RELAXED);
+#else
+			cells[j] = 0;
+#endif
+		}
+	}
+}
+
+gdouble
+rspamd_counters_hist_quantile (const guint64 *buckets, guint64 count,
+		gdouble q)
+{
+	guint64 rank, acc = 0;
+	guint i;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	rank = (guint64)(q * count + 0.5);
+
+	if (rank == 0) {
+		rank = 1;
+	}
+	else if (rank > count) {
+		rank = count;
+	}
+
+	for (i = 0; i < RSPAMD_COUNTERS_HIST_BUCKETS; i ++) {
+		acc += buckets[i];
+
+		if (acc >= rank) {
+			/* Middle of the bucket has the minimal error */
+			return (rspamd_counters_hist_bucket_min (i) +
+					rspamd_counters_hist_bucket_max (i)) / 2.0;
+		}
+	}
+
+	return rspamd_counters_hist_bucket_max (RSPAMD_COUNTERS_HIST_BUCKETS - 1);
+}
+
+guint
+rspamd_counters_count (struct rspamd_counters *reg)
+{
+	g_assert (reg != NULL);
+
+	return reg->elts->len;
+}
+
+const gchar *
+rspamd_counters_name (struct rspamd_counters *reg, gint id)
+{
+	g_assert (reg != NULL);
+
+	return rspamd_counters_elt (reg, id)->name;
+}
+
+enum rspamd_counter_type
+rspamd_counters_type (struct rspamd_counters *reg, gint id)
+{
+	g_assert (reg != NULL);
+
+	return rspamd_counters_elt (reg, id)->type;
+}
+
+void
+rspamd_counters_destroy (struct rspamd_counters *reg)
+{
+	if (reg) {
+		g_hash_table_unref (reg->names);
+		g_ptr_array_free (reg->elts, TRUE);
+		rspamd_mempool_delete (reg->pool);
+		g_slice_free1 (sizeof (*reg), reg);
+	}
+}
@@ -0,0 +1,180 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SRC_LIBUTIL_COUNTERS_H_
+#define SRC_LIBUTIL_COUNTERS_H_
+
+#include "config.h"
+
+/**
+ * @file counters.h
+ * Registry of counters and latency histograms placed in shared memory. Each
+ * process writes to its own slot that is aligned to a cache line, so there are
+ * neither lost updates nor false sharing between workers. Readers sum values
+ * over all slots directly from shared memory.
+ *
+ * Elements must be registered and the registry must be mapped by the main
+ * process before workers are forked.
+ */
+
+/**
+ * Histograms have log-linear buckets: 8 buckets per power of two, so a value
+ * is stored with relative error less than 12.5%. Values larger than 2^32 are
+ * stored in the last bucket
+ */
+#define RSPAMD_COUNTERS_HIST_BUCKETS 240
+/** Number of buckets per power of two */
+#define RSPAMD_COUNTERS_HIST_SUB_BUCKETS 8
+
+enum rspamd_counter_type {
+	RSPAMD_COUNTER_TYPE_COUNTER = 0,
+	RSPAMD_COUNTER_TYPE_HISTOGRAM,
+};
+
+struct rspamd_counters;
+
+/**
+ * Creates new empty registry
+ * @return new registry
+ */
+struct rspamd_counters *rspamd_counters_new (void);
+
+/**
+ * Registers new element or returns an existing one with the same name and
+ * type. Elements registered after mapping use the reserved space, so they are
+ * visible merely for processes forked afterwards
+ * @param reg registry
+ * @param name name of element
+ * @param type type of element
+ * @return id of element or -1 if there is no space or types mismatch
+ */
+gint rspamd_counters_register (struct rspamd_counters *reg,
+		const gchar *name, enum rspamd_counter_type type);
+
+/**
+ * Finds element by name
+ * @return id of element or -1
+ */
+gint rspamd_counters_find (struct rspamd_counters *reg, const gchar *name);
+
+/**
+ * Allocates slots in shared memory
+ * @param reg registry
+ * @param nslots number of slots, slot 0 is shared by processes that have no
+ * own slot
+ * @param reserve number of 64 bit cells reserved for future registrations,
+ * 0 selects the default reserve of 16 histograms
+ * @return TRUE if slots have been allocated
+ */
+gboolean rspamd_counters_map (struct rspamd_counters *reg, guint nslots,
+		gsize reserve);
+
+/**
+ * Picks a slot for a new process, should be called by the main process
+ * @return number of slot, 0 if there are no free slots
+ */
+guint rspamd_counters_acquire_slot (struct rspamd_counters *reg);
+
+/**
+ * Returns slot of a dead process. Values are preserved, so they are added
+ * by the next process that uses this slot
+ */
+void rspamd_counters_release_slot (struct rspamd_counters *reg, guint slot);
+
+/**
+ * Sets slot that is used by the current process
+ */
+void rspamd_counters_use_slot (struct rspamd_counters *reg, guint slot);
+
+/**
+ * Adds value to a counter, does nothing if registry is NULL
+ */
+void rspamd_counters_add (struct rspamd_counters *reg, gint id, guint64 value);
+
+#define rspamd_counters_inc(reg, id) rspamd_counters_add ((reg), (id), 1)
+
+/**
+ * Adds value (e.g. latency in microseconds) to a histogram, does nothing if
+ * registry is NULL
+ */
+void rspamd_counters_hist_add (struct rspamd_counters *reg, gint id,
+		guint64 value);
+
+/**
+ * Returns sum of a counter over all slots
+ */
+guint64 rspamd_counters_get (struct rspamd_counters *reg, gint id);
+
+/**
+ * Merges a histogram over all slots
+ * @param reg registry
+ * @param id id of histogram
+ * @param buckets output array of RSPAMD_COUNTERS_HIST_BUCKETS elements
+ * @param sum output sum of all values (may be NULL)
+ * @return number of values in histogram
+ */
+guint64 rspamd_counters_hist_get (struct rspamd_counters *reg, gint id,
+		guint64 *buckets, guint64 *sum);
+
+/**
+ * Resets an element in all slots
+ */
+void rspamd_counters_reset (struct rspamd_counters *reg, gint id);
+
+/**
+ * Estimates quantile of a merged histogram
+ * @param buckets merged buckets
+ * @param count number of values in histogram
+ * @param q quantile in range [0, 1]
+ * @return value of quantile or 0 if histogram is empty
+ */
+gdouble rspamd_counters_hist_quantile (const guint64 *buckets, guint64 count,
+		gdouble q);
+
+/**
+ * Returns the largest value that belongs to a histogram bucket
+ */
+guint64 rspamd_counters_hist_bucket_max (guint bucket);
+
+/**
+ * Returns number of registered elements, ids are in range [0, count)
+ */
+guint rspamd_counters_count (struct rspamd_counters *reg);
+
+/**
+ * Returns name of element
+ */
+const gchar *rspamd_counters_name (struct rspamd_counters *reg, gint id);
+
+/**
+ * Returns type of element
+ */
+enum rspamd_counter_type rspamd_counters_type (struct rspamd_counters *reg,
+		gint id);
+
+/**
+ * Destroys registry
+ */
+void rspamd_counters_destroy (struct rspamd_counters *reg);
+
+#endif /* SRC_LIBUTIL_COUNTERS_H_ */
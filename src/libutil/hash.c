@@ -28,16 +28,25 @@
 
 /**
  * LRU hashing
+ *
+ * Elements are stored in a single open addressed array (linear probing) with
+ * hashes kept inline, so lookups do not allocate or touch any list nodes.
+ * Eviction uses CLOCK algorithm: each lookup sets a referenced flag and the
+ * clock hand evicts the first element that has not been referenced since
+ * the previous pass.
  */
 
+#define LRU_ELT_USED (1u << 0)
+#define LRU_ELT_REFERENCED (1u << 1)
+#define LRU_MIN_SIZE 16
+
 typedef struct rspamd_lru_element_s {
 	gpointer data;
 	gpointer key;
 	time_t store_time;
 	guint ttl;
-	rspamd_lru_hash_t *hash;
-	GList *link;
-
+	guint32 hv;
+	guint32 flags;
 } rspamd_lru_element_t;
 
 struct rspamd_lru_hash_s {
@@ -45,48 +54,140 @@ struct rspamd_lru_hash_s {
 	gint maxage;
 	GDestroyNotify value_destroy;
 	GDestroyNotify key_destroy;
+	GHashFunc hfunc;
+	GEqualFunc eqfunc;
 
-	GHashTable *tbl;
-	GQueue *exp; /* Elements are inserted to the tail and removed from the front */
+	rspamd_lru_element_t *elts;
+	guint32 mask; /* Number of slots - 1 */
+	guint32 nelts;
+	guint32 hand; /* Clock hand */
 };
 
+static inline gboolean
+rspamd_lru_hash_expired (rspamd_lru_hash_t *hash, rspamd_lru_element_t *elt,
+		time_t now)
+{
+	if (elt->ttl != 0 && now - elt->store_time > elt->ttl) {
+		return TRUE;
+	}
+
+	if (hash->maxage > 0 && now - elt->store_time > hash->maxage) {
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static rspamd_lru_element_t *
+rspamd_lru_hash_find (rspamd_lru_hash_t *hash, gconstpointer key, guint32 hv,
+		guint32 *pidx)
+{
+	rspamd_lru_element_t *elt;
+	guint32 i;
+
+	/* Load factor is always less than 0.5, so there is always a free slot */
+	for (i = hv & hash->mask; ; i = (i + 1) & hash->mask) {
+		elt = &hash->elts[i];
+
+		if (!(elt->flags & LRU_ELT_USED)) {
+			*pidx = i;
+			return NULL;
+		}
+
+		if (elt->hv == hv && hash->eqfunc (elt->key, key)) {
+			*pidx = i;
+			return elt;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Removes element using backward shift, so no tombstones are required
+ */
 static void
-rspamd_lru_destroy_node (gpointer value)
+rspamd_lru_hash_remove_at (rspamd_lru_hash_t *hash, guint32 i)
 {
-	rspamd_lru_element_t *elt = (rspamd_lru_element_t *)value;
+	rspamd_lru_element_t *elt = &hash->elts[i];
+	guint32 j, k;
+
+	if (hash->key_destroy) {
+		hash->key_destroy (elt->key);
+	}
+	if (hash->value_destroy) {
+		hash->value_destroy (elt->data);
+	}
+
+	for (j = i; ; ) {
+		j = (j + 1) & hash->mask;
 
-	if (elt) {
-		if (elt->hash && elt->hash->key_destroy) {
-			elt->hash->key_destroy (elt->key);
+		if (!(hash->elts[j].flags & LRU_ELT_USED)) {
+			break;
 		}
-		if (elt->hash && elt->hash->value_destroy) {
-			elt->hash->value_destroy (elt->data);
+
+		/* Ideal position of the element */
+		k = hash->elts[j].hv & hash->mask;
+
+		/* Move element if its ideal slot is not in cyclic range (i, j] */
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			hash->elts[i] = hash->elts[j];
+			i = j;
 		}
-		if (elt->hash && elt->link) {
-			g_queue_delete_link (elt->hash->exp, elt->link);
+	}
+
+	memset (&hash->elts[i], 0, sizeof (hash->elts[i]));
+	hash->nelts --;
+}
+
+static void
+rspamd_lru_hash_evict (rspamd_lru_hash_t *hash, time_t now)
+{
+	rspamd_lru_element_t *elt;
+
+	/* Terminates in at most two passes as the first one clears all flags */
+	for (;;) {
+		elt = &hash->elts[hash->hand];
+
+		if (elt->flags & LRU_ELT_USED) {
+			if (!(elt->flags & LRU_ELT_REFERENCED) ||
+					rspamd_lru_hash_expired (hash, elt, now)) {
+				rspamd_lru_hash_remove_at (hash, hash->hand);
+				return;
+			}
+
+			elt->flags &= ~LRU_ELT_REFERENCED;
 		}
 
-		g_slice_free1 (sizeof (*elt), elt);
+		hash->hand = (hash->hand + 1) & hash->mask;
 	}
 }
 
-static rspamd_lru_element_t *
-rspamd_lru_create_node (rspamd_lru_hash_t *hash,
-	gpointer key,
-	gpointer value,
-	time_t now,
-	guint ttl)
+static void
+rspamd_lru_hash_resize (rspamd_lru_hash_t *hash, guint32 nslots)
 {
-	rspamd_lru_element_t *node;
+	rspamd_lru_element_t *old = hash->elts, *elt;
+	guint32 i, idx, old_slots = hash->mask + 1;
 
-	node = g_slice_alloc (sizeof (rspamd_lru_element_t));
-	node->data = value;
-	node->key = key;
-	node->store_time = now;
-	node->ttl = ttl;
-	node->hash = hash;
+	hash->elts = g_malloc0 (sizeof (*elt) * nslots);
+	hash->mask = nslots - 1;
+	hash->hand = 0;
 
-	return node;
+	if (old != NULL) {
+		for (i = 0; i < old_slots; i ++) {
+			if (old[i].flags & LRU_ELT_USED) {
+				idx = old[i].hv & hash->mask;
+
+				while (hash->elts[idx].flags & LRU_ELT_USED) {
+					idx = (idx + 1) & hash->mask;
+				}
+
+				hash->elts[idx] = old[i];
+			}
+		}
+
+		g_free (old);
+	}
 }
 
 rspamd_lru_hash_t *
@@ -99,14 +200,24 @@ rspamd_lru_hash_new_full (
 	GEqualFunc cmpf)
 {
 	rspamd_lru_hash_t *new;
+	guint32 nslots = LRU_MIN_SIZE;
 
-	new = g_slice_alloc (sizeof (rspamd_lru_hash_t));
-	new->tbl = g_hash_table_new_full (hf, cmpf, NULL, rspamd_lru_destroy_node);
-	new->exp = g_queue_new ();
+	new = g_slice_alloc0 (sizeof (rspamd_lru_hash_t));
 	new->maxage = maxage;
 	new->maxsize = maxsize;
 	new->value_destroy = value_destroy;
 	new->key_destroy = key_destroy;
+	new->hfunc = hf;
+	new->eqfunc = cmpf;
+
+	if (maxsize > 0) {
+		/* Keep load factor below 0.5 */
+		while (nslots < (guint32)maxsize * 2 + 1) {
+			nslots <<= 1;
+		}
+	}
+
+	rspamd_lru_hash_resize (new, nslots);
 
 	return new;
 }
@@ -127,45 +238,22 @@ gpointer
 rspamd_lru_hash_lookup (rspamd_lru_hash_t *hash, gconstpointer key, time_t now)
 {
 	rspamd_lru_element_t *res;
-	GList *cur, *tmp;
+	guint32 idx;
+
+	res = rspamd_lru_hash_find (hash, key, hash->hfunc (key), &idx);
 
-	res = g_hash_table_lookup (hash->tbl, key);
 	if (res != NULL) {
-		if (res->ttl != 0) {
-			if (now - res->store_time > res->ttl) {
-				g_hash_table_remove (hash->tbl, key);
-				return NULL;
-			}
+		if (rspamd_lru_hash_expired (hash, res, now)) {
+			rspamd_lru_hash_remove_at (hash, idx);
+			return NULL;
 		}
-		if (hash->maxage > 0) {
-			if (now - res->store_time > hash->maxage) {
-				/* Expire elements from queue head */
-				cur = hash->exp->head;
-				while (cur) {
-					tmp = cur->next;
-					res = (rspamd_lru_element_t *)cur->data;
-
-					if (now - res->store_time > hash->maxage) {
-						/* That would also remove element from the queue */
-						g_hash_table_remove (hash->tbl, res->key);
-					}
-					else {
-						break;
-					}
-
-					cur = tmp;
-				}
 
-				return NULL;
-			}
-		}
-		else {
+		if (hash->maxage <= 0) {
 			res->store_time = now;
-			/* Reinsert element to the tail */
-			g_queue_unlink (hash->exp, res->link);
-			g_queue_push_tail_link (hash->exp, res->link);
 		}
 
+		res->flags |= LRU_ELT_REFERENCED;
+
 		return res->data;
 	}
 
@@ -177,57 +265,64 @@ rspamd_lru_hash_insert (rspamd_lru_hash_t *hash, gpointer key, gpointer value,
 	time_t now, guint ttl)
 {
 	rspamd_lru_element_t *res;
-	gint removed = 0;
-	GList *cur, *tmp;
+	guint32 idx, hv;
+
+	hv = hash->hfunc (key);
+	res = rspamd_lru_hash_find (hash, key, hv, &idx);
 
-	res = g_hash_table_lookup (hash->tbl, key);
 	if (res != NULL) {
-		g_hash_table_remove (hash->tbl, key);
+		rspamd_lru_hash_remove_at (hash, idx);
 	}
-	else {
-		if (hash->maxsize > 0 &&
-			(gint)g_hash_table_size (hash->tbl) >= hash->maxsize) {
-			/* Expire some elements */
-			if (hash->maxage > 0) {
-				cur = hash->exp->head;
-				while (cur) {
-					tmp = cur->next;
-					res = (rspamd_lru_element_t *)cur->data;
-
-					if (now - res->store_time > hash->maxage) {
-						/* That would also remove element from the queue */
-						g_hash_table_remove (hash->tbl, res->key);
-						removed ++;
-					}
-					else {
-						break;
-					}
-
-					cur = tmp;
-				}
-			}
-			if (removed == 0) {
-				/* Just unlink the element at the head */
-				res = (rspamd_lru_element_t *)hash->exp->head->data;
-				g_hash_table_remove (hash->tbl, res->key);
-			}
+	else if (hash->maxsize > 0) {
+		if (hash->nelts >= (guint32)hash->maxsize) {
+			rspamd_lru_hash_evict (hash, now);
 		}
 	}
+	else if ((hash->nelts + 1) * 2 > hash->mask + 1) {
+		rspamd_lru_hash_resize (hash, (hash->mask + 1) * 2);
+	}
 
-	res = rspamd_lru_create_node (hash, key, value, now, ttl);
-	g_hash_table_insert (hash->tbl, key, res);
-	g_queue_push_tail (hash->exp, res);
-	res->link = hash->exp->tail;
+	/* Slots might be shifted by removal, so find a free one again */
+	rspamd_lru_hash_find (hash, key, hv, &idx);
+	res = &hash->elts[idx];
+	res->key = key;
+	res->data = value;
+	res->store_time = now;
+	res->ttl = ttl;
+	res->hv = hv;
+	res->flags = LRU_ELT_USED;
+	hash->nelts ++;
 }
 
 void
 rspamd_lru_hash_destroy (rspamd_lru_hash_t *hash)
 {
-	g_hash_table_unref (hash->tbl);
-	g_queue_free (hash->exp);
+	rspamd_lru_element_t *elt;
+	guint32 i;
+
+	for (i = 0; i <= hash->mask; i ++) {
+		elt = &hash->elts[i];
+
+		if (elt->flags & LRU_ELT_USED) {
+			if (hash->key_destroy) {
+				hash->key_destroy (elt->key);
+			}
+			if (hash->value_destroy) {
+				hash->value_destroy (elt->data);
+			}
+		}
+	}
+
+	g_free (hash->elts);
 	g_slice_free1 (sizeof (rspamd_lru_hash_t), hash);
 }
 
+guint
+rspamd_lru_hash_size (rspamd_lru_hash_t *hash)
+{
+	return hash->nelts;
+}
+
 /*
  * vi:ts=4
  */
@@ -64,6 +64,13 @@ void rspamd_lru_hash_insert (rspamd_lru_hash_t *hash,
 	time_t now,
 	guint ttl);
 
+/**
+ * Returns number of elements stored in hash
+ * @param hash hash object
+ * @return number of elements
+ */
+guint rspamd_lru_hash_size (rspamd_lru_hash_t *hash);
+
 /**
  * Remove lru hash
  * @param hash hash object
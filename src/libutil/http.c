@@ -57,6 +57,13 @@ struct rspamd_http_connection_private {
 	guint outlen;
 	gsize wr_pos;
 	gsize wr_total;
+	gboolean keepalive;
+	/* Data of the pipelined requests read with the current one */
+	rspamd_fstring_t *pipelined;
+	/* Copy of a request sent over a reused socket to resend it once */
+	rspamd_fstring_t *retry_buf;
+	struct sockaddr_storage retry_addr;
+	socklen_t retry_addrlen;
 };
 
 enum http_magic_type {
@@ -775,6 +782,15 @@ rspamd_http_on_message_complete (http_parser * parser)
 
 	priv = conn->priv;
 
+	if (conn->type == RSPAMD_HTTP_SERVER &&
+			(conn->opts & RSPAMD_HTTP_SERVER_KEEP_ALIVE)) {
+		/* Body handler can reply immediately, so decide it before */
+		priv->keepalive = (priv->msg->method < HTTP_SYMBOLS &&
+				http_should_keep_alive (parser)) ? TRUE : FALSE;
+		/* Do not read pipelined requests until the reply is written */
+		event_del (&priv->ev);
+	}
+
 	if ((conn->opts & RSPAMD_HTTP_BODY_PARTIAL) == 0 && priv->encrypted) {
 		if (priv->local_key == NULL || priv->msg->peer_key == NULL ||
 				priv->msg->body->len < rspamd_cryptobox_nonce_bytes () +
@@ -815,15 +831,33 @@ rspamd_http_on_message_complete (http_parser * parser)
 			event_del (&priv->ev);
 		}
 
+		if (conn->type == RSPAMD_HTTP_CLIENT &&
+				(conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE)) {
+			/* Reply is complete, so we can reuse socket if server allows it */
+			priv->keepalive = http_should_keep_alive (parser) ? TRUE : FALSE;
+		}
+
 		rspamd_http_connection_ref (conn);
 		ret = conn->finish_handler (conn, priv->msg);
 		conn->finished = TRUE;
 		rspamd_http_connection_unref (conn);
+
+		if (ret == 0 && conn->type == RSPAMD_HTTP_SERVER &&
+				(conn->opts & RSPAMD_HTTP_SERVER_KEEP_ALIVE)) {
+			/*
+			 * Stop parsing here: the following requests are processed after
+			 * the reply to this one is written
+			 */
+			http_parser_pause (parser, 1);
+		}
 	}
 
 	return ret;
 }
 
+static gboolean rspamd_http_connection_retry (
+		struct rspamd_http_connection *conn);
+
 static void
 rspamd_http_simple_client_helper (struct rspamd_http_connection *conn)
 {
@@ -885,6 +919,11 @@ rspamd_http_write_helper (struct rspamd_http_connection *conn)
 #endif
 	r = sendmsg (conn->fd, &msg, flags);
 
+	if (r == -1 && (errno == EPIPE || errno == ECONNRESET) &&
+			rspamd_http_connection_retry (conn)) {
+		return;
+	}
+
 	if (r == -1) {
 		err =
 			g_error_new (HTTP_ERROR, errno, "IO write error: %s", strerror (
@@ -928,7 +967,9 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	struct rspamd_http_connection *conn = (struct rspamd_http_connection *)ud;
 	struct rspamd_http_connection_private *priv;
 	struct _rspamd_http_privbuf *pbuf;
-	rspamd_fstring_t *buf;
+	rspamd_fstring_t *buf, *pipelined = NULL;
+	const gchar *data;
+	gsize nparsed;
 	gssize r;
 	GError *err;
 
@@ -939,7 +980,34 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 	buf = priv->buf->data;
 
 	if (what == EV_READ) {
-		r = read (fd, buf->str, buf->allocated);
+		if (priv->pipelined != NULL) {
+			/* Data has been already received with the previous request */
+			pipelined = priv->pipelined;
+			priv->pipelined = NULL;
+			data = pipelined->str;
+			r = pipelined->len;
+		}
+		else {
+			data = buf->str;
+			r = read (fd, buf->str, buf->allocated);
+		}
+
+		if (priv->retry_buf != NULL) {
+			/* Reused socket has been closed before sending any reply */
+			if ((r == 0 || (r == -1 && errno == ECONNRESET)) &&
+					rspamd_http_connection_retry (conn)) {
+				REF_RELEASE (pbuf);
+				rspamd_http_connection_unref (conn);
+
+				return;
+			}
+
+			if (r > 0) {
+				rspamd_fstring_free (priv->retry_buf);
+				priv->retry_buf = NULL;
+			}
+		}
+
 		if (r == -1) {
 			err = g_error_new (HTTP_ERROR,
 					errno,
@@ -969,22 +1037,41 @@ rspamd_http_event_handler (int fd, short what, gpointer ud)
 			return;
 		}
 		else {
-			buf->len = r;
+			if (pipelined == NULL) {
+				buf->len = r;
+			}
 
-			if (http_parser_execute (&priv->parser, &priv->parser_cb,
-					buf->str, r) != (size_t)r || priv->parser.http_errno != 0) {
+			nparsed = http_parser_execute (&priv->parser, &priv->parser_cb,
+					data, r);
+
+			if (priv->parser.http_errno == HPE_PAUSED) {
+				/* Request is complete, keep the rest for the next ones */
+				if (nparsed < (gsize)r) {
+					priv->pipelined = rspamd_fstring_new_init (data + nparsed,
+							r - nparsed);
+				}
+			}
+			else if (nparsed != (gsize)r || priv->parser.http_errno != 0) {
 				err = g_error_new (HTTP_ERROR, priv->parser.http_errno,
 						"HTTP parser error: %s",
 						http_errno_description (priv->parser.http_errno));
 				conn->error_handler (conn, err);
 				g_error_free (err);
 
+				if (pipelined != NULL) {
+					rspamd_fstring_free (pipelined);
+				}
+
 				REF_RELEASE (pbuf);
 				rspamd_http_connection_unref (conn);
 
 				return;
 			}
 		}
+
+		if (pipelined != NULL) {
+			rspamd_fstring_free (pipelined);
+		}
 	}
 	else if (what == EV_TIMEOUT) {
 		err = g_error_new (HTTP_ERROR, ETIMEDOUT,
@@ -1048,6 +1135,12 @@ rspamd_http_connection_new (rspamd_http_body_handler_t body_handler,
 	new->finished = FALSE;
 	new->cache = cache;
 
+	if (cache == NULL && type == RSPAMD_HTTP_CLIENT &&
+			(opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE)) {
+		/* Reuse shared secrets for the persistent peers */
+		new->cache = rspamd_http_keepalive_keypair_cache ();
+	}
+
 	/* Init priv */
 	priv = g_slice_alloc0 (sizeof (struct rspamd_http_connection_private));
 	new->priv = priv;
@@ -1081,6 +1174,11 @@ rspamd_http_connection_reset (struct rspamd_http_connection *conn)
 	/* Clear priv */
 	event_del (&priv->ev);
 
+	if (conn->type == RSPAMD_HTTP_CLIENT) {
+		/* Server needs this flag to write reply to the current request */
+		priv->keepalive = FALSE;
+	}
+
 	if (priv->buf != NULL) {
 		REF_RELEASE (priv->buf);
 		priv->buf = NULL;
@@ -1126,6 +1224,14 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 	if (priv != NULL) {
 		rspamd_http_connection_reset (conn);
 
+		if (priv->pipelined) {
+			rspamd_fstring_free (priv->pipelined);
+		}
+
+		if (priv->retry_buf) {
+			rspamd_fstring_free (priv->retry_buf);
+		}
+
 		if (priv->local_key) {
 			REF_RELEASE (priv->local_key);
 		}
@@ -1140,6 +1246,322 @@ rspamd_http_connection_free (struct rspamd_http_connection *conn)
 	g_slice_free1 (sizeof (struct rspamd_http_connection),		   conn);
 }
 
+/* Idle client connections are closed after this timeout by default */
+#define HTTP_KEEPALIVE_TIMEOUT 10.0
+/* Maximum number of idle connections per peer */
+#define HTTP_KEEPALIVE_MAX_IDLE 16
+#define HTTP_KEEPALIVE_KEYPAIRS 64
+
+struct rspamd_http_keepalive_elt {
+	GQueue *queue;
+	GList *link;
+	struct event ev;
+	gint fd;
+};
+
+/* Idle sockets are per process, as they must not be shared with children */
+static GHashTable *http_keepalive_conns = NULL;
+/* Sockets taken from the pool that have not been written yet */
+static GHashTable *http_keepalive_reused = NULL;
+static pid_t http_keepalive_pid = 0;
+static gdouble http_keepalive_timeout = HTTP_KEEPALIVE_TIMEOUT;
+
+static GHashTable *
+rspamd_http_keepalive_conns (void)
+{
+	GHashTableIter it;
+	gpointer v;
+	GQueue *q;
+	struct rspamd_http_keepalive_elt *elt;
+
+	if (http_keepalive_conns != NULL && http_keepalive_pid != getpid ()) {
+		/*
+		 * Sockets are inherited from the parent, so we just close our copies
+		 * without touching events that belong to the parent's event base
+		 */
+		g_hash_table_iter_init (&it, http_keepalive_conns);
+
+		while (g_hash_table_iter_next (&it, NULL, &v)) {
+			q = v;
+
+			while ((elt = g_queue_pop_head (q)) != NULL) {
+				close (elt->fd);
+				g_slice_free1 (sizeof (*elt), elt);
+			}
+
+			g_queue_free (q);
+		}
+
+		g_hash_table_unref (http_keepalive_conns);
+		g_hash_table_unref (http_keepalive_reused);
+		http_keepalive_conns = NULL;
+	}
+
+	if (http_keepalive_conns == NULL) {
+		http_keepalive_conns = g_hash_table_new_full (g_str_hash, g_str_equal,
+				g_free, NULL);
+		http_keepalive_reused = g_hash_table_new (g_direct_hash,
+				g_direct_equal);
+		http_keepalive_pid = getpid ();
+	}
+
+	return http_keepalive_conns;
+}
+
+/*
+ * Sockets of encrypted connections are bound to the keys used, so the
+ * keys identifiers are a part of the pool key
+ */
+static void
+rspamd_http_keepalive_key (const gchar *peer,
+		struct rspamd_http_keypair *local_key,
+		struct rspamd_http_keypair *peer_key,
+		gchar *buf, gsize len)
+{
+	if (local_key != NULL && peer_key != NULL) {
+		rspamd_snprintf (buf, len, "%s:encrypted:%*xs:%*xs", peer,
+				(gint)sizeof (local_key->id), local_key->id,
+				(gint)sizeof (peer_key->id), peer_key->id);
+	}
+	else {
+		rspamd_snprintf (buf, len, "%s:plain", peer);
+	}
+}
+
+static void
+rspamd_http_keepalive_handler (gint fd, short what, gpointer ud)
+{
+	struct rspamd_http_keepalive_elt *elt = ud;
+
+	/*
+	 * Either timeout or server has closed connection (or sent some garbage),
+	 * in any case we cannot use this socket any more
+	 */
+	event_del (&elt->ev);
+	g_queue_delete_link (elt->queue, elt->link);
+	close (elt->fd);
+	g_slice_free1 (sizeof (*elt), elt);
+}
+
+struct rspamd_keypair_cache *
+rspamd_http_keepalive_keypair_cache (void)
+{
+	static struct rspamd_keypair_cache *cache = NULL;
+
+	if (cache == NULL) {
+		cache = rspamd_keypair_cache_new (HTTP_KEEPALIVE_KEYPAIRS);
+	}
+
+	return cache;
+}
+
+void
+rspamd_http_keepalive_set_timeout (gdouble timeout)
+{
+	http_keepalive_timeout = timeout;
+}
+
+gint
+rspamd_http_keepalive_get (const gchar *peer, gpointer local_key,
+		gpointer peer_key)
+{
+	GQueue *q;
+	struct rspamd_http_keepalive_elt *elt;
+	gchar key[512];
+	gint fd = -1;
+
+	g_assert (peer != NULL);
+
+	rspamd_http_keepalive_key (peer, local_key, peer_key, key, sizeof (key));
+	q = g_hash_table_lookup (rspamd_http_keepalive_conns (), key);
+
+	if (q != NULL) {
+		/* The most recently used socket is the least likely to be closed */
+		elt = g_queue_pop_tail (q);
+
+		if (elt != NULL) {
+			event_del (&elt->ev);
+			fd = elt->fd;
+			g_slice_free1 (sizeof (*elt), elt);
+			g_hash_table_insert (http_keepalive_reused, GINT_TO_POINTER (fd),
+					GINT_TO_POINTER (fd));
+		}
+	}
+
+	return fd;
+}
+
+void
+rspamd_http_keepalive_release (struct rspamd_http_connection *conn,
+		const gchar *peer, struct event_base *ev_base)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	struct rspamd_http_keepalive_elt *elt;
+	gpointer peer_key;
+	GHashTable *conns;
+	GQueue *q;
+	struct timeval tv;
+	gchar key[512];
+
+	if (conn->fd == -1) {
+		return;
+	}
+
+	event_del (&priv->ev);
+
+	if (peer != NULL && priv->keepalive && conn->type == RSPAMD_HTTP_CLIENT) {
+		conns = rspamd_http_keepalive_conns ();
+		peer_key = priv->msg != NULL ? priv->msg->peer_key : NULL;
+
+		if (peer_key == NULL) {
+			peer_key = priv->peer_key;
+		}
+
+		rspamd_http_keepalive_key (peer, priv->local_key, peer_key, key,
+				sizeof (key));
+		q = g_hash_table_lookup (conns, key);
+
+		if (q == NULL) {
+			q = g_queue_new ();
+			g_hash_table_insert (conns, g_strdup (key), q);
+		}
+
+		if (g_queue_get_length (q) < HTTP_KEEPALIVE_MAX_IDLE) {
+			elt = g_slice_alloc (sizeof (*elt));
+			elt->fd = conn->fd;
+			elt->queue = q;
+			g_queue_push_tail (q, elt);
+			elt->link = g_queue_peek_tail_link (q);
+
+			double_to_tv (rspamd_time_jitter (http_keepalive_timeout, 0), &tv);
+			event_set (&elt->ev, elt->fd, EV_READ | EV_TIMEOUT,
+					rspamd_http_keepalive_handler, elt);
+
+			if (ev_base != NULL) {
+				event_base_set (ev_base, &elt->ev);
+			}
+
+			event_add (&elt->ev, &tv);
+			priv->keepalive = FALSE;
+			conn->fd = -1;
+
+			return;
+		}
+	}
+
+	close (conn->fd);
+	conn->fd = -1;
+}
+
+/*
+ * Keeps a copy of the request written to a socket taken from the keep-alive
+ * pool: server might have closed it while it has been idle
+ */
+static void
+rspamd_http_connection_save_retry (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	guint i;
+
+	if (priv->retry_buf != NULL) {
+		rspamd_fstring_free (priv->retry_buf);
+		priv->retry_buf = NULL;
+	}
+
+	if (http_keepalive_reused == NULL || conn->type != RSPAMD_HTTP_CLIENT ||
+			!g_hash_table_remove (http_keepalive_reused,
+					GINT_TO_POINTER (conn->fd))) {
+		return;
+	}
+
+	/* Reading of the reply is not driven by the caller only for these */
+	if (!(conn->opts & RSPAMD_HTTP_CLIENT_SIMPLE)) {
+		return;
+	}
+
+	priv->retry_addrlen = sizeof (priv->retry_addr);
+
+	if (getpeername (conn->fd, (struct sockaddr *)&priv->retry_addr,
+			&priv->retry_addrlen) == -1) {
+		priv->retry_addrlen = 0;
+		return;
+	}
+
+	priv->retry_buf = rspamd_fstring_sized_new (priv->wr_total);
+
+	for (i = 0; i < priv->outlen; i ++) {
+		priv->retry_buf = rspamd_fstring_append (priv->retry_buf,
+				priv->out[i].iov_base, priv->out[i].iov_len);
+	}
+}
+
+/*
+ * Sends the saved request once more over a new connection to the same peer,
+ * the new socket replaces the old one under the same descriptor
+ */
+static gboolean
+rspamd_http_connection_retry (struct rspamd_http_connection *conn)
+{
+	struct rspamd_http_connection_private *priv = conn->priv;
+	struct event_base *base;
+	gint nfd;
+
+	if (priv->retry_buf == NULL || priv->retry_addrlen == 0) {
+		return FALSE;
+	}
+
+	nfd = rspamd_socket_create (priv->retry_addr.ss_family, SOCK_STREAM, 0,
+			TRUE);
+
+	if (nfd == -1) {
+		return FALSE;
+	}
+
+	if (connect (nfd, (struct sockaddr *)&priv->retry_addr,
+			priv->retry_addrlen) == -1 && errno != EINPROGRESS) {
+		close (nfd);
+
+		return FALSE;
+	}
+
+	base = event_get_base (&priv->ev);
+	event_del (&priv->ev);
+
+	if (dup2 (nfd, conn->fd) == -1) {
+		close (nfd);
+
+		return FALSE;
+	}
+
+	close (nfd);
+	msg_debug ("resend request over a new connection as a kept alive one "
+			"has been closed by the peer");
+
+	/* Request is retried only once */
+	priv->retry_addrlen = 0;
+
+	if (priv->out != NULL) {
+		g_slice_free1 (sizeof (struct iovec) * priv->outlen, priv->out);
+	}
+
+	priv->outlen = 1;
+	priv->out = g_slice_alloc (sizeof (struct iovec));
+	priv->out[0].iov_base = priv->retry_buf->str;
+	priv->out[0].iov_len = priv->retry_buf->len;
+	priv->wr_pos = 0;
+	priv->wr_total = priv->retry_buf->len;
+
+	event_set (&priv->ev, conn->fd, EV_WRITE, rspamd_http_event_handler, conn);
+
+	if (base != NULL) {
+		event_base_set (base, &priv->ev);
+	}
+
+	event_add (&priv->ev, priv->ptv);
+
+	return TRUE;
+}
+
 void
 rspamd_http_connection_read_message (struct rspamd_http_connection *conn,
 	gpointer ud, gint fd, struct timeval *timeout, struct event_base *base)
@@ -1182,6 +1604,11 @@ rspamd_http_connection_read_message (struct rspamd_http_connection *conn,
 		event_base_set (base, &priv->ev);
 	}
 	event_add (&priv->ev, priv->ptv);
+
+	if (priv->pipelined != NULL) {
+		/* Process the pipelined request from the next loop iteration */
+		event_active (&priv->ev, EV_READ, 0);
+	}
 }
 
 static void
@@ -1299,6 +1726,7 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 	rspamd_fstring_t *buf;
 	gboolean encrypted = FALSE;
 	gchar *b32_key, *b32_id;
+	const gchar *conn_type;
 	guchar nonce[rspamd_cryptobox_MAX_NONCEBYTES], mac[rspamd_cryptobox_MAX_MACBYTES],
 		id[rspamd_cryptobox_HASHBYTES];
 	guchar *np = NULL, *mp = NULL, *meth_pos = NULL;
@@ -1445,6 +1873,8 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 
 	if (conn->type == RSPAMD_HTTP_SERVER) {
 		/* Format reply */
+		conn_type = priv->keepalive ? "keep-alive" : "close";
+
 		if (msg->method < HTTP_SYMBOLS) {
 			ptm = gmtime (&msg->date);
 			t = *ptm;
@@ -1465,13 +1895,14 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 				/* Internal reply (encrypted) */
 				meth_len = rspamd_snprintf (repbuf, sizeof (repbuf),
 						"HTTP/1.1 %d %V\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: %s\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: %s", /* NO \r\n at the end ! */
 						msg->code,
 						msg->status,
+						conn_type,
 						"rspamd/" RVERSION,
 						datebuf,
 						bodylen,
@@ -1479,23 +1910,25 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 				enclen += meth_len;
 				/* External reply */
 				rspamd_printf_fstring (&buf, "HTTP/1.1 200 OK\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: rspamd\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: application/octet-stream\r\n",
+						conn_type,
 						datebuf,
 						enclen);
 			}
 			else {
 				rspamd_printf_fstring (&buf, "HTTP/1.1 %d %V\r\n"
-						"Connection: close\r\n"
+						"Connection: %s\r\n"
 						"Server: %s\r\n"
 						"Date: %s\r\n"
 						"Content-Length: %z\r\n"
 						"Content-Type: %s\r\n",
 						msg->code,
 						msg->status,
+						conn_type,
 						"rspamd/" RVERSION,
 						datebuf,
 						bodylen,
@@ -1514,6 +1947,8 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 	}
 	else {
 		/* Format request */
+		conn_type = (conn->opts & RSPAMD_HTTP_CLIENT_KEEP_ALIVE) ?
+				"keep-alive" : "close";
 		enclen += msg->url->len +
 				strlen (http_method_str (msg->method)) + 1 /* method + space */;
 		if (host == NULL && msg->host == NULL) {
@@ -1537,21 +1972,23 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 			if (encrypted) {
 				if (host != NULL) {
 					rspamd_printf_fstring (&buf, "%s %s HTTP/1.1\r\n"
-									"Connection: close\r\n"
+									"Connection: %s\r\n"
 									"Host: %s\r\n"
 									"Content-Length: %z\r\n",
 							"POST",
 							"/post",
+							conn_type,
 							host,
 							enclen);
 				}
 				else {
 					rspamd_printf_fstring (&buf, "%s %s HTTP/1.1\r\n"
-									"Connection: close\r\n"
+									"Connection: %s\r\n"
 									"Host: %V\r\n"
 									"Content-Length: %z\r\n",
 							"POST",
 							"/post",
+							conn_type,
 							msg->host,
 							enclen);
 				}
@@ -1559,21 +1996,23 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 			else {
 				if (host != NULL) {
 					rspamd_printf_fstring (&buf, "%s %V HTTP/1.1\r\n"
-									"Connection: close\r\n"
+									"Connection: %s\r\n"
 									"Host: %s\r\n"
 									"Content-Length: %z\r\n",
 							http_method_str (msg->method),
 							msg->url,
+							conn_type,
 							host,
 							bodylen);
 				}
 				else {
 					rspamd_printf_fstring (&buf, "%s %V HTTP/1.1\r\n"
-									"Connection: close\r\n"
+									"Connection: %s\r\n"
 									"Host: %V\r\n"
 									"Content-Length: %z\r\n",
 							http_method_str (msg->method),
 							msg->url,
+							conn_type,
 							msg->host,
 							bodylen);
 				}
@@ -1669,6 +2108,8 @@ rspamd_http_connection_write_message (struct rspamd_http_connection *conn,
 		}
 	}
 
+	rspamd_http_connection_save_retry (conn);
+
 	if (base != NULL && event_get_base (&priv->ev) == base) {
 		event_del (&priv->ev);
 	}
@@ -2396,6 +2837,20 @@ rspamd_http_connection_is_encrypted (struct rspamd_http_connection *conn)
 	return FALSE;
 }
 
+gboolean
+rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn)
+{
+	return conn->type == RSPAMD_HTTP_SERVER && conn->priv->keepalive;
+}
+
+void
+rspamd_http_connection_disable_keepalive (struct rspamd_http_connection *conn)
+{
+	if (conn->type == RSPAMD_HTTP_SERVER) {
+		conn->priv->keepalive = FALSE;
+	}
+}
+
 void
 rspamd_http_connection_key_unref (gpointer key)
 {
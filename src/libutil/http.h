@@ -82,7 +82,9 @@ struct rspamd_http_message {
 enum rspamd_http_options {
 	RSPAMD_HTTP_BODY_PARTIAL = 0x1, /**< Call body handler on all body data portions */
 	RSPAMD_HTTP_CLIENT_SIMPLE = 0x2, /**< Read HTTP client reply automatically */
-	RSPAMD_HTTP_CLIENT_ENCRYPTED = 0x4 /**< Encrypt data for client */
+	RSPAMD_HTTP_CLIENT_ENCRYPTED = 0x4, /**< Encrypt data for client */
+	RSPAMD_HTTP_CLIENT_KEEP_ALIVE = 0x8, /**< Ask server to keep connection alive */
+	RSPAMD_HTTP_SERVER_KEEP_ALIVE = 0x10 /**< Keep connection alive if client asks for it and accept pipelined requests */
 };
 
 struct rspamd_http_connection_private;
@@ -191,6 +193,23 @@ void rspamd_http_connection_set_key (struct rspamd_http_connection *conn,
  */
 gboolean rspamd_http_connection_is_encrypted (struct rspamd_http_connection *conn);
 
+/**
+ * Returns TRUE if a server connection created with
+ * `RSPAMD_HTTP_SERVER_KEEP_ALIVE` can be used for the next request after the
+ * current reply is written
+ * @param conn
+ * @return
+ */
+gboolean rspamd_http_connection_is_keepalive (struct rspamd_http_connection *conn);
+
+/**
+ * Makes a server connection reply with `Connection: close` even if the client
+ * asked to keep it alive, so no more requests are read after the current one
+ * @param conn
+ */
+void rspamd_http_connection_disable_keepalive (
+		struct rspamd_http_connection *conn);
+
 /** Print pubkey */
 #define RSPAMD_KEYPAIR_PUBKEY 0x1
 /** Print secret key */
@@ -290,6 +309,46 @@ rspamd_http_connection_unref (struct rspamd_http_connection *conn)
  */
 void rspamd_http_connection_reset (struct rspamd_http_connection *conn);
 
+/**
+ * Returns an idle socket to the specified peer from the keep-alive pool of
+ * the current process. Sockets of encrypted connections are returned for the
+ * same pair of keys only. If a returned socket turns out to be closed by the
+ * peer before any reply, then a request written to it by a connection with
+ * `RSPAMD_HTTP_CLIENT_SIMPLE` is sent once more over a new socket
+ * @param peer peer identifier, e.g. `address:port`
+ * @param local_key local keypair of an encrypted connection or NULL
+ * @param peer_key public key of the peer of an encrypted connection or NULL
+ * @return socket or -1 if there are no idle sockets for this peer
+ */
+gint rspamd_http_keepalive_get (const gchar *peer, gpointer local_key,
+		gpointer peer_key);
+
+/**
+ * Releases socket of a client connection: if the connection has been created
+ * with `RSPAMD_HTTP_CLIENT_KEEP_ALIVE` and the server allowed keep-alive for
+ * the last reply, then socket is put to the pool. Otherwise it is closed.
+ * Socket must not be used by the caller afterwards.
+ * @param conn connection
+ * @param peer peer identifier, e.g. `address:port`
+ * @param ev_base event base used to watch idle socket
+ */
+void rspamd_http_keepalive_release (struct rspamd_http_connection *conn,
+		const gchar *peer, struct event_base *ev_base);
+
+/**
+ * Sets how long idle sockets are kept in the keep-alive pool (10 seconds by
+ * default)
+ * @param timeout timeout in seconds
+ */
+void rspamd_http_keepalive_set_timeout (gdouble timeout);
+
+/**
+ * Returns keypairs cache shared by the keep-alive client connections, so the
+ * shared secrets for the same peers are not recalculated
+ * @return
+ */
+struct rspamd_keypair_cache *rspamd_http_keepalive_keypair_cache (void);
+
 /**
  * Extract the current message from a connection to deal with separately
  * @param conn
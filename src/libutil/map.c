@@ -74,6 +74,12 @@ struct http_callback_data {
 #define HTTP_CONNECT_TIMEOUT 2
 #define HTTP_READ_TIMEOUT 10
 
+static void
+http_map_keepalive_key (struct http_map_data *data, gchar *buf, gsize len)
+{
+	rspamd_snprintf (buf, len, "%s:%d", data->host, (gint)data->port);
+}
+
 /**
  * Helper for HTTP connection establishment
  */
@@ -84,9 +90,19 @@ connect_http (struct rspamd_map *map,
 {
 	gint sock;
 	rspamd_mempool_t *pool;
+	gchar key[256];
 
 	pool = map->pool;
 
+	if (is_async) {
+		/* Try to reuse idle connection to the same server */
+		http_map_keepalive_key (data, key, sizeof (key));
+
+		if ((sock = rspamd_http_keepalive_get (key, NULL, NULL)) != -1) {
+			return sock;
+		}
+	}
+
 	if ((sock = rspamd_socket_tcp (data->addr, FALSE, is_async)) == -1) {
 		msg_info_pool ("cannot connect to http server %s: %d, %s",
 			data->host,
@@ -128,13 +144,17 @@ write_http_request (struct http_callback_data *cbd)
 static void
 free_http_cbdata (struct http_callback_data *cbd)
 {
+	gchar key[256];
+
 	g_atomic_int_set (cbd->map->locked, 0);
 	if (cbd->remain_buf) {
 		g_string_free (cbd->remain_buf, TRUE);
 	}
 
+	/* Socket is either closed or kept for the next requests */
+	http_map_keepalive_key (cbd->data, key, sizeof (key));
+	rspamd_http_keepalive_release (cbd->data->conn, key, cbd->ev_base);
 	rspamd_http_connection_reset (cbd->data->conn);
-	close (cbd->fd);
 	g_slice_free1 (sizeof (struct http_callback_data), cbd);
 }
 
@@ -407,41 +427,176 @@ http_callback (gint fd, short what, void *ud)
 	}
 }
 
+/**
+ * Load image of a shared map if it has been replaced by the main process
+ */
+static void
+read_map_image (struct rspamd_map *map)
+{
+	struct stat st;
+	radix_compressed_t *tree;
+	rspamd_mempool_t *pool = map->pool;
+
+	if (stat (map->image_path, &st) == -1 || st.st_ino == map->image_ino) {
+		/* Images are always replaced by rename, so inode is enough */
+		return;
+	}
+
+	tree = radix_load_compressed_image (map->image_path);
+
+	if (tree == NULL) {
+		msg_warn_pool ("cannot load map image '%s', keep the current data",
+				map->image_path);
+		return;
+	}
+
+	if (*map->user_data) {
+		radix_destroy_compressed (*map->user_data);
+	}
+
+	*map->user_data = tree;
+	map->image_ino = st.st_ino;
+	msg_info_pool ("loaded shared radix trie of %z elements for map %s",
+			radix_get_size (tree), map->uri);
+}
+
+/**
+ * Image callback for workers
+ */
+static void
+image_callback (gint fd, short what, void *ud)
+{
+	struct rspamd_map *map = ud;
+
+	jitter_timeout_event (map, FALSE, FALSE);
+	read_map_image (map);
+}
+
+static void
+rspamd_map_watch_single (struct rspamd_map *map, struct event_base *ev_base)
+{
+	struct file_map_data *fdata;
+
+	map->ev_base = ev_base;
+	event_base_set (map->ev_base, &map->ev);
+
+	if (map->image_path != NULL && map->image_owner != getpid ()) {
+		/*
+		 * Map is loaded by the main process, so just map its image. Data
+		 * inherited on fork are used if the image is unavailable
+		 */
+		evtimer_set (&map->ev, image_callback, map);
+		read_map_image (map);
+		jitter_timeout_event (map, FALSE, TRUE);
+	}
+	else if (map->protocol == MAP_PROTO_FILE) {
+		evtimer_set (&map->ev, file_callback, map);
+		/* Read initial data */
+		fdata = map->map_data;
+		if (fdata->st.st_mtime != -1 && !map->preloaded) {
+			/* Do not try to read non-existent or already loaded file */
+			read_map_file (map, map->map_data);
+		}
+		/* Plan event with jitter */
+		jitter_timeout_event (map, FALSE, TRUE);
+	}
+	else if (map->protocol == MAP_PROTO_HTTP) {
+		evtimer_set (&map->ev, http_callback, map);
+		jitter_timeout_event (map, FALSE, TRUE);
+	}
+}
+
 /* Start watching event for all maps */
 void
 rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base)
 {
 	GList *cur = cfg->maps;
 	struct rspamd_map *map;
-	struct file_map_data *fdata;
 
 	/* First of all do synced read of data */
 	while (cur) {
 		map = cur->data;
-		map->ev_base = ev_base;
-		event_base_set (map->ev_base, &map->ev);
-		if (map->protocol == MAP_PROTO_FILE) {
-			evtimer_set (&map->ev, file_callback, map);
-			/* Read initial data */
+		rspamd_map_watch_single (map, ev_base);
+		cur = g_list_next (cur);
+	}
+}
+
+void
+rspamd_map_compile_shared (struct rspamd_config *cfg,
+		struct event_base *ev_base)
+{
+	GList *cur = cfg->maps;
+	struct rspamd_map *map;
+
+	while (cur) {
+		map = cur->data;
+
+		/*
+		 * Only radix maps have a pointer free representation, HTTP maps are
+		 * also excluded as their requests cannot be cancelled on reload
+		 */
+		if (map->read_callback == rspamd_radix_read &&
+				map->protocol == MAP_PROTO_FILE && map->image_path == NULL) {
+			map->image_owner = getpid ();
+			map->image_path = rspamd_mempool_alloc (cfg->map_pool, PATH_MAX);
+			rspamd_snprintf (map->image_path, PATH_MAX,
+					"%s/rspamd-map-%P-%*s.radix", cfg->temp_dir,
+					map->image_owner, (gint)sizeof (map->pool->tag.uid),
+					map->pool->tag.uid);
+			rspamd_map_watch_single (map, ev_base);
+		}
+
+		cur = g_list_next (cur);
+	}
+}
+
+guint
+rspamd_map_preload (struct rspamd_config *cfg)
+{
+	GList *cur = cfg->maps;
+	struct rspamd_map *map;
+	struct file_map_data *fdata;
+	guint nloaded = 0;
+
+	while (cur) {
+		map = cur->data;
+
+		/* Shared images are loaded separately */
+		if (map->protocol == MAP_PROTO_FILE && map->image_path == NULL &&
+				!map->preloaded) {
 			fdata = map->map_data;
+
 			if (fdata->st.st_mtime != -1) {
-				/* Do not try to read non-existent file */
-				read_map_file (map, map->map_data);
+				read_map_file (map, fdata);
+				map->preloaded = TRUE;
+				nloaded ++;
 			}
-			/* Plan event with jitter */
-			jitter_timeout_event (map, FALSE, TRUE);
-		}
-		else if (map->protocol == MAP_PROTO_HTTP) {
-			evtimer_set (&map->ev, http_callback, map);
-			jitter_timeout_event (map, FALSE, TRUE);
 		}
+
 		cur = g_list_next (cur);
 	}
+
+	return nloaded;
 }
 
 void
 rspamd_map_remove_all (struct rspamd_config *cfg)
 {
+	GList *cur = cfg->maps;
+	struct rspamd_map *map;
+
+	while (cur) {
+		map = cur->data;
+
+		if (map->image_path != NULL && map->image_owner == getpid ()) {
+			/* Processes that have already mapped an image are not affected */
+			evtimer_del (&map->ev);
+			unlink (map->image_path);
+		}
+
+		cur = g_list_next (cur);
+	}
+
 	g_list_free (cfg->maps);
 	cfg->maps = NULL;
 	if (cfg->map_pool != NULL) {
@@ -620,7 +775,8 @@ rspamd_map_add (struct rspamd_config *cfg,
 		close (s);
 		hdata->conn = rspamd_http_connection_new (http_map_read, http_map_error,
 			http_map_finish,
-			RSPAMD_HTTP_BODY_PARTIAL | RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_BODY_PARTIAL | RSPAMD_HTTP_CLIENT_SIMPLE |
+			RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
 			RSPAMD_HTTP_CLIENT, NULL);
 		new_map->map_data = hdata;
 	}
@@ -962,11 +1118,17 @@ rspamd_radix_read (rspamd_mempool_t * pool,
 void
 rspamd_radix_fin (rspamd_mempool_t * pool, struct map_cb_data *data)
 {
+	struct rspamd_map *map = data->map;
+
 	if (data->prev_data) {
 		radix_destroy_compressed (data->prev_data);
 	}
 	if (data->cur_data) {
 		msg_info_pool ("read radix trie of %z elements", radix_get_size
 				(data->cur_data));
+
+		if (map->image_path != NULL && map->image_owner == getpid ()) {
+			radix_save_compressed_image (data->cur_data, map->image_path);
+		}
 	}
 }
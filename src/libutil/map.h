@@ -47,6 +47,12 @@ struct rspamd_map {
 	guint32 checksum;
 	/* Shared lock for temporary disabling of map reading (e.g. when this map is written by UI) */
 	gint *locked;
+	/* Compiled image written by the main process and mapped by workers */
+	gchar *image_path;
+	pid_t image_owner;
+	ino_t image_ino;
+	/* Initial data has been read by the main process before forking */
+	gboolean preloaded;
 };
 
 /**
@@ -79,6 +85,23 @@ gboolean rspamd_map_add (struct rspamd_config *cfg,
  */
 void rspamd_map_watch (struct rspamd_config *cfg, struct event_base *ev_base);
 
+/**
+ * Load maps that can be shared between processes in the main process and
+ * watch them there. Loaded data is saved as read only images in the temporary
+ * directory, so workers map these images instead of parsing the same data
+ * each. Should be called before workers are spawned
+ */
+void rspamd_map_compile_shared (struct rspamd_config *cfg,
+		struct event_base *ev_base);
+
+/**
+ * Read file maps in the main process before workers are spawned, so workers
+ * inherit the parsed data and do not read the same files on start. Changed
+ * files are still reread by each worker afterwards
+ * @return number of maps loaded
+ */
+guint rspamd_map_preload (struct rspamd_config *cfg);
+
 /**
  * Remove all maps watched (remove events)
  */
@@ -27,6 +27,7 @@
 #include "radix.h"
 #include "rspamd.h"
 #include "mem_pool.h"
+#include "unix-std.h"
 
 #define msg_err_radix(...) rspamd_default_log_function (G_LOG_LEVEL_CRITICAL, \
         "radix", tree->pool->tag.uid, \
@@ -62,29 +63,57 @@ struct radix_compressed_node {
 };
 
 
+/*
+ * Flat pointer-free representation of a tree that can be shared between
+ * processes via mmap: nodes are addressed by indices (0 means no node) and
+ * keys of compressed nodes are stored in a separate area after nodes
+ */
+#define RADIX_IMAGE_MAGIC "rsradix1"
+
+struct radix_image_header {
+	gchar magic[8];
+	guint64 size;
+	guint32 nnodes;
+	guint32 keys_len;
+};
+
+struct radix_image_node {
+	guint64 value;
+	guint32 left;   /* Key offset for compressed nodes */
+	guint32 right;  /* Key length for compressed nodes */
+	guint32 level;
+	guint32 skipped;
+};
+
 struct radix_tree_compressed {
 	struct radix_compressed_node *root;
 	rspamd_mempool_t *pool;
 	size_t size;
+	/* Read only image of the tree, root is unused in this case */
+	const struct radix_image_node *image_nodes;
+	const guint8 *image_keys;
+	gpointer image;
+	gsize image_len;
+	guint32 image_root;
 };
 
 static gboolean
-radix_compare_compressed (struct radix_compressed_node *node,
-		guint8 *key, guint keylen, guint cur_level)
+radix_compare_key (const guint8 *nkey, guint nkeylen, guint level,
+		const guint8 *key, guint keylen, guint cur_level)
 {
-	guint8 *nk;
-	guint8 *k;
+	const guint8 *nk;
+	const guint8 *k;
 	guint8 bit;
 	guint shift, rbits, skip;
 
-	if (node->d.s.keylen > keylen) {
+	if (nkeylen > keylen) {
 		/* Obvious case */
 		return FALSE;
 	}
 
 
 	/* Compare byte aligned levels of a compressed node */
-	shift = node->d.s.level / NBBY;
+	shift = level / NBBY;
 	/*
 	 * We know that at least of cur_level bits are the same,
 	 * se we can optimize search slightly
@@ -92,15 +121,15 @@ radix_compare_compressed (struct radix_compressed_node *node,
 	if (shift > 0) {
 		skip = cur_level / NBBY;
 		if (shift > skip &&
-				memcmp (node->d.s.key + skip, key + skip, shift - skip) != 0) {
+				memcmp (nkey + skip, key + skip, shift - skip) != 0) {
 			return FALSE;
 		}
 	}
 
-	rbits = node->d.s.level % NBBY;
+	rbits = level % NBBY;
 	if (rbits > 0) {
 		/* Precisely compare remaining bits */
-		nk = node->d.s.key + shift;
+		nk = nkey + shift;
 		k = key + shift;
 
 		bit = 1U << 7;
@@ -117,6 +146,78 @@ radix_compare_compressed (struct radix_compressed_node *node,
 	return TRUE;
 }
 
+static inline gboolean
+radix_compare_compressed (struct radix_compressed_node *node,
+		guint8 *key, guint keylen, guint cur_level)
+{
+	return radix_compare_key (node->d.s.key, node->d.s.keylen,
+			node->d.s.level, key, keylen, cur_level);
+}
+
+static inline gboolean
+radix_compare_image (radix_compressed_t *tree,
+		const struct radix_image_node *node,
+		guint8 *key, guint keylen, guint cur_level)
+{
+	return radix_compare_key (tree->image_keys + node->left, node->right,
+			node->level, key, keylen, cur_level);
+}
+
+static uintptr_t
+radix_find_image (radix_compressed_t *tree, guint8 *key, gsize keylen)
+{
+	const struct radix_image_node *node;
+	guint32 bit, idx;
+	gsize kremain = keylen / sizeof (guint32);
+	uintptr_t value;
+	guint32 *k = (guint32 *)key;
+	guint32 kv = ntohl (*k);
+	guint cur_level = 0;
+
+	bit = 1U << 31;
+	value = RADIX_NO_VALUE;
+	idx = tree->image_root;
+
+	while (idx != 0 && kremain) {
+		node = &tree->image_nodes[idx];
+
+		if (node->skipped) {
+			/* It is obviously a leaf node */
+			if (radix_compare_image (tree, node, key, keylen, cur_level)) {
+				return (uintptr_t)node->value;
+			}
+			else {
+				return value;
+			}
+		}
+		if (node->value != (guint64)RADIX_NO_VALUE) {
+			value = (uintptr_t)node->value;
+		}
+
+		idx = (kv & bit) ? node->right : node->left;
+
+		bit >>= 1;
+		if (bit == 0) {
+			k ++;
+			bit = 1U << 31;
+			kv = ntohl (*k);
+			kremain --;
+		}
+		cur_level ++;
+	}
+
+	if (idx != 0) {
+		node = &tree->image_nodes[idx];
+
+		if (node->skipped &&
+				radix_compare_image (tree, node, key, keylen, cur_level)) {
+			return (uintptr_t)node->value;
+		}
+	}
+
+	return value;
+}
+
 uintptr_t
 radix_find_compressed (radix_compressed_t * tree, guint8 *key, gsize keylen)
 {
@@ -128,6 +229,10 @@ radix_find_compressed (radix_compressed_t * tree, guint8 *key, gsize keylen)
 	guint32 kv = ntohl (*k);
 	guint cur_level = 0;
 
+	if (tree->image != NULL) {
+		return radix_find_image (tree, key, keylen);
+	}
+
 	bit = 1U << 31;
 	value = RADIX_NO_VALUE;
 	node = tree->root;
@@ -453,6 +558,9 @@ radix_insert_compressed (radix_compressed_t * tree,
 	gsize kremain = keylen;
 	uintptr_t oldval = RADIX_NO_VALUE;
 
+	/* Images are read only */
+	g_assert (tree->image == NULL);
+
 	bit = 1U << 7;
 	node = tree->root;
 
@@ -580,6 +688,11 @@ radix_create_compressed (void)
 	tree->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 	tree->size = 0;
 	tree->root = NULL;
+	tree->image = NULL;
+	tree->image_nodes = NULL;
+	tree->image_keys = NULL;
+	tree->image_len = 0;
+	tree->image_root = 0;
 
 	return tree;
 }
@@ -588,6 +701,10 @@ void
 radix_destroy_compressed (radix_compressed_t *tree)
 {
 	if (tree) {
+		if (tree->image) {
+			munmap (tree->image, tree->image_len);
+		}
+
 		rspamd_mempool_delete (tree->pool);
 		g_slice_free1 (sizeof (*tree), tree);
 	}
@@ -716,3 +833,209 @@ radix_get_pool (radix_compressed_t *tree)
 
 	return NULL;
 }
+
+static void
+radix_image_count (struct radix_compressed_node *node, guint32 *nnodes,
+		guint32 *keys_len)
+{
+	if (node == NULL) {
+		return;
+	}
+
+	(*nnodes) ++;
+
+	if (node->skipped) {
+		*keys_len += node->d.s.keylen;
+	}
+	else {
+		radix_image_count (node->d.n.left, nnodes, keys_len);
+		radix_image_count (node->d.n.right, nnodes, keys_len);
+	}
+}
+
+static guint32
+radix_image_fill (struct radix_compressed_node *node,
+		struct radix_image_node *nodes, guint8 *keys,
+		guint32 *cur_node, guint32 *cur_key)
+{
+	struct radix_image_node *inode;
+	guint32 idx;
+
+	if (node == NULL) {
+		return 0;
+	}
+
+	idx = (*cur_node) ++;
+	inode = &nodes[idx];
+	inode->value = (guint64)node->value;
+	inode->level = 0;
+	inode->skipped = node->skipped ? 1 : 0;
+
+	if (node->skipped) {
+		inode->left = *cur_key;
+		inode->right = node->d.s.keylen;
+		inode->level = node->d.s.level;
+		memcpy (keys + *cur_key, node->d.s.key, node->d.s.keylen);
+		*cur_key += node->d.s.keylen;
+	}
+	else {
+		inode->left = radix_image_fill (node->d.n.left, nodes, keys,
+				cur_node, cur_key);
+		inode->right = radix_image_fill (node->d.n.right, nodes, keys,
+				cur_node, cur_key);
+	}
+
+	return idx;
+}
+
+gboolean
+radix_save_compressed_image (radix_compressed_t *tree, const gchar *path)
+{
+	struct radix_image_header hdr;
+	struct radix_image_node *nodes;
+	guint8 *keys;
+	guint32 nnodes = 0, keys_len = 0, cur_node = 1, cur_key = 0;
+	gchar tmpbuf[PATH_MAX];
+	gsize nodes_len;
+	gint fd;
+	gboolean ret = FALSE;
+
+	g_assert (tree != NULL);
+	g_assert (tree->image == NULL);
+
+	radix_image_count (tree->root, &nnodes, &keys_len);
+	/* Node 0 is reserved as NULL node */
+	nodes_len = (nnodes + 1) * sizeof (*nodes);
+	nodes = g_malloc0 (nodes_len);
+	keys = g_malloc (keys_len + 1);
+	radix_image_fill (tree->root, nodes, keys, &cur_node, &cur_key);
+
+	memset (&hdr, 0, sizeof (hdr));
+	memcpy (hdr.magic, RADIX_IMAGE_MAGIC, sizeof (hdr.magic));
+	hdr.size = tree->size;
+	hdr.nnodes = nnodes;
+	hdr.keys_len = keys_len;
+
+	/*
+	 * Write to a temporary file and rename to replace image atomically. The
+	 * name is unpredictable and the file is created exclusively, so nobody
+	 * can substitute a link to another file in a shared directory
+	 */
+	rspamd_snprintf (tmpbuf, sizeof (tmpbuf), "%s.XXXXXX", path);
+	fd = mkstemp (tmpbuf);
+
+	if (fd == -1) {
+		msg_err_radix ("cannot create radix image %s: %s", tmpbuf,
+				strerror (errno));
+	}
+	else if (fchmod (fd, 00644) == -1) {
+		/* Workers could run as a different user */
+		msg_err_radix ("cannot chmod radix image %s: %s", tmpbuf,
+				strerror (errno));
+		close (fd);
+		unlink (tmpbuf);
+	}
+	else {
+		if (write (fd, &hdr, sizeof (hdr)) != sizeof (hdr) ||
+				write (fd, nodes, nodes_len) != (gssize)nodes_len ||
+				write (fd, keys, keys_len) != (gssize)keys_len) {
+			msg_err_radix ("cannot write radix image %s: %s", tmpbuf,
+					strerror (errno));
+			close (fd);
+			unlink (tmpbuf);
+		}
+		else {
+			close (fd);
+
+			if (rename (tmpbuf, path) == -1) {
+				msg_err_radix ("cannot rename radix image %s: %s", tmpbuf,
+						strerror (errno));
+				unlink (tmpbuf);
+			}
+			else {
+				msg_debug_radix ("saved radix image %s: %ud nodes, %ud key "
+						"bytes", path, nnodes, keys_len);
+				ret = TRUE;
+			}
+		}
+	}
+
+	g_free (nodes);
+	g_free (keys);
+
+	return ret;
+}
+
+/* Checks that all indices and key ranges of an image are within its bounds */
+static gboolean
+radix_image_validate (const struct radix_image_header *hdr,
+		const struct radix_image_node *nodes)
+{
+	const struct radix_image_node *node;
+	guint32 i;
+
+	for (i = 1; i <= hdr->nnodes; i ++) {
+		node = &nodes[i];
+
+		if (node->skipped) {
+			if ((guint64)node->left + node->right > hdr->keys_len ||
+					(guint64)node->level > (guint64)node->right * NBBY) {
+				return FALSE;
+			}
+		}
+		else if (node->left > hdr->nnodes || node->right > hdr->nnodes) {
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+radix_compressed_t *
+radix_load_compressed_image (const gchar *path)
+{
+	radix_compressed_t *tree;
+	struct radix_image_header *hdr;
+	struct stat st;
+	gpointer map;
+	gint fd;
+
+	if ((fd = open (path, O_RDONLY | O_NOFOLLOW)) == -1) {
+		return NULL;
+	}
+
+	if (fstat (fd, &st) == -1 || st.st_size < (off_t)sizeof (*hdr)) {
+		close (fd);
+		return NULL;
+	}
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	hdr = map;
+
+	if (memcmp (hdr->magic, RADIX_IMAGE_MAGIC, sizeof (hdr->magic)) != 0 ||
+			(guint64)st.st_size != sizeof (*hdr) +
+			((guint64)hdr->nnodes + 1) * sizeof (struct radix_image_node) +
+			hdr->keys_len ||
+			!radix_image_validate (hdr,
+					(const struct radix_image_node *)(hdr + 1))) {
+		msg_err ("invalid radix image %s", path);
+		munmap (map, st.st_size);
+		return NULL;
+	}
+
+	tree = radix_create_compressed ();
+	tree->image = map;
+	tree->image_len = st.st_size;
+	tree->size = hdr->size;
+	tree->image_nodes = (const struct radix_image_node *)(hdr + 1);
+	tree->image_keys = (const guint8 *)(tree->image_nodes + hdr->nnodes + 1);
+	tree->image_root = hdr->nnodes > 0 ? 1 : 0;
+
+	return tree;
+}
@@ -109,4 +109,23 @@ gsize radix_get_size (radix_compressed_t *tree);
  */
 rspamd_mempool_t* radix_get_pool (radix_compressed_t *tree);
 
+/**
+ * Writes flattened image of the tree to the specified file. The file is
+ * replaced atomically, so readers can load it at any time
+ * @param tree
+ * @param path
+ * @return TRUE if an image has been saved
+ */
+gboolean radix_save_compressed_image (radix_compressed_t *tree,
+		const gchar *path);
+
+/**
+ * Maps an image written by `radix_save_compressed_image` read only, so the
+ * same pages are shared by all processes that load the image. The resulting
+ * tree cannot be modified
+ * @param path
+ * @return new tree or NULL if an image is missing or invalid
+ */
+radix_compressed_t *radix_load_compressed_image (const gchar *path);
+
 #endif
@@ -29,25 +29,42 @@
 #include "ref.h"
 #include "util.h"
 #include "rspamd.h"
+
+#ifndef WITH_PCRE2
 #include <pcre.h>
+#define PCRE_T pcre
+#define PCRE_FREE pcre_free
+#define PCRE_FLAG(x) G_PASTE (PCRE_, x)
+#define RSPAMD_PCRE_UTF PCRE_UTF8
+#else
+#ifndef PCRE2_CODE_UNIT_WIDTH
+#define PCRE2_CODE_UNIT_WIDTH 8
+#endif
+#include <pcre2.h>
+#define PCRE_T pcre2_code
+#define PCRE_FREE pcre2_code_free
+#define PCRE_FLAG(x) G_PASTE (PCRE2_, x)
+#define RSPAMD_PCRE_UTF PCRE2_UTF
+#endif
 
-typedef guchar regexp_id_t[rspamd_cryptobox_HASHBYTES];
+/*
+ * Only one regexp is executed at a time within a process, so all jit compiled
+ * regexps share the same stack
+ */
+#define RSPAMD_REGEXP_JIT_STACK_MIN (32 * 1024)
+#define RSPAMD_REGEXP_JIT_STACK_MAX (1024 * 1024)
 
-#define RSPAMD_REGEXP_FLAG_RAW (1 << 1)
-#define RSPAMD_REGEXP_FLAG_NOOPT (1 << 2)
-#define RSPAMD_REGEXP_FLAG_FULL_MATCH (1 << 3)
+typedef guchar regexp_id_t[rspamd_cryptobox_HASHBYTES];
 
 struct rspamd_regexp_s {
 	gdouble exec_time;
 	gchar *pattern;
-	pcre *re;
+	PCRE_T *re;
+	PCRE_T *raw_re;
+#ifndef WITH_PCRE2
 	pcre_extra *extra;
-#ifdef HAVE_PCRE_JIT
-	pcre_jit_stack *jstack;
-	pcre_jit_stack *raw_jstack;
-#endif
-	pcre *raw_re;
 	pcre_extra *raw_extra;
+#endif
 	regexp_id_t id;
 	ref_entry_t ref;
 	gpointer ud;
@@ -64,6 +81,17 @@ struct rspamd_regexp_cache {
 
 static struct rspamd_regexp_cache *global_re_cache = NULL;
 static gboolean can_jit = FALSE;
+#ifndef WITH_PCRE2
+#ifdef HAVE_PCRE_JIT
+static pcre_jit_stack *shared_jstack = NULL;
+#endif
+#else
+static pcre2_jit_stack *shared_jstack = NULL;
+static pcre2_compile_context *shared_compile_ctx = NULL;
+static pcre2_match_context *shared_match_ctx = NULL;
+static pcre2_match_data *shared_match_data = NULL;
+static guint32 shared_match_data_size = 0;
+#endif
 
 static GQuark
 rspamd_regexp_quark (void)
@@ -92,29 +120,27 @@ rspamd_regexp_dtor (rspamd_regexp_t *re)
 {
 	if (re) {
 		if (re->raw_re && re->raw_re != re->re) {
-			pcre_free (re->raw_re);
+			PCRE_FREE (re->raw_re);
+#ifndef WITH_PCRE2
 #ifdef HAVE_PCRE_JIT
 			if (re->raw_extra) {
 				pcre_free_study (re->raw_extra);
 			}
-			if (re->raw_jstack) {
-				pcre_jit_stack_free (re->raw_jstack);
-			}
 #else
 			pcre_free (re->raw_extra);
+#endif
 #endif
 		}
 		if (re->re) {
-			pcre_free (re->re);
+			PCRE_FREE (re->re);
+#ifndef WITH_PCRE2
 #ifdef HAVE_PCRE_JIT
 			if (re->extra) {
 				pcre_free_study (re->extra);
 			}
-			if (re->jstack) {
-				pcre_jit_stack_free (re->jstack);
-			}
 #else
 			pcre_free (re->extra);
+#endif
 #endif
 		}
 
@@ -124,15 +150,133 @@ rspamd_regexp_dtor (rspamd_regexp_t *re)
 	}
 }
 
+#ifndef WITH_PCRE2
+static PCRE_T *
+rspamd_regexp_compile (const gchar *pattern, gint flags, GString **err)
+{
+	const gchar *err_str;
+	gint err_off;
+	PCRE_T *r;
+
+	r = pcre_compile (pattern, flags, &err_str, &err_off, NULL);
+
+	if (r == NULL) {
+		*err = g_string_sized_new (64);
+		rspamd_printf_gstring (*err, "%s at position %d", err_str, err_off);
+	}
+
+	return r;
+}
+
+static pcre_extra *
+rspamd_regexp_optimize (PCRE_T *r, const gchar *pattern, const gchar *type,
+		gboolean *jit_compiled)
+{
+	pcre_extra *extra;
+	const gchar *err_str;
+	gint study_flags = 0;
+
+#ifdef HAVE_PCRE_JIT
+	study_flags |= PCRE_STUDY_JIT_COMPILE;
+#endif
+
+	extra = pcre_study (r, study_flags, &err_str);
+
+	if (extra != NULL) {
+#ifdef HAVE_PCRE_JIT
+		gint jit, n;
+
+		if (can_jit) {
+			jit = 0;
+			n = pcre_fullinfo (r, extra, PCRE_INFO_JIT, &jit);
+
+			if (n != 0 || jit != 1) {
+				msg_debug ("jit compilation of %s is not supported", pattern);
+			}
+			else {
+				pcre_assign_jit_stack (extra, NULL, shared_jstack);
+				*jit_compiled = TRUE;
+			}
+		}
+#endif
+	}
+	else {
+		msg_warn ("cannot optimize %sregexp pattern: '%s': %s",
+				type, pattern, err_str);
+	}
+
+	return extra;
+}
+#else
+static PCRE_T *
+rspamd_regexp_compile (const gchar *pattern, gint flags, GString **err)
+{
+	gint errcode;
+	PCRE2_SIZE err_off;
+	PCRE2_UCHAR err_str[128];
+	PCRE_T *r;
+
+	r = pcre2_compile ((PCRE2_SPTR)pattern, PCRE2_ZERO_TERMINATED, flags,
+			&errcode, &err_off, shared_compile_ctx);
+
+	if (r == NULL) {
+		pcre2_get_error_message (errcode, err_str, sizeof (err_str));
+		*err = g_string_sized_new (64);
+		rspamd_printf_gstring (*err, "%s at position %z", err_str,
+				(gssize)err_off);
+	}
+
+	return r;
+}
+
+static void
+rspamd_regexp_optimize (PCRE_T *r, const gchar *pattern, const gchar *type,
+		gboolean *jit_compiled)
+{
+	if (can_jit) {
+		if (pcre2_jit_compile (r, PCRE2_JIT_COMPLETE) != 0) {
+			msg_debug ("jit compilation of %s%s is not supported",
+					type, pattern);
+		}
+		else {
+			*jit_compiled = TRUE;
+		}
+	}
+}
+
+/* Returns match data that can hold at least `n` pairs of offsets */
+static pcre2_match_data *
+rspamd_regexp_match_data (guint32 n)
+{
+	if (shared_match_data == NULL || shared_match_data_size < n) {
+		if (shared_match_data) {
+			pcre2_match_data_free (shared_match_data);
+		}
+
+		shared_match_data_size = MAX (n, 16);
+		shared_match_data = pcre2_match_data_create (shared_match_data_size,
+				NULL);
+	}
+
+	return shared_match_data;
+}
+#endif
+
 rspamd_regexp_t*
 rspamd_regexp_new (const gchar *pattern, const gchar *flags,
 		GError **err)
 {
-	const gchar *start = pattern, *end, *flags_str = NULL, *err_str;
+	const gchar *start = pattern, *end, *flags_str = NULL;
 	rspamd_regexp_t *res;
-	pcre *r;
+	PCRE_T *r;
+	GString *err_str = NULL;
 	gchar sep = 0, *real_pattern;
-	gint regexp_flags = 0, rspamd_flags = 0, err_off, study_flags = 0, ncaptures;
+	gint regexp_flags = 0, rspamd_flags = 0;
+#ifndef WITH_PCRE2
+	gint ncaptures;
+#else
+	guint32 ncaptures;
+#endif
 	gboolean strict_flags = FALSE;
 
 	rspamd_regexp_library_init ();
@@ -182,27 +326,33 @@ rspamd_regexp_new (const gchar *pattern, const gchar *flags,
 
 	rspamd_flags |= RSPAMD_REGEXP_FLAG_RAW;
 
+#ifndef WITH_PCRE2
 	regexp_flags |= PCRE_NEWLINE_ANYCRLF;
-	regexp_flags &= ~PCRE_UTF8;
+#endif
+	regexp_flags &= ~RSPAMD_PCRE_UTF;
 
 	if (flags_str != NULL) {
 		while (*flags_str) {
 			switch (*flags_str) {
 			case 'i':
-				regexp_flags |= PCRE_CASELESS;
+				regexp_flags |= PCRE_FLAG (CASELESS);
+				rspamd_flags |= RSPAMD_REGEXP_FLAG_CASELESS;
 				break;
 			case 'm':
-				regexp_flags |= PCRE_MULTILINE;
+				regexp_flags |= PCRE_FLAG (MULTILINE);
+				rspamd_flags |= RSPAMD_REGEXP_FLAG_MULTILINE;
 				break;
 			case 's':
-				regexp_flags |= PCRE_DOTALL;
+				regexp_flags |= PCRE_FLAG (DOTALL);
+				rspamd_flags |= RSPAMD_REGEXP_FLAG_DOTALL;
 				break;
 			case 'x':
-				regexp_flags |= PCRE_EXTENDED;
+				regexp_flags |= PCRE_FLAG (EXTENDED);
+				rspamd_flags |= RSPAMD_REGEXP_FLAG_EXTENDED;
 				break;
 			case 'u':
 				rspamd_flags &= ~RSPAMD_REGEXP_FLAG_RAW;
-				regexp_flags |= PCRE_UTF8;
+				regexp_flags |= RSPAMD_PCRE_UTF;
 				break;
 			case 'O':
 				/* We optimize all regexps by default */
@@ -210,7 +360,7 @@ rspamd_regexp_new (const gchar *pattern, const gchar *flags,
 				break;
 			case 'r':
 				rspamd_flags |= RSPAMD_REGEXP_FLAG_RAW;
-				regexp_flags &= ~PCRE_UTF8;
+				regexp_flags &= ~RSPAMD_PCRE_UTF;
 				break;
 			default:
 				if (strict_flags) {
@@ -231,12 +381,13 @@ fin:
 	real_pattern = g_malloc (end - start + 1);
 	rspamd_strlcpy (real_pattern, start, end - start + 1);
 
-	r = pcre_compile (real_pattern, regexp_flags, &err_str, &err_off, NULL);
+	r = rspamd_regexp_compile (real_pattern, regexp_flags, &err_str);
 
 	if (r == NULL) {
 		g_set_error (err, rspamd_regexp_quark(), EINVAL,
-			"invalid regexp pattern: '%s': %s at position %d",
-			pattern, err_str, err_off);
+			"invalid regexp pattern: '%s': %s",
+			pattern, err_str->str);
+		g_string_free (err_str, TRUE);
 		g_free (real_pattern);
 
 		return NULL;
@@ -254,92 +405,64 @@ fin:
 	}
 	else {
 		res->re = r;
-		res->raw_re = pcre_compile (pattern, regexp_flags & ~PCRE_UTF8,
-				&err_str, &err_off, NULL);
+		res->raw_re = rspamd_regexp_compile (pattern,
+				regexp_flags & ~RSPAMD_PCRE_UTF, &err_str);
 
 		if (res->raw_re == NULL) {
-			msg_warn ("invalid raw regexp pattern: '%s': %s at position %d",
-					pattern, err_str, err_off);
+			msg_warn ("invalid raw regexp pattern: '%s': %s",
+					pattern, err_str->str);
+			g_string_free (err_str, TRUE);
 		}
 	}
 
-#ifdef HAVE_PCRE_JIT
-	study_flags |= PCRE_STUDY_JIT_COMPILE;
-#endif
-
 	if (!(rspamd_flags & RSPAMD_REGEXP_FLAG_NOOPT)) {
+		gboolean jit = FALSE, raw_jit = FALSE;
+
 		/* Optimize regexp */
+#ifndef WITH_PCRE2
 		if (res->re) {
-			res->extra = pcre_study (res->re, study_flags, &err_str);
-			if (res->extra != NULL) {
-#ifdef HAVE_PCRE_JIT
-				gint jit, n;
-
-				if (can_jit) {
-					jit = 0;
-					n = pcre_fullinfo (res->re, res->extra,
-							PCRE_INFO_JIT, &jit);
-
-					if (n != 0 || jit != 1) {
-						msg_debug ("jit compilation of %s is not supported", pattern);
-						res->jstack = NULL;
-					}
-					else {
-						res->jstack = pcre_jit_stack_alloc (32 * 1024, 512 * 1024);
-						pcre_assign_jit_stack (res->extra, NULL, res->jstack);
-					}
-				}
-#endif
-			}
-			else {
-				msg_warn ("cannot optimize regexp pattern: '%s': %s",
-						pattern, err_str);
-			}
+			res->extra = rspamd_regexp_optimize (res->re, pattern, "", &jit);
 		}
 
 		if (res->raw_re) {
 			if (res->raw_re != res->re) {
-				res->raw_extra = pcre_study (res->raw_re, study_flags, &err_str);
-				if (res->raw_extra != NULL) {
-#ifdef HAVE_PCRE_JIT
-					gint jit, n;
-
-					if (can_jit) {
-						jit = 0;
-						n = pcre_fullinfo (res->raw_re, res->raw_extra,
-								PCRE_INFO_JIT, &jit);
-
-						if (n != 0 || jit != 1) {
-							msg_debug ("jit compilation of %s is not supported",
-									pattern);
-							res->raw_jstack = NULL;
-						}
-						else {
-							res->raw_jstack = pcre_jit_stack_alloc (32 * 1024,
-									512 * 1024);
-							pcre_assign_jit_stack (res->raw_extra, NULL,
-									res->raw_jstack);
-						}
-					}
-#endif
-				}
-				else {
-					msg_warn ("cannot optimize raw regexp pattern: '%s': %s",
-							pattern, err_str);
-				}
+				res->raw_extra = rspamd_regexp_optimize (res->raw_re, pattern,
+						"raw ", &raw_jit);
 			}
 			else {
 #ifdef HAVE_PCRE_JIT
 				/* Just alias pointers */
 				res->raw_extra = res->extra;
-				res->raw_jstack = res->jstack;
+				raw_jit = jit;
 #endif
 			}
 		}
+#else
+		if (res->re) {
+			rspamd_regexp_optimize (res->re, pattern, "", &jit);
+		}
+
+		if (res->raw_re) {
+			if (res->raw_re != res->re) {
+				rspamd_regexp_optimize (res->raw_re, pattern, "raw ", &raw_jit);
+			}
+			else {
+				raw_jit = jit;
+			}
+		}
+#endif
+
+		if (jit) {
+			res->flags |= RSPAMD_REGEXP_FLAG_JIT;
+		}
+		if (raw_jit) {
+			res->flags |= RSPAMD_REGEXP_FLAG_RAW_JIT;
+		}
 	}
 
 	rspamd_regexp_generate_id (pattern, flags, res->id);
 
+#ifndef WITH_PCRE2
 	/* Check number of captures */
 	if (pcre_fullinfo (res->raw_re, res->extra, PCRE_INFO_CAPTURECOUNT,
 			&ncaptures) == 0) {
@@ -351,6 +474,19 @@ fin:
 			&ncaptures) == 0) {
 		res->nbackref = ncaptures;
 	}
+#else
+	/* Check number of captures */
+	if (pcre2_pattern_info (res->raw_re, PCRE2_INFO_CAPTURECOUNT,
+			&ncaptures) == 0) {
+		res->ncaptures = ncaptures;
+	}
+
+	/* Check number of backrefs */
+	if (pcre2_pattern_info (res->raw_re, PCRE2_INFO_BACKREFMAX,
+			&ncaptures) == 0) {
+		res->nbackref = ncaptures;
+	}
+#endif
 
 	return res;
 }
@@ -360,14 +496,20 @@ rspamd_regexp_search (rspamd_regexp_t *re, const gchar *text, gsize len,
 		const gchar **start, const gchar **end, gboolean raw,
 		GArray *captures)
 {
-	pcre *r;
+	PCRE_T *r;
+	const gchar *mt;
+	gsize remain = 0;
+#ifndef WITH_PCRE2
 	pcre_extra *ext;
 #if defined(HAVE_PCRE_JIT) && defined(HAVE_PCRE_JIT_FAST)
 	pcre_jit_stack *st = NULL;
 #endif
-	const gchar *mt;
-	gsize remain = 0;
 	gint rc, match_flags = 0, *ovec, ncaptures, i;
+#else
+	pcre2_match_data *mdata;
+	PCRE2_SIZE *ovec;
+	gint rc, i;
+#endif
 
 	g_assert (re != NULL);
 	g_assert (text != NULL);
@@ -393,21 +535,25 @@ rspamd_regexp_search (rspamd_regexp_t *re, const gchar *text, gsize len,
 		return FALSE;
 	}
 
+#ifndef WITH_PCRE2
 	match_flags = PCRE_NEWLINE_ANYCRLF;
 
 	if ((re->flags & RSPAMD_REGEXP_FLAG_RAW) || raw) {
 		r = re->raw_re;
 		ext = re->raw_extra;
 #if defined(HAVE_PCRE_JIT) && defined(HAVE_PCRE_JIT_FAST)
-		st = re->raw_jstack;
+		if (re->flags & RSPAMD_REGEXP_FLAG_RAW_JIT) {
+			st = shared_jstack;
+		}
 #endif
 	}
 	else {
 		r = re->re;
 		ext = re->extra;
 #if defined(HAVE_PCRE_JIT) && defined(HAVE_PCRE_JIT_FAST)
-		if (g_utf8_validate (mt, remain, NULL)) {
-			st = re->jstack;
+		if ((re->flags & RSPAMD_REGEXP_FLAG_JIT) &&
+				g_utf8_validate (mt, remain, NULL)) {
+			st = shared_jstack;
 		}
 #endif
 	}
@@ -444,6 +590,21 @@ rspamd_regexp_search (rspamd_regexp_t *re, const gchar *text, gsize len,
 		rc = pcre_exec (r, ext, mt, remain, 0, match_flags, ovec,
 				ncaptures);
 	}
+#else
+	if ((re->flags & RSPAMD_REGEXP_FLAG_RAW) || raw) {
+		r = re->raw_re;
+	}
+	else {
+		r = re->re;
+	}
+
+	g_assert (r != NULL);
+	/* Match data and jit stack are reused between all searches */
+	mdata = rspamd_regexp_match_data (re->ncaptures + 1);
+	rc = pcre2_match (r, (PCRE2_SPTR)mt, remain, 0, 0, mdata,
+			shared_match_ctx);
+	ovec = pcre2_get_ovector_pointer (mdata);
+#endif
 
 	if (rc >= 0) {
 		if (start) {
@@ -470,7 +631,7 @@ rspamd_regexp_search (rspamd_regexp_t *re, const gchar *text, gsize len,
 
 		if (re->flags & RSPAMD_REGEXP_FLAG_FULL_MATCH) {
 			/* We also ensure that the match is full */
-			if (ovec[0] != 0 || (guint)ovec[1] < len) {
+			if (ovec[0] != 0 || (gsize)ovec[1] < len) {
 				return FALSE;
 			}
 		}
@@ -489,6 +650,14 @@ rspamd_regexp_get_pattern (rspamd_regexp_t *re)
 	return re->pattern;
 }
 
+gint
+rspamd_regexp_get_flags (rspamd_regexp_t *re)
+{
+	g_assert (re != NULL);
+
+	return re->flags;
+}
+
 gint
 rspamd_regexp_get_nbackrefs (rspamd_regexp_t *re)
 {
@@ -713,6 +882,7 @@ rspamd_regexp_library_init (void)
 {
 	if (global_re_cache == NULL) {
 		global_re_cache = rspamd_regexp_cache_new ();
+#ifndef WITH_PCRE2
 #ifdef HAVE_PCRE_JIT
 		gint jit, rc;
 		const gchar *str;
@@ -728,7 +898,15 @@ rspamd_regexp_library_init (void)
 			msg_info ("pcre is compiled with JIT for unknown target");
 #endif
 
-			can_jit = TRUE;
+			shared_jstack = pcre_jit_stack_alloc (RSPAMD_REGEXP_JIT_STACK_MIN,
+					RSPAMD_REGEXP_JIT_STACK_MAX);
+
+			if (shared_jstack != NULL) {
+				can_jit = TRUE;
+			}
+			else {
+				msg_err ("cannot allocate jit stack, jit is disabled");
+			}
 		}
 		else {
 			msg_info ("pcre is compiled without JIT support, so many optimisations"
@@ -737,6 +915,34 @@ rspamd_regexp_library_init (void)
 #else
 		msg_info ("pcre is too old and has no JIT support, so many optimisations"
 				" are impossible");
+#endif
+#else
+		guint32 jit = 0;
+		gchar str[64];
+
+		shared_compile_ctx = pcre2_compile_context_create (NULL);
+		pcre2_set_newline (shared_compile_ctx, PCRE2_NEWLINE_ANYCRLF);
+		shared_match_ctx = pcre2_match_context_create (NULL);
+
+		if (pcre2_config (PCRE2_CONFIG_JIT, &jit) >= 0 && jit == 1) {
+			pcre2_config (PCRE2_CONFIG_JITTARGET, str);
+			msg_info ("pcre2 is compiled with JIT for %s", str);
+
+			shared_jstack = pcre2_jit_stack_create (RSPAMD_REGEXP_JIT_STACK_MIN,
+					RSPAMD_REGEXP_JIT_STACK_MAX, NULL);
+
+			if (shared_jstack != NULL) {
+				pcre2_jit_stack_assign (shared_match_ctx, NULL, shared_jstack);
+				can_jit = TRUE;
+			}
+			else {
+				msg_err ("cannot allocate jit stack, jit is disabled");
+			}
+		}
+		else {
+			msg_info ("pcre2 is compiled without JIT support, so many "
+					"optimisations are impossible");
+		}
 #endif
 	}
 }
@@ -747,6 +953,15 @@ rspamd_regexp_library_finalize (void)
 	if (global_re_cache != NULL) {
 		rspamd_regexp_cache_destroy (global_re_cache);
 	}
+
+	/* Jit stack is still referenced by all compiled regexps */
+#ifdef WITH_PCRE2
+	if (shared_match_data != NULL) {
+		pcre2_match_data_free (shared_match_data);
+		shared_match_data = NULL;
+		shared_match_data_size = 0;
+	}
+#endif
 }
 
 gpointer
@@ -29,6 +29,16 @@
 
 #define RSPAMD_INVALID_ID ((guint64)-1LL)
 
+#define RSPAMD_REGEXP_FLAG_RAW (1 << 1)
+#define RSPAMD_REGEXP_FLAG_NOOPT (1 << 2)
+#define RSPAMD_REGEXP_FLAG_FULL_MATCH (1 << 3)
+#define RSPAMD_REGEXP_FLAG_JIT (1 << 4)
+#define RSPAMD_REGEXP_FLAG_RAW_JIT (1 << 5)
+#define RSPAMD_REGEXP_FLAG_CASELESS (1 << 6)
+#define RSPAMD_REGEXP_FLAG_MULTILINE (1 << 7)
+#define RSPAMD_REGEXP_FLAG_DOTALL (1 << 8)
+#define RSPAMD_REGEXP_FLAG_EXTENDED (1 << 9)
+
 typedef struct rspamd_regexp_s rspamd_regexp_t;
 struct rspamd_regexp_cache;
 struct rspamd_re_capture {
@@ -112,6 +122,11 @@ gpointer rspamd_regexp_get_id (rspamd_regexp_t *re);
  */
 const char* rspamd_regexp_get_pattern (rspamd_regexp_t *re);
 
+/**
+ * Returns flags of a regexp (a combination of `RSPAMD_REGEXP_FLAG_*`)
+ */
+gint rspamd_regexp_get_flags (rspamd_regexp_t *re);
+
 /**
  * Returns number of backreferences in a regexp
  */
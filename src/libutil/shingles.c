@@ -24,8 +24,11 @@
 #include "shingles.h"
 #include "fstring.h"
 #include "cryptobox.h"
+#include "xxhash.h"
 
 #define SHINGLES_WINDOW 3
+/* Rotation applied to each older word hash inside of the rolling window */
+#define SHINGLES_ROTATE 21
 
 struct rspamd_shingle*
 rspamd_shingles_generate (GArray *input,
@@ -109,6 +112,108 @@ rspamd_shingles_generate (GArray *input,
 	return res;
 }
 
+static inline guint64
+rspamd_shingles_rotl (guint64 x, guint r)
+{
+	r %= 64;
+
+	return r == 0 ? x : (x << r) | (x >> (64 - r));
+}
+
+static inline guint64
+rspamd_shingles_splitmix (guint64 *st)
+{
+	guint64 z = (*st += G_GUINT64_CONSTANT (0x9E3779B97F4A7C15));
+
+	z = (z ^ (z >> 30)) * G_GUINT64_CONSTANT (0xBF58476D1CE4E5B9);
+	z = (z ^ (z >> 27)) * G_GUINT64_CONSTANT (0x94D049BB133111EB);
+
+	return z ^ (z >> 31);
+}
+
+static inline void
+rspamd_shingles_fast_lanes (guint64 h, const guint64 *k1, const guint64 *k2,
+		guint64 *mins)
+{
+	guint64 x;
+	gint j;
+
+	/*
+	 * Each lane is a keyed bijection of the window hash, all lanes are
+	 * independent, so this loop could be vectorized by a compiler
+	 */
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+		x = (h ^ k1[j]) * G_GUINT64_CONSTANT (0xFF51AFD7ED558CCD);
+		x ^= x >> 32;
+		x *= k2[j];
+		x ^= x >> 29;
+		mins[j] = x < mins[j] ? x : mins[j];
+	}
+}
+
+struct rspamd_shingle*
+rspamd_shingles_generate_fast (GArray *input,
+		const guchar key[16],
+		rspamd_mempool_t *pool)
+{
+	struct rspamd_shingle *res;
+	guint64 k1[RSPAMD_SHINGLE_SIZE], k2[RSPAMD_SHINGLE_SIZE],
+		wh[SHINGLES_WINDOW], seed, st, h = 0;
+	guchar shabuf[rspamd_cryptobox_HASHBYTES];
+	rspamd_ftok_t *word;
+	guint i, nwin;
+	gint j;
+
+	if (pool != NULL) {
+		res = rspamd_mempool_alloc (pool, sizeof (*res));
+	}
+	else {
+		res = g_malloc (sizeof (*res));
+	}
+
+	/*
+	 * Derive word hash seed and keys for all lanes from a single hash
+	 * of the initial key
+	 */
+	rspamd_cryptobox_hash (shabuf, key, 16, NULL, 0);
+	memcpy (&seed, shabuf, sizeof (seed));
+	memcpy (&st, shabuf + sizeof (seed), sizeof (st));
+
+	for (j = 0; j < RSPAMD_SHINGLE_SIZE; j ++) {
+		k1[j] = rspamd_shingles_splitmix (&st);
+		/* Multiplier must be odd to keep the lane mix bijective */
+		k2[j] = rspamd_shingles_splitmix (&st) | 1;
+		res->hashes[j] = G_MAXUINT64;
+	}
+
+	/*
+	 * Window hash is rotl(h[0], 2R) ^ rotl(h[1], R) ^ h[2], so it can be
+	 * updated incrementally: the oldest word is shifted out and the new
+	 * word is xored in
+	 */
+	nwin = MIN (input->len, SHINGLES_WINDOW);
+
+	for (i = 0; i < nwin; i ++) {
+		word = &g_array_index (input, rspamd_ftok_t, i);
+		wh[i] = XXH64 (word->begin, word->len, seed);
+		h = rspamd_shingles_rotl (h, SHINGLES_ROTATE) ^ wh[i];
+	}
+
+	/* Short inputs produce a single window with all words like the old way */
+	rspamd_shingles_fast_lanes (h, k1, k2, res->hashes);
+
+	for (i = nwin; i < input->len; i ++) {
+		word = &g_array_index (input, rspamd_ftok_t, i);
+		h = rspamd_shingles_rotl (h, SHINGLES_ROTATE) ^
+			rspamd_shingles_rotl (wh[i % SHINGLES_WINDOW],
+					SHINGLES_ROTATE * SHINGLES_WINDOW);
+		wh[i % SHINGLES_WINDOW] = XXH64 (word->begin, word->len, seed);
+		h ^= wh[i % SHINGLES_WINDOW];
+		rspamd_shingles_fast_lanes (h, k1, k2, res->hashes);
+	}
+
+	return res;
+}
 
 guint64
 rspamd_shingles_default_filter (guint64 *input, gsize count,
@@ -57,6 +57,21 @@ struct rspamd_shingle* rspamd_shingles_generate (GArray *input,
 		rspamd_shingles_filter filter,
 		gpointer filterd);
 
+/**
+ * Generate shingles from the input of fixed size strings. Unlike
+ * `rspamd_shingles_generate` each word is hashed only once, window hashes
+ * are updated incrementally and all permutations are derived from the window
+ * hash by a keyed mix, keeping the minimal value for each of them. The result
+ * is not compatible with `rspamd_shingles_generate` for the same input
+ * @param input array of `rspamd_fstring_t`
+ * @param key secret key used to generate shingles
+ * @param pool pool to allocate shigles array
+ * @return shingles array
+ */
+struct rspamd_shingle* rspamd_shingles_generate_fast (GArray *input,
+		const guchar key[16],
+		rspamd_mempool_t *pool);
+
 /**
  * Compares two shingles and return result as a floating point value - 1.0
  * for completely similar shingles and 0.0 for completely different ones
@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "shm_cache.h"
+#include "mem_pool.h"
+#include "logger.h"
+#include "xxhash.h"
+
+/* Element can be placed only in one of slots of its group */
+#define SHM_CACHE_GROUP_SLOTS 8
+/* Groups are protected by striped locks to reduce contention */
+#define SHM_CACHE_LOCKS 64
+#define SHM_CACHE_SEED 0xdeadbabe
+
+/* Slot header, key and value follow it */
+struct rspamd_shm_cache_elt {
+	guint64 hash;
+	guint64 expire;
+	guint32 keylen;
+	guint32 vlen;
+};
+
+/* Placed in shared memory */
+struct rspamd_shm_cache_stripe {
+	rspamd_mempool_mutex_t *lock;
+	guint64 hits;
+	guint64 misses;
+	guint64 evictions;
+};
+
+struct rspamd_shm_cache {
+	rspamd_mempool_t *pool;
+	gchar *name;
+	guchar *slots;
+	struct rspamd_shm_cache_stripe *stripes;
+	gsize slot_size;
+	guint ngroups;
+};
+
+static inline guint64
+rspamd_shm_cache_hash (const gchar *key, gsize keylen)
+{
+	guint64 h;
+
+	h = XXH64 (key, keylen, SHM_CACHE_SEED);
+
+	/* Zero hash marks an empty slot */
+	return h != 0 ? h : 1;
+}
+
+static inline gboolean
+rspamd_shm_cache_elt_alive (struct rspamd_shm_cache_elt *elt, time_t now)
+{
+	return elt->hash != 0 && elt->expire > (guint64)now;
+}
+
+static inline struct rspamd_shm_cache_elt *
+rspamd_shm_cache_slot (struct rspamd_shm_cache *cache, guint group, guint i)
+{
+	return (struct rspamd_shm_cache_elt *)(cache->slots +
+			((gsize)group * SHM_CACHE_GROUP_SLOTS + i) * cache->slot_size);
+}
+
+static inline gboolean
+rspamd_shm_cache_elt_match (struct rspamd_shm_cache_elt *elt, guint64 h,
+		const gchar *key, gsize keylen)
+{
+	return elt->hash == h && elt->keylen == keylen &&
+			memcmp ((guchar *)elt + sizeof (*elt), key, keylen) == 0;
+}
+
+struct rspamd_shm_cache *
+rspamd_shm_cache_new (const gchar *name, guint nelts, gsize max_elt)
+{
+	struct rspamd_shm_cache *cache;
+	guint i;
+
+	g_assert (name != NULL);
+
+	cache = g_slice_alloc0 (sizeof (*cache));
+	cache->pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), "shmcache");
+	cache->name = g_strdup (name);
+	cache->ngroups = MAX (1, (nelts + SHM_CACHE_GROUP_SLOTS - 1) /
+			SHM_CACHE_GROUP_SLOTS);
+	/* Keep headers aligned */
+	cache->slot_size = (sizeof (struct rspamd_shm_cache_elt) + max_elt + 7) &
+			~(gsize)7;
+	cache->slots = rspamd_mempool_alloc0_shared (cache->pool,
+			(gsize)cache->ngroups * SHM_CACHE_GROUP_SLOTS * cache->slot_size);
+	cache->stripes = rspamd_mempool_alloc0_shared (cache->pool,
+			sizeof (*cache->stripes) * SHM_CACHE_LOCKS);
+
+	for (i = 0; i < SHM_CACHE_LOCKS; i ++) {
+		cache->stripes[i].lock = rspamd_mempool_get_mutex (cache->pool);
+	}
+
+	msg_info ("created shared cache %s: %ud elements of %uz bytes",
+			name, cache->ngroups * SHM_CACHE_GROUP_SLOTS, cache->slot_size);
+
+	return cache;
+}
+
+gpointer
+rspamd_shm_cache_lookup (struct rspamd_shm_cache *cache,
+		const gchar *key, gsize keylen, time_t now, gsize *vlen, guint *ttl)
+{
+	struct rspamd_shm_cache_elt *elt;
+	struct rspamd_shm_cache_stripe *stripe;
+	gpointer res = NULL;
+	guint64 h;
+	guint group, i;
+
+	g_assert (cache != NULL);
+
+	h = rspamd_shm_cache_hash (key, keylen);
+	group = h % cache->ngroups;
+	stripe = &cache->stripes[group % SHM_CACHE_LOCKS];
+
+	rspamd_mempool_lock_mutex (stripe->lock);
+
+	for (i = 0; i < SHM_CACHE_GROUP_SLOTS; i ++) {
+		elt = rspamd_shm_cache_slot (cache, group, i);
+
+		if (rspamd_shm_cache_elt_match (elt, h, key, keylen)) {
+			if (!rspamd_shm_cache_elt_alive (elt, now)) {
+				/* Expired element */
+				elt->hash = 0;
+			}
+			else {
+				res = g_malloc (elt->vlen);
+				memcpy (res, (guchar *)elt + sizeof (*elt) + elt->keylen,
+						elt->vlen);
+
+				if (vlen) {
+					*vlen = elt->vlen;
+				}
+				if (ttl) {
+					*ttl = elt->expire - now;
+				}
+			}
+
+			break;
+		}
+	}
+
+	if (res) {
+		stripe->hits ++;
+	}
+	else {
+		stripe->misses ++;
+	}
+
+	rspamd_mempool_unlock_mutex (stripe->lock);
+
+	return res;
+}
+
+gboolean
+rspamd_shm_cache_insert (struct rspamd_shm_cache *cache,
+		const gchar *key, gsize keylen, gconstpointer value, gsize vlen,
+		time_t now, guint ttl)
+{
+	struct rspamd_shm_cache_elt *elt, *victim = NULL;
+	struct rspamd_shm_cache_stripe *stripe;
+	guint64 h;
+	guint group, i;
+
+	g_assert (cache != NULL);
+
+	if (sizeof (*elt) + keylen + vlen > cache->slot_size) {
+		return FALSE;
+	}
+
+	h = rspamd_shm_cache_hash (key, keylen);
+	group = h % cache->ngroups;
+	stripe = &cache->stripes[group % SHM_CACHE_LOCKS];
+
+	rspamd_mempool_lock_mutex (stripe->lock);
+
+	for (i = 0; i < SHM_CACHE_GROUP_SLOTS; i ++) {
+		elt = rspamd_shm_cache_slot (cache, group, i);
+
+		if (rspamd_shm_cache_elt_match (elt, h, key, keylen)) {
+			victim = elt;
+			break;
+		}
+
+		if (!rspamd_shm_cache_elt_alive (elt, now)) {
+			/* Free slot is always preferred to an alive one */
+			if (victim == NULL || rspamd_shm_cache_elt_alive (victim, now)) {
+				victim = elt;
+			}
+		}
+		else if (victim == NULL || (rspamd_shm_cache_elt_alive (victim, now) &&
+				elt->expire < victim->expire)) {
+			victim = elt;
+		}
+	}
+
+	if (rspamd_shm_cache_elt_alive (victim, now) &&
+			!rspamd_shm_cache_elt_match (victim, h, key, keylen)) {
+		stripe->evictions ++;
+	}
+
+	victim->hash = h;
+	victim->expire = now + ttl;
+	victim->keylen = keylen;
+	victim->vlen = vlen;
+	memcpy ((guchar *)victim + sizeof (*victim), key, keylen);
+	memcpy ((guchar *)victim + sizeof (*victim) + keylen, value, vlen);
+
+	rspamd_mempool_unlock_mutex (stripe->lock);
+
+	return TRUE;
+}
+
+void
+rspamd_shm_cache_stat (struct rspamd_shm_cache *cache,
+		guint64 *hits, guint64 *misses, guint64 *evictions)
+{
+	guint i;
+	guint64 h = 0, m = 0, e = 0;
+
+	g_assert (cache != NULL);
+
+	for (i = 0; i < SHM_CACHE_LOCKS; i ++) {
+		h += cache->stripes[i].hits;
+		m += cache->stripes[i].misses;
+		e += cache->stripes[i].evictions;
+	}
+
+	if (hits) {
+		*hits = h;
+	}
+	if (misses) {
+		*misses = m;
+	}
+	if (evictions) {
+		*evictions = e;
+	}
+}
+
+void
+rspamd_shm_cache_destroy (struct rspamd_shm_cache *cache)
+{
+	if (cache) {
+		rspamd_mempool_delete (cache->pool);
+		g_free (cache->name);
+		g_slice_free1 (sizeof (*cache), cache);
+	}
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef SRC_LIBUTIL_SHM_CACHE_H_
+#define SRC_LIBUTIL_SHM_CACHE_H_
+
+#include "config.h"
+
+/**
+ * @file shm_cache.h
+ * Cache of serialized values placed in shared memory. If it is created before
+ * forking of workers, then an element inserted by any worker is visible to
+ * all other processes. Elements are expired according to their TTL and
+ * the oldest elements are evicted when there is no space.
+ */
+
+struct rspamd_shm_cache;
+
+/**
+ * Creates new shared cache
+ * @param name name of the cache used for logging
+ * @param nelts number of elements in the cache
+ * @param max_elt maximum size of key plus value
+ * @return new cache
+ */
+struct rspamd_shm_cache *rspamd_shm_cache_new (const gchar *name,
+		guint nelts, gsize max_elt);
+
+/**
+ * Finds an element in the cache
+ * @param cache cache object
+ * @param key key to find
+ * @param keylen length of key
+ * @param now current time
+ * @param vlen output length of value
+ * @param ttl output time left before the element expires
+ * @return copy of value that must be freed by `g_free` or NULL if not found
+ */
+gpointer rspamd_shm_cache_lookup (struct rspamd_shm_cache *cache,
+		const gchar *key, gsize keylen, time_t now, gsize *vlen, guint *ttl);
+
+/**
+ * Inserts or replaces an element in the cache
+ * @param cache cache object
+ * @param key key of element
+ * @param keylen length of key
+ * @param value serialized value
+ * @param vlen length of value
+ * @param now current time
+ * @param ttl time to live for the element
+ * @return TRUE if element has been inserted, FALSE if it is too large
+ */
+gboolean rspamd_shm_cache_insert (struct rspamd_shm_cache *cache,
+		const gchar *key, gsize keylen, gconstpointer value, gsize vlen,
+		time_t now, guint ttl);
+
+/**
+ * Returns statistics of the cache
+ * @param cache cache object
+ * @param hits number of successful lookups
+ * @param misses number of failed lookups
+ * @param evictions number of alive elements evicted to insert new ones
+ */
+void rspamd_shm_cache_stat (struct rspamd_shm_cache *cache,
+		guint64 *hits, guint64 *misses, guint64 *evictions);
+
+/**
+ * Destroys cache
+ * @param cache cache object
+ */
+void rspamd_shm_cache_destroy (struct rspamd_shm_cache *cache);
+
+#endif /* SRC_LIBUTIL_SHM_CACHE_H_ */
@@ -26,6 +26,8 @@
 
 /* Lua module init function */
 #define MODULE_INIT_FUNC "module_init"
+/* Registry key for the main lua thread */
+#define MAIN_THREAD_KEY "rspamd_main_thread"
 
 const luaL_reg null_reg[] = {
 	{"__tostring", rspamd_lua_class_tostring},
@@ -250,6 +252,10 @@ rspamd_lua_init (struct rspamd_config *cfg)
 
 	rspamd_lua_add_preload (L, "ucl", luaopen_ucl);
 
+	/* Save the main thread, so async callbacks never run in coroutines */
+	lua_pushthread (L);
+	lua_setfield (L, LUA_REGISTRYINDEX, MAIN_THREAD_KEY);
+
 	return L;
 }
 
@@ -944,3 +950,15 @@ rspamd_lua_traceback (lua_State *L)
 
 	return 1;
 }
+
+lua_State *
+rspamd_lua_main_state (lua_State *L)
+{
+	lua_State *main;
+
+	lua_getfield (L, LUA_REGISTRYINDEX, MAIN_THREAD_KEY);
+	main = lua_tothread (L, -1);
+	lua_pop (L, 1);
+
+	return main != NULL ? main : L;
+}
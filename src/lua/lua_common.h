@@ -20,6 +20,10 @@
 #define luaL_reg    luaL_Reg
 #endif
 
+#if LUA_VERSION_NUM > 501 && !defined(lua_objlen)
+#define lua_objlen(L, idx) lua_rawlen ((L), (idx))
+#endif
+
 #define LUA_ENUM(L, name, val) \
 	lua_pushlstring (L, # name, sizeof(# name) - 1); \
 	lua_pushnumber (L, val); \
@@ -289,5 +293,12 @@ gboolean rspamd_lua_parse_table_arguments (lua_State *L, gint pos,
 
 
 gint rspamd_lua_traceback (lua_State *L);
+
+/**
+ * Returns the main lua state for a coroutine (or the state itself if it is
+ * not a coroutine). Callbacks of async events must be called in the main state
+ * as a coroutine that has registered them might be suspended or reused.
+ */
+lua_State *rspamd_lua_main_state (lua_State *L);
 #endif /* WITH_LUA */
 #endif /* RSPAMD_LUA_H */
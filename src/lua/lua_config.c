@@ -24,6 +24,7 @@
 
 
 #include "lua_common.h"
+#include "lua_thread_pool.h"
 #include "map.h"
 #include "message.h"
 #include "radix.h"
@@ -374,6 +375,18 @@ LUA_FUNCTION_DEF (config, register_regexp);
  */
 LUA_FUNCTION_DEF (config, replace_regexp);
 
+/***
+ * @method rspamd_config:get_symbol_lua_stats(name)
+ * Returns execution statistics of a lua symbol gathered by the current process
+ * as a table with the following fields:
+ * - `runs`: number of calls
+ * - `cpu`: total cpu time spent in lua (in seconds)
+ * - `memory`: total memory allocated by lua during calls (in bytes)
+ * @param {string} name symbol's name
+ * @return {table} statistics table or nil if symbol is not a lua symbol
+ */
+LUA_FUNCTION_DEF (config, get_symbol_lua_stats);
+
 static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, get_module_opt),
 	LUA_INTERFACE_DEF (config, get_mempool),
@@ -400,6 +413,7 @@ static const struct luaL_reg configlib_m[] = {
 	LUA_INTERFACE_DEF (config, add_condition),
 	LUA_INTERFACE_DEF (config, register_regexp),
 	LUA_INTERFACE_DEF (config, replace_regexp),
+	LUA_INTERFACE_DEF (config, get_symbol_lua_stats),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__newindex", lua_config_newindex},
 	{NULL, NULL}
@@ -589,6 +603,10 @@ struct lua_callback_data {
 	gboolean cb_is_ref;
 	lua_State *L;
 	gchar *symbol;
+	/* Per process execution stats */
+	guint64 nruns;
+	gdouble cpu_time;
+	gint64 mem_used;
 };
 
 /*
@@ -910,19 +928,91 @@ lua_config_get_key (lua_State *L)
 	return 1;
 }
 
+static void
+lua_metric_symbol_callback_return (struct thread_entry *thread, gint nresults)
+{
+	struct lua_callback_data *cd = thread->cd;
+	struct rspamd_task *task = thread->task;
+	lua_State *L = thread->lua_state;
+	gint level = lua_gettop (L) - nresults;
+
+	if (nresults >= 1) {
+		/* Function returned boolean, so maybe we need to insert result? */
+		gboolean res;
+		GList *opts = NULL;
+		gint i;
+		gdouble flag = 1.0;
+
+		if (lua_type (L, level + 1) == LUA_TBOOLEAN) {
+			res = lua_toboolean (L, level + 1);
+			if (res) {
+				gint first_opt = 2;
+
+				if (lua_type (L, level + 2) == LUA_TNUMBER) {
+					flag = lua_tonumber (L, level + 2);
+					/* Shift opt index */
+					first_opt = 3;
+				}
+
+				for (i = lua_gettop (L); i >= level + first_opt; i--) {
+					if (lua_type (L, i) == LUA_TSTRING) {
+						const char *opt = lua_tostring (L, i);
+
+						opts = g_list_prepend (opts,
+								rspamd_mempool_strdup (task->task_pool,
+										opt));
+					}
+				}
+				rspamd_task_insert_result (task, cd->symbol, flag, opts);
+			}
+		}
+		lua_pop (L, nresults);
+	}
+
+	cd->nruns ++;
+	cd->cpu_time += thread->cpu_time;
+	cd->mem_used += thread->mem_used;
+
+	msg_debug_task ("lua symbol %s finished: %.3f ms cpu, %L bytes allocated",
+			cd->symbol, thread->cpu_time * 1000.0, thread->mem_used);
+
+	if (thread->w) {
+		/* Symbol has been suspended, so we need to release its watcher */
+		rspamd_session_watcher_pop (task->s, thread->w);
+	}
+}
+
+static void
+lua_metric_symbol_callback_error (struct thread_entry *thread, const gchar *err)
+{
+	struct lua_callback_data *cd = thread->cd;
+	struct rspamd_task *task = thread->task;
+
+	msg_err_task ("call to (%s) failed: %s", cd->symbol, err);
+
+	cd->nruns ++;
+	cd->cpu_time += thread->cpu_time;
+	cd->mem_used += thread->mem_used;
+
+	if (thread->w) {
+		rspamd_session_watcher_pop (task->s, thread->w);
+	}
+}
+
 static void
 lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
 {
 	struct lua_callback_data *cd = ud;
 	struct rspamd_task **ptask;
-	gint level = lua_gettop (cd->L), nresults, err_idx;
-	lua_State *L = cd->L;
-	GString *tb;
-
-	lua_pushcfunction (L, &rspamd_lua_traceback);
-	err_idx = lua_gettop (L);
+	struct thread_entry *thread;
+	lua_State *L;
 
-	level ++;
+	/* Each symbol is executed in its own coroutine, so it can yield */
+	thread = lua_thread_pool_get_for_task (task->cfg->lua_thread_pool, task);
+	thread->cd = cd;
+	thread->finish_callback = lua_metric_symbol_callback_return;
+	thread->error_callback = lua_metric_symbol_callback_error;
+	L = thread->lua_state;
 
 	if (cd->cb_is_ref) {
 		lua_rawgeti (L, LUA_REGISTRYINDEX, cd->callback.ref);
@@ -935,50 +1025,45 @@ lua_metric_symbol_callback (struct rspamd_task *task, gpointer ud)
 	rspamd_lua_setclass (L, "rspamd{task}", -1);
 	*ptask = task;
 
-	if (lua_pcall (L, 1, LUA_MULTRET, err_idx) != 0) {
-		tb = lua_touserdata (L, -1);
-		msg_err_task ("call to (%s) failed: %v", cd->symbol, tb);
-		g_string_free (tb, TRUE);
-		lua_pop (L, 1);
+	if (lua_thread_pool_resume (task->cfg->lua_thread_pool, thread, 1) ==
+			LUA_YIELD) {
+		/*
+		 * Symbol is waiting for some async event, so we hold the current
+		 * watcher until the coroutine is finished
+		 */
+		thread->w = rspamd_session_get_watcher (task->s);
+		rspamd_session_watcher_push (task->s);
 	}
-	else {
-		nresults = lua_gettop (L) - level;
-
-		if (nresults >= 1) {
-			/* Function returned boolean, so maybe we need to insert result? */
-			gboolean res;
-			GList *opts = NULL;
-			gint i;
-			gdouble flag = 1.0;
-
-			if (lua_type (cd->L, level + 1) == LUA_TBOOLEAN) {
-				res = lua_toboolean (L, level + 1);
-				if (res) {
-					gint first_opt = 2;
-
-					if (lua_type (L, level + 2) == LUA_TNUMBER) {
-						flag = lua_tonumber (L, level + 2);
-						/* Shift opt index */
-						first_opt = 3;
-					}
+}
 
-					for (i = lua_gettop (L); i >= level + first_opt; i--) {
-						if (lua_type (L, i) == LUA_TSTRING) {
-							const char *opt = lua_tostring (L, i);
+static gint
+lua_config_get_symbol_lua_stats (lua_State *L)
+{
+	struct rspamd_config *cfg = lua_check_config (L, 1);
+	const gchar *sym = luaL_checkstring (L, 2);
+	struct lua_callback_data *cd;
+	symbol_func_t func;
+	gpointer ud;
 
-							opts = g_list_prepend (opts,
-									rspamd_mempool_strdup (task->task_pool,
-											opt));
-						}
-					}
-					rspamd_task_insert_result (task, cd->symbol, flag, opts);
-				}
-			}
-			lua_pop (L, nresults);
-		}
+	if (cfg && sym && rspamd_symbols_cache_get_callback (cfg->cache, sym,
+			&func, &ud) && func == lua_metric_symbol_callback) {
+		cd = ud;
+		lua_createtable (L, 0, 3);
+		lua_pushstring (L, "runs");
+		lua_pushnumber (L, cd->nruns);
+		lua_settable (L, -3);
+		lua_pushstring (L, "cpu");
+		lua_pushnumber (L, cd->cpu_time);
+		lua_settable (L, -3);
+		lua_pushstring (L, "memory");
+		lua_pushnumber (L, cd->mem_used);
+		lua_settable (L, -3);
+	}
+	else {
+		lua_pushnil (L);
 	}
 
-	lua_pop (L, 1); /* Error function */
+	return 1;
 }
 
 static gint
@@ -22,6 +22,7 @@
  */
 
 #include "lua_common.h"
+#include "lua_thread_pool.h"
 #include "dns.h"
 #include "utlist.h"
 
@@ -47,6 +48,21 @@ local function symbol_callback(task)
 
 	task:get_resolver():resolve_a(task:get_session(), task:get_mempool(),
 		host, dns_cb)
+end
+ * If a request is made from a symbol callback in the table form with a `task`
+ * but without `callback`, then the symbol is suspended until the reply arrives
+ * and results are returned directly:
+ * @example
+local function symbol_callback(task)
+	local results, err = task:get_resolver():resolve_a({
+		task = task,
+		name = 'example.com'
+	})
+
+	if results then
+		return true
+	end
+	return false
 end
  */
 struct rspamd_dns_resolver * lua_check_dns_resolver (lua_State * L);
@@ -91,6 +107,8 @@ struct lua_dns_cbdata {
 	const gchar *user_str;
 	struct rspamd_async_watcher *w;
 	struct rspamd_async_session *s;
+	struct lua_thread_pool *thread_pool;
+	struct thread_entry *thread;
 };
 
 static int
@@ -135,70 +153,89 @@ lua_dns_get_type (lua_State *L, int argno)
 	return type;
 }
 
+/* Pushes results and error to the stack */
 static void
-lua_dns_callback (struct rdns_reply *reply, gpointer arg)
+lua_dns_push_results (lua_State *L, struct rdns_reply *reply)
 {
-	struct lua_dns_cbdata *cd = arg;
 	gint i = 0;
-	struct rspamd_dns_resolver **presolver;
 	struct rdns_reply_entry *elt;
 	rspamd_inet_addr_t *addr;
 
-	lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->cbref);
-	presolver = lua_newuserdata (cd->L, sizeof (gpointer));
-	rspamd_lua_setclass (cd->L, "rspamd{resolver}", -1);
-
-	*presolver = cd->resolver;
-	lua_pushstring (cd->L, cd->to_resolve);
-
 	/*
 	 * XXX: rework to handle different request types
 	 */
 	if (reply->code == RDNS_RC_NOERROR) {
-		lua_newtable (cd->L);
+		lua_newtable (L);
 		LL_FOREACH (reply->entries, elt)
 		{
 			switch (elt->type) {
 			case RDNS_REQUEST_A:
 				addr = rspamd_inet_address_new (AF_INET, &elt->content.a.addr);
-				rspamd_lua_ip_push (cd->L, addr);
+				rspamd_lua_ip_push (L, addr);
 				rspamd_inet_address_destroy (addr);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_AAAA:
 				addr = rspamd_inet_address_new (AF_INET6, &elt->content.aaa.addr);
-				rspamd_lua_ip_push (cd->L, addr);
+				rspamd_lua_ip_push (L, addr);
 				rspamd_inet_address_destroy (addr);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_PTR:
-				lua_pushstring (cd->L, elt->content.ptr.name);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.ptr.name);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_TXT:
 			case RDNS_REQUEST_SPF:
-				lua_pushstring (cd->L, elt->content.txt.data);
-				lua_rawseti (cd->L, -2, ++i);
+				lua_pushstring (L, elt->content.txt.data);
+				lua_rawseti (L, -2, ++i);
 				break;
 			case RDNS_REQUEST_MX:
 				/* mx['name'], mx['priority'] */
-				lua_newtable (cd->L);
-				rspamd_lua_table_set (cd->L, "name", elt->content.mx.name);
-				lua_pushstring (cd->L, "priority");
-				lua_pushnumber (cd->L, elt->content.mx.priority);
-				lua_settable (cd->L, -3);
+				lua_newtable (L);
+				rspamd_lua_table_set (L, "name", elt->content.mx.name);
+				lua_pushstring (L, "priority");
+				lua_pushnumber (L, elt->content.mx.priority);
+				lua_settable (L, -3);
 
-				lua_rawseti (cd->L, -2, ++i);
+				lua_rawseti (L, -2, ++i);
 				break;
 			}
 		}
-		lua_pushnil (cd->L);
+		lua_pushnil (L);
 	}
 	else {
-		lua_pushnil (cd->L);
-		lua_pushstring (cd->L, rdns_strerror (reply->code));
+		lua_pushnil (L);
+		lua_pushstring (L, rdns_strerror (reply->code));
+	}
+}
+
+static void
+lua_dns_callback (struct rdns_reply *reply, gpointer arg)
+{
+	struct lua_dns_cbdata *cd = arg;
+	struct rspamd_dns_resolver **presolver;
+
+	if (cd->thread) {
+		/* Wake up the suspended coroutine with results */
+		lua_dns_push_results (cd->thread->lua_state, reply);
+		lua_thread_pool_resume (cd->thread_pool, cd->thread, 2);
+
+		if (cd->s) {
+			rspamd_session_watcher_pop (cd->s, cd->w);
+		}
+
+		return;
 	}
 
+	lua_rawgeti (cd->L, LUA_REGISTRYINDEX, cd->cbref);
+	presolver = lua_newuserdata (cd->L, sizeof (gpointer));
+	rspamd_lua_setclass (cd->L, "rspamd{resolver}", -1);
+
+	*presolver = cd->resolver;
+	lua_pushstring (cd->L, cd->to_resolve);
+	lua_dns_push_results (cd->L, reply);
+
 	if (cd->user_str != NULL) {
 		lua_pushstring (cd->L, cd->user_str);
 	}
@@ -267,6 +304,7 @@ lua_dns_resolver_resolve_common (lua_State *L,
 	rspamd_mempool_t *pool = NULL, **ppool;
 	const gchar *to_resolve, *user_str = NULL;
 	struct lua_dns_cbdata *cbdata;
+	struct thread_entry *thread = NULL;
 	gint cbref = -1;
 	struct rspamd_task *task = NULL;
 
@@ -302,13 +340,20 @@ lua_dns_resolver_resolve_common (lua_State *L,
 		lua_pushstring (L, "callback");
 		lua_gettable (L, -2);
 
-		if (to_resolve == NULL || lua_type (L, -1) != LUA_TFUNCTION) {
+		if (to_resolve == NULL) {
 			lua_pop (L, 2);
 			msg_err ("DNS request has bad params");
 			lua_pushboolean (L, FALSE);
 			return 1;
 		}
-		cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+
+		if (lua_type (L, -1) == LUA_TFUNCTION) {
+			cbref = luaL_ref (L, LUA_REGISTRYINDEX);
+		}
+		else {
+			/* Can be a coroutine request, checked when task is known */
+			lua_pop (L, 1);
+		}
 
 		lua_pushstring (L, "task");
 		lua_gettable (L, -2);
@@ -349,11 +394,22 @@ lua_dns_resolver_resolve_common (lua_State *L,
 		lua_pop (L, 1);
 
 		lua_pop (L, 1);
+
+		if (cbref == -1 && task != NULL) {
+			thread = lua_thread_pool_get_running_entry (
+					task->cfg->lua_thread_pool, L);
+		}
 	}
 
-	if (pool != NULL && session != NULL && to_resolve != NULL && cbref != -1) {
+	if (pool != NULL && session != NULL && to_resolve != NULL &&
+			(cbref != -1 || thread != NULL)) {
 		cbdata = rspamd_mempool_alloc0 (pool, sizeof (struct lua_dns_cbdata));
-		cbdata->L = L;
+		cbdata->L = rspamd_lua_main_state (L);
+		cbdata->thread = thread;
+
+		if (thread) {
+			cbdata->thread_pool = task->cfg->lua_thread_pool;
+		}
 		cbdata->resolver = resolver;
 		cbdata->cbref = cbref;
 		cbdata->user_str = rspamd_mempool_strdup (pool, user_str);
@@ -404,13 +460,25 @@ lua_dns_resolver_resolve_common (lua_State *L,
 					cbdata,
 					type,
 					to_resolve)) {
-				lua_pushboolean (L, TRUE);
 				cbdata->s = session;
 				cbdata->w = rspamd_session_get_watcher (session);
 				rspamd_session_watcher_push (session);
+
+				if (thread) {
+					/* Results are passed to lua_resume in the callback */
+					return lua_yield (L, 0);
+				}
+
+				lua_pushboolean (L, TRUE);
 			}
 			else {
 				lua_pushnil (L);
+
+				if (thread) {
+					lua_pushstring (L, "cannot make DNS request");
+
+					return 2;
+				}
 			}
 		}
 	}
@@ -90,13 +90,26 @@ lua_http_global_resolver (struct event_base *ev_base)
 	return global_resolver;
 }
 
+static void
+lua_http_keepalive_key (struct lua_http_cbdata *cbd, gchar *buf, gsize len)
+{
+	rspamd_snprintf (buf, len, "%s:%d",
+			rspamd_inet_address_to_string (cbd->addr),
+			(gint)rspamd_inet_address_get_port (cbd->addr));
+}
+
 static void
 lua_http_fin (gpointer arg)
 {
 	struct lua_http_cbdata *cbd = (struct lua_http_cbdata *)arg;
+	gchar key[128];
 
 	luaL_unref (cbd->L, LUA_REGISTRYINDEX, cbd->cbref);
 	if (cbd->conn) {
+		/* Socket is either closed or kept for the subsequent requests */
+		lua_http_keepalive_key (cbd, key, sizeof (key));
+		rspamd_http_keepalive_release (cbd->conn, key, cbd->ev_base);
+		cbd->fd = -1;
 		/* Here we already have a connection, so we need to unref it */
 		rspamd_http_connection_unref (cbd->conn);
 	}
@@ -186,9 +199,15 @@ static gboolean
 lua_http_make_connection (struct lua_http_cbdata *cbd)
 {
 	int fd;
+	gchar key[128];
 
 	rspamd_inet_address_set_port (cbd->addr, cbd->msg->port);
-	fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+	lua_http_keepalive_key (cbd, key, sizeof (key));
+	fd = rspamd_http_keepalive_get (key, NULL, NULL);
+
+	if (fd == -1) {
+		fd = rspamd_inet_address_connect (cbd->addr, SOCK_STREAM, TRUE);
+	}
 
 	if (fd == -1) {
 		msg_info ("cannot connect to %V", cbd->msg->host);
@@ -196,7 +215,8 @@ lua_http_make_connection (struct lua_http_cbdata *cbd)
 	}
 	cbd->fd = fd;
 	cbd->conn = rspamd_http_connection_new (NULL, lua_http_error_handler,
-			lua_http_finish_handler, RSPAMD_HTTP_CLIENT_SIMPLE,
+			lua_http_finish_handler,
+			RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
 			RSPAMD_HTTP_CLIENT, NULL);
 
 	rspamd_http_connection_write_message (cbd->conn, cbd->msg,
@@ -433,7 +453,7 @@ lua_http_request (lua_State *L)
 	}
 
 	cbd = g_slice_alloc0 (sizeof (*cbd));
-	cbd->L = L;
+	cbd->L = rspamd_lua_main_state (L);
 	cbd->cbref = cbref;
 	cbd->msg = msg;
 	cbd->ev_base = ev_base;
@@ -23,6 +23,8 @@
 
 #include "lua_common.h"
 #include "dns.h"
+#include "upstream.h"
+#include "redis_pool.h"
 
 #ifdef WITH_HIREDIS
 #include "hiredis/hiredis.h"
@@ -72,14 +74,23 @@ struct lua_redis_userdata {
 	redisAsyncContext *ctx;
 	lua_State *L;
 	struct rspamd_task *task;
+	struct rspamd_redis_pool *pool;
+	struct upstream *up;
 	struct event timeout;
-	gchar *server;
-	gchar *reqline;
 	gchar **args;
 	gint cbref;
 	guint nargs;
-	guint16 port;
 	guint16 terminated;
+	struct lua_redis_request *req;
+};
+
+/*
+ * Reply callback argument, it outlives userdata if the task is finished
+ * before the reply arrives: the reply must still be read from the
+ * connection shared with other requests
+ */
+struct lua_redis_request {
+	struct lua_redis_userdata *ud;
 };
 
 static void
@@ -100,14 +111,24 @@ static void
 lua_redis_fin (void *arg)
 {
 	struct lua_redis_userdata *ud = arg;
+	redisAsyncContext *ctx;
+
+	ud->terminated = 1;
 
 	if (ud->ctx) {
-		ud->terminated = 1;
-		redisAsyncFree (ud->ctx);
-		lua_redis_free_args (ud);
-		event_del (&ud->timeout);
-		luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+		/*
+		 * Reply has not been received yet: detach it from this request and
+		 * release the connection, as other requests may be pipelined over it
+		 */
+		ctx = ud->ctx;
+		ud->ctx = NULL;
+		ud->req->ud = NULL;
+		rspamd_redis_pool_release_connection (ud->pool, ctx, FALSE);
 	}
+
+	lua_redis_free_args (ud);
+	event_del (&ud->timeout);
+	luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
 }
 
 /**
@@ -117,8 +138,7 @@ lua_redis_fin (void *arg)
  */
 static void
 lua_redis_push_error (const gchar *err,
-	struct lua_redis_userdata *ud,
-	gboolean connected)
+	struct lua_redis_userdata *ud)
 {
 	struct rspamd_task **ptask;
 
@@ -136,9 +156,7 @@ lua_redis_push_error (const gchar *err,
 		msg_info ("call to callback failed: %s", lua_tostring (ud->L, -1));
 	}
 
-	if (connected) {
-		rspamd_session_remove_event (ud->task->s, lua_redis_fin, ud);
-	}
+	rspamd_session_remove_event (ud->task->s, lua_redis_fin, ud);
 }
 
 static void
@@ -209,32 +227,59 @@ static void
 lua_redis_callback (redisAsyncContext *c, gpointer r, gpointer priv)
 {
 	redisReply *reply = r;
-	struct lua_redis_userdata *ud = priv;
+	struct lua_redis_request *req = priv;
+	struct lua_redis_userdata *ud = req->ud;
+
+	g_slice_free1 (sizeof (*req), req);
 
-	if (ud->terminated) {
-		/* We are already at the termination stage, just go out */
+	if (ud == NULL || ud->terminated) {
+		/*
+		 * Request has been already finished, connection has been released
+		 * by fin, so just go out
+		 */
+		return;
+	}
+
+	/*
+	 * Our part of the pipeline is done, so the connection can be used by
+	 * other requests. Context is still valid here, as hiredis defers its
+	 * destruction until callback returns.
+	 */
+	ud->ctx = NULL;
+	rspamd_redis_pool_release_connection (ud->pool, c, r == NULL);
+
+	if (rspamd_session_is_destroying (ud->task->s)) {
+		/* Connection is closed by another client, fin is called by session */
 		return;
 	}
 
 	if (c->err == 0) {
 		if (r != NULL) {
+			if (ud->up) {
+				rspamd_upstream_ok (ud->up);
+			}
+
 			if (reply->type != REDIS_REPLY_ERROR) {
 				lua_redis_push_data (reply, ud);
 			}
 			else {
-				lua_redis_push_error (reply->str, ud, TRUE);
+				lua_redis_push_error (reply->str, ud);
 			}
 		}
 		else {
-			lua_redis_push_error ("received no data from server", ud, TRUE);
+			lua_redis_push_error ("received no data from server", ud);
 		}
 	}
 	else {
+		if (ud->up) {
+			rspamd_upstream_fail (ud->up);
+		}
+
 		if (c->err == REDIS_ERR_IO) {
-			lua_redis_push_error (strerror (errno), ud, TRUE);
+			lua_redis_push_error (strerror (errno), ud);
 		}
 		else {
-			lua_redis_push_error (c->errstr, ud, TRUE);
+			lua_redis_push_error (c->errstr, ud);
 		}
 	}
 }
@@ -243,9 +288,26 @@ static void
 lua_redis_timeout (int fd, short what, gpointer u)
 {
 	struct lua_redis_userdata *ud = u;
+	redisAsyncContext *ctx;
 
 	msg_info ("timeout while querying redis server");
-	lua_redis_push_error ("timeout while connecting the server", ud, TRUE);
+
+	if (ud->up) {
+		rspamd_upstream_fail (ud->up);
+	}
+
+	if (ud->ctx) {
+		/*
+		 * Connection cannot be reused as the reply may arrive later and would
+		 * be read by the next request, so it is closed by the pool
+		 */
+		ctx = ud->ctx;
+		ud->ctx = NULL;
+		ud->req->ud = NULL;
+		rspamd_redis_pool_release_connection (ud->pool, ctx, TRUE);
+	}
+
+	lua_redis_push_error ("timeout while connecting the server", ud);
 }
 
 
@@ -258,7 +320,7 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 
 	if (idx != 0 && lua_type (L, idx) == LUA_TTABLE) {
 		/* Get all arguments */
-		lua_pushvalue (L, 5);
+		lua_pushvalue (L, idx);
 		lua_pushnil (L);
 		top = 0;
 
@@ -275,7 +337,9 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 		top = 1;
 
 		while (lua_next (L, -2) != 0) {
-			args[top++] = g_strdup (lua_tostring (L, -1));
+			if (lua_isstring (L, -1)) {
+				args[top++] = g_strdup (lua_tostring (L, -1));
+			}
 			lua_pop (L, 1);
 		}
 
@@ -292,26 +356,39 @@ lua_redis_parse_args (lua_State *L, gint idx, const gchar *cmd,
 	ud->args = args;
 }
 
-static void
-lua_redis_connect_cb (const struct redisAsyncContext *c, int status)
+/*
+ * Server can be specified either as an ip address or as an upstream object,
+ * in the latter case we also mark upstream as failed or alive
+ */
+static rspamd_inet_addr_t *
+lua_redis_get_server (lua_State *L, gint idx, struct upstream **pup)
 {
-	/*
-	 * Workaround to prevent double close:
-	 * https://groups.google.com/forum/#!topic/redis-db/mQm46XkIPOY
-	 */
-#if defined(HIREDIS_MAJOR) && HIREDIS_MAJOR == 0 && HIREDIS_MINOR <= 11
-	struct redisAsyncContext *nc = (struct redisAsyncContext *)c;
-	if (status == REDIS_ERR) {
-		nc->c.fd = -1;
+	struct rspamd_lua_ip **pip;
+	struct upstream **up;
+
+	if ((up = rspamd_lua_check_class (L, idx, "rspamd{upstream}")) != NULL &&
+			*up != NULL) {
+		*pup = *up;
+
+		return rspamd_upstream_addr (*up);
 	}
-#endif
+	else if ((pip = rspamd_lua_check_class (L, idx, "rspamd{ip}")) != NULL &&
+			*pip != NULL) {
+		*pup = NULL;
+
+		return (*pip)->addr;
+	}
+
+	return NULL;
 }
 
 /***
  * @function rspamd_redis.make_request({params})
- * Make request to redis server, params is a table of key=value arguments in any order
+ * Make request to redis server, params is a table of key=value arguments in any order.
+ * Connections are taken from the per-worker pool, so requests to the same server
+ * are pipelined over the already established connections.
  * @param {task} task worker task object
- * @param {ip} host server address
+ * @param {ip|upstream} host server address or an upstream, upstreams are marked as failed or alive automatically
  * @param {function} callback callback to be called in form `function (task, err, data)`
  * @param {string} cmd command to be sent to redis
  * @param {table} args numeric array of strings used as redis arguments
@@ -321,8 +398,9 @@ lua_redis_connect_cb (const struct redisAsyncContext *c, int status)
 static int
 lua_redis_make_request (lua_State *L)
 {
-	struct lua_redis_userdata *ud;
-	struct rspamd_lua_ip *addr = NULL;
+	struct lua_redis_userdata *ud = NULL;
+	rspamd_inet_addr_t *addr = NULL;
+	struct upstream *up = NULL;
 	struct rspamd_task *task = NULL;
 	const gchar *cmd = NULL;
 	gint top, cbref = -1;
@@ -357,25 +435,27 @@ lua_redis_make_request (lua_State *L)
 
 		lua_pushstring (L, "host");
 		lua_gettable (L, -2);
-		if (lua_type (L, -1) == LUA_TUSERDATA) {
-			addr = lua_check_ip (L, -1);
-		}
+		addr = lua_redis_get_server (L, -1, &up);
 		lua_pop (L, 1);
 
 		lua_pushstring (L, "timeout");
 		lua_gettable (L, -2);
-		timeout = lua_tonumber (L, -1);
+		if (lua_type (L, -1) == LUA_TNUMBER) {
+			timeout = lua_tonumber (L, -1);
+		}
 		lua_pop (L, 1);
 
 		if (task != NULL && addr != NULL && cbref != -1 && cmd != NULL) {
 			ud =
-					rspamd_mempool_alloc (task->task_pool,
+					rspamd_mempool_alloc0 (task->task_pool,
 							sizeof (struct lua_redis_userdata));
 			ud->task = task;
-			ud->L = L;
+			ud->L = rspamd_lua_main_state (L);
 			ud->cbref = cbref;
 			lua_pushstring (L, "args");
+			lua_gettable (L, -2);
 			lua_redis_parse_args (L, -1, cmd, ud);
+			lua_pop (L, 1);
 			ret = TRUE;
 		}
 		else {
@@ -387,16 +467,16 @@ lua_redis_make_request (lua_State *L)
 		}
 	}
 	else if ((task = lua_check_task (L, 1)) != NULL) {
-		addr = lua_check_ip (L, 2);
+		addr = lua_redis_get_server (L, 2, &up);
 		top = lua_gettop (L);
 		/* Now get callback */
-		if (lua_isfunction (L, 3) && addr != NULL && addr->addr && top >= 4) {
+		if (lua_isfunction (L, 3) && addr != NULL && top >= 4) {
 			/* Create userdata */
 			ud =
-				rspamd_mempool_alloc (task->task_pool,
+				rspamd_mempool_alloc0 (task->task_pool,
 					sizeof (struct lua_redis_userdata));
 			ud->task = task;
-			ud->L = L;
+			ud->L = rspamd_lua_main_state (L);
 
 			/* Pop other arguments */
 			lua_pushvalue (L, 3);
@@ -420,27 +500,35 @@ lua_redis_make_request (lua_State *L)
 
 	if (ret) {
 		ud->terminated = 0;
-		ud->ctx = redisAsyncConnect (rspamd_inet_address_to_string (addr->addr),
-				rspamd_inet_address_get_port (addr->addr));
-		redisAsyncSetConnectCallback (ud->ctx, lua_redis_connect_cb);
+		ud->up = up;
+		ud->pool = task->cfg->redis_pool;
+		ud->ctx = rspamd_redis_pool_connect (ud->pool, task->ev_base,
+				rspamd_inet_address_to_string (addr),
+				rspamd_inet_address_get_port (addr));
 
-		if (ud->ctx == NULL || ud->ctx->err) {
+		if (ud->ctx == NULL) {
 			ud->terminated = 1;
-			redisAsyncFree (ud->ctx);
+
+			if (ud->up) {
+				rspamd_upstream_fail (ud->up);
+			}
+
 			lua_redis_free_args (ud);
 			luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
 			lua_pushboolean (L, FALSE);
 
 			return 1;
 		}
-		redisLibeventAttach (ud->ctx, ud->task->ev_base);
-		ret = redisAsyncCommandArgv (ud->ctx,
+
+		ud->req = g_slice_alloc (sizeof (*ud->req));
+		ud->req->ud = ud;
+
+		if (redisAsyncCommandArgv (ud->ctx,
 					lua_redis_callback,
-					ud,
+					ud->req,
 					ud->nargs,
 					(const gchar **)ud->args,
-					NULL);
-		if (ret == REDIS_OK) {
+					NULL) == REDIS_OK) {
 			rspamd_session_add_event (ud->task->s,
 					lua_redis_fin,
 					ud,
@@ -454,9 +542,13 @@ lua_redis_make_request (lua_State *L)
 		else {
 			msg_info ("call to redis failed: %s", ud->ctx->errstr);
 			ud->terminated = 1;
+			g_slice_free1 (sizeof (*ud->req), ud->req);
+			/* Connection is closed by pool if it is in error state */
+			rspamd_redis_pool_release_connection (ud->pool, ud->ctx, FALSE);
+			ud->ctx = NULL;
 			lua_redis_free_args (ud);
-			redisAsyncFree (ud->ctx);
 			luaL_unref (ud->L, LUA_REGISTRYINDEX, ud->cbref);
+			ret = FALSE;
 		}
 	}
 
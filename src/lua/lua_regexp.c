@@ -23,6 +23,10 @@
 
 #include "lua_common.h"
 #include "regexp.h"
+#include "libserver/re_cache.h"
+#ifdef WITH_HYPERSCAN
+#include "hs.h"
+#endif
 
 /***
  * @module rspamd_regexp
@@ -35,6 +39,12 @@
  * re:match('some_string')
  * local re = rspamd_regexp.create_cached('/\\s+/i')
  * re:split('word word   word') -- returns ['word', 'word', 'word']
+ *
+ * Large sets of regular expressions should be registered once as a regexp set,
+ * so all of them are matched in a single native pass:
+ * local set = rspamd_regexp.create_set({'/^foo/i', '/bar$/', '/baz/'})
+ * local matched = set:match_task(task, 'header', 'Subject')
+ * -- matched is an array of matched patterns indices, e.g. {1, 3}
  */
 
 LUA_FUNCTION_DEF (regexp, create);
@@ -48,6 +58,13 @@ LUA_FUNCTION_DEF (regexp, matchn);
 LUA_FUNCTION_DEF (regexp, split);
 LUA_FUNCTION_DEF (regexp, destroy);
 LUA_FUNCTION_DEF (regexp, gc);
+LUA_FUNCTION_DEF (regexp, create_set);
+LUA_FUNCTION_DEF (regexp_set, match);
+LUA_FUNCTION_DEF (regexp_set, match_task);
+LUA_FUNCTION_DEF (regexp_set, get_pattern);
+LUA_FUNCTION_DEF (regexp_set, set_limit);
+LUA_FUNCTION_DEF (regexp_set, size);
+LUA_FUNCTION_DEF (regexp_set, gc);
 
 static const struct luaL_reg regexplib_m[] = {
 	LUA_INTERFACE_DEF (regexp, get_pattern),
@@ -61,8 +78,20 @@ static const struct luaL_reg regexplib_m[] = {
 	{"__gc", lua_regexp_gc},
 	{NULL, NULL}
 };
+static const struct luaL_reg regexpsetlib_m[] = {
+	LUA_INTERFACE_DEF (regexp_set, match),
+	LUA_INTERFACE_DEF (regexp_set, match_task),
+	LUA_INTERFACE_DEF (regexp_set, get_pattern),
+	LUA_INTERFACE_DEF (regexp_set, set_limit),
+	LUA_INTERFACE_DEF (regexp_set, size),
+	{"__len", lua_regexp_set_size},
+	{"__tostring", rspamd_lua_class_tostring},
+	{"__gc", lua_regexp_set_gc},
+	{NULL, NULL}
+};
 static const struct luaL_reg regexplib_f[] = {
 	LUA_INTERFACE_DEF (regexp, create),
+	LUA_INTERFACE_DEF (regexp, create_set),
 	LUA_INTERFACE_DEF (regexp, get_cached),
 	LUA_INTERFACE_DEF (regexp, create_cached),
 	{NULL, NULL}
@@ -73,6 +102,22 @@ static const struct luaL_reg regexplib_f[] = {
 
 rspamd_mempool_t *regexp_static_pool = NULL;
 
+struct rspamd_lua_regexp_set {
+	GPtrArray *res;
+	gsize match_limit;
+	/* Alternations of patterns, see `struct rspamd_lua_regexp_chunk` */
+	GArray *chunks;
+	/* Indices of patterns that are matched one by one */
+	GArray *single;
+	GArray *captures;
+#ifdef WITH_HYPERSCAN
+	hs_database_t *hs_db;
+	hs_scratch_t *hs_scratch;
+	/* Patterns whose hyperscan matches need no pcre confirmation */
+	guchar *hs_exact;
+#endif
+};
+
 static struct rspamd_lua_regexp *
 lua_check_regexp (lua_State * L)
 {
@@ -634,6 +679,831 @@ lua_regexp_gc (lua_State *L)
 	return 0;
 }
 
+/*
+ * Patterns that cannot be compiled to hyperscan are joined to alternations of
+ * this size, so a single pcre search rejects all of them at once
+ */
+#define LUA_REGEXP_SET_CHUNK 32
+
+/* A number of set patterns combined to a single pcre alternation */
+struct rspamd_lua_regexp_chunk {
+	rspamd_regexp_t *re;
+	/* Indices of patterns in the set */
+	guint *ids;
+	/* Capture group that wraps each alternative */
+	guint *groups;
+	guint n;
+};
+
+static struct rspamd_lua_regexp_set *
+lua_check_regexp_set (lua_State * L)
+{
+	void *ud = luaL_checkudata (L, 1, "rspamd{regexp_set}");
+
+	luaL_argcheck (L, ud != NULL, 1, "'regexp_set' expected");
+	return ud ? *((struct rspamd_lua_regexp_set **)ud) : NULL;
+}
+
+/*
+ * Checks if a pattern could be safely wrapped into a group of an alternation:
+ * it must not depend on groups numbering, must not affect the rest of the
+ * alternation and must be matched the same way for raw and utf8 input
+ */
+static gboolean
+lua_regexp_set_can_combine (rspamd_regexp_t *re)
+{
+	const gchar *pat, *p, *c;
+	gint flags;
+
+	flags = rspamd_regexp_get_flags (re);
+
+	if (!(flags & RSPAMD_REGEXP_FLAG_RAW) ||
+			(flags & (RSPAMD_REGEXP_FLAG_FULL_MATCH|RSPAMD_REGEXP_FLAG_EXTENDED))) {
+		return FALSE;
+	}
+
+	if (rspamd_regexp_get_nbackrefs (re) > 0) {
+		return FALSE;
+	}
+
+	pat = rspamd_regexp_get_pattern (re);
+
+	if (strstr (pat, "\\Q") || strstr (pat, "\\g") || strstr (pat, "(*")) {
+		return FALSE;
+	}
+
+	for (p = strstr (pat, "(?"); p != NULL; p = strstr (p + 2, "(?")) {
+		/* Recursion and subroutine calls */
+		if (p[2] == 'R' || p[2] == '&' || p[2] == '+' ||
+				g_ascii_isdigit (p[2]) ||
+				(p[2] == 'P' && p[3] == '>') ||
+				(p[2] == '-' && g_ascii_isdigit (p[3]))) {
+			return FALSE;
+		}
+
+		/* Inline extended mode */
+		for (c = p + 2; g_ascii_isalpha (*c) || *c == '-'; c ++) {
+			if (*c == 'x') {
+				return FALSE;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+lua_regexp_set_add_chunk (struct rspamd_lua_regexp_set *set,
+		const guint *ids, guint n)
+{
+	struct rspamd_lua_regexp_chunk chunk;
+	rspamd_regexp_t *re;
+	GString *pat;
+	GError *err = NULL;
+	guint i, group = 1;
+	gint flags;
+
+	chunk.ids = g_malloc (sizeof (*chunk.ids) * n);
+	chunk.groups = g_malloc (sizeof (*chunk.groups) * n);
+	chunk.n = n;
+	pat = g_string_sized_new (128);
+
+	for (i = 0; i < n; i ++) {
+		re = g_ptr_array_index (set->res, ids[i]);
+		flags = rspamd_regexp_get_flags (re);
+		chunk.ids[i] = ids[i];
+		chunk.groups[i] = group;
+		group += rspamd_regexp_get_ncaptures (re) + 1;
+
+		if (i > 0) {
+			g_string_append_c (pat, '|');
+		}
+
+		g_string_append_c (pat, '(');
+
+		/* Options set inside a group are not applied outside of it */
+		if (flags & (RSPAMD_REGEXP_FLAG_CASELESS|RSPAMD_REGEXP_FLAG_MULTILINE|
+				RSPAMD_REGEXP_FLAG_DOTALL)) {
+			g_string_append (pat, "(?");
+
+			if (flags & RSPAMD_REGEXP_FLAG_CASELESS) {
+				g_string_append_c (pat, 'i');
+			}
+			if (flags & RSPAMD_REGEXP_FLAG_MULTILINE) {
+				g_string_append_c (pat, 'm');
+			}
+			if (flags & RSPAMD_REGEXP_FLAG_DOTALL) {
+				g_string_append_c (pat, 's');
+			}
+
+			g_string_append_c (pat, ')');
+		}
+
+		g_string_append (pat, rspamd_regexp_get_pattern (re));
+		g_string_append_c (pat, ')');
+	}
+
+	chunk.re = rspamd_regexp_new (pat->str, "", &err);
+	g_string_free (pat, TRUE);
+
+	if (chunk.re == NULL) {
+		msg_info ("cannot combine %ud regexps, match them one by one: %s", n,
+				err == NULL ? "undefined" : err->message);
+
+		if (err) {
+			g_error_free (err);
+		}
+
+		g_free (chunk.ids);
+		g_free (chunk.groups);
+
+		return FALSE;
+	}
+
+	g_array_append_val (set->chunks, chunk);
+
+	return TRUE;
+}
+
+/* Joins patterns to alternations, patterns that cannot be joined stay single */
+static void
+lua_regexp_set_compile_pcre (struct rspamd_lua_regexp_set *set, GArray *ids)
+{
+	GArray *combined;
+	rspamd_regexp_t *re;
+	guint i, id, n;
+
+	combined = g_array_new (FALSE, FALSE, sizeof (guint));
+
+	for (i = 0; i < ids->len; i ++) {
+		id = g_array_index (ids, guint, i);
+		re = g_ptr_array_index (set->res, id);
+
+		if (lua_regexp_set_can_combine (re)) {
+			g_array_append_val (combined, id);
+		}
+		else {
+			g_array_append_val (set->single, id);
+		}
+	}
+
+	for (i = 0; i < combined->len; i += LUA_REGEXP_SET_CHUNK) {
+		n = MIN (LUA_REGEXP_SET_CHUNK, combined->len - i);
+
+		/* Single pattern is matched faster by itself */
+		if (n == 1 || !lua_regexp_set_add_chunk (set,
+				&g_array_index (combined, guint, i), n)) {
+			g_array_append_vals (set->single,
+					&g_array_index (combined, guint, i), n);
+		}
+	}
+
+	g_array_free (combined, TRUE);
+}
+
+#ifdef WITH_HYPERSCAN
+static guint
+lua_regexp_set_hs_flags (rspamd_regexp_t *re)
+{
+	gint flags = rspamd_regexp_get_flags (re);
+	guint hs_flags = HS_FLAG_ALLOWEMPTY|HS_FLAG_SINGLEMATCH;
+
+	if (flags & RSPAMD_REGEXP_FLAG_CASELESS) {
+		hs_flags |= HS_FLAG_CASELESS;
+	}
+	if (flags & RSPAMD_REGEXP_FLAG_MULTILINE) {
+		hs_flags |= HS_FLAG_MULTILINE;
+	}
+	if (flags & RSPAMD_REGEXP_FLAG_DOTALL) {
+		hs_flags |= HS_FLAG_DOTALL;
+	}
+
+	return hs_flags;
+}
+
+/*
+ * Compiles all supported patterns to a single hyperscan database. Patterns
+ * that hyperscan can only approximate are compiled in prefilter mode and
+ * their matches are confirmed by pcre. Unsupported patterns are appended to
+ * `rest`.
+ */
+static void
+lua_regexp_set_compile_hs (struct rspamd_lua_regexp_set *set, GArray *rest)
+{
+	rspamd_regexp_t *re;
+	hs_expr_info_t *info;
+	hs_compile_error_t *hs_errors;
+	const gchar **hs_pats;
+	guint *hs_flags, *hs_ids, i, j, n = 0, flags;
+	gint rc;
+
+	hs_pats = g_malloc (sizeof (*hs_pats) * set->res->len);
+	hs_flags = g_malloc (sizeof (*hs_flags) * set->res->len);
+	hs_ids = g_malloc (sizeof (*hs_ids) * set->res->len);
+	set->hs_exact = g_malloc0 (NBYTES (set->res->len));
+
+	for (i = 0; i < set->res->len; i ++) {
+		re = g_ptr_array_index (set->res, i);
+
+		if (re == NULL) {
+			continue;
+		}
+
+		/* Utf8 patterns are matched differently for raw input */
+		if (!(rspamd_regexp_get_flags (re) & RSPAMD_REGEXP_FLAG_RAW) ||
+				(rspamd_regexp_get_flags (re) & RSPAMD_REGEXP_FLAG_EXTENDED)) {
+			g_array_append_val (rest, i);
+			continue;
+		}
+
+		flags = lua_regexp_set_hs_flags (re);
+		hs_errors = NULL;
+		info = NULL;
+
+		if (!(rspamd_regexp_get_flags (re) & RSPAMD_REGEXP_FLAG_FULL_MATCH) &&
+				hs_expression_info (rspamd_regexp_get_pattern (re), flags,
+						&info, &hs_errors) == HS_SUCCESS) {
+			setbit (set->hs_exact, i);
+		}
+		else {
+			if (hs_errors) {
+				hs_free_compile_error (hs_errors);
+				hs_errors = NULL;
+			}
+
+			flags |= HS_FLAG_PREFILTER;
+
+			if (hs_expression_info (rspamd_regexp_get_pattern (re), flags,
+					&info, &hs_errors) != HS_SUCCESS) {
+				if (hs_errors) {
+					hs_free_compile_error (hs_errors);
+				}
+
+				g_array_append_val (rest, i);
+				continue;
+			}
+		}
+
+		if (info) {
+			g_free (info);
+		}
+
+		hs_pats[n] = rspamd_regexp_get_pattern (re);
+		hs_flags[n] = flags;
+		hs_ids[n] = i;
+		n ++;
+	}
+
+	while (n > 0) {
+		rc = hs_compile_multi (hs_pats, hs_flags, hs_ids, n, HS_MODE_BLOCK,
+				NULL, &set->hs_db, &hs_errors);
+
+		if (rc == HS_SUCCESS) {
+			break;
+		}
+
+		set->hs_db = NULL;
+
+		if (hs_errors->expression < 0) {
+			/* Not a problem of a specific pattern, use pcre for all */
+			msg_info ("cannot compile regexp set to hyperscan: %s",
+					hs_errors->message);
+			hs_free_compile_error (hs_errors);
+			g_array_append_vals (rest, hs_ids, n);
+			n = 0;
+			break;
+		}
+
+		/* Exclude the failed pattern and try again */
+		j = hs_errors->expression;
+		msg_info ("cannot compile %s to hyperscan: %s", hs_pats[j],
+				hs_errors->message);
+		hs_free_compile_error (hs_errors);
+		g_array_append_val (rest, hs_ids[j]);
+		n --;
+		memmove (&hs_pats[j], &hs_pats[j + 1], (n - j) * sizeof (*hs_pats));
+		memmove (&hs_flags[j], &hs_flags[j + 1], (n - j) * sizeof (*hs_flags));
+		memmove (&hs_ids[j], &hs_ids[j + 1], (n - j) * sizeof (*hs_ids));
+	}
+
+	if (set->hs_db != NULL &&
+			hs_alloc_scratch (set->hs_db, &set->hs_scratch) != HS_SUCCESS) {
+		msg_info ("cannot allocate hyperscan scratch for regexp set");
+		hs_free_database (set->hs_db);
+		set->hs_db = NULL;
+		g_array_append_vals (rest, hs_ids, n);
+	}
+
+	g_free (hs_pats);
+	g_free (hs_flags);
+	g_free (hs_ids);
+}
+#endif
+
+static void
+lua_regexp_set_compile (struct rspamd_lua_regexp_set *set)
+{
+	GArray *rest;
+#ifndef WITH_HYPERSCAN
+	guint i;
+#endif
+
+	rest = g_array_new (FALSE, FALSE, sizeof (guint));
+	set->chunks = g_array_new (FALSE, FALSE,
+			sizeof (struct rspamd_lua_regexp_chunk));
+	set->single = g_array_new (FALSE, FALSE, sizeof (guint));
+	set->captures = g_array_new (FALSE, TRUE, sizeof (struct rspamd_re_capture));
+
+#ifdef WITH_HYPERSCAN
+	lua_regexp_set_compile_hs (set, rest);
+#else
+	for (i = 0; i < set->res->len; i ++) {
+		if (g_ptr_array_index (set->res, i) != NULL) {
+			g_array_append_val (rest, i);
+		}
+	}
+#endif
+
+	lua_regexp_set_compile_pcre (set, rest);
+	g_array_free (rest, TRUE);
+}
+
+/***
+ * @function rspamd_regexp.create_set(patterns[, flags])
+ * Creates a set of regular expressions that are matched all together in a
+ * single pass over the input. When rspamd is built with hyperscan, the set is
+ * compiled to a single hyperscan database, patterns that hyperscan cannot
+ * handle (and all patterns otherwise) are joined to pcre alternations, and
+ * the remaining ones, e.g. utf8 patterns or patterns with backreferences, are
+ * matched one by one. Invalid patterns are reported and never match, so
+ * indices of the set always correspond to the indices of `patterns`.
+ * @param {table} patterns array of patterns (strings) or regexp objects
+ * @param {string} flags optional flags applied to string patterns
+ * @return {regexp_set} new regexp set
+ * @example
+ * local rspamd_regexp = require "rspamd_regexp"
+ *
+ * local set = rspamd_regexp.create_set({'/^test/i', '/\\d{5}/'})
+ * local matched = set:match('Test 12345') -- {1, 2}
+ */
+static int
+lua_regexp_create_set (lua_State *L)
+{
+	struct rspamd_lua_regexp_set *set, **pset;
+	struct rspamd_lua_regexp **plre;
+	rspamd_regexp_t *re;
+	const gchar *string, *flags_str = NULL;
+	GError *err = NULL;
+	guint i, npat;
+
+	if (!lua_istable (L, 1)) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_type (L, 2) == LUA_TSTRING) {
+		flags_str = lua_tostring (L, 2);
+	}
+
+	npat = lua_objlen (L, 1);
+	set = g_slice_alloc0 (sizeof (*set));
+	set->res = g_ptr_array_sized_new (npat);
+
+	for (i = 1; i <= npat; i ++) {
+		re = NULL;
+		lua_rawgeti (L, 1, i);
+
+		if (lua_type (L, -1) == LUA_TSTRING) {
+			string = lua_tostring (L, -1);
+			re = rspamd_regexp_new (string, flags_str, &err);
+
+			if (re == NULL) {
+				msg_info ("cannot parse regexp: %s, error: %s",
+						string,
+						err == NULL ? "undefined" : err->message);
+
+				if (err) {
+					g_error_free (err);
+					err = NULL;
+				}
+			}
+		}
+		else {
+			plre = rspamd_lua_check_class (L, -1, "rspamd{regexp}");
+
+			if (plre != NULL && !IS_DESTROYED (*plre)) {
+				re = rspamd_regexp_ref ((*plre)->re);
+			}
+			else {
+				msg_info ("invalid regexp set element at position %d", i);
+			}
+		}
+
+		g_ptr_array_add (set->res, re);
+		lua_pop (L, 1);
+	}
+
+	lua_regexp_set_compile (set);
+
+	pset = lua_newuserdata (L, sizeof (*pset));
+	rspamd_lua_setclass (L, "rspamd{regexp_set}", -1);
+	*pset = set;
+
+	return 1;
+}
+
+#ifdef WITH_HYPERSCAN
+struct lua_regexp_set_hs_cbdata {
+	struct rspamd_lua_regexp_set *set;
+	const gchar *data;
+	gsize len;
+	gboolean raw;
+	guchar *matched;
+	guint nmatched;
+};
+
+static gint
+lua_regexp_set_hs_cb (unsigned int id,
+		unsigned long long from,
+		unsigned long long to,
+		unsigned int flags,
+		void *ud)
+{
+	struct lua_regexp_set_hs_cbdata *cbd = ud;
+	rspamd_regexp_t *re;
+
+	if (!isset (cbd->matched, id)) {
+		re = g_ptr_array_index (cbd->set->res, id);
+
+		/* Prefilter matches are approximate and must be confirmed by pcre */
+		if (isset (cbd->set->hs_exact, id) ||
+				rspamd_regexp_search (re, cbd->data, cbd->len, NULL, NULL,
+						cbd->raw, NULL)) {
+			setbit (cbd->matched, id);
+			cbd->nmatched ++;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+static guint
+lua_regexp_set_process_chunk (struct rspamd_lua_regexp_set *set,
+		struct rspamd_lua_regexp_chunk *chunk,
+		const gchar *data, gsize len, gboolean raw, guchar *matched)
+{
+	rspamd_regexp_t *re;
+	guint i, alt = 0, ret = 0;
+
+	for (i = 0; i < chunk->n; i ++) {
+		if (!isset (matched, chunk->ids[i])) {
+			break;
+		}
+	}
+
+	if (i == chunk->n) {
+		return 0;
+	}
+
+	if (!rspamd_regexp_search (chunk->re, data, len, NULL, NULL, TRUE,
+			set->captures)) {
+		return 0;
+	}
+
+	/*
+	 * The last group set belongs to the alternative that has matched, whilst
+	 * other patterns could still match elsewhere in the input
+	 */
+	for (i = 0; i < chunk->n && chunk->groups[i] < set->captures->len; i ++) {
+		alt = i;
+	}
+
+	for (i = 0; i < chunk->n; i ++) {
+		if (isset (matched, chunk->ids[i])) {
+			continue;
+		}
+
+		re = g_ptr_array_index (set->res, chunk->ids[i]);
+
+		if (i == alt ||
+				rspamd_regexp_search (re, data, len, NULL, NULL, raw, NULL)) {
+			setbit (matched, chunk->ids[i]);
+			ret ++;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Matches all regexps that have not been matched so far against the input,
+ * returns the number of matched regexps
+ */
+static guint
+lua_regexp_set_process (struct rspamd_lua_regexp_set *set,
+		const gchar *data, gsize len, gboolean raw, guchar *matched)
+{
+	rspamd_regexp_t *re;
+	guint i, id, ret = 0;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	if (set->match_limit > 0) {
+		len = MIN (len, set->match_limit);
+	}
+
+#ifdef WITH_HYPERSCAN
+	if (set->hs_db != NULL) {
+		struct lua_regexp_set_hs_cbdata cbd;
+
+		cbd.set = set;
+		cbd.data = data;
+		cbd.len = len;
+		cbd.raw = raw;
+		cbd.matched = matched;
+		cbd.nmatched = 0;
+
+		hs_scan (set->hs_db, data, len, 0, set->hs_scratch,
+				lua_regexp_set_hs_cb, &cbd);
+		ret += cbd.nmatched;
+	}
+#endif
+
+	for (i = 0; i < set->chunks->len; i ++) {
+		ret += lua_regexp_set_process_chunk (set,
+				&g_array_index (set->chunks, struct rspamd_lua_regexp_chunk, i),
+				data, len, raw, matched);
+	}
+
+	for (i = 0; i < set->single->len; i ++) {
+		id = g_array_index (set->single, guint, i);
+		re = g_ptr_array_index (set->res, id);
+
+		if (!isset (matched, id) &&
+				rspamd_regexp_search (re, data, len, NULL, NULL, raw, NULL)) {
+			setbit (matched, id);
+			ret ++;
+		}
+	}
+
+	return ret;
+}
+
+/* Pushes an array of matched indices (starting from 1) */
+static void
+lua_regexp_set_push_result (lua_State *L, struct rspamd_lua_regexp_set *set,
+		const guchar *matched, guint nmatched)
+{
+	guint i, cnt = 1;
+
+	lua_createtable (L, nmatched, 0);
+
+	for (i = 0; i < set->res->len && cnt <= nmatched; i ++) {
+		if (isset (matched, i)) {
+			lua_pushnumber (L, i + 1);
+			lua_rawseti (L, -2, cnt ++);
+		}
+	}
+}
+
+/***
+ * @method set:match(input[, raw_match])
+ * Matches all regexps of the set against the input
+ * @param {string|text|table} input string, text or array of strings to match
+ * @param {bool} raw_match match raw regexp instead of utf8 one
+ * @return {table} array of indices of matched regexps (empty if nothing matches)
+ */
+static int
+lua_regexp_set_match (lua_State *L)
+{
+	struct rspamd_lua_regexp_set *set = lua_check_regexp_set (L);
+	struct rspamd_lua_text *t;
+	const gchar *data;
+	guchar *matched;
+	gsize len;
+	guint nmatched = 0;
+	gboolean raw = FALSE;
+
+	if (set == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	if (lua_gettop (L) >= 3) {
+		raw = lua_toboolean (L, 3);
+	}
+
+	matched = g_malloc0 (NBYTES (set->res->len));
+
+	if (lua_type (L, 2) == LUA_TSTRING) {
+		data = lua_tolstring (L, 2, &len);
+		nmatched = lua_regexp_set_process (set, data, len, raw, matched);
+	}
+	else if (lua_type (L, 2) == LUA_TUSERDATA) {
+		t = lua_check_text (L, 2);
+
+		if (t != NULL) {
+			nmatched = lua_regexp_set_process (set, t->start, t->len, raw,
+					matched);
+		}
+	}
+	else if (lua_type (L, 2) == LUA_TTABLE) {
+		lua_pushvalue (L, 2);
+		lua_pushnil (L);
+
+		while (lua_next (L, -2) != 0) {
+			if (lua_type (L, -1) == LUA_TSTRING) {
+				data = lua_tolstring (L, -1, &len);
+				nmatched += lua_regexp_set_process (set, data, len, raw,
+						matched);
+			}
+
+			lua_pop (L, 1);
+		}
+
+		lua_pop (L, 1);
+	}
+
+	lua_regexp_set_push_result (L, set, matched, nmatched);
+	g_free (matched);
+
+	return 1;
+}
+
+/***
+ * @method set:match_task(task, type[, header[, strong]])
+ * Matches all regexps of the set against the specified content of a task. Each
+ * part of the content is traversed once for the whole set.
+ * @param {task} task task object
+ * @param {string} type type of content:
+ *   + `mime`: text parts
+ *   + `header`: decoded headers
+ *   + `rawheader`: raw headers
+ *   + `allheader`: all raw headers of a message
+ *   + `body`: raw message
+ *   + `url`: urls and emails
+ * @param {string} header header name for `header` and `rawheader` types
+ * @param {bool} strong match header name case sensitively
+ * @return {table} array of indices of matched regexps (empty if nothing matches)
+ */
+static int
+lua_regexp_set_match_task (lua_State *L)
+{
+	struct rspamd_lua_regexp_set *set = lua_check_regexp_set (L);
+	struct rspamd_task *task = lua_check_task (L, 2);
+	const gchar *type_str = luaL_checkstring (L, 3), *header = NULL;
+	enum rspamd_re_type type;
+	struct rspamd_re_input *in;
+	GArray *inputs;
+	guchar *matched;
+	guint i, nmatched = 0;
+	gboolean strong = FALSE;
+
+	if (set == NULL || task == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	type = rspamd_re_cache_type_from_string (type_str);
+
+	if (type == RSPAMD_RE_MAX) {
+		return luaL_error (L, "invalid content type: %s", type_str);
+	}
+
+	if (type == RSPAMD_RE_HEADER || type == RSPAMD_RE_RAWHEADER) {
+		header = luaL_checkstring (L, 4);
+
+		if (lua_gettop (L) >= 5) {
+			strong = lua_toboolean (L, 5);
+		}
+	}
+
+	matched = g_malloc0 (NBYTES (set->res->len));
+	inputs = rspamd_re_cache_get_inputs (task, type, header, strong);
+
+	for (i = 0; i < inputs->len && nmatched < set->res->len; i ++) {
+		in = &g_array_index (inputs, struct rspamd_re_input, i);
+		nmatched += lua_regexp_set_process (set, in->begin, in->len,
+				in->raw, matched);
+	}
+
+	g_array_free (inputs, TRUE);
+	lua_regexp_set_push_result (L, set, matched, nmatched);
+	g_free (matched);
+
+	return 1;
+}
+
+/***
+ * @method set:get_pattern(idx)
+ * Get pattern of regexp with the specified index
+ * @param {number} idx index of regexp (starting from 1)
+ * @return {string} pattern or `nil` if there is no valid regexp at `idx`
+ */
+static int
+lua_regexp_set_get_pattern (lua_State *L)
+{
+	struct rspamd_lua_regexp_set *set = lua_check_regexp_set (L);
+	gint idx = luaL_checknumber (L, 2);
+	rspamd_regexp_t *re;
+
+	if (set && idx > 0 && (guint)idx <= set->res->len) {
+		re = g_ptr_array_index (set->res, idx - 1);
+
+		if (re) {
+			lua_pushstring (L, rspamd_regexp_get_pattern (re));
+
+			return 1;
+		}
+	}
+
+	lua_pushnil (L);
+
+	return 1;
+}
+
+/***
+ * @method set:set_limit(lim)
+ * Set maximum size of text that is matched by regexps of the set
+ * @param {number} lim limit in bytes (0 means no limit)
+ */
+static int
+lua_regexp_set_set_limit (lua_State *L)
+{
+	struct rspamd_lua_regexp_set *set = lua_check_regexp_set (L);
+	gint64 lim = luaL_checknumber (L, 2);
+
+	if (set) {
+		set->match_limit = lim > 0 ? lim : 0;
+	}
+
+	return 0;
+}
+
+/***
+ * @method set:size()
+ * Returns number of elements in the set (including invalid ones)
+ * @return {number} size of the set
+ */
+static int
+lua_regexp_set_size (lua_State *L)
+{
+	struct rspamd_lua_regexp_set *set = lua_check_regexp_set (L);
+
+	if (set) {
+		lua_pushnumber (L, set->res->len);
+	}
+	else {
+		lua_pushnil (L);
+	}
+
+	return 1;
+}
+
+static gint
+lua_regexp_set_gc (lua_State *L)
+{
+	struct rspamd_lua_regexp_set *set = lua_check_regexp_set (L);
+	struct rspamd_lua_regexp_chunk *chunk;
+	rspamd_regexp_t *re;
+	guint i;
+
+	if (set) {
+		for (i = 0; i < set->res->len; i ++) {
+			re = g_ptr_array_index (set->res, i);
+
+			if (re) {
+				rspamd_regexp_unref (re);
+			}
+		}
+
+		for (i = 0; i < set->chunks->len; i ++) {
+			chunk = &g_array_index (set->chunks,
+					struct rspamd_lua_regexp_chunk, i);
+			rspamd_regexp_unref (chunk->re);
+			g_free (chunk->ids);
+			g_free (chunk->groups);
+		}
+
+#ifdef WITH_HYPERSCAN
+		if (set->hs_db) {
+			hs_free_database (set->hs_db);
+			hs_free_scratch (set->hs_scratch);
+		}
+
+		g_free (set->hs_exact);
+#endif
+
+		g_array_free (set->chunks, TRUE);
+		g_array_free (set->single, TRUE);
+		g_array_free (set->captures, TRUE);
+		g_ptr_array_free (set->res, TRUE);
+		g_slice_free1 (sizeof (*set), set);
+	}
+
+	return 0;
+}
+
 static gint
 lua_load_regexp (lua_State * L)
 {
@@ -657,6 +1527,19 @@ luaopen_regexp (lua_State * L)
 
 	luaL_register (L, NULL, regexplib_m);
 	rspamd_lua_add_preload (L, "rspamd_regexp", lua_load_regexp);
+	lua_pop (L, 1);
+
+	luaL_newmetatable (L, "rspamd{regexp_set}");
+	lua_pushstring (L, "__index");
+	lua_pushvalue (L, -2);
+	lua_settable (L, -3);
+
+	lua_pushstring (L, "class");
+	lua_pushstring (L, "rspamd{regexp_set}");
+	lua_rawset (L, -3);
+
+	luaL_register (L, NULL, regexpsetlib_m);
+	lua_pop (L, 1);
 
 	regexp_static_pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
 }
@@ -54,6 +54,17 @@ rspamd_config.DATE_IN_PAST = function(task)
 end
  */
 
+/* Task creation */
+/***
+ * @function rspamd_task.load_from_string(message, cfg)
+ * Creates a task from the specified message and parses it, no filters are
+ * called for the task. The task must be destroyed by `task:destroy()`
+ * @param {string} message text of message
+ * @param {rspamd_config} cfg config object
+ * @return {rspamd_task} new task or nil if the message cannot be parsed
+ */
+LUA_FUNCTION_DEF (task, load_from_string);
+
 /* Task methods */
 LUA_FUNCTION_DEF (task, get_message);
 LUA_FUNCTION_DEF (task, process_message);
@@ -487,6 +498,7 @@ LUA_FUNCTION_DEF (task, set_flag);
 LUA_FUNCTION_DEF (task, get_flags);
 
 static const struct luaL_reg tasklib_f[] = {
+	LUA_INTERFACE_DEF (task, load_from_string),
 	{NULL, NULL}
 };
 
@@ -605,6 +617,45 @@ lua_check_text (lua_State * L, gint pos)
 	return ud ? (struct rspamd_lua_text *)ud : NULL;
 }
 
+/* Task creation */
+static int
+lua_task_load_from_string (lua_State *L)
+{
+	struct rspamd_config *cfg = NULL;
+	struct rspamd_task *task;
+	const gchar *message;
+	gchar *copy;
+	gsize mlen;
+	void *ud;
+
+	message = luaL_checklstring (L, 1, &mlen);
+	ud = luaL_checkudata (L, 2, "rspamd{config}");
+	luaL_argcheck (L, ud != NULL, 2, "'config' expected");
+
+	if (ud) {
+		cfg = *((struct rspamd_config **)ud);
+	}
+
+	if (cfg == NULL || mlen == 0) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	task = rspamd_task_new (NULL, cfg);
+	copy = rspamd_mempool_alloc (task->task_pool, mlen);
+	memcpy (copy, message, mlen);
+
+	if (!rspamd_task_load_message (task, NULL, copy, mlen) ||
+			rspamd_message_parse (task) != 0) {
+		rspamd_task_free (task);
+		lua_pushnil (L);
+	}
+	else {
+		rspamd_lua_task_push (L, task);
+	}
+
+	return 1;
+}
+
 /* Task methods */
 static int
 lua_task_process_message (lua_State *L)
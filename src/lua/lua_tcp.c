@@ -578,7 +578,7 @@ lua_tcp_request (lua_State *L)
 	}
 
 	cbd = g_slice_alloc0 (sizeof (*cbd));
-	cbd->L = L;
+	cbd->L = rspamd_lua_main_state (L);
 	cbd->cbref = cbref;
 	cbd->ev_base = ev_base;
 	msec_to_tv (timeout, &cbd->tv);
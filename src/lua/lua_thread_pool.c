@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+#include "lua_thread_pool.h"
+#include "task.h"
+
+struct lua_thread_pool {
+	GQueue *available;
+	lua_State *L;
+	guint max_items;
+	struct thread_entry *running;
+};
+
+/* Links a suspended thread with the task that owns it */
+struct lua_thread_binding {
+	struct lua_thread_pool *pool;
+	struct thread_entry *thread;
+};
+
+static struct thread_entry *
+lua_thread_entry_new (lua_State *L)
+{
+	struct thread_entry *ent;
+
+	ent = g_slice_alloc0 (sizeof (*ent));
+	ent->lua_state = lua_newthread (L);
+	/* Pin thread in the registry, so it is not collected while pooled */
+	ent->thread_index = luaL_ref (L, LUA_REGISTRYINDEX);
+
+	return ent;
+}
+
+static void
+lua_thread_entry_free (lua_State *L, struct thread_entry *ent)
+{
+	luaL_unref (L, LUA_REGISTRYINDEX, ent->thread_index);
+	g_slice_free1 (sizeof (*ent), ent);
+}
+
+struct lua_thread_pool *
+lua_thread_pool_new (lua_State *L, guint max_items)
+{
+	struct lua_thread_pool *pool;
+
+	g_assert (L != NULL);
+
+	pool = g_slice_alloc0 (sizeof (*pool));
+	pool->L = L;
+	pool->max_items = max_items;
+	pool->available = g_queue_new ();
+
+	return pool;
+}
+
+void
+lua_thread_pool_free (struct lua_thread_pool *pool)
+{
+	struct thread_entry *ent;
+
+	if (pool) {
+		while ((ent = g_queue_pop_head (pool->available)) != NULL) {
+			lua_thread_entry_free (pool->L, ent);
+		}
+
+		g_queue_free (pool->available);
+		g_slice_free1 (sizeof (*pool), pool);
+	}
+}
+
+struct thread_entry *
+lua_thread_pool_get (struct lua_thread_pool *pool)
+{
+	struct thread_entry *ent;
+
+	g_assert (pool != NULL);
+
+	ent = g_queue_pop_head (pool->available);
+
+	if (ent == NULL) {
+		ent = lua_thread_entry_new (pool->L);
+	}
+
+	return ent;
+}
+
+static void
+lua_thread_pool_binding_dtor (gpointer p)
+{
+	struct lua_thread_binding *bnd = p;
+	struct thread_entry *ent = bnd->thread;
+
+	if (ent != NULL && ent->yielded) {
+		/*
+		 * Task is destroyed but the thread is still waiting for some
+		 * event that will never be delivered, so we cannot reuse it
+		 */
+		ent->cd = NULL;
+		lua_thread_entry_free (bnd->pool->L, ent);
+		bnd->thread = NULL;
+	}
+}
+
+struct thread_entry *
+lua_thread_pool_get_for_task (struct lua_thread_pool *pool,
+		struct rspamd_task *task)
+{
+	struct thread_entry *ent;
+	struct lua_thread_binding *bnd;
+
+	g_assert (task != NULL);
+
+	ent = lua_thread_pool_get (pool);
+	ent->task = task;
+
+	bnd = rspamd_mempool_alloc (task->task_pool, sizeof (*bnd));
+	bnd->pool = pool;
+	bnd->thread = ent;
+	ent->binding = bnd;
+	rspamd_mempool_add_destructor (task->task_pool,
+			lua_thread_pool_binding_dtor, bnd);
+
+	return ent;
+}
+
+static void
+lua_thread_pool_unbind (struct thread_entry *thread)
+{
+	if (thread->binding) {
+		thread->binding->thread = NULL;
+		thread->binding = NULL;
+	}
+}
+
+void
+lua_thread_pool_return (struct lua_thread_pool *pool,
+		struct thread_entry *thread)
+{
+	g_assert (pool != NULL);
+	g_assert (thread != NULL);
+	/* We can return only finished (or not started) threads */
+	g_assert (lua_status (thread->lua_state) == 0);
+
+	lua_thread_pool_unbind (thread);
+	lua_settop (thread->lua_state, 0);
+
+	if (g_queue_get_length (pool->available) < pool->max_items) {
+		thread->cd = NULL;
+		thread->task = NULL;
+		thread->binding = NULL;
+		thread->w = NULL;
+		thread->finish_callback = NULL;
+		thread->error_callback = NULL;
+		thread->cpu_time = 0;
+		thread->mem_used = 0;
+		thread->yielded = FALSE;
+		g_queue_push_head (pool->available, thread);
+	}
+	else {
+		lua_thread_entry_free (pool->L, thread);
+	}
+}
+
+static void
+lua_thread_pool_terminate (struct lua_thread_pool *pool,
+		struct thread_entry *thread)
+{
+	lua_thread_pool_unbind (thread);
+	lua_thread_entry_free (pool->L, thread);
+}
+
+/* Returns memory used by lua in bytes */
+static inline gint64
+lua_thread_pool_mem (lua_State *L)
+{
+	return (gint64)lua_gc (L, LUA_GCCOUNT, 0) * 1024 +
+			lua_gc (L, LUA_GCCOUNTB, 0);
+}
+
+static GString *
+lua_thread_traceback (lua_State *L)
+{
+	lua_Debug d;
+	GString *tb;
+	gint i = 0;
+
+	tb = g_string_sized_new (100);
+	g_string_append_printf (tb, "%s; trace:", lua_tostring (L, -1));
+
+	while (lua_getstack (L, i++, &d)) {
+		lua_getinfo (L, "nSl", &d);
+		g_string_append_printf (tb, " [%d]:{%s:%d - %s [%s]};",
+				i - 1, d.short_src, d.currentline,
+				(d.name ? d.name : "<unknown>"), d.what);
+	}
+
+	return tb;
+}
+
+gint
+lua_thread_pool_resume (struct lua_thread_pool *pool,
+		struct thread_entry *thread, gint narg)
+{
+	struct thread_entry *prev;
+	GString *tb;
+	gdouble t1;
+	gint64 m1, m2;
+	gint ret;
+
+	g_assert (pool != NULL);
+	g_assert (thread != NULL);
+
+	prev = pool->running;
+	pool->running = thread;
+	t1 = rspamd_get_virtual_ticks ();
+	m1 = lua_thread_pool_mem (pool->L);
+
+#if LUA_VERSION_NUM >= 504
+	{
+		gint nres;
+
+		ret = lua_resume (thread->lua_state, NULL, narg, &nres);
+	}
+#elif LUA_VERSION_NUM > 501
+	ret = lua_resume (thread->lua_state, NULL, narg);
+#else
+	ret = lua_resume (thread->lua_state, narg);
+#endif
+
+	thread->cpu_time += rspamd_get_virtual_ticks () - t1;
+	m2 = lua_thread_pool_mem (pool->L);
+
+	/* GC step can free more than the thread has allocated */
+	if (m2 > m1) {
+		thread->mem_used += m2 - m1;
+	}
+
+	pool->running = prev;
+
+	switch (ret) {
+	case 0:
+		thread->yielded = FALSE;
+
+		if (thread->finish_callback) {
+			thread->finish_callback (thread, lua_gettop (thread->lua_state));
+		}
+
+		lua_thread_pool_return (pool, thread);
+		break;
+	case LUA_YIELD:
+		thread->yielded = TRUE;
+		break;
+	default:
+		thread->yielded = FALSE;
+		tb = lua_thread_traceback (thread->lua_state);
+
+		if (thread->error_callback) {
+			thread->error_callback (thread, tb->str);
+		}
+		else {
+			msg_err ("lua coroutine failed: %v", tb);
+		}
+
+		g_string_free (tb, TRUE);
+		/* Dead coroutine cannot be resumed any longer */
+		lua_thread_pool_terminate (pool, thread);
+		break;
+	}
+
+	return ret;
+}
+
+struct thread_entry *
+lua_thread_pool_get_running_entry (struct lua_thread_pool *pool,
+		lua_State *L)
+{
+	if (pool && pool->running && pool->running->lua_state == L) {
+		return pool->running;
+	}
+
+	return NULL;
+}
+
+void
+lua_thread_pool_gc_step (struct lua_thread_pool *pool, guint step)
+{
+	if (pool && step > 0) {
+		lua_gc (pool->L, LUA_GCSTEP, step);
+	}
+}
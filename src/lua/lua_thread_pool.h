@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef LUA_THREAD_POOL_H_
+#define LUA_THREAD_POOL_H_
+
+#include "config.h"
+#include "lua_common.h"
+
+struct lua_thread_pool;
+struct lua_thread_binding;
+struct thread_entry;
+
+/* Called when a thread returns, results are on the top of the thread stack */
+typedef void (*lua_thread_finish_t) (struct thread_entry *thread, gint nret);
+/* Called when a thread fails, the thread is not reused afterwards */
+typedef void (*lua_thread_error_t) (struct thread_entry *thread,
+		const gchar *err);
+
+struct thread_entry {
+	lua_State *lua_state;
+	gint thread_index;
+	gpointer cd;
+	struct rspamd_task *task;
+	struct rspamd_async_watcher *w;
+	lua_thread_finish_t finish_callback;
+	lua_thread_error_t error_callback;
+	struct lua_thread_binding *binding;
+	gdouble cpu_time;
+	gint64 mem_used;
+	gboolean yielded;
+};
+
+/**
+ * Create a new pool of coroutines attached to the main lua state
+ * @param L main lua state
+ * @param max_items maximum number of idle coroutines kept for reuse
+ * @return new pool
+ */
+struct lua_thread_pool *lua_thread_pool_new (lua_State *L, guint max_items);
+
+/**
+ * Destroy pool and all idle coroutines
+ * @param pool
+ */
+void lua_thread_pool_free (struct lua_thread_pool *pool);
+
+/**
+ * Get an idle coroutine from the pool or create a new one
+ * @param pool
+ * @return thread entry ready to accept a function and its arguments
+ */
+struct thread_entry *lua_thread_pool_get (struct lua_thread_pool *pool);
+
+/**
+ * Same as `lua_thread_pool_get` but also binds the thread to the task, so
+ * it is cleaned up if the task is destroyed while the thread is suspended
+ * @param pool
+ * @param task
+ * @return
+ */
+struct thread_entry *lua_thread_pool_get_for_task (struct lua_thread_pool *pool,
+		struct rspamd_task *task);
+
+/**
+ * Return a finished coroutine to the pool
+ * @param pool
+ * @param thread
+ */
+void lua_thread_pool_return (struct lua_thread_pool *pool,
+		struct thread_entry *thread);
+
+/**
+ * Start or resume execution of a thread with `narg` arguments on its stack,
+ * either finish or error callback is called once the thread is done
+ * @param pool
+ * @param thread
+ * @param narg
+ * @return LUA_YIELD if a thread has been suspended, 0 if it has been
+ * finished and an error code otherwise
+ */
+gint lua_thread_pool_resume (struct lua_thread_pool *pool,
+		struct thread_entry *thread, gint narg);
+
+/**
+ * Returns the entry that is currently executed by `lua_thread_pool_resume`
+ * @param pool
+ * @param L current lua state
+ * @return thread entry or NULL if L is not a pooled coroutine
+ */
+struct thread_entry *lua_thread_pool_get_running_entry (
+		struct lua_thread_pool *pool, lua_State *L);
+
+/**
+ * Performs incremental GC step if it has been configured, called between tasks
+ * @param pool
+ * @param step size of the step (in Kb)
+ */
+void lua_thread_pool_gc_step (struct lua_thread_pool *pool, guint step);
+
+#endif /* LUA_THREAD_POOL_H_ */
@@ -26,6 +26,7 @@
 #include "lua_common.h"
 #include "acism.h"
 #include "message.h"
+#include "libserver/re_cache.h"
 
 /***
  * @module rspamd_trie
@@ -45,6 +46,9 @@ local function trie_callback(number, pos)
 end
 
 trie:match('some big text', trie_callback)
+
+-- Collect indices of all patterns found in the subject without callbacks
+local matched = trie:match_task(task, 'header', 'Subject')
  */
 
 /* Suffix trie */
@@ -52,12 +56,14 @@ LUA_FUNCTION_DEF (trie, create);
 LUA_FUNCTION_DEF (trie, match);
 LUA_FUNCTION_DEF (trie, search_mime);
 LUA_FUNCTION_DEF (trie, search_rawmsg);
+LUA_FUNCTION_DEF (trie, match_task);
 LUA_FUNCTION_DEF (trie, destroy);
 
 static const struct luaL_reg trielib_m[] = {
 	LUA_INTERFACE_DEF (trie, match),
 	LUA_INTERFACE_DEF (trie, search_mime),
 	LUA_INTERFACE_DEF (trie, search_rawmsg),
+	LUA_INTERFACE_DEF (trie, match_task),
 	{"__tostring", rspamd_lua_class_tostring},
 	{"__gc", lua_trie_destroy},
 	{NULL, NULL}
@@ -315,6 +321,88 @@ lua_trie_search_rawmsg (lua_State *L)
 	return 1;
 }
 
+/* Bitset of found patterns, grows on demand as trie does not expose its size */
+static gint
+lua_trie_collect_callback (int strnum, int textpos, void *context)
+{
+	GArray *matched = context;
+
+	if ((guint)strnum >= matched->len * NBBY) {
+		g_array_set_size (matched, NBYTES (strnum + 1));
+	}
+
+	setbit (matched->data, strnum);
+
+	return 0;
+}
+
+/***
+ * @method trie:match_task(task, type[, header[, caseless]])
+ * Search for all patterns in the specified content of a task without calling
+ * of lua callbacks. Each part of the content is traversed only once.
+ * @param {task} task object
+ * @param {string} type type of content (`mime`, `header`, `rawheader`, `allheader`, `body` or `url`), @see rspamd_regexp.create_set
+ * @param {string} header name of header for `header` and `rawheader` types
+ * @param {boolean} caseless if `true` then match ignores symbols case (ASCII only)
+ * @return {table} sorted array of indices of found patterns (starting from 1)
+ */
+static gint
+lua_trie_match_task (lua_State *L)
+{
+	ac_trie_t *trie = lua_check_trie (L, 1);
+	struct rspamd_task *task = lua_check_task (L, 2);
+	const gchar *type_str = luaL_checkstring (L, 3), *header = NULL;
+	struct rspamd_re_input *in;
+	enum rspamd_re_type type;
+	GArray *inputs, *matched;
+	gboolean icase = FALSE;
+	gint state;
+	guint i, cnt;
+
+	if (trie == NULL || task == NULL) {
+		return luaL_error (L, "invalid arguments");
+	}
+
+	type = rspamd_re_cache_type_from_string (type_str);
+
+	if (type == RSPAMD_RE_MAX) {
+		return luaL_error (L, "invalid content type: %s", type_str);
+	}
+
+	if (type == RSPAMD_RE_HEADER || type == RSPAMD_RE_RAWHEADER) {
+		header = luaL_checkstring (L, 4);
+	}
+
+	if (lua_gettop (L) >= 5) {
+		icase = lua_toboolean (L, 5);
+	}
+
+	matched = g_array_new (FALSE, TRUE, sizeof (guchar));
+	inputs = rspamd_re_cache_get_inputs (task, type, header, FALSE);
+
+	for (i = 0; i < inputs->len; i ++) {
+		in = &g_array_index (inputs, struct rspamd_re_input, i);
+		/* Patterns cannot cross the boundaries of inputs */
+		state = 0;
+		acism_lookup (trie, in->begin, in->len, lua_trie_collect_callback,
+				matched, &state, icase);
+	}
+
+	lua_newtable (L);
+
+	for (i = 0, cnt = 1; i < matched->len * NBBY; i ++) {
+		if (isset (matched->data, i)) {
+			lua_pushnumber (L, i + 1);
+			lua_rawseti (L, -2, cnt ++);
+		}
+	}
+
+	g_array_free (inputs, TRUE);
+	g_array_free (matched, TRUE);
+
+	return 1;
+}
+
 static gint
 lua_load_trie (lua_State *L)
 {
@@ -35,6 +35,8 @@
  * - time_jitter (number): jitter in seconds to allow time diff while checking
  * - trusted_only (flag): check signatures only for domains in 'domains' map
  * - skip_mutli (flag): skip messages with multiply dkim signatures
+ * - dkim_cache_size (number): number of keys cached, the shared cache size
+ *   is set on start and is not changed on reload
  */
 
 #include "config.h"
@@ -42,6 +44,7 @@
 #include "libserver/dkim.h"
 #include "libutil/hash.h"
 #include "libutil/map.h"
+#include "libutil/shm_cache.h"
 #include "rspamd.h"
 #include "utlist.h"
 
@@ -51,6 +54,8 @@
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
 #define DEFAULT_TIME_JITTER 60
+/* Enough for key name and 4096 bits RSA key */
+#define SHARED_KEY_MAX_SIZE 1024
 
 struct dkim_ctx {
 	struct module_ctx ctx;
@@ -64,6 +69,7 @@ struct dkim_ctx {
 	guint strict_multiplier;
 	guint time_jitter;
 	rspamd_lru_hash_t *dkim_hash;
+	guint cache_expire;
 	gboolean trusted_only;
 	gboolean skip_multi;
 };
@@ -79,6 +85,11 @@ struct dkim_check_result {
 };
 
 static struct dkim_ctx *dkim_module_ctx = NULL;
+/*
+ * Keys cache shared by all workers, it is created in the main process once and
+ * is not destroyed on reload
+ */
+static struct rspamd_shm_cache *dkim_shared_keys = NULL;
 
 static void dkim_symbol_callback (struct rspamd_task *task, void *unused);
 
@@ -159,6 +170,7 @@ dkim_module_config (struct rspamd_config *cfg)
 	else {
 		cache_expire = DEFAULT_CACHE_MAXAGE;
 	}
+	dkim_module_ctx->cache_expire = cache_expire;
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "dkim", "time_jitter")) != NULL) {
 		dkim_module_ctx->time_jitter = ucl_obj_todouble (value);
@@ -253,6 +265,11 @@ dkim_module_config (struct rspamd_config *cfg)
 				g_free,
 				(GDestroyNotify)rspamd_dkim_key_free);
 
+		if (dkim_shared_keys == NULL) {
+			dkim_shared_keys = rspamd_shm_cache_new ("dkim keys", cache_size,
+					SHARED_KEY_MAX_SIZE);
+		}
+
 		msg_info_config ("init internal dkim module");
 #ifndef HAVE_OPENSSL
 		msg_warn_config (
@@ -397,6 +414,63 @@ dkim_module_check (struct dkim_check_result *res)
 	}
 }
 
+/*
+ * Shared cache element is DER of the key
+ */
+static void
+dkim_module_shared_insert (rspamd_dkim_context_t *ctx, rspamd_dkim_key_t *key,
+	time_t now)
+{
+	guint ttl;
+
+	if (dkim_shared_keys == NULL) {
+		return;
+	}
+
+	ttl = dkim_module_ctx->cache_expire;
+
+	if (key->ttl > 0 && key->ttl < ttl) {
+		ttl = key->ttl;
+	}
+
+	rspamd_shm_cache_insert (dkim_shared_keys, ctx->dns_key,
+			strlen (ctx->dns_key), key->keydata, key->decoded_len,
+			now, ttl);
+}
+
+static rspamd_dkim_key_t *
+dkim_module_shared_lookup (rspamd_dkim_context_t *ctx, time_t now)
+{
+	rspamd_dkim_key_t *key;
+	guchar *buf;
+	gsize len;
+	guint ttl;
+	GError *err = NULL;
+
+	if (dkim_shared_keys == NULL) {
+		return NULL;
+	}
+
+	buf = rspamd_shm_cache_lookup (dkim_shared_keys, ctx->dns_key,
+			strlen (ctx->dns_key), now, &len, &ttl);
+
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	key = rspamd_dkim_key_from_der (buf, len, ttl, &err);
+
+	if (err != NULL) {
+		msg_info ("cannot load shared key for %s: %s", ctx->dns_key,
+				err->message);
+		g_error_free (err);
+	}
+
+	g_free (buf);
+
+	return key;
+}
+
 static void
 dkim_module_key_handler (rspamd_dkim_key_t *key,
 	gsize keylen,
@@ -411,6 +485,8 @@ dkim_module_key_handler (rspamd_dkim_key_t *key,
 		rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
 			g_strdup (ctx->dns_key),
 			key, res->task->tv.tv_sec, key->ttl);
+		/* And make it available for other workers */
+		dkim_module_shared_insert (ctx, key, res->task->tv.tv_sec);
 		res->key = key;
 	}
 	else {
@@ -508,6 +584,19 @@ dkim_symbol_callback (struct rspamd_task *task, void *unused)
 					key = rspamd_lru_hash_lookup (dkim_module_ctx->dkim_hash,
 							ctx->dns_key,
 							task->tv.tv_sec);
+
+					if (key == NULL) {
+						key = dkim_module_shared_lookup (ctx, task->tv.tv_sec);
+
+						if (key != NULL) {
+							debug_task ("found key for %s in shared cache",
+									ctx->dns_key);
+							rspamd_lru_hash_insert (dkim_module_ctx->dkim_hash,
+									g_strdup (ctx->dns_key),
+									key, task->tv.tv_sec, key->ttl);
+						}
+					}
+
 					if (key != NULL) {
 						debug_task ("found key for %s in cache", ctx->dns_key);
 						cur->key = key;
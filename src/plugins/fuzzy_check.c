@@ -50,6 +50,7 @@
 #include "ottery.h"
 #include "keypair_private.h"
 #include "unix-std.h"
+#include "xxhash.h"
 #include <math.h>
 
 #define DEFAULT_SYMBOL "R_FUZZY_HASH"
@@ -60,6 +61,7 @@
 #define DEFAULT_IO_TIMEOUT 500
 #define DEFAULT_RETRANSMITS 3
 #define DEFAULT_PORT 11335
+#define FUZZY_HASHES_VAR "fuzzy_hashes"
 
 struct fuzzy_mapping {
 	guint64 fuzzy_flag;
@@ -85,6 +87,24 @@ struct fuzzy_rule {
 	double max_score;
 	gboolean read_only;
 	gboolean skip_unknown;
+	gboolean fast_shingles;
+};
+
+/*
+ * Digests and shingles are cached per task, so rules that share keys do not
+ * hash the same parts several times
+ */
+struct fuzzy_cached_key {
+	gconstpointer data;
+	gsize len;
+	guchar hash_key[rspamd_cryptobox_HASHKEYBYTES];
+	guchar shingles_key[16];
+	gboolean fast_shingles;
+};
+
+struct fuzzy_cached_hash {
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	struct rspamd_shingle *sgl;
 };
 
 struct fuzzy_ctx {
@@ -407,6 +427,9 @@ fuzzy_parse_rule (struct rspamd_config *cfg, const ucl_object_t *obj, gint cb_id
 	if ((value = ucl_object_find_key (obj, "skip_unknown")) != NULL) {
 		rule->skip_unknown = ucl_obj_toboolean (value);
 	}
+	if ((value = ucl_object_find_key (obj, "fast_shingles")) != NULL) {
+		rule->fast_shingles = ucl_obj_toboolean (value);
+	}
 
 	if ((value = ucl_object_find_key (obj, "servers")) != NULL) {
 		rule->servers = rspamd_upstreams_create (cfg->ups_ctx);
@@ -741,6 +764,140 @@ fuzzy_cmd_from_task_meta (struct fuzzy_rule *rule,
 	return io;
 }
 
+static guint
+fuzzy_cached_key_hash (gconstpointer p)
+{
+	return XXH64 (p, sizeof (struct fuzzy_cached_key), 0);
+}
+
+static gboolean
+fuzzy_cached_key_equal (gconstpointer a, gconstpointer b)
+{
+	return memcmp (a, b, sizeof (struct fuzzy_cached_key)) == 0;
+}
+
+static struct fuzzy_cached_hash *
+fuzzy_cache_lookup (struct rspamd_task *task, struct fuzzy_rule *rule,
+		gconstpointer data, gsize len, gboolean text,
+		struct fuzzy_cached_key *key)
+{
+	GHashTable *cache;
+
+	cache = rspamd_mempool_get_variable (task->task_pool, FUZZY_HASHES_VAR);
+
+	if (cache == NULL) {
+		cache = g_hash_table_new (fuzzy_cached_key_hash,
+				fuzzy_cached_key_equal);
+		rspamd_mempool_set_variable (task->task_pool, FUZZY_HASHES_VAR,
+				cache, (rspamd_mempool_destruct_t)g_hash_table_unref);
+	}
+
+	/* Key is compared as a whole, so padding must be zeroed as well */
+	memset (key, 0, sizeof (*key));
+	key->data = data;
+	key->len = len;
+	memcpy (key->hash_key, rule->hash_key->str,
+			MIN (rule->hash_key->len, sizeof (key->hash_key)));
+
+	/* Shingles are not generated for data parts */
+	if (text) {
+		memcpy (key->shingles_key, rule->shingles_key->str,
+				sizeof (key->shingles_key));
+		key->fast_shingles = rule->fast_shingles;
+	}
+
+	return g_hash_table_lookup (cache, key);
+}
+
+static void
+fuzzy_cache_insert (struct rspamd_task *task, struct fuzzy_cached_key *key,
+		struct fuzzy_cached_hash *h)
+{
+	GHashTable *cache;
+	struct fuzzy_cached_key *nkey;
+
+	cache = rspamd_mempool_get_variable (task->task_pool, FUZZY_HASHES_VAR);
+	g_assert (cache != NULL);
+	nkey = rspamd_mempool_alloc (task->task_pool, sizeof (*nkey));
+	memcpy (nkey, key, sizeof (*nkey));
+	g_hash_table_insert (cache, nkey, h);
+}
+
+static struct fuzzy_cached_hash *
+fuzzy_text_part_hashes (struct fuzzy_rule *rule, struct rspamd_task *task,
+		struct mime_text_part *part)
+{
+	struct fuzzy_cached_hash *h;
+	struct fuzzy_cached_key key;
+	rspamd_cryptobox_hash_state_t st;
+	rspamd_ftok_t *word;
+	GArray *words;
+	rspamd_mempool_t *pool = task->task_pool;
+	guint i;
+
+	h = fuzzy_cache_lookup (task, rule, part, 0, TRUE, &key);
+
+	if (h != NULL) {
+		return h;
+	}
+
+	h = rspamd_mempool_alloc (pool, sizeof (*h));
+
+	/*
+	 * Generate hash from all words in the part
+	 */
+	rspamd_cryptobox_hash_init (&st, rule->hash_key->str, rule->hash_key->len);
+	words = fuzzy_preprocess_words (part, pool);
+
+	for (i = 0; i < words->len; i ++) {
+		word = &g_array_index (words, rspamd_ftok_t, i);
+		rspamd_cryptobox_hash_update (&st, word->begin, word->len);
+	}
+	rspamd_cryptobox_hash_final (&st, h->digest);
+
+	msg_debug_pool ("loading shingles with key %*xs", 16,
+			rule->shingles_key->str);
+	if (rule->fast_shingles) {
+		h->sgl = rspamd_shingles_generate_fast (words,
+				rule->shingles_key->str, pool);
+	}
+	else {
+		h->sgl = rspamd_shingles_generate (words,
+				rule->shingles_key->str, pool,
+				rspamd_shingles_default_filter, NULL);
+	}
+
+	fuzzy_cache_insert (task, &key, h);
+
+	return h;
+}
+
+static struct fuzzy_cached_hash *
+fuzzy_data_part_hashes (struct fuzzy_rule *rule, struct rspamd_task *task,
+		const guchar *data, gsize datalen)
+{
+	struct fuzzy_cached_hash *h;
+	struct fuzzy_cached_key key;
+	rspamd_cryptobox_hash_state_t st;
+
+	h = fuzzy_cache_lookup (task, rule, data, datalen, FALSE, &key);
+
+	if (h != NULL) {
+		return h;
+	}
+
+	h = rspamd_mempool_alloc (task->task_pool, sizeof (*h));
+	/* Use blake2b for digest */
+	rspamd_cryptobox_hash_init (&st, rule->hash_key->str, rule->hash_key->len);
+	rspamd_cryptobox_hash_update (&st, data, datalen);
+	rspamd_cryptobox_hash_final (&st, h->digest);
+	h->sgl = NULL;
+
+	fuzzy_cache_insert (task, &key, h);
+
+	return h;
+}
+
 /*
  * Create fuzzy command from a text part
  */
@@ -749,18 +906,15 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 		int c,
 		gint flag,
 		guint32 weight,
-		rspamd_mempool_t *pool,
+		struct rspamd_task *task,
 		struct mime_text_part *part)
 {
 	struct rspamd_fuzzy_shingle_cmd *shcmd;
 	struct rspamd_fuzzy_encrypted_shingle_cmd *encshcmd;
-	struct rspamd_shingle *sh;
-	guint i;
-	rspamd_cryptobox_hash_state_t st;
-	rspamd_ftok_t *word;
-	GArray *words;
+	struct fuzzy_cached_hash *h;
 	struct fuzzy_cmd_io *io;
 	struct rspamd_http_keypair *lk, *rk;
+	rspamd_mempool_t *pool = task->task_pool;
 
 	if (rule->peer_key) {
 		encshcmd = rspamd_mempool_alloc0 (pool, sizeof (*encshcmd));
@@ -773,31 +927,19 @@ fuzzy_cmd_from_text_part (struct fuzzy_rule *rule,
 		encshcmd = NULL;
 	}
 
-	/*
-	 * Generate hash from all words in the part
-	 */
-	rspamd_cryptobox_hash_init (&st, rule->hash_key->str, rule->hash_key->len);
-	words = fuzzy_preprocess_words (part, pool);
+	h = fuzzy_text_part_hashes (rule, task, part);
+	memcpy (shcmd->basic.digest, h->digest, sizeof (shcmd->basic.digest));
 
-	for (i = 0; i < words->len; i ++) {
-		word = &g_array_index (words, rspamd_ftok_t, i);
-		rspamd_cryptobox_hash_update (&st, word->begin, word->len);
-	}
-	rspamd_cryptobox_hash_final (&st, shcmd->basic.digest);
-
-	msg_debug_pool ("loading shingles with key %*xs", 16,
-			rule->shingles_key->str);
-	sh = rspamd_shingles_generate (words,
-			rule->shingles_key->str, pool,
-			rspamd_shingles_default_filter, NULL);
-	if (sh != NULL) {
-		memcpy (&shcmd->sgl, sh, sizeof (shcmd->sgl));
+	if (h->sgl != NULL) {
+		memcpy (&shcmd->sgl, h->sgl, sizeof (shcmd->sgl));
 		shcmd->basic.shingles_count = RSPAMD_SHINGLE_SIZE;
 	}
 
 	shcmd->basic.tag = ottery_rand_uint32 ();
 	shcmd->basic.cmd = c;
-	shcmd->basic.version = RSPAMD_FUZZY_VERSION;
+	/* Storage must know that shingles are not comparable with the old ones */
+	shcmd->basic.version = rule->fast_shingles ?
+			RSPAMD_FUZZY_VERSION_FAST_SHINGLES : RSPAMD_FUZZY_VERSION;
 	if (c != FUZZY_CHECK) {
 		shcmd->basic.flag = flag;
 		shcmd->basic.value = weight;
@@ -835,15 +977,16 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 		int c,
 		gint flag,
 		guint32 weight,
-		rspamd_mempool_t *pool,
+		struct rspamd_task *task,
 		const guchar *data,
 		gsize datalen)
 {
 	struct rspamd_fuzzy_cmd *cmd;
 	struct rspamd_fuzzy_encrypted_cmd *enccmd;
+	struct fuzzy_cached_hash *h;
 	struct fuzzy_cmd_io *io;
-	rspamd_cryptobox_hash_state_t st;
 	struct rspamd_http_keypair *lk, *rk;
+	rspamd_mempool_t *pool = task->task_pool;
 
 	if (rule->peer_key) {
 		enccmd = rspamd_mempool_alloc0 (pool, sizeof (*enccmd));
@@ -863,10 +1006,8 @@ fuzzy_cmd_from_data_part (struct fuzzy_rule *rule,
 	}
 	cmd->shingles_count = 0;
 	cmd->tag = ottery_rand_uint32 ();
-	/* Use blake2b for digest */
-	rspamd_cryptobox_hash_init (&st, rule->hash_key->str, rule->hash_key->len);
-	rspamd_cryptobox_hash_update (&st, data, datalen);
-	rspamd_cryptobox_hash_final (&st, cmd->digest);
+	h = fuzzy_data_part_hashes (rule, task, data, datalen);
+	memcpy (cmd->digest, h->digest, sizeof (cmd->digest));
 
 	io = rspamd_mempool_alloc (pool, sizeof (*io));
 	io->flags = 0;
@@ -1457,8 +1598,7 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 			continue;
 		}
 
-		io = fuzzy_cmd_from_text_part (rule, c, flag, value, task->task_pool,
-				part);
+		io = fuzzy_cmd_from_text_part (rule, c, flag, value, task, part);
 		if (io) {
 			g_ptr_array_add (res, io);
 		}
@@ -1477,15 +1617,13 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 					fuzzy_module_ctx->min_width) {
 					if (c == FUZZY_CHECK) {
 						io = fuzzy_cmd_from_data_part (rule, c, flag, value,
-								task->task_pool,
-								image->data->data, image->data->len);
+								task, image->data->data, image->data->len);
 						if (io) {
 							g_ptr_array_add (res, io);
 						}
 					}
 					io = fuzzy_cmd_from_data_part (rule, c, flag, value,
-							task->task_pool,
-							image->data->data, image->data->len);
+							task, image->data->data, image->data->len);
 					if (io) {
 						g_ptr_array_add (res, io);
 					}
@@ -1504,8 +1642,7 @@ fuzzy_generate_commands (struct rspamd_task *task, struct fuzzy_rule *rule,
 			if (fuzzy_module_ctx->min_bytes <= 0 || mime_part->content->len >=
 				fuzzy_module_ctx->min_bytes) {
 				io = fuzzy_cmd_from_data_part (rule, c, flag, value,
-						task->task_pool,
-						mime_part->content->data, mime_part->content->len);
+						task, mime_part->content->data, mime_part->content->len);
 				if (io) {
 					g_ptr_array_add (res, io);
 				}
@@ -97,16 +97,6 @@ local function check_limits(task, args)
 
   local key = _.foldl(function(acc, k) return acc .. k[2] end, '', args)
   local upstream = upstreams:get_upstream_by_hash(key)
-  local addr = upstream:get_addr()
-  --- Called when value was set on server
-  local function rate_set_key_cb(task, err, data)
-    if err then
-      rspamd_logger.infox(task, 'got error while getting limit: %1', err)
-      upstream:fail()
-    else
-      upstream:ok()
-    end
-  end
   --- Called when value is got from server
   local function rate_get_cb(task, err, data)
     if data then
@@ -137,14 +127,13 @@ local function check_limits(task, args)
       end, _.zip(parse_limits(data), _.map(function(a) return a[1] end, args)))
     elseif err then
       rspamd_logger.infox(task, 'got error while getting limit: %1', err)
-      upstream:fail()
     end
   end
 
   if upstream then
     local cmd = generate_format_string(args, false)
 
-    rspamd_redis.make_request(task, addr, rate_get_cb, cmd,
+    rspamd_redis.make_request(task, upstream, rate_get_cb, cmd,
       _.totable(_.map(function(l) return l[2] end, args)))
   end
 end
@@ -153,14 +142,10 @@ end
 local function set_limits(task, args)
   local key = _.foldl(function(acc, k) return acc .. k[2] end, '', args)
   local upstream = upstreams:get_upstream_by_hash(key)
-  local addr = upstream:get_addr()
 
   local function rate_set_key_cb(task, err, data)
     if err then
       rspamd_logger.infox(task, 'got error while setting limit: %1', err)
-      upstream:fail()
-    else
-      upstream:ok()
     end
   end
 
@@ -189,16 +174,15 @@ local function set_limits(task, args)
       end, _.zip(parse_limits(data), _.iter(args)))
 
       local cmd = generate_format_string(values, true)
-      rspamd_redis.make_request(task, addr, rate_set_key_cb, cmd, values)
+      rspamd_redis.make_request(task, upstream, rate_set_key_cb, cmd, values)
     elseif err then
       rspamd_logger.infox(task, 'got error while setting limit: %1', err)
-      upstream:fail()
     end
   end
   if upstream then
     local cmd = generate_format_string(args, false)
 
-    rspamd_redis.make_request(task, addr, rate_set_cb, cmd,
+    rspamd_redis.make_request(task, upstream, rate_set_cb, cmd,
       _.totable(_.map(function(l) return l[2] end, args)))
   end
 end
@@ -105,23 +105,18 @@ local function handle_header_def(hline, cur_rule)
     if h == 'ALL' or h == 'ALL:raw' then
       ordinary = false
       cur_rule['type'] = 'function'
+      -- Rule to match all headers, regexp is registered after replacements
+      cur_rule['allheader'] = true
       -- Pack closure
-      local re = cur_rule['re']
-      local not_f = cur_rule['not']
-      local sym = cur_rule['symbol']
-      -- Rule to match all headers
-      rspamd_config:register_regexp({
-        re = re,
-        type = 'allheader'
-      })
+      local rule = cur_rule
       cur_rule['function'] = function(task)
-        if not re then
+        if not rule['re'] then
           rspamd_logger.errx(task, 're is missing for rule %s', h)
           return 0
         end
 
         return task:process_regexp({
-          re = re,
+          re = rule['re'],
           type = 'allheader'
         })
       end
@@ -131,13 +126,10 @@ local function handle_header_def(hline, cur_rule)
       cur_param['raw'] = false
       cur_param['header'] = args[1]
 
-      if args[2] then
-        -- We have some ops that are required for the header, so it's not ordinary
-        ordinary = false
-      end
-
       _.each(function(func)
           if func == 'addr' then
+            -- Functions are applied to headers in lua, so it's not ordinary
+            ordinary = false
             cur_param['function'] = function(str)
               local addr_parsed = util.parse_addr(str)
               local ret = {}
@@ -152,6 +144,7 @@ local function handle_header_def(hline, cur_rule)
               return ret
             end
           elseif func == 'name' then
+            ordinary = false
             cur_param['function'] = function(str)
               local addr_parsed = util.parse_addr(str)
               local ret = {}
@@ -191,13 +184,11 @@ local function handle_header_def(hline, cur_rule)
         -- Some header rules require splitting to check of multiple headers
         if cur_param['header'] == 'MESSAGEID' then
           -- Special case for spamassassin
-          ordinary = false
           split_hdr_param(cur_param, {
             'Message-ID',
             'X-Message-ID',
             'Resent-Message-ID'})
         elseif cur_param['header'] == 'ToCc' then
-          ordinary = false
           split_hdr_param(cur_param, { 'To', 'Cc', 'Bcc' })
         else
           table.insert(hdr_params, cur_param)
@@ -583,39 +574,20 @@ local function process_sa_conf(f)
           handle_header_def(words[3], cur_rule)
         end
 
-        if words[1] == 'mimeheader' then
+        if words[1] == 'mimeheader' or cur_rule['unset'] then
+          -- Mime headers and default values are checked in lua
           cur_rule['ordinary'] = false
-          cur_rule['mime'] = true
+
+          if words[1] == 'mimeheader' and cur_rule['header'] then
+            _.each(function(h)
+              h['mime'] = true
+            end, cur_rule['header'])
+          end
         end
 
         if cur_rule['re'] and cur_rule['symbol'] and
           (cur_rule['header'] or cur_rule['function']) then
           valid_rule = true
-          if cur_rule['header'] and cur_rule['ordinary'] then
-            for i,h in ipairs(cur_rule['header']) do
-              if type(h) == 'string' then
-                rspamd_config:register_regexp({
-                  re = cur_rule['re'],
-                  type = 'header',
-                  header = h})
-              else
-                if h['raw'] then
-                  rspamd_config:register_regexp({
-                    re = cur_rule['re'],
-                    type = 'rawheader',
-                    header = h['header']
-                  })
-                else
-                  rspamd_config:register_regexp({
-                    re = cur_rule['re'],
-                    type = 'header',
-                    header = h['header']
-                  })
-                end
-              end
-            end
-            cur_rule['re']:set_limit(match_limit)
-          end
         end
       else
         -- Maybe we know the function and can convert it
@@ -643,15 +615,10 @@ local function process_sa_conf(f)
           or string.sub(words[3], 1, 1) == 'm') then
         cur_rule['type'] = 'part'
         cur_rule['re_expr'] = words_to_re(words, 2)
-        cur_rule['re'] = rspamd_regexp.create_cached(cur_rule['re_expr'])
+        cur_rule['re'] = rspamd_regexp.create(cur_rule['re_expr'])
         cur_rule['raw'] = true
         if cur_rule['re'] then
-          rspamd_config:register_regexp({
-            re = cur_rule['re'],
-            type = 'mime',
-          })
           valid_rule = true
-          cur_rule['re']:set_limit(match_limit)
         end
       else
         -- might be function
@@ -679,15 +646,10 @@ local function process_sa_conf(f)
           or string.sub(words[3], 1, 1) == 'm') then
         cur_rule['type'] = 'message'
         cur_rule['re_expr'] = words_to_re(words, 2)
-        cur_rule['re'] = rspamd_regexp.create_cached(cur_rule['re_expr'])
+        cur_rule['re'] = rspamd_regexp.create(cur_rule['re_expr'])
         cur_rule['raw'] = true
         if cur_rule['re'] then
           valid_rule = true
-          rspamd_config:register_regexp({
-            re = cur_rule['re'],
-            type = 'body',
-          })
-          cur_rule['re']:set_limit(match_limit)
         end
       else
         -- might be function
@@ -711,14 +673,9 @@ local function process_sa_conf(f)
       cur_rule['type'] = 'uri'
       cur_rule['symbol'] = words[2]
       cur_rule['re_expr'] = words_to_re(words, 2)
-      cur_rule['re'] = rspamd_regexp.create_cached(cur_rule['re_expr'])
+      cur_rule['re'] = rspamd_regexp.create(cur_rule['re_expr'])
       if cur_rule['re'] and cur_rule['symbol'] then
         valid_rule = true
-        rspamd_config:register_regexp({
-          re = cur_rule['re'],
-          type = 'url',
-        })
-        cur_rule['re']:set_limit(match_limit)
       end
     elseif words[1] == "meta" then
       -- meta SYMBOL expression
@@ -925,18 +882,66 @@ _.each(function(r)
         rule['re'] = nil
       else
         rspamd_logger.debugx(rspamd_config, 'replace %1 -> %2', r, nexpr)
-        rspamd_config:replace_regexp({
-          old_re = rule['re'],
-          new_re = nre
-        })
         rule['re'] = nre
         rule['re_expr'] = nexpr
-        nre:set_limit(match_limit)
       end
     end
   end
 end, replace['rules'])
 
+-- Register all regexps in the re cache, so they are compiled by hyperscan
+-- and evaluated in bulk like regexps of the regexp module.
+-- A regexp object can belong to a single class only, therefore rules that
+-- check multiple headers get a separate object for every header but the first.
+local function register_sa_regexp(rule, re_type, header, copy)
+  local re = rule['re']
+
+  if copy then
+    re = rspamd_regexp.create(rule['re_expr'])
+  end
+
+  if re then
+    rspamd_config:register_regexp({
+      re = re,
+      type = re_type,
+      header = header,
+    })
+    re:set_limit(match_limit)
+  end
+
+  return re
+end
+
+local sa_re_types = {
+  part = 'mime',
+  message = 'body',
+  uri = 'url',
+}
+
+_.each(function(k, r)
+    r['re']:set_limit(match_limit)
+
+    if r['type'] == 'header' then
+      if r['ordinary'] then
+        for i,h in ipairs(r['header']) do
+          h['type'] = 'header'
+          if h['raw'] then
+            h['type'] = 'rawheader'
+          end
+          h['re'] = register_sa_regexp(r, h['type'], h['header'], i > 1)
+        end
+      end
+    elseif r['allheader'] then
+      register_sa_regexp(r, 'allheader')
+    elseif sa_re_types[r['type']] then
+      register_sa_regexp(r, sa_re_types[r['type']])
+    end
+  end,
+  _.filter(function(k, r)
+      return r['re']
+    end,
+    rules))
+
 _.each(function(key, score)
   if rules[key] then
     rules[key]['score'] = score
@@ -950,30 +955,27 @@ _.each(function(k, r)
       local check = {}
       -- Cached path for ordinary expressions
       if r['ordinary'] then
-        local h = r['header'][1]
-        local t = 'header'
+        local ret = 0
 
-        if h['raw'] then
-          t = 'rawheader'
+        for i,h in ipairs(r['header']) do
+          if not h['re'] then
+            rspamd_logger.errx(task, 're is missing for rule %s (%s header)', k,
+                h['header'])
+          else
+            ret = ret + task:process_regexp({
+              re = h['re'],
+              type = h['type'],
+              strong = h['strong'],
+              header = h['header'],
+              multiple = r['multiple'],
+            })
+          end
         end
 
-        if not r['re'] then
-          rspamd_logger.errx(task, 're is missing for rule %s (%s header)', k,
-              h['header'])
+        if r['not'] then
+          if ret == 0 then return 1 end
           return 0
         end
-
-        local ret = task:process_regexp({
-          re = r['re'],
-          type = t,
-          strong = h['strong'],
-          header = h['header'],
-          raw = h['raw'],
-        })
-
-        if h['not'] then
-          return not ret
-        end
         return ret
       end
 
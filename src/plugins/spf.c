@@ -30,6 +30,8 @@
  * - symbol_fail (string): symbol to insert (default: 'R_SPF_FAIL')
  * - symbol_softfail (string): symbol to insert (default: 'R_SPF_SOFTFAIL')
  * - whitelist (map): map of whitelisted networks
+ * - spf_cache_size (number): number of records cached, the shared cache size
+ *   is set on start and is not changed on reload
  */
 
 #include "config.h"
@@ -37,6 +39,7 @@
 #include "libserver/spf.h"
 #include "libutil/hash.h"
 #include "libutil/map.h"
+#include "libutil/shm_cache.h"
 #include "rspamd.h"
 #include "addr.h"
 
@@ -46,6 +49,8 @@
 #define DEFAULT_SYMBOL_ALLOW "R_SPF_ALLOW"
 #define DEFAULT_CACHE_SIZE 2048
 #define DEFAULT_CACHE_MAXAGE 86400
+/* Larger flattened records are cached per process only */
+#define SHARED_RECORD_MAX_SIZE 4096
 
 struct spf_ctx {
 	struct module_ctx ctx;
@@ -57,9 +62,15 @@ struct spf_ctx {
 	rspamd_mempool_t *spf_pool;
 	radix_compressed_t *whitelist_ip;
 	rspamd_lru_hash_t *spf_hash;
+	guint cache_expire;
 };
 
 static struct spf_ctx *spf_module_ctx = NULL;
+/*
+ * Records cache shared by all workers, it is created in the main process once
+ * and is not destroyed on reload
+ */
+static struct rspamd_shm_cache *spf_shared_records = NULL;
 
 static void spf_symbol_callback (struct rspamd_task *task, void *unused);
 
@@ -157,6 +168,7 @@ spf_module_config (struct rspamd_config *cfg)
 	else {
 		cache_expire = DEFAULT_CACHE_MAXAGE;
 	}
+	spf_module_ctx->cache_expire = cache_expire;
 	if ((value =
 		rspamd_config_get_module_opt (cfg, "spf", "whitelist")) != NULL) {
 		if (!rspamd_map_add (cfg, ucl_obj_tostring (value),
@@ -195,6 +207,11 @@ spf_module_config (struct rspamd_config *cfg)
 			NULL,
 			(GDestroyNotify)spf_record_unref);
 
+	if (spf_shared_records == NULL) {
+		spf_shared_records = rspamd_shm_cache_new ("spf records", cache_size,
+				SHARED_RECORD_MAX_SIZE);
+	}
+
 	msg_info_config ("init internal spf module");
 
 	return res;
@@ -215,109 +232,106 @@ spf_module_reconfig (struct rspamd_config *cfg)
 	return spf_module_config (cfg);
 }
 
-static gboolean
-spf_check_element (struct spf_addr *addr, struct rspamd_task *task)
+static void
+spf_insert_result (struct spf_addr *addr, struct rspamd_task *task)
 {
-	gboolean res = FALSE;
-	const guint8 *s, *d;
 	gchar *spf_result;
-	guint af, mask, bmask, addrlen;
 	const gchar *spf_message, *spf_symbol;
 	GList *opts = NULL;
 
-	if (task->from_addr == NULL) {
-		return FALSE;
+	spf_result = rspamd_mempool_strdup (task->task_pool, addr->spf_string);
+	opts = g_list_prepend (opts, spf_result);
+	switch (addr->mech) {
+	case SPF_FAIL:
+		spf_symbol = spf_module_ctx->symbol_fail;
+		spf_message = "(SPF): spf fail";
+		break;
+	case SPF_SOFT_FAIL:
+		spf_symbol = spf_module_ctx->symbol_softfail;
+		spf_message = "(SPF): spf softfail";
+		break;
+	case SPF_NEUTRAL:
+		spf_symbol = spf_module_ctx->symbol_neutral;
+		spf_message = "(SPF): spf neutral";
+		break;
+	default:
+		spf_symbol = spf_module_ctx->symbol_allow;
+		spf_message = "(SPF): spf allow";
+		break;
 	}
+	rspamd_task_insert_result (task,
+			spf_symbol,
+			1,
+			opts);
+	task->messages = g_list_prepend (task->messages, (gpointer)spf_message);
+}
 
-	af = rspamd_inet_address_get_af (task->from_addr);
-	/* Basic comparing algorithm */
-	if (((addr->flags & RSPAMD_SPF_FLAG_IPV6) && af == AF_INET6) ||
-		((addr->flags & RSPAMD_SPF_FLAG_IPV4) && af == AF_INET)) {
-		d = rspamd_inet_address_get_radix_key (task->from_addr, &addrlen);
+static void
+spf_check_list (struct spf_resolved *rec, struct rspamd_task *task)
+{
+	struct spf_addr *addr;
 
-		if (af == AF_INET6) {
-			s = (const guint8 *)addr->addr6;
-			mask = addr->m.dual.mask_v6;
-		}
-		else {
-			s = (const guint8 *)addr->addr4;
-			mask = addr->m.dual.mask_v4;
-		}
+	addr = spf_record_find_addr (rec, task->from_addr);
 
-		/* Compare the first bytes */
-		bmask = mask / CHAR_BIT;
-		if (bmask > addrlen) {
-			msg_info_task ("bad mask length: %d", mask);
-		}
-		else if (memcmp (s, d, bmask) == 0) {
-
-			if (bmask * CHAR_BIT != mask) {
-				/* Compare the remaining bits */
-				s += bmask;
-				d += bmask;
-				mask = (0xff << (CHAR_BIT - (mask - bmask * 8))) & 0xff;
-				if ((*s & mask) == (*d & mask)) {
-					res = TRUE;
-				}
-			}
-			else {
-				res = TRUE;
-			}
-		}
+	if (addr != NULL) {
+		spf_insert_result (addr, task);
 	}
-	else {
-		if (addr->flags & RSPAMD_SPF_FLAG_ANY) {
-			res = TRUE;
-		}
-		else {
-			res = FALSE;
-		}
+}
+
+/*
+ * Shared cache element is a serialized record
+ */
+static void
+spf_plugin_shared_insert (struct spf_resolved *record, time_t now)
+{
+	guchar *data;
+	gsize len;
+	guint ttl;
+
+	if (spf_shared_records == NULL) {
+		return;
 	}
 
-	if (res) {
-		spf_result = rspamd_mempool_strdup (task->task_pool, addr->spf_string);
-		opts = g_list_prepend (opts, spf_result);
-		switch (addr->mech) {
-		case SPF_FAIL:
-			spf_symbol = spf_module_ctx->symbol_fail;
-			spf_message = "(SPF): spf fail";
-			break;
-		case SPF_SOFT_FAIL:
-			spf_symbol = spf_module_ctx->symbol_softfail;
-			spf_message = "(SPF): spf softfail";
-			break;
-		case SPF_NEUTRAL:
-			spf_symbol = spf_module_ctx->symbol_neutral;
-			spf_message = "(SPF): spf neutral";
-			break;
-		default:
-			spf_symbol = spf_module_ctx->symbol_allow;
-			spf_message = "(SPF): spf allow";
-			break;
-		}
-		rspamd_task_insert_result (task,
-				spf_symbol,
-				1,
-				opts);
-		task->messages = g_list_prepend (task->messages, (gpointer)spf_message);
-		return TRUE;
+	ttl = spf_module_ctx->cache_expire;
+
+	if (record->ttl > 0 && record->ttl < ttl) {
+		ttl = record->ttl;
 	}
 
-	return FALSE;
+	data = spf_record_serialize (record, &len);
+	rspamd_shm_cache_insert (spf_shared_records, record->domain,
+			strlen (record->domain), data, len, now, ttl);
+	g_free (data);
 }
 
-static void
-spf_check_list (struct spf_resolved *rec, struct rspamd_task *task)
+static struct spf_resolved *
+spf_plugin_shared_lookup (const gchar *domain, time_t now)
 {
-	guint i;
-	struct spf_addr *addr;
+	struct spf_resolved *record;
+	guchar *buf;
+	gsize len;
+	guint ttl;
 
-	for (i = 0; i < rec->elts->len; i ++) {
-		addr = &g_array_index (rec->elts, struct spf_addr, i);
-		if (spf_check_element (addr, task)) {
-			break;
-		}
+	if (spf_shared_records == NULL) {
+		return NULL;
+	}
+
+	buf = rspamd_shm_cache_lookup (spf_shared_records, domain,
+			strlen (domain), now, &len, &ttl);
+
+	if (buf == NULL) {
+		return NULL;
 	}
+
+	record = spf_record_deserialize (domain, buf, len);
+
+	if (record) {
+		record->ttl = ttl;
+	}
+
+	g_free (buf);
+
+	return record;
 }
 
 static void
@@ -335,6 +349,8 @@ spf_plugin_callback (struct spf_resolved *record, struct rspamd_task *task)
 			rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
 				record->domain, l,
 				task->tv.tv_sec, record->ttl);
+			/* And make it available for other workers */
+			spf_plugin_shared_insert (record, task->tv.tv_sec);
 
 		}
 		spf_record_ref (l);
@@ -356,9 +372,17 @@ spf_symbol_callback (struct rspamd_task *task, void *unused)
 			task->from_addr) == RADIX_NO_VALUE) {
 		domain = get_spf_domain (task);
 		if (domain) {
-			if ((l =
-				rspamd_lru_hash_lookup (spf_module_ctx->spf_hash, domain,
-				task->tv.tv_sec)) != NULL) {
+			l = rspamd_lru_hash_lookup (spf_module_ctx->spf_hash, domain,
+					task->tv.tv_sec);
+
+			if (l == NULL &&
+					(l = spf_plugin_shared_lookup (domain, task->tv.tv_sec))) {
+				/* Hash owns the reference */
+				rspamd_lru_hash_insert (spf_module_ctx->spf_hash,
+						l->domain, l, task->tv.tv_sec, l->ttl);
+			}
+
+			if (l != NULL) {
 				spf_record_ref (l);
 				spf_check_list (l, task);
 				spf_record_unref (l);
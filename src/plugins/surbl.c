@@ -1047,8 +1047,10 @@ free_redirector_session (void *ud)
 {
 	struct redirector_param *param = (struct redirector_param *)ud;
 
+	/* Socket is either closed or kept for the subsequent requests */
+	rspamd_http_keepalive_release (param->conn,
+			rspamd_upstream_name (param->redirector), param->task->ev_base);
 	rspamd_http_connection_unref (param->conn);
-	close (param->sock);
 }
 
 static void
@@ -1137,8 +1139,13 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 			RSPAMD_UPSTREAM_ROUND_ROBIN, url->host, url->hostlen);
 
 	if (selected) {
-		s = rspamd_inet_address_connect (rspamd_upstream_addr (selected),
-				SOCK_STREAM, TRUE);
+		s = rspamd_http_keepalive_get (rspamd_upstream_name (selected),
+				NULL, NULL);
+
+		if (s == -1) {
+			s = rspamd_inet_address_connect (rspamd_upstream_addr (selected),
+					SOCK_STREAM, TRUE);
+		}
 	}
 
 	if (s == -1) {
@@ -1156,7 +1163,7 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 	param->task = task;
 	param->conn = rspamd_http_connection_new (NULL, surbl_redirector_error,
 			surbl_redirector_finish,
-			RSPAMD_HTTP_CLIENT_SIMPLE,
+			RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
 			RSPAMD_HTTP_CLIENT, NULL);
 	msg = rspamd_http_new_message (HTTP_REQUEST);
 	msg->url = rspamd_fstring_assign (msg->url, url->string, url->urllen);
@@ -1172,7 +1179,9 @@ register_redirector_call (struct rspamd_url *url, struct rspamd_task *task,
 		param,
 		g_quark_from_static_string ("surbl"));
 
-	rspamd_http_connection_write_message (param->conn, msg, NULL,
+	/* HTTP/1.1 is required for keep-alive, so we need to send host */
+	rspamd_http_connection_write_message (param->conn, msg,
+			rspamd_upstream_name (selected),
 			NULL, param, s, timeout, task->ev_base);
 
 	msg_info_task (
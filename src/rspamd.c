@@ -428,6 +428,8 @@ make_listen_key (struct rspamd_worker_bind_conf *cf)
 		}
 	}
 
+	XXH64_update (&st, &cf->socktype, sizeof (cf->socktype));
+
 	return XXH64_digest (&st);
 }
 
@@ -467,6 +469,7 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 	GQuark qtype;
 
 	qtype = g_quark_try_string ("hs_helper");
+	rspamd_main->spawn_time = rspamd_get_ticks ();
 
 	cur = rspamd_main->cfg->workers;
 
@@ -491,7 +494,8 @@ spawn_workers (struct rspamd_main *rspamd_main, struct event_base *ev_base)
 						if (!bcf->is_systemd) {
 							/* Create listen socket */
 							ls = create_listen_socket (bcf->addrs, bcf->cnt,
-									cf->worker->listen_type);
+									bcf->socktype ? bcf->socktype :
+											cf->worker->listen_type);
 						}
 						else {
 							ls = systemd_get_socket (rspamd_main, bcf->cnt);
@@ -683,6 +687,74 @@ do_encrypt_password (void)
 	rspamd_fprintf (stderr, "use rspamadm pw for this operation\n");
 }
 
+/*
+ * Loads immutable data in the main process, so workers inherit it on fork
+ * instead of loading the same data each
+ */
+static void
+rspamd_main_warmup (struct rspamd_main *rspamd_main)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg;
+	guint nmaps;
+#ifdef WITH_HYPERSCAN
+	struct rspamd_worker_conf *cf;
+	const ucl_object_t *elt;
+	const gchar *hs_dir = RSPAMD_DBDIR "/";
+	GList *cur;
+	GQuark qtype;
+#endif
+
+	nmaps = rspamd_map_preload (cfg);
+
+#ifdef WITH_HYPERSCAN
+	qtype = g_quark_try_string ("hs_helper");
+
+	for (cur = cfg->workers; cur != NULL; cur = g_list_next (cur)) {
+		cf = cur->data;
+
+		if (cf->type == qtype && cf->options != NULL) {
+			elt = ucl_object_find_key (cf->options, "cache_dir");
+
+			if (elt != NULL && ucl_object_tostring (elt) != NULL) {
+				hs_dir = ucl_object_tostring (elt);
+			}
+		}
+	}
+
+	if (!rspamd_re_cache_load_hyperscan (cfg->re_cache, hs_dir)) {
+		/* Workers load the classes when they are compiled by hs_helper */
+		msg_info_main ("hyperscan cache in %s is not complete, loading "
+				"is deferred to workers", hs_dir);
+	}
+#endif
+
+	/* Otherwise each worker would collect the garbage left by configuration */
+	lua_gc (cfg->lua_state, LUA_GCCOLLECT, 0);
+
+	msg_info_main ("preloaded %ud maps before spawning workers", nmaps);
+}
+
+/*
+ * Registers shared counters, performs warm-up if enabled and logs the timings
+ * of startup phases, the time spent before workers are ready is logged when
+ * they report it
+ */
+static void
+rspamd_main_prepare_spawn (struct rspamd_main *rspamd_main, gdouble cfg_time)
+{
+	gdouble start;
+
+	start = rspamd_get_ticks ();
+	rspamd_worker_counters_init (rspamd_main);
+
+	if (rspamd_main->cfg->prefork_warmup) {
+		rspamd_main_warmup (rspamd_main);
+	}
+
+	msg_info_main ("config loaded in %.2f ms, warm-up took %.2f ms",
+			cfg_time * 1000.0, (rspamd_get_ticks () - start) * 1000.0);
+}
+
 /* Signal handlers */
 static void
 rspamd_term_handler (gint signo, short what, gpointer arg)
@@ -707,20 +779,106 @@ rspamd_usr1_handler (gint signo, short what, gpointer arg)
 			NULL);
 }
 
+/*
+ * Applies the new config in place if only scores or actions have been changed,
+ * so workers are not restarted and keep all compiled rules and caches
+ */
+static gboolean
+rspamd_fast_reload (struct rspamd_main *rspamd_main)
+{
+	struct rspamd_config *cfg = rspamd_main->cfg, *tmp_cfg;
+	GList *changed, *cur;
+	GError *err = NULL;
+	GHashTable *tmp_checksums;
+	gchar *tmp_checksum;
+	gboolean ret = TRUE;
+	gdouble start;
+
+	if (!cfg->fast_reload || cfg->sections_checksums == NULL) {
+		return FALSE;
+	}
+
+	start = rspamd_get_ticks ();
+	tmp_cfg = rspamd_config_new ();
+	tmp_cfg->libs_ctx = cfg->libs_ctx;
+	REF_RETAIN (tmp_cfg->libs_ctx);
+
+	if (!rspamd_config_read_ucl (tmp_cfg, cfg->cfg_name, ucl_vars)) {
+		REF_RELEASE (tmp_cfg);
+
+		return FALSE;
+	}
+
+	changed = rspamd_config_changed_sections (cfg, tmp_cfg);
+
+	if (changed == NULL) {
+		/* Lua rules or other included files might have been changed */
+		ret = FALSE;
+	}
+
+	for (cur = changed; cur != NULL; cur = g_list_next (cur)) {
+		msg_debug_main ("section %s has been changed", (const gchar *)cur->data);
+
+		if (strcmp (cur->data, "metric") != 0) {
+			ret = FALSE;
+		}
+	}
+
+	g_list_free (changed);
+
+	if (ret) {
+		if (!rspamd_config_update_scores (cfg, tmp_cfg->rcl_obj, &err)) {
+			msg_err_main ("cannot update scores: %e", err);
+			g_error_free (err);
+			ret = FALSE;
+		}
+		else if (!rspamd_control_broadcast_scores (rspamd_main,
+				tmp_cfg->rcl_obj)) {
+			ret = FALSE;
+		}
+		else {
+			/* The next reload is compared with the updated snapshot */
+			tmp_checksums = cfg->sections_checksums;
+			cfg->sections_checksums = tmp_cfg->sections_checksums;
+			tmp_cfg->sections_checksums = tmp_checksums;
+			tmp_checksum = cfg->checksum;
+			cfg->checksum = tmp_cfg->checksum;
+			tmp_cfg->checksum = tmp_checksum;
+
+			msg_info_main ("scores have been updated in %.3f ms without "
+					"restarting workers", (rspamd_get_ticks () - start) * 1000.0);
+		}
+	}
+
+	REF_RELEASE (tmp_cfg);
+
+	return ret;
+}
+
 static void
 rspamd_hup_handler (gint signo, short what, gpointer arg)
 {
 	struct rspamd_main *rspamd_main = arg;
+	gdouble start, cfg_time;
 
 	rspamd_log_reopen_priv (rspamd_main->logger,
 			rspamd_main->workers_uid,
 			rspamd_main->workers_gid);
+
+	if (rspamd_fast_reload (rspamd_main)) {
+		return;
+	}
+
 	msg_info_main ("rspamd "
 			RVERSION
 			" is restarting");
 	g_hash_table_foreach (rspamd_main->workers, kill_old_workers, NULL);
 	rspamd_map_remove_all (rspamd_main->cfg);
+	start = rspamd_get_ticks ();
 	reread_config (rspamd_main);
+	cfg_time = rspamd_get_ticks () - start;
+	rspamd_map_compile_shared (rspamd_main->cfg, rspamd_main->ev_base);
+	rspamd_main_prepare_spawn (rspamd_main, cfg_time);
 	spawn_workers (rspamd_main, rspamd_main->ev_base);
 }
 
@@ -788,6 +946,13 @@ rspamd_cld_handler (gint signo, short what, gpointer arg)
 			rspamd_fork_delayed (cur->cf, cur->index, rspamd_main);
 		}
 
+		if (!cur->ready && rspamd_main->workers_starting > 0) {
+			rspamd_main->workers_starting --;
+		}
+
+		rspamd_counters_release_slot (rspamd_main->counters,
+				cur->counters_slot);
+
 		event_del (&cur->srv_ev);
 		g_free (cur);
 	}
@@ -875,6 +1040,7 @@ main (gint argc, gchar **argv, gchar **env)
 	struct event term_ev, int_ev, cld_ev, hup_ev, usr1_ev, control_ev;
 	struct timeval term_tv;
 	struct rspamd_main *rspamd_main;
+	gdouble start, cfg_time;
 
 #if ((GLIB_MAJOR_VERSION == 2) && (GLIB_MINOR_VERSION <= 30))
 	g_thread_init (NULL);
@@ -998,10 +1164,14 @@ main (gint argc, gchar **argv, gchar **env)
 	}
 
 	/* Load config */
+	start = rspamd_get_ticks ();
+
 	if (!load_rspamd_config (rspamd_main, rspamd_main->cfg, TRUE, TRUE)) {
 		exit (EXIT_FAILURE);
 	}
 
+	cfg_time = rspamd_get_ticks () - start;
+
 	/* Override pidfile from configuration by command line argument */
 	if (rspamd_pidfile != NULL) {
 		rspamd_main->cfg->pid_file = rspamd_pidfile;
@@ -1116,6 +1286,8 @@ main (gint argc, gchar **argv, gchar **env)
 	event_base_set (ev_base, &usr1_ev);
 	event_add (&usr1_ev, NULL);
 
+	rspamd_map_compile_shared (rspamd_main->cfg, ev_base);
+	rspamd_main_prepare_spawn (rspamd_main, cfg_time);
 	spawn_workers (rspamd_main, ev_base);
 
 	if (control_fd != -1) {
@@ -1175,6 +1347,7 @@ main (gint argc, gchar **argv, gchar **env)
 	msg_info_main ("terminating...");
 	rspamd_log_close (rspamd_main->logger);
 	REF_RELEASE (rspamd_main->cfg);
+	rspamd_counters_destroy (rspamd_main->counters);
 	g_free (rspamd_main);
 	event_base_free (ev_base);
 
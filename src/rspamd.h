@@ -13,6 +13,7 @@
 #include "libutil/logger.h"
 #include "libutil/http.h"
 #include "libutil/upstream.h"
+#include "libutil/counters.h"
 #include "libserver/url.h"
 #include "libserver/protocol.h"
 #include "libserver/buffer.h"
@@ -60,6 +61,8 @@ struct rspamd_worker {
 	                                     main process. [0] - main, [1] - worker			*/
 	struct event srv_ev;            /**< used by main for read workers' requests		*/
 	gpointer control_data;          /**< used by control protocol to handle commands	*/
+	gboolean ready;                 /**< worker has started accepting connections		*/
+	guint counters_slot;            /**< slot in the shared counters registry			*/
 };
 
 struct rspamd_worker_signal_handler;
@@ -152,6 +155,30 @@ struct rspamd_stat {
 	guint fuzzy_hashes_expired;                         /**< number of fuzzy hashes expired					*/
 	guint64 fuzzy_hashes_checked[RSPAMD_FUZZY_EPOCH_MAX]; /**< ammount of check requests for each epoch		*/
 	guint64 fuzzy_hashes_found[RSPAMD_FUZZY_EPOCH_MAX]; /**< amount of hashes found by epoch				*/
+	guint fuzzy_updates_pending;                        /**< number of fuzzy updates waiting for commit		*/
+	guint64 fuzzy_updates_coalesced;                    /**< fuzzy updates merged with the pending ones		*/
+	guint fuzzy_commit_time;                            /**< duration of the last fuzzy commit in ms		*/
+	guint fuzzy_commit_time_max;                        /**< maximum duration of fuzzy commits in ms		*/
+	guint64 fuzzy_replica_seq;                          /**< last update applied from replication master	*/
+	guint64 fuzzy_replica_lag;                          /**< number of updates replica is behind master		*/
+};
+
+/**
+ * Elements registered in the shared counters registry before any other ones,
+ * so their ids are the same in all processes
+ */
+enum rspamd_builtin_counter {
+	RSPAMD_COUNTER_SCANNED = 0,
+	RSPAMD_COUNTER_LEARNED,
+	RSPAMD_COUNTER_CONNECTIONS,
+	RSPAMD_COUNTER_CONTROL_CONNECTIONS,
+	/* Counter for each action */
+	RSPAMD_COUNTER_ACTIONS,
+	/* Total time of task processing in microseconds */
+	RSPAMD_COUNTER_SCAN_TIME = RSPAMD_COUNTER_ACTIONS + METRIC_ACTION_NOACTION + 1,
+	/* Time of each stage starting from RSPAMD_TASK_STAGE_READ_MESSAGE */
+	RSPAMD_COUNTER_STAGE_TIME,
+	RSPAMD_COUNTER_BUILTIN_MAX = RSPAMD_COUNTER_STAGE_TIME + 6
 };
 
 /**
@@ -174,6 +201,9 @@ struct rspamd_main {
 	gboolean is_privilleged;                                    /**< true if run in privilleged mode                */
 	struct roll_history *history;                               /**< rolling history								*/
 	struct event_base *ev_base;
+	gdouble spawn_time;                                         /**< when workers were spawned, 0 if all are ready	*/
+	guint workers_starting;                                     /**< workers that are not ready yet				*/
+	struct rspamd_counters *counters;                           /**< counters shared by all processes				*/
 };
 
 /**
@@ -706,7 +706,7 @@ accept_socket (gint fd, short what, void *arg)
 	session->session_time = time (NULL);
 	session->resolver = ctx->resolver;
 	session->ev_base = ctx->ev_base;
-	worker->srv->stat->connections_count++;
+	rspamd_counters_inc (worker->srv->counters, RSPAMD_COUNTER_CONNECTIONS);
 
 	/* Resolve client's addr */
 	/* Set up async session */
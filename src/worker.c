@@ -48,6 +48,14 @@
 #define DEFAULT_WORKER_IO_TIMEOUT 60000
 /* Timeout for task processing */
 #define DEFAULT_TASK_TIMEOUT 8.0
+/* Maximum number of messages in a batch request */
+#define DEFAULT_MAX_BATCH 1024
+/* Maximum number of messages of a batch checked at the same time */
+#define DEFAULT_MAX_BATCH_TASKS 16
+/* Maximum number of idle kept alive connections */
+#define DEFAULT_MAX_IDLE 1024
+/* 5 seconds to wait for the next request over a kept alive connection */
+#define DEFAULT_KEEPALIVE_TIMEOUT 5000
 
 gpointer init_worker (struct rspamd_config *cfg);
 void start_worker (struct rspamd_worker *worker);
@@ -100,6 +108,19 @@ struct rspamd_worker_ctx {
 	guint32 max_tasks;
 	/* Maximum time for task processing */
 	gdouble task_timeout;
+	/* Allow many requests over a single connection */
+	gboolean keepalive;
+	/* Timeout of an idle kept alive connection */
+	guint32 keepalive_timeout;
+	struct timeval keepalive_tv;
+	/* Limit of idle kept alive connections */
+	guint32 max_idle;
+	/* Number of idle kept alive connections */
+	guint32 nidle;
+	/* Limit of messages in a batch request */
+	guint32 max_batch;
+	/* Limit of messages of a batch checked simultaneously */
+	guint32 max_batch_tasks;
 	/* Events base */
 	struct event_base *ev_base;
 	/* Encryption key */
@@ -111,14 +132,51 @@ struct rspamd_worker_ctx {
 };
 
 /*
- * Reduce number of tasks proceeded
+ * Connection of a client, several requests can be sent over it if the client
+ * asks to keep it alive
  */
-static void
-reduce_tasks_count (gpointer arg)
-{
-	guint *nconns = arg;
+struct rspamd_worker_session {
+	struct rspamd_worker *worker;
+	struct rspamd_worker_ctx *ctx;
+	struct rspamd_http_connection *http_conn;
+	rspamd_inet_addr_t *addr;
+	/* Task for the current request */
+	struct rspamd_task *task;
+	/* Batch of messages for the current request if any */
+	struct rspamd_worker_batch *batch;
+	gint sock;
+	guint nrequests;
+	/* Waiting for the next request, counted in `nidle` and not in `nconns` */
+	gboolean idle;
+};
 
-	(*nconns)--;
+/*
+ * Several messages checked within a single request, each one by its own task.
+ * Tasks are started up to `max_batch_tasks` at once and every running task is
+ * counted in `nconns` like a separate connection
+ */
+struct rspamd_worker_batch {
+	struct rspamd_worker_session *session;
+	struct rspamd_task *task;
+	struct rspamd_http_message *msg;
+	GArray *messages;
+	GPtrArray *tasks;
+	rspamd_fstring_t **results;
+	guint running;
+	guint done;
+	gboolean scheduling;
+	gboolean started;
+};
+
+struct rspamd_worker_batch_item {
+	struct rspamd_worker_batch *batch;
+	guint idx;
+};
+
+static GQuark
+rspamd_worker_quark (void)
+{
+	return g_quark_from_static_string ("normal-worker");
 }
 
 static void
@@ -133,16 +191,303 @@ rspamd_task_timeout (gint fd, short what, gpointer ud)
 	}
 }
 
+static void
+rspamd_worker_set_timeout (struct rspamd_worker_ctx *ctx,
+		struct rspamd_task *task)
+{
+	struct timeval task_tv;
+
+	/* Set global timeout for the task */
+	if (ctx->task_timeout > 0.0) {
+		event_set (&task->timeout_ev, -1, EV_TIMEOUT, rspamd_task_timeout,
+				task);
+		event_base_set (ctx->ev_base, &task->timeout_ev);
+		double_to_tv (ctx->task_timeout, &task_tv);
+		event_add (&task->timeout_ev, &task_tv);
+	}
+}
+
+static void
+rspamd_worker_task_init (struct rspamd_worker_session *session,
+		struct rspamd_task *task)
+{
+	struct rspamd_worker_ctx *ctx = session->ctx;
+
+	/* Copy some variables */
+	if (ctx->is_mime) {
+		task->flags |= RSPAMD_TASK_FLAG_MIME;
+	}
+	else {
+		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
+	}
+
+	task->client_addr = rspamd_inet_address_copy (session->addr);
+	task->resolver = ctx->resolver;
+	task->ev_base = ctx->ev_base;
+}
+
+static void
+rspamd_worker_batch_dtor (gpointer p)
+{
+	struct rspamd_worker_batch *batch = p;
+	struct rspamd_task *task;
+	guint i;
+
+	/* Tasks that have not finished are still counted as connections */
+	batch->session->worker->nconns -= batch->running;
+	batch->running = 0;
+
+	for (i = 0; i < batch->tasks->len; i ++) {
+		task = g_ptr_array_index (batch->tasks, i);
+		rspamd_session_destroy (task->s);
+
+		if (batch->results[i] != NULL) {
+			rspamd_fstring_free (batch->results[i]);
+		}
+	}
+
+	g_ptr_array_free (batch->tasks, TRUE);
+	g_array_free (batch->messages, TRUE);
+	g_free (batch->results);
+}
+
+static gboolean rspamd_worker_batch_fin (struct rspamd_task *task, void *arg);
+
+/*
+ * Starts tasks for the next messages in batch while limits allow it
+ */
+static void
+rspamd_worker_batch_next (struct rspamd_worker_batch *batch)
+{
+	struct rspamd_worker_session *session = batch->session;
+	struct rspamd_worker_ctx *ctx = session->ctx;
+	struct rspamd_worker_batch_item *item;
+	struct rspamd_task *task = batch->task, *sub;
+	rspamd_ftok_t *tok;
+	guint i;
+
+	/* Tasks finished synchronously must not start the next ones recursively */
+	batch->scheduling = TRUE;
+
+	while (batch->tasks->len < batch->messages->len) {
+		if (ctx->max_batch_tasks > 0 &&
+				batch->running >= ctx->max_batch_tasks) {
+			break;
+		}
+
+		/* At least one message is always checked to finish the batch */
+		if (ctx->max_tasks != 0 && batch->running > 0 &&
+				session->worker->nconns >= ctx->max_tasks) {
+			break;
+		}
+
+		i = batch->tasks->len;
+		tok = &g_array_index (batch->messages, rspamd_ftok_t, i);
+		sub = rspamd_task_new (session->worker, ctx->cfg);
+		rspamd_worker_task_init (session, sub);
+		rspamd_protocol_handle_request (sub, batch->msg);
+		sub->cmd = CMD_SYMBOLS;
+
+		item = rspamd_mempool_alloc (sub->task_pool, sizeof (*item));
+		item->batch = batch;
+		item->idx = i;
+		sub->fin_callback = rspamd_worker_batch_fin;
+		sub->fin_arg = item;
+		sub->s = rspamd_session_create (sub->task_pool, rspamd_task_fin,
+				rspamd_task_restore, (event_finalizer_t)rspamd_task_free, sub);
+		g_ptr_array_add (batch->tasks, sub);
+		batch->running ++;
+		session->worker->nconns ++;
+
+		if (!rspamd_task_load_message (sub, batch->msg, tok->begin, tok->len)) {
+			msg_info_task ("cannot load message %ud in batch: %e", i + 1,
+					sub->err);
+			sub->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
+
+		rspamd_worker_set_timeout (ctx, sub);
+		rspamd_task_process (sub, RSPAMD_TASK_PROCESS_ALL);
+
+		if (sub->processed_stages & RSPAMD_TASK_STAGE_DONE) {
+			rspamd_session_pending (sub->s);
+		}
+	}
+
+	batch->scheduling = FALSE;
+}
+
+static gboolean
+rspamd_worker_batch_fin (struct rspamd_task *task, void *arg)
+{
+	struct rspamd_worker_batch_item *item = arg;
+	struct rspamd_worker_batch *batch = item->batch;
+	struct rspamd_http_message *msg;
+	ucl_object_t *top;
+
+	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
+		return TRUE;
+	}
+
+	if (task->err != NULL) {
+		top = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (top, ucl_object_fromstring (task->err->message),
+				"error", 0, false);
+		batch->results[item->idx] = rspamd_fstring_sized_new (64);
+		rspamd_ucl_emit_fstring (top, UCL_EMIT_JSON_COMPACT,
+				&batch->results[item->idx]);
+		ucl_object_unref (top);
+	}
+	else {
+		/* Use the same output as for a single message */
+		msg = rspamd_http_new_message (HTTP_RESPONSE);
+		rspamd_protocol_http_reply (msg, task);
+		batch->results[item->idx] = msg->body;
+		msg->body = NULL;
+		rspamd_http_message_free (msg);
+	}
+
+	task->processed_stages |= RSPAMD_TASK_STAGE_REPLIED;
+	batch->running --;
+	batch->done ++;
+	batch->session->worker->nconns --;
+
+	if (batch->started && !batch->scheduling) {
+		rspamd_worker_batch_next (batch);
+
+		if (batch->done == batch->messages->len) {
+			batch->task->processed_stages |= RSPAMD_TASK_STAGE_DONE;
+			rspamd_session_pending (batch->task->s);
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean
+rspamd_worker_batch_start (struct rspamd_worker_session *session,
+		struct rspamd_task *task, struct rspamd_http_message *msg,
+		const gchar *chunk, gsize len)
+{
+	struct rspamd_worker_ctx *ctx = session->ctx;
+	struct rspamd_worker_batch *batch;
+	GArray *messages;
+	rspamd_ftok_t srch_file, srch_path;
+
+	srch_file.begin = "file";
+	srch_file.len = 4;
+	srch_path.begin = "path";
+	srch_path.len = 4;
+
+	/* Headers and query arguments are applied to all messages in batch */
+	if (rspamd_http_message_find_header (msg, "File") != NULL ||
+			rspamd_http_message_find_header (msg, "Path") != NULL ||
+			g_hash_table_lookup (task->request_headers, &srch_file) != NULL ||
+			g_hash_table_lookup (task->request_headers, &srch_path) != NULL) {
+		g_set_error (&task->err, rspamd_worker_quark (), RSPAMD_PROTOCOL_ERROR,
+				"files cannot be checked in batch");
+
+		return FALSE;
+	}
+
+	messages = rspamd_protocol_parse_batch (chunk, len, ctx->max_batch,
+			&task->err);
+
+	if (messages == NULL) {
+		return FALSE;
+	}
+
+	/* Request is kept by the connection until the reply is written */
+	batch = rspamd_mempool_alloc0 (task->task_pool, sizeof (*batch));
+	batch->session = session;
+	batch->task = task;
+	batch->msg = msg;
+	batch->messages = messages;
+	batch->tasks = g_ptr_array_sized_new (messages->len);
+	batch->results = g_malloc0 (sizeof (*batch->results) * messages->len);
+	rspamd_mempool_add_destructor (task->task_pool, rspamd_worker_batch_dtor,
+			batch);
+	session->batch = batch;
+
+	msg_debug_task ("checking %ud messages in batch", messages->len);
+
+	rspamd_worker_batch_next (batch);
+	batch->started = TRUE;
+
+	if (batch->done == messages->len) {
+		/* All messages have been checked synchronously */
+		task->processed_stages |= RSPAMD_TASK_STAGE_DONE;
+	}
+
+	return TRUE;
+}
+
+static void
+rspamd_worker_batch_reply (struct rspamd_worker_session *session,
+		struct rspamd_task *task)
+{
+	struct rspamd_worker_batch *batch = session->batch;
+	struct rspamd_http_message *msg;
+	guint i;
+
+	msg = rspamd_http_new_message (HTTP_RESPONSE);
+	msg->date = time (NULL);
+	msg->body = rspamd_fstring_sized_new (batch->tasks->len * 256);
+
+	/* Results are written in the same format as messages in request */
+	for (i = 0; i < batch->tasks->len; i ++) {
+		rspamd_printf_fstring (&msg->body, "%uz\n%V\n",
+				batch->results[i]->len, batch->results[i]);
+	}
+
+	rspamd_http_connection_reset (task->http_conn);
+	rspamd_http_connection_write_message (task->http_conn, msg, NULL,
+			"application/octet-stream", task, task->sock,
+			&session->ctx->io_tv, task->ev_base);
+
+	task->processed_stages |= RSPAMD_TASK_STAGE_REPLIED;
+}
+
+static gboolean
+rspamd_worker_task_reply (struct rspamd_task *task, void *arg)
+{
+	struct rspamd_worker_session *session = arg;
+	struct rspamd_worker_ctx *ctx = session->ctx;
+
+	if (wanna_die) {
+		/* Worker is terminating, so the client should reconnect */
+		rspamd_http_connection_disable_keepalive (session->http_conn);
+	}
+	else if (ctx->max_idle != 0 && ctx->nidle >= ctx->max_idle) {
+		/* Too many idle connections, do not keep one more */
+		rspamd_http_connection_disable_keepalive (session->http_conn);
+	}
+
+	if (session->batch != NULL && task->err == NULL) {
+		rspamd_worker_batch_reply (session, task);
+	}
+	else {
+		rspamd_protocol_write_reply (task);
+	}
+
+	return TRUE;
+}
+
 static gint
 rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg,
 	const gchar *chunk, gsize len)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker_session *session = task->fin_arg;
 	struct rspamd_worker_ctx *ctx;
-	struct timeval task_tv;
 
-	ctx = task->worker->ctx;
+	ctx = session->ctx;
+
+	if (session->idle) {
+		session->idle = FALSE;
+		session->worker->nconns ++;
+		ctx->nidle --;
+	}
 
 	if (!rspamd_protocol_handle_request (task, msg)) {
 		msg_err_task ("cannot handle request: %e", task->err);
@@ -152,6 +497,15 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		if (task->cmd == CMD_PING) {
 			task->flags |= RSPAMD_TASK_FLAG_SKIP;
 		}
+		else if (task->cmd == CMD_BATCH) {
+			if (rspamd_worker_batch_start (session, task, msg, chunk, len)) {
+				/* Messages are processed by their own tasks */
+				return 0;
+			}
+
+			msg_err_task ("cannot check batch: %e", task->err);
+			task->flags |= RSPAMD_TASK_FLAG_SKIP;
+		}
 		else {
 			if (!rspamd_task_load_message (task, msg, chunk, len)) {
 				msg_err_task ("cannot load message: %e", task->err);
@@ -160,29 +514,104 @@ rspamd_worker_body_handler (struct rspamd_http_connection *conn,
 		}
 	}
 
-	/* Set global timeout for the task */
-	if (ctx->task_timeout > 0.0) {
-		event_set (&task->timeout_ev, -1, EV_TIMEOUT, rspamd_task_timeout,
-				task);
-		event_base_set (ctx->ev_base, &task->timeout_ev);
-		double_to_tv (ctx->task_timeout, &task_tv);
-		event_add (&task->timeout_ev, &task_tv);
-	}
-
+	rspamd_worker_set_timeout (ctx, task);
 	rspamd_task_process (task, RSPAMD_TASK_PROCESS_ALL);
 
 	return 0;
 }
 
+static void
+rspamd_worker_session_free (struct rspamd_worker_session *session)
+{
+	if (!session->idle) {
+		session->worker->nconns --;
+	}
+	else {
+		session->ctx->nidle --;
+	}
+
+	rspamd_http_connection_unref (session->http_conn);
+	close (session->sock);
+	rspamd_inet_address_destroy (session->addr);
+	g_slice_free1 (sizeof (*session), session);
+}
+
+/*
+ * Creates task for the next request over the connection
+ */
+static void
+rspamd_worker_session_next (struct rspamd_worker_session *session)
+{
+	struct rspamd_worker_ctx *ctx = session->ctx;
+	struct rspamd_task *task;
+	struct timeval *tv = &ctx->io_tv;
+
+	task = rspamd_task_new (session->worker, ctx->cfg);
+	rspamd_worker_task_init (session, task);
+	task->sock = session->sock;
+	task->http_conn = rspamd_http_connection_ref (session->http_conn);
+	task->fin_callback = rspamd_worker_task_reply;
+	task->fin_arg = session;
+
+	/* Set up async session */
+	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
+			rspamd_task_restore, (event_finalizer_t )rspamd_task_free, task);
+
+	session->task = task;
+	session->batch = NULL;
+
+	if (session->nrequests > 0) {
+		/* Idle connections are limited by `max_idle`, not by `max_tasks` */
+		session->idle = TRUE;
+		session->worker->nconns --;
+		ctx->nidle ++;
+		tv = &ctx->keepalive_tv;
+	}
+
+	session->nrequests ++;
+
+	rspamd_http_connection_read_message (session->http_conn,
+			task,
+			session->sock,
+			tv,
+			ctx->ev_base);
+}
+
+/*
+ * Destroys task of the current request leaving the connection opened
+ */
+static void
+rspamd_worker_session_finish_task (struct rspamd_worker_session *session)
+{
+	struct rspamd_task *task = session->task;
+
+	/* Socket belongs to the connection */
+	task->sock = -1;
+	session->task = NULL;
+	session->batch = NULL;
+	rspamd_session_destroy (task->s);
+}
+
 static void
 rspamd_worker_error_handler (struct rspamd_http_connection *conn, GError *err)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker_session *session = task->fin_arg;
+
+	if (session->idle) {
+		msg_debug_task ("closing idle connection from: %s after %ud requests, "
+				"error: %e",
+				rspamd_inet_address_to_string (session->addr),
+				session->nrequests - 1, err);
+	}
+	else {
+		msg_info_task ("abnormally closing connection from: %s, error: %e",
+			rspamd_inet_address_to_string (session->addr), err);
+	}
 
-	msg_info_task ("abnormally closing connection from: %s, error: %e",
-		rspamd_inet_address_to_string (task->client_addr), err);
 	/* Terminate session immediately */
-	rspamd_session_destroy (task->s);
+	rspamd_worker_session_finish_task (session);
+	rspamd_worker_session_free (session);
 }
 
 static gint
@@ -190,12 +619,23 @@ rspamd_worker_finish_handler (struct rspamd_http_connection *conn,
 	struct rspamd_http_message *msg)
 {
 	struct rspamd_task *task = (struct rspamd_task *) conn->ud;
+	struct rspamd_worker_session *session = task->fin_arg;
 
 	if (task->processed_stages & RSPAMD_TASK_STAGE_REPLIED) {
 		/* We are done here */
-		msg_debug_task ("normally closing connection from: %s",
-			rspamd_inet_address_to_string (task->client_addr));
-		rspamd_session_destroy (task->s);
+		if (rspamd_http_connection_is_keepalive (conn) && !wanna_die) {
+			msg_debug_task ("keeping connection from: %s alive",
+				rspamd_inet_address_to_string (session->addr));
+			rspamd_worker_session_finish_task (session);
+			rspamd_http_connection_reset (conn);
+			rspamd_worker_session_next (session);
+		}
+		else {
+			msg_debug_task ("normally closing connection from: %s",
+				rspamd_inet_address_to_string (session->addr));
+			rspamd_worker_session_finish_task (session);
+			rspamd_worker_session_free (session);
+		}
 	}
 	else if (task->processed_stages & RSPAMD_TASK_STAGE_DONE) {
 		rspamd_session_pending (task->s);
@@ -212,6 +652,7 @@ accept_socket (gint fd, short what, void *arg)
 {
 	struct rspamd_worker *worker = (struct rspamd_worker *) arg;
 	struct rspamd_worker_ctx *ctx;
+	struct rspamd_worker_session *session;
 	struct rspamd_task *task;
 	rspamd_inet_addr_t *addr;
 	gint nfd;
@@ -235,51 +676,32 @@ accept_socket (gint fd, short what, void *arg)
 		return;
 	}
 
-	task = rspamd_task_new (worker, ctx->cfg);
-
-	msg_info_task ("accepted connection from %s port %d",
-		rspamd_inet_address_to_string (addr),
-		rspamd_inet_address_get_port (addr));
-
-	/* Copy some variables */
-	if (ctx->is_mime) {
-		task->flags |= RSPAMD_TASK_FLAG_MIME;
-	}
-	else {
-		task->flags &= ~RSPAMD_TASK_FLAG_MIME;
-	}
-
-	task->sock = nfd;
-	task->client_addr = addr;
-
-	worker->srv->stat->connections_count++;
-	task->resolver = ctx->resolver;
-
-	task->http_conn = rspamd_http_connection_new (
+	session = g_slice_alloc0 (sizeof (*session));
+	session->worker = worker;
+	session->ctx = ctx;
+	session->sock = nfd;
+	session->addr = addr;
+	session->http_conn = rspamd_http_connection_new (
 		rspamd_worker_body_handler,
 		rspamd_worker_error_handler,
 		rspamd_worker_finish_handler,
-		0,
+		ctx->keepalive ? RSPAMD_HTTP_SERVER_KEEP_ALIVE : 0,
 		RSPAMD_HTTP_SERVER,
 		ctx->keys_cache);
-	task->ev_base = ctx->ev_base;
-	worker->nconns++;
-	rspamd_mempool_add_destructor (task->task_pool,
-		(rspamd_mempool_destruct_t)reduce_tasks_count, &worker->nconns);
-
-	/* Set up async session */
-	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
-			rspamd_task_restore, (event_finalizer_t )rspamd_task_free, task);
 
 	if (ctx->key) {
-		rspamd_http_connection_set_key (task->http_conn, ctx->key);
+		rspamd_http_connection_set_key (session->http_conn, ctx->key);
 	}
 
-	rspamd_http_connection_read_message (task->http_conn,
-			task,
-		nfd,
-		&ctx->io_tv,
-		ctx->ev_base);
+	rspamd_counters_inc (worker->srv->counters, RSPAMD_COUNTER_CONNECTIONS);
+	worker->nconns++;
+
+	rspamd_worker_session_next (session);
+	task = session->task;
+
+	msg_info_task ("accepted connection from %s port %d",
+		rspamd_inet_address_to_string (addr),
+		rspamd_inet_address_get_port (addr));
 }
 
 #ifdef WITH_HYPERSCAN
@@ -291,12 +713,20 @@ rspamd_worker_hyperscan_ready (struct rspamd_main *rspamd_main,
 {
 	struct rspamd_control_reply rep;
 
-	msg_info ("loading hyperscan expressions after receiving compilation notice");
 	memset (&rep, 0, sizeof (rep));
 	rep.type = RSPAMD_CONTROL_HYPERSCAN_LOADED;
 
-	rep.reply.hs_loaded.status = rspamd_re_cache_load_hyperscan (
-			worker->srv->cfg->re_cache, cmd->cmd.hs_loaded.cache_dir);
+	if (cmd->cmd.hs_loaded.class_hash[0] != '\0') {
+		/* A single class is published as soon as it is compiled */
+		rep.reply.hs_loaded.status = rspamd_re_cache_load_hyperscan_class (
+				worker->srv->cfg->re_cache, cmd->cmd.hs_loaded.cache_dir,
+				cmd->cmd.hs_loaded.class_hash);
+	}
+	else {
+		msg_info ("loading hyperscan expressions after receiving compilation notice");
+		rep.reply.hs_loaded.status = rspamd_re_cache_load_hyperscan (
+				worker->srv->cfg->re_cache, cmd->cmd.hs_loaded.cache_dir);
+	}
 
 	if (write (fd, &rep, sizeof (rep)) != sizeof (rep)) {
 		msg_err ("cannot write reply to the control socket: %s",
@@ -321,6 +751,11 @@ init_worker (struct rspamd_config *cfg)
 	ctx->timeout = DEFAULT_WORKER_IO_TIMEOUT;
 	ctx->cfg = cfg;
 	ctx->task_timeout = DEFAULT_TASK_TIMEOUT;
+	ctx->keepalive = TRUE;
+	ctx->max_batch = DEFAULT_MAX_BATCH;
+	ctx->max_batch_tasks = DEFAULT_MAX_BATCH_TASKS;
+	ctx->max_idle = DEFAULT_MAX_IDLE;
+	ctx->keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT;
 
 	rspamd_rcl_register_worker_option (cfg, type, "mime",
 			rspamd_rcl_parse_struct_boolean, ctx,
@@ -353,6 +788,30 @@ init_worker (struct rspamd_config *cfg)
 			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
 					max_tasks), RSPAMD_CL_FLAG_INT_32);
 
+	rspamd_rcl_register_worker_option (cfg, type, "keepalive",
+			rspamd_rcl_parse_struct_boolean, ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx, keepalive), 0);
+
+	rspamd_rcl_register_worker_option (cfg, type, "keepalive_timeout",
+			rspamd_rcl_parse_struct_time, ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+					keepalive_timeout), RSPAMD_CL_FLAG_TIME_INTEGER);
+
+	rspamd_rcl_register_worker_option (cfg, type, "max_idle",
+			rspamd_rcl_parse_struct_integer, ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+					max_idle), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "max_batch",
+			rspamd_rcl_parse_struct_integer, ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+					max_batch), RSPAMD_CL_FLAG_INT_32);
+
+	rspamd_rcl_register_worker_option (cfg, type, "max_batch_tasks",
+			rspamd_rcl_parse_struct_integer, ctx,
+			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
+					max_batch_tasks), RSPAMD_CL_FLAG_INT_32);
+
 	rspamd_rcl_register_worker_option (cfg, type, "keypair",
 			rspamd_rcl_parse_struct_keypair, ctx,
 			G_STRUCT_OFFSET (struct rspamd_worker_ctx,
@@ -371,6 +830,7 @@ start_worker (struct rspamd_worker *worker)
 
 	ctx->ev_base = rspamd_prepare_worker (worker, "normal", accept_socket);
 	msec_to_tv (ctx->timeout, &ctx->io_tv);
+	msec_to_tv (ctx->keepalive_timeout, &ctx->keepalive_tv);
 
 	rspamd_map_watch (worker->srv->cfg, ctx->ev_base);
 	rspamd_symbols_cache_start_refresh (worker->srv->cfg->cache, ctx->ev_base);
@@ -86,5 +86,132 @@ context("Regexp unit tests", function()
     end
   end)
   
+  test("Regexp set", function()
+    local set = re.create_set({'/^test/i', '/\\d{3}/', '/[/', '/xyz$/'})
+    assert_not_nil(set)
+    assert_equal(set:size(), 4)
+    assert_nil(set:get_pattern(3))
+
+    local cases = {
+      {'TeSt 123', {1, 2}},
+      {'abc xyz', {4}},
+      {'nothing', {}},
+      {{'test', 'xyz'}, {1, 4}},
+    }
+
+    for _,c in ipairs(cases) do
+      local res = set:match(c[1])
+      assert_equal(#res, #c[2])
+
+      for i,r in ipairs(c[2]) do
+        assert_equal(res[i], r)
+      end
+    end
+  end)
+
+  local function check_set_result(res, expected, what)
+    assert_equal(#res, #expected, 'invalid number of matches for ' .. what)
+
+    for i,r in ipairs(expected) do
+      assert_equal(res[i], r, 'invalid match for ' .. what)
+    end
+  end
+
+  test("Regexp set combined matching", function()
+    local patterns = {}
+
+    -- Large enough to be split to several alternations
+    for i = 1,70 do
+      table.insert(patterns, string.format('/\\bw%d\\b/i', i))
+    end
+    -- Overlapping matches, a backreference, full match and inline flags
+    table.insert(patterns, '/abc/')
+    table.insert(patterns, '/bcd/')
+    table.insert(patterns, '/(x)\\1/')
+    table.insert(patterns, 'm{^full$}')
+    table.insert(patterns, '/(?i)MiXeD/')
+
+    local set = re.create_set(patterns)
+    assert_not_nil(set)
+    assert_equal(set:size(), 75)
+
+    local cases = {
+      {'w3 W17 w40 w400 w69', {3, 17, 40, 69}},
+      {'abcd', {71, 72}},
+      {'xx w70', {70, 73}},
+      {'full', {74}},
+      {'not full', {}},
+      {'mixed abc', {71, 75}},
+      {{'w1', 'w2', 'bcd'}, {1, 2, 72}},
+    }
+
+    for _,c in ipairs(cases) do
+      check_set_result(set:match(c[1]), c[2], tostring(c[1]))
+    end
+  end)
+
+  test("Regexp set raw and utf8 patterns", function()
+    local set = re.create_set({'/ТесТ/iu', '/тест/', '/^\\S+$/'})
+    assert_not_nil(set)
+
+    local cases = {
+      {'ТЕСТ', false, {1, 3}},
+      {'ТЕСТ', true, {3}},
+      {'тест', false, {1, 2, 3}},
+      {'тест', true, {2, 3}},
+    }
+
+    for _,c in ipairs(cases) do
+      check_set_result(set:match(c[1], c[2]), c[3],
+          string.format('%s (raw: %s)', c[1], c[2]))
+    end
+  end)
+
+  test("Regexp set task matching", function()
+    local rspamd_util = require "rspamd_util"
+    local rspamd_task = require "rspamd_task"
+    local cfg = rspamd_util.config_from_ucl({
+      logging = {
+        type = 'console',
+        level = 'info'
+      },
+    })
+    assert_not_nil(cfg)
+
+    local msg = [[
+From: <sender@example.com>
+To: <nobody@example.com>
+Subject: Test offer 12345
+X-Test: first
+X-Test: second
+Content-Type: text/plain; charset=utf-8
+
+Buy cheap pills here today.
+]]
+    local task = rspamd_task.load_from_string(msg, cfg)
+    assert_not_nil(task)
+
+    local cases = {
+      {{'/^test offer/i', '/\\d{5}/', '/nothing/'}, {'header', 'Subject'},
+        {1, 2}},
+      {{'/^first$/', '/^third$/', '/^second$/'}, {'header', 'X-Test'},
+        {1, 3}},
+      {{'/first/'}, {'header', 'x-test', true}, {}},
+      {{'/offer/', '/^Test$/'}, {'rawheader', 'Subject'}, {1}},
+      {{'/^Subject: Test/m', '/^X-Test: second$/m', '/^Received:/m'},
+        {'allheader'}, {1, 2}},
+      {{'/cheap pills/i', '/viagra/i', '/pills?/'}, {'mime'}, {1, 3}},
+      {{'/here today\\.$/m', '/^From:/m'}, {'body'}, {1, 2}},
+    }
+
+    for _,c in ipairs(cases) do
+      local set = re.create_set(c[1])
+      local res = set:match_task(task, c[2][1], c[2][2], c[2][3])
+      check_set_result(res, c[3], c[2][1] .. ' ' .. tostring(c[2][2]))
+    end
+
+    task:destroy()
+  end)
+
   end
 )
\ No newline at end of file
@@ -54,4 +54,47 @@ context("Trie search functions", function()
     end
     
   end)
+
+  test("Trie task matching", function()
+    local rspamd_util = require "rspamd_util"
+    local rspamd_task = require "rspamd_task"
+    local cfg = rspamd_util.config_from_ucl({
+      logging = {
+        type = 'console',
+        level = 'info'
+      },
+    })
+    local msg = [[
+From: <sender@example.com>
+To: <nobody@example.com>
+Subject: Test offer for you, another offer
+Content-Type: text/plain; charset=utf-8
+
+Buy cheap pills here today.
+]]
+    local task = rspamd_task.load_from_string(msg, cfg)
+    assert_not_nil(task)
+
+    local trie = t.create({'offer', 'test', 'missing', 'Test', 'pills', 'you'})
+    local cases = {
+      {{'header', 'Subject'}, {1, 4, 6}},
+      -- Only text is lowercased in caseless mode
+      {{'header', 'Subject', true}, {1, 2, 6}},
+      {{'mime'}, {5}},
+      {{'allheader'}, {1, 4, 6}},
+      {{'header', 'X-Missing'}, {}},
+    }
+
+    for _,c in ipairs(cases) do
+      local res = trie:match_task(task, c[1][1], c[1][2], c[1][3])
+      local what = c[1][1] .. ' ' .. tostring(c[1][2])
+
+      assert_equal(#res, #c[2], 'invalid number of matches for ' .. what)
+      for i,r in ipairs(c[2]) do
+        assert_equal(res[i], r, 'invalid match for ' .. what)
+      end
+    end
+
+    task:destroy()
+  end)
 end)
\ No newline at end of file
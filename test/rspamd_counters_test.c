@@ -0,0 +1,119 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "libutil/counters.h"
+#include "tests.h"
+#include <math.h>
+
+#define TEST_SLOTS 4
+#define TEST_VALUES 10000
+
+static void
+rspamd_counters_test_quantile (const guint64 *buckets, guint64 count,
+		gdouble q)
+{
+	gdouble est, expected;
+
+	est = rspamd_counters_hist_quantile (buckets, count, q);
+	expected = TEST_VALUES * q;
+
+	/* Buckets are 1/8 of a power of two wide */
+	g_assert (fabs (est - expected) <= expected * 0.125);
+}
+
+void
+rspamd_counters_test_func (void)
+{
+	struct rspamd_counters *reg;
+	guint64 *buckets, sum, count;
+	gint cnt_id, hist_id;
+	guint i, slot;
+
+	reg = rspamd_counters_new ();
+	cnt_id = rspamd_counters_register (reg, "test_counter",
+			RSPAMD_COUNTER_TYPE_COUNTER);
+	hist_id = rspamd_counters_register (reg, "test_hist",
+			RSPAMD_COUNTER_TYPE_HISTOGRAM);
+	g_assert (cnt_id >= 0 && hist_id >= 0 && cnt_id != hist_id);
+	g_assert (rspamd_counters_register (reg, "test_counter",
+			RSPAMD_COUNTER_TYPE_COUNTER) == cnt_id);
+	g_assert (rspamd_counters_register (reg, "test_counter",
+			RSPAMD_COUNTER_TYPE_HISTOGRAM) == -1);
+	g_assert (rspamd_counters_find (reg, "test_hist") == hist_id);
+
+	/* Nothing is counted before mapping */
+	rspamd_counters_add (reg, cnt_id, 100);
+	g_assert (rspamd_counters_map (reg, TEST_SLOTS, 0));
+	g_assert (rspamd_counters_get (reg, cnt_id) == 0);
+
+	/* Values from different slots are summed */
+	slot = rspamd_counters_acquire_slot (reg);
+	g_assert (slot != 0);
+	rspamd_counters_use_slot (reg, slot);
+	rspamd_counters_add (reg, cnt_id, 5);
+	slot = rspamd_counters_acquire_slot (reg);
+	rspamd_counters_use_slot (reg, slot);
+	rspamd_counters_add (reg, cnt_id, 7);
+	rspamd_counters_inc (reg, cnt_id);
+	g_assert (rspamd_counters_get (reg, cnt_id) == 13);
+
+	/* Released slots keep their values */
+	rspamd_counters_release_slot (reg, slot);
+	g_assert (rspamd_counters_acquire_slot (reg) == slot);
+	g_assert (rspamd_counters_get (reg, cnt_id) == 13);
+
+	/* Elements registered after mapping use the reserved space */
+	g_assert (rspamd_counters_register (reg, "test_late",
+			RSPAMD_COUNTER_TYPE_COUNTER) >= 0);
+
+	for (i = 1; i <= TEST_VALUES; i ++) {
+		rspamd_counters_hist_add (reg, hist_id, i);
+	}
+
+	buckets = g_malloc0 (sizeof (*buckets) * RSPAMD_COUNTERS_HIST_BUCKETS);
+	count = rspamd_counters_hist_get (reg, hist_id, buckets, &sum);
+	g_assert (count == TEST_VALUES);
+	g_assert (sum == (guint64)TEST_VALUES * (TEST_VALUES + 1) / 2);
+	rspamd_counters_test_quantile (buckets, count, 0.5);
+	rspamd_counters_test_quantile (buckets, count, 0.99);
+
+	/* Buckets are contiguous */
+	for (i = 1; i < RSPAMD_COUNTERS_HIST_BUCKETS; i ++) {
+		g_assert (rspamd_counters_hist_bucket_max (i) >
+				rspamd_counters_hist_bucket_max (i - 1));
+	}
+
+	g_assert (rspamd_counters_hist_bucket_max (
+			RSPAMD_COUNTERS_HIST_BUCKETS - 1) ==
+			(G_GUINT64_CONSTANT (1) << 32) - 1);
+
+	rspamd_counters_reset (reg, cnt_id);
+	rspamd_counters_reset (reg, hist_id);
+	g_assert (rspamd_counters_get (reg, cnt_id) == 0);
+	g_assert (rspamd_counters_hist_get (reg, hist_id, buckets, NULL) == 0);
+
+	g_free (buckets);
+	rspamd_counters_destroy (reg);
+}
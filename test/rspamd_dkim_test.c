@@ -36,6 +36,68 @@ static const gchar test_dkim_sig[] = "v=1; a=rsa-sha256; c=relaxed/relaxed; "
 
 extern struct event_base *base;
 
+/* Body hashes are calculated according to RFC 6376, section 3.4 */
+static const struct {
+	const gchar *canon;
+	guint len;
+	const gchar *body;
+	const gchar *bh;
+} test_dkim_bodies[] = {
+	/* Trailing empty lines are ignored */
+	{"simple", 0, "Hi.\r\n\r\nWe lost the game.\r\n\r\n\r\n",
+			"sTT02lKuPAH1nGYBiIjR27DGuCuXdYrdO56uQNzQX+8="},
+	{"relaxed", 0, " C \r\nD \t E\r\n\r\n\r\n",
+			"unak6JHq0wL+Q1HP7dW1tjBx9FLA6DffoZ0qrLwbbpo="},
+	/* Missing CRLF at the end is added */
+	{"simple", 0, "abc", "VSuraGTHp7aaUC7RhUuSRcDhow8AiqoLKB2mJYX9sCU="},
+	{"relaxed", 0, "abc  ", "VSuraGTHp7aaUC7RhUuSRcDhow8AiqoLKB2mJYX9sCU="},
+	{"simple", 0, "abc\n\n", "VSuraGTHp7aaUC7RhUuSRcDhow8AiqoLKB2mJYX9sCU="},
+	/* No body: single CRLF for simple and nothing for relaxed */
+	{"simple", 0, "", "frcCV1k9oG9oKj3dpUqdJg1PxRT2RSN/XKdLCPjaYaY="},
+	{"relaxed", 0, "", "47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU="},
+	{"simple", 0, "\r\n\r\n", "frcCV1k9oG9oKj3dpUqdJg1PxRT2RSN/XKdLCPjaYaY="},
+	{"relaxed", 0, "\r\n  \r\n", "47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU="},
+	/* l= limits the number of canonicalized octets */
+	{"simple", 6, "abc\r\ndef\r\n", "TOGsWYmuyBPSy0dxsacznhT7Aar0NMTuiBHYgd7wopo="},
+	{"relaxed", 3, "a  b \r\n", "yGh6CKpdbtIEQyj6aml6uOltw0KR6MIDSujDjm/MbWU="},
+};
+
+static void
+rspamd_dkim_test_body_hash (void)
+{
+	rspamd_dkim_context_t *ctx;
+	rspamd_mempool_t *pool;
+	GError *err = NULL;
+	gchar *sig, len[32];
+	const gchar *body;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (test_dkim_bodies); i ++) {
+		/* Body hashes are cached in pool, so use a separate one for each */
+		pool = rspamd_mempool_new (rspamd_mempool_suggest_size (), NULL);
+		len[0] = '\0';
+
+		if (test_dkim_bodies[i].len > 0) {
+			rspamd_snprintf (len, sizeof (len), " l=%ud;",
+					test_dkim_bodies[i].len);
+		}
+
+		sig = g_strdup_printf ("v=1; a=rsa-sha256; c=relaxed/%s;%s "
+				"d=example.com; s=dkim; h=From; bh=%s; "
+				"b=PCiECkOaPFb99DW+gApgfmdlTUo6XN6YXjnj52Cxoz2FoA857B0ZHFge;",
+				test_dkim_bodies[i].canon, len, test_dkim_bodies[i].bh);
+		ctx = rspamd_create_dkim_context (sig, pool, 0, &err);
+		g_assert_no_error (err);
+		g_assert (ctx != NULL);
+
+		body = test_dkim_bodies[i].body;
+		g_assert (rspamd_dkim_check_body_hash (ctx, body, body + strlen (body)));
+
+		g_free (sig);
+		rspamd_mempool_delete (pool);
+	}
+}
+
 static void
 test_key_handler (rspamd_dkim_key_t *key, gsize keylen, rspamd_dkim_context_t *ctx, gpointer ud, GError *err)
 {
@@ -60,6 +122,8 @@ session_fin (gpointer unused)
 void
 rspamd_dkim_test_func ()
 {
+	rspamd_dkim_test_body_hash ();
+
 #if 0
 	rspamd_dkim_context_t *ctx;
 	rspamd_dkim_key_t *key;
@@ -0,0 +1,272 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "fuzzy_backend.h"
+#include "unix-std.h"
+
+#define TEST_MASTER_FILENAME "/tmp/rspamd_test_fuzzy_master.sqlite"
+#define TEST_REPLICA_FILENAME "/tmp/rspamd_test_fuzzy_replica.sqlite"
+#define TEST_SOURCE "master.example.com:11336"
+#define TEST_EXPIRE 3600
+#define TEST_UPDATES 100
+/* The last of the initial updates deletes the first digest */
+#define TEST_DELETED 0
+
+struct rspamd_fuzzy_test_cmd {
+	union {
+		struct rspamd_fuzzy_cmd normal;
+		struct rspamd_fuzzy_shingle_cmd shingle;
+	} cmd;
+	gsize len;
+};
+
+static void
+rspamd_fuzzy_test_unlink (const gchar *path)
+{
+	gchar fname[PATH_MAX];
+
+	unlink (path);
+	rspamd_snprintf (fname, sizeof (fname), "%s-wal", path);
+	unlink (fname);
+	rspamd_snprintf (fname, sizeof (fname), "%s-shm", path);
+	unlink (fname);
+}
+
+static struct rspamd_fuzzy_backend *
+rspamd_fuzzy_test_open (const gchar *path)
+{
+	struct rspamd_fuzzy_backend *backend;
+	GError *err = NULL;
+
+	backend = rspamd_fuzzy_backend_open (path, FALSE, &err);
+
+	if (backend == NULL) {
+		msg_err ("cannot open %s: %e", path, err);
+		g_error_free (err);
+	}
+
+	g_assert (backend != NULL);
+
+	return backend;
+}
+
+/* Digest is derived from the number, odd numbers carry shingles */
+static void
+rspamd_fuzzy_test_make_cmd (guint num, guint8 type,
+		struct rspamd_fuzzy_test_cmd *cmd)
+{
+	guint i;
+
+	memset (cmd, 0, sizeof (*cmd));
+	cmd->cmd.normal.version = RSPAMD_FUZZY_VERSION;
+	cmd->cmd.normal.cmd = type;
+	cmd->cmd.normal.flag = 1;
+	cmd->cmd.normal.value = num + 1;
+	rspamd_cryptobox_hash ((guchar *)cmd->cmd.normal.digest,
+			(const guchar *)&num, sizeof (num), NULL, 0);
+
+	if (num % 2 == 1) {
+		cmd->cmd.normal.shingles_count = RSPAMD_SHINGLE_SIZE;
+
+		for (i = 0; i < RSPAMD_SHINGLE_SIZE; i ++) {
+			cmd->cmd.shingle.sgl.hashes[i] = ((guint64)num << 8) | i;
+		}
+
+		cmd->len = sizeof (cmd->cmd.shingle);
+	}
+	else {
+		cmd->len = sizeof (cmd->cmd.normal);
+	}
+}
+
+/* Writes updates from `first` to `last` to the master and logs them */
+static void
+rspamd_fuzzy_test_master_update (struct rspamd_fuzzy_backend *backend,
+		guint first, guint last)
+{
+	struct rspamd_fuzzy_test_cmd cmd;
+	guint i;
+
+	g_assert (rspamd_fuzzy_backend_prepare_update (backend));
+
+	for (i = first; i <= last; i ++) {
+		if (i == TEST_UPDATES - 1) {
+			rspamd_fuzzy_test_make_cmd (TEST_DELETED, FUZZY_DEL, &cmd);
+			g_assert (rspamd_fuzzy_backend_del (backend, &cmd.cmd.normal));
+		}
+		else {
+			rspamd_fuzzy_test_make_cmd (i, FUZZY_WRITE, &cmd);
+			g_assert (rspamd_fuzzy_backend_add (backend, &cmd.cmd.normal));
+		}
+
+		g_assert (rspamd_fuzzy_backend_log_update (backend, &cmd.cmd.normal,
+				cmd.len));
+	}
+
+	g_assert (rspamd_fuzzy_backend_finish_update (backend));
+}
+
+static rspamd_fstring_t *
+rspamd_fuzzy_test_fetch (guint64 from, guint expected)
+{
+	struct rspamd_fuzzy_backend *backend;
+	rspamd_fstring_t *buf;
+
+	backend = rspamd_fuzzy_test_open (TEST_MASTER_FILENAME);
+	buf = rspamd_fstring_new ();
+	g_assert_cmpuint (rspamd_fuzzy_backend_log_fetch (backend, from,
+			TEST_UPDATES * 2, rspamd_fuzzy_backend_log_serialize, &buf),
+			==, expected);
+	rspamd_fuzzy_backend_close (backend);
+
+	return buf;
+}
+
+/* Applies stream to the replica as the fuzzy storage does */
+static enum rspamd_fuzzy_replica_status
+rspamd_fuzzy_test_apply (rspamd_fstring_t *buf, gsize len, guint64 *seq,
+		guint *nrecords)
+{
+	struct rspamd_fuzzy_backend *backend;
+	enum rspamd_fuzzy_replica_status status;
+
+	backend = rspamd_fuzzy_test_open (TEST_REPLICA_FILENAME);
+	*seq = rspamd_fuzzy_backend_source_seq (backend, TEST_SOURCE);
+	*nrecords = 0;
+	g_assert (rspamd_fuzzy_backend_prepare_update (backend));
+	status = rspamd_fuzzy_backend_log_apply (backend,
+			(const guchar *)buf->str, len, FALSE, seq, nrecords);
+	g_assert (rspamd_fuzzy_backend_set_source_seq (backend, TEST_SOURCE, *seq));
+	g_assert (rspamd_fuzzy_backend_finish_update (backend));
+	rspamd_fuzzy_backend_close (backend);
+
+	return status;
+}
+
+static void
+rspamd_fuzzy_test_check_replica (guint last)
+{
+	struct rspamd_fuzzy_backend *backend;
+	struct rspamd_fuzzy_test_cmd cmd;
+	struct rspamd_fuzzy_reply rep;
+	guint i;
+
+	backend = rspamd_fuzzy_test_open (TEST_REPLICA_FILENAME);
+	g_assert_cmpuint (rspamd_fuzzy_backend_source_seq (backend, TEST_SOURCE),
+			==, last + 1);
+
+	for (i = 0; i <= last; i ++) {
+		if (i == TEST_UPDATES - 1) {
+			continue;
+		}
+
+		rspamd_fuzzy_test_make_cmd (i, FUZZY_CHECK, &cmd);
+		rep = rspamd_fuzzy_backend_check (backend, &cmd.cmd.normal,
+				TEST_EXPIRE);
+
+		if (i == TEST_DELETED) {
+			g_assert (rep.prob == 0.0);
+		}
+		else {
+			g_assert (rep.prob == 1.0);
+			g_assert_cmpint (rep.value, ==, i + 1);
+			g_assert_cmpuint (rep.flag, ==, 1);
+		}
+	}
+
+	rspamd_fuzzy_backend_close (backend);
+}
+
+void
+rspamd_fuzzy_backend_test_func (void)
+{
+	struct rspamd_fuzzy_backend *backend;
+	rspamd_fstring_t *buf;
+	enum rspamd_fuzzy_replica_status status;
+	guint64 seq;
+	guint nrecords;
+
+	rspamd_fuzzy_test_unlink (TEST_MASTER_FILENAME);
+	rspamd_fuzzy_test_unlink (TEST_REPLICA_FILENAME);
+
+	/* Full round trip: log on master, apply on replica */
+	backend = rspamd_fuzzy_test_open (TEST_MASTER_FILENAME);
+	rspamd_fuzzy_test_master_update (backend, 0, TEST_UPDATES - 1);
+	g_assert_cmpuint (rspamd_fuzzy_backend_log_last (backend), ==,
+			TEST_UPDATES);
+	rspamd_fuzzy_backend_close (backend);
+
+	buf = rspamd_fuzzy_test_fetch (0, TEST_UPDATES);
+	status = rspamd_fuzzy_test_apply (buf, buf->len, &seq, &nrecords);
+	g_assert_cmpint (status, ==, RSPAMD_FUZZY_REPLICA_OK);
+	g_assert_cmpuint (seq, ==, TEST_UPDATES);
+	g_assert_cmpuint (nrecords, ==, TEST_UPDATES);
+	rspamd_fuzzy_test_check_replica (TEST_UPDATES - 1);
+
+	/* The same stream is applied once */
+	status = rspamd_fuzzy_test_apply (buf, buf->len, &seq, &nrecords);
+	g_assert_cmpint (status, ==, RSPAMD_FUZZY_REPLICA_OK);
+	g_assert_cmpuint (seq, ==, TEST_UPDATES);
+	g_assert_cmpuint (nrecords, ==, 0);
+	rspamd_fstring_free (buf);
+
+	/* Incremental fetch of the new updates */
+	backend = rspamd_fuzzy_test_open (TEST_MASTER_FILENAME);
+	rspamd_fuzzy_test_master_update (backend, TEST_UPDATES,
+			TEST_UPDATES * 2 - 1);
+	rspamd_fuzzy_backend_close (backend);
+
+	buf = rspamd_fuzzy_test_fetch (TEST_UPDATES, TEST_UPDATES);
+
+	/* Truncated stream is applied up to the last complete record */
+	status = rspamd_fuzzy_test_apply (buf, buf->len - 1, &seq, &nrecords);
+	g_assert_cmpint (status, ==, RSPAMD_FUZZY_REPLICA_INVALID);
+	g_assert_cmpuint (seq, ==, TEST_UPDATES * 2 - 1);
+	g_assert_cmpuint (nrecords, ==, TEST_UPDATES - 1);
+
+	status = rspamd_fuzzy_test_apply (buf, buf->len, &seq, &nrecords);
+	g_assert_cmpint (status, ==, RSPAMD_FUZZY_REPLICA_OK);
+	g_assert_cmpuint (seq, ==, TEST_UPDATES * 2);
+	g_assert_cmpuint (nrecords, ==, 1);
+	rspamd_fuzzy_test_check_replica (TEST_UPDATES * 2 - 1);
+	rspamd_fstring_free (buf);
+
+	/* New replica cannot follow master after the log has been expired */
+	rspamd_fuzzy_test_unlink (TEST_REPLICA_FILENAME);
+	backend = rspamd_fuzzy_test_open (TEST_MASTER_FILENAME);
+	rspamd_fuzzy_backend_log_expire (backend, TEST_UPDATES);
+	rspamd_fuzzy_backend_close (backend);
+
+	buf = rspamd_fuzzy_test_fetch (0, TEST_UPDATES);
+	status = rspamd_fuzzy_test_apply (buf, buf->len, &seq, &nrecords);
+	g_assert_cmpint (status, ==, RSPAMD_FUZZY_REPLICA_GAP);
+	g_assert_cmpuint (seq, ==, 0);
+	g_assert_cmpuint (nrecords, ==, 0);
+	rspamd_fstring_free (buf);
+
+	rspamd_fuzzy_test_unlink (TEST_MASTER_FILENAME);
+	rspamd_fuzzy_test_unlink (TEST_REPLICA_FILENAME);
+}
@@ -39,6 +39,7 @@ static guint file_size = 500;
 static guint pconns = 100;
 static guint ntests = 3000;
 static guint nservers = 1;
+static guint npipelined = 16;
 
 static void
 rspamd_server_error (struct rspamd_http_connection_entry *conn_ent,
@@ -249,6 +250,343 @@ rspamd_http_stop_servers (pid_t *sfd)
 	}
 }
 
+/*
+ * Server of pipelined requests, replies with paths of requests in the same
+ * way as the normal worker replies over kept alive connections
+ */
+struct rspamd_pipelined_session {
+	struct event_base *ev_base;
+	gint fd;
+	gboolean replied;
+};
+
+enum rspamd_pipelined_mode {
+	/* Any error is fatal */
+	PIPELINED_STRICT = 0,
+	/* Clients can close idle connections */
+	PIPELINED_KEEPALIVE,
+	/* Connection is closed after a reply even if it is kept alive */
+	PIPELINED_CLOSE
+};
+
+/* Set in the server process only */
+static enum rspamd_pipelined_mode pipelined_mode = PIPELINED_STRICT;
+
+static gint
+rspamd_pipelined_body (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg,
+	const gchar *chunk, gsize len)
+{
+	return 0;
+}
+
+static void
+rspamd_pipelined_error (struct rspamd_http_connection *conn, GError *err)
+{
+	struct rspamd_pipelined_session *session = conn->ud;
+
+	if (pipelined_mode == PIPELINED_STRICT) {
+		msg_err ("pipelined http error occurred: %s", err->message);
+		g_assert (0);
+	}
+
+	close (session->fd);
+	rspamd_http_connection_unref (conn);
+	g_free (session);
+}
+
+static gint
+rspamd_pipelined_finish (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_pipelined_session *session = conn->ud;
+	struct rspamd_http_message *reply;
+
+	if (!session->replied) {
+		reply = rspamd_http_new_message (HTTP_RESPONSE);
+		reply->date = time (NULL);
+		reply->code = 200;
+		reply->status = rspamd_fstring_new_init ("OK", 2);
+		reply->body = rspamd_fstring_new_init (msg->url->str, msg->url->len);
+		session->replied = TRUE;
+		rspamd_http_connection_reset (conn);
+		rspamd_http_connection_write_message (conn, reply, NULL, "text/plain",
+				session, session->fd, NULL, session->ev_base);
+	}
+	else if (rspamd_http_connection_is_keepalive (conn) &&
+			pipelined_mode != PIPELINED_CLOSE) {
+		session->replied = FALSE;
+		rspamd_http_connection_reset (conn);
+		rspamd_http_connection_read_message (conn, session, session->fd,
+				NULL, session->ev_base);
+	}
+	else {
+		close (session->fd);
+		rspamd_http_connection_unref (conn);
+		g_free (session);
+	}
+
+	return 0;
+}
+
+static void
+rspamd_pipelined_accept (gint fd, short what, void *arg)
+{
+	struct event_base *ev_base = arg;
+	struct rspamd_pipelined_session *session;
+	struct rspamd_http_connection *conn;
+	rspamd_inet_addr_t *addr;
+	gint nfd;
+
+	if ((nfd =
+			rspamd_accept_from_socket (fd, &addr)) == -1) {
+		msg_warn ("accept failed: %s", strerror (errno));
+		return;
+	}
+	/* Check for EAGAIN */
+	if (nfd == 0) {
+		return;
+	}
+
+	rspamd_inet_address_destroy (addr);
+	session = g_malloc0 (sizeof (*session));
+	session->ev_base = ev_base;
+	session->fd = nfd;
+	conn = rspamd_http_connection_new (rspamd_pipelined_body,
+			rspamd_pipelined_error, rspamd_pipelined_finish,
+			RSPAMD_HTTP_SERVER_KEEP_ALIVE, RSPAMD_HTTP_SERVER, NULL);
+	rspamd_http_connection_read_message (conn, session, nfd, NULL, ev_base);
+}
+
+static pid_t
+rspamd_http_start_pipelined_server (rspamd_inet_addr_t *addr,
+		enum rspamd_pipelined_mode mode)
+{
+	struct event_base *ev_base;
+	struct event accept_ev, term_ev;
+	gint fd;
+	pid_t pid;
+
+	g_assert ((fd = rspamd_inet_address_listen (addr, SOCK_STREAM, TRUE)) != -1);
+	pid = fork ();
+	g_assert (pid != -1);
+
+	if (pid == 0) {
+		pipelined_mode = mode;
+		ev_base = event_init ();
+		event_set (&accept_ev, fd, EV_READ | EV_PERSIST,
+				rspamd_pipelined_accept, ev_base);
+		event_base_set (ev_base, &accept_ev);
+		event_add (&accept_ev, NULL);
+
+		evsignal_set (&term_ev, SIGTERM, rspamd_http_term_handler, ev_base);
+		event_base_set (ev_base, &term_ev);
+		event_add (&term_ev, NULL);
+
+		event_base_loop (ev_base, 0);
+		exit (EXIT_SUCCESS);
+	}
+
+	close (fd);
+	usleep (100000);
+
+	return pid;
+}
+
+static void
+rspamd_http_test_pipelined (rspamd_inet_addr_t *addr)
+{
+	GString *req, *rep;
+	gchar buf[8192], expected[64], *pos, *hdr_end;
+	const gchar *conn_hdr;
+	gssize r;
+	gint fd, res;
+	guint i, len;
+	pid_t pid;
+
+	pid = rspamd_http_start_pipelined_server (addr, PIPELINED_STRICT);
+
+	/* All requests are sent at once, the last one asks to close connection */
+	req = g_string_new (NULL);
+
+	for (i = 0; i < npipelined; i ++) {
+		rspamd_printf_gstring (req, "GET /pipelined/%ud HTTP/1.1\r\n"
+				"Connection: %s\r\n\r\n",
+				i, i == npipelined - 1 ? "close" : "keep-alive");
+	}
+
+	g_assert ((fd = rspamd_inet_address_connect (addr, SOCK_STREAM, FALSE)) != -1);
+	g_assert (write (fd, req->str, req->len) == (gssize)req->len);
+
+	rep = g_string_new (NULL);
+
+	while ((r = read (fd, buf, sizeof (buf))) > 0) {
+		g_string_append_len (rep, buf, r);
+	}
+
+	g_assert (r == 0);
+	close (fd);
+
+	/* Replies must come in order of requests */
+	pos = rep->str;
+
+	for (i = 0; i < npipelined; i ++) {
+		hdr_end = strstr (pos, "\r\n\r\n");
+		g_assert (hdr_end != NULL);
+		*hdr_end = '\0';
+		g_assert (g_str_has_prefix (pos, "HTTP/1.1 200"));
+		conn_hdr = i == npipelined - 1 ? "Connection: close" :
+				"Connection: keep-alive";
+		g_assert (strstr (pos, conn_hdr) != NULL);
+
+		pos = hdr_end + 4;
+		len = rspamd_snprintf (expected, sizeof (expected), "/pipelined/%ud", i);
+		g_assert (rep->len - (pos - rep->str) >= len);
+		g_assert (memcmp (pos, expected, len) == 0);
+		pos += len;
+	}
+
+	g_assert (pos == rep->str + rep->len);
+	msg_info ("Made %d pipelined requests over a single connection",
+			npipelined);
+
+	g_string_free (req, TRUE);
+	g_string_free (rep, TRUE);
+	kill (pid, SIGTERM);
+	wait (&res);
+}
+
+/*
+ * Keep-alive client: requests are sent one by one, and each next request is
+ * sent from the finish handler of the previous one over a pooled socket
+ */
+#define KEEPALIVE_TEST_PEER "keepalive-test"
+#define KEEPALIVE_TEST_TIMEOUT 0.5
+
+struct rspamd_keepalive_test {
+	struct event_base *ev_base;
+	rspamd_inet_addr_t *addr;
+	guint nreq;
+	guint done;
+	guint reused;
+};
+
+static void rspamd_keepalive_client_request (struct rspamd_keepalive_test *kt);
+
+static void
+rspamd_keepalive_client_err (struct rspamd_http_connection *conn, GError *err)
+{
+	msg_err ("keep-alive http error occurred: %s", err->message);
+	g_assert (0);
+}
+
+static gint
+rspamd_keepalive_client_finish (struct rspamd_http_connection *conn,
+	struct rspamd_http_message *msg)
+{
+	struct rspamd_keepalive_test *kt = conn->ud;
+
+	g_assert (msg->code == 200);
+	kt->done ++;
+	rspamd_http_keepalive_release (conn, KEEPALIVE_TEST_PEER, kt->ev_base);
+	rspamd_http_connection_unref (conn);
+
+	if (kt->done < kt->nreq) {
+		rspamd_keepalive_client_request (kt);
+	}
+
+	return 0;
+}
+
+static void
+rspamd_keepalive_client_request (struct rspamd_keepalive_test *kt)
+{
+	struct rspamd_http_connection *conn;
+	struct rspamd_http_message *msg;
+	struct timeval tv = {1, 0};
+	gint fd;
+
+	fd = rspamd_http_keepalive_get (KEEPALIVE_TEST_PEER, NULL, NULL);
+
+	if (fd != -1) {
+		kt->reused ++;
+	}
+	else {
+		fd = rspamd_inet_address_connect (kt->addr, SOCK_STREAM, TRUE);
+		g_assert (fd != -1);
+	}
+
+	conn = rspamd_http_connection_new (NULL, rspamd_keepalive_client_err,
+			rspamd_keepalive_client_finish,
+			RSPAMD_HTTP_CLIENT_SIMPLE|RSPAMD_HTTP_CLIENT_KEEP_ALIVE,
+			RSPAMD_HTTP_CLIENT, NULL);
+	msg = rspamd_http_message_from_url ("http://127.0.0.1/keepalive");
+	g_assert (conn != NULL && msg != NULL);
+	rspamd_http_connection_write_message (conn, msg, NULL, NULL, kt, fd, &tv,
+			kt->ev_base);
+}
+
+/* Returns time spent in the event loop until idle sockets are closed */
+static gdouble
+rspamd_keepalive_run (struct event_base *ev_base, rspamd_inet_addr_t *addr,
+		guint nreq, guint *reused)
+{
+	struct rspamd_keepalive_test kt;
+	gdouble ts1;
+
+	memset (&kt, 0, sizeof (kt));
+	kt.ev_base = ev_base;
+	kt.addr = addr;
+	kt.nreq = nreq;
+
+	rspamd_keepalive_client_request (&kt);
+	ts1 = rspamd_get_ticks ();
+	event_base_loop (ev_base, 0);
+
+	g_assert (kt.done == nreq);
+	*reused = kt.reused;
+
+	return rspamd_get_ticks () - ts1;
+}
+
+static void
+rspamd_http_test_keepalive (struct event_base *ev_base,
+		rspamd_inet_addr_t *addr)
+{
+	gint res;
+	guint reused;
+	gdouble elapsed;
+	pid_t pid;
+
+	rspamd_http_keepalive_set_timeout (KEEPALIVE_TEST_TIMEOUT);
+
+	/* Subsequent requests reuse the same socket */
+	pid = rspamd_http_start_pipelined_server (addr, PIPELINED_KEEPALIVE);
+	elapsed = rspamd_keepalive_run (ev_base, addr, 4, &reused);
+	g_assert (reused == 3);
+	/* Loop is finished when the idle socket is closed by timeout */
+	g_assert (elapsed >= KEEPALIVE_TEST_TIMEOUT);
+	g_assert (rspamd_http_keepalive_get (KEEPALIVE_TEST_PEER, NULL, NULL) == -1);
+	kill (pid, SIGTERM);
+	wait (&res);
+
+	/* Server closes connection after a reply despite of keep-alive */
+	pid = rspamd_http_start_pipelined_server (addr, PIPELINED_CLOSE);
+	elapsed = rspamd_keepalive_run (ev_base, addr, 1, &reused);
+	/* Idle socket is dropped once it is closed, not by timeout */
+	g_assert (elapsed < KEEPALIVE_TEST_TIMEOUT);
+	g_assert (rspamd_http_keepalive_get (KEEPALIVE_TEST_PEER, NULL, NULL) == -1);
+
+	/* Socket closed by server is reused, so request is sent once more */
+	rspamd_keepalive_run (ev_base, addr, 2, &reused);
+	g_assert (reused == 1);
+	kill (pid, SIGTERM);
+	wait (&res);
+
+	msg_info ("Checked reuse, idle timeout and server close of kept alive "
+			"connections");
+}
+
 void
 rspamd_http_test_func (void)
 {
@@ -483,4 +821,7 @@ rspamd_http_test_func (void)
 	close (fd);
 	unlink (filepath);
 	rspamd_http_stop_servers (sfd);
+
+	rspamd_http_test_pipelined (addr);
+	rspamd_http_test_keepalive (ev_base, addr);
 }
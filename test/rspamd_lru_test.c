@@ -0,0 +1,252 @@
+/* Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "hash.h"
+#include "ottery.h"
+
+static const guint max_elts = 1024;
+static const guint lookup_cycles = 1024;
+
+/*
+ * Reference implementation of the previous lru hash (hash table + queue of
+ * allocated nodes) used to compare performance
+ */
+struct old_lru_elt {
+	gpointer key;
+	gpointer data;
+	time_t store_time;
+	GList *link;
+};
+
+struct old_lru {
+	gint maxsize;
+	GHashTable *tbl;
+	GQueue *exp;
+};
+
+static void
+old_lru_elt_free (gpointer p)
+{
+	g_slice_free1 (sizeof (struct old_lru_elt), p);
+}
+
+static struct old_lru *
+old_lru_new (gint maxsize)
+{
+	struct old_lru *lru;
+
+	lru = g_slice_alloc (sizeof (*lru));
+	lru->maxsize = maxsize;
+	lru->tbl = g_hash_table_new_full (g_int64_hash, g_int64_equal, NULL,
+			old_lru_elt_free);
+	lru->exp = g_queue_new ();
+
+	return lru;
+}
+
+static gpointer
+old_lru_lookup (struct old_lru *lru, gconstpointer key, time_t now)
+{
+	struct old_lru_elt *elt;
+
+	elt = g_hash_table_lookup (lru->tbl, key);
+
+	if (elt != NULL) {
+		elt->store_time = now;
+		g_queue_unlink (lru->exp, elt->link);
+		g_queue_push_tail_link (lru->exp, elt->link);
+
+		return elt->data;
+	}
+
+	return NULL;
+}
+
+static void
+old_lru_insert (struct old_lru *lru, gpointer key, gpointer value, time_t now)
+{
+	struct old_lru_elt *elt;
+
+	elt = g_hash_table_lookup (lru->tbl, key);
+
+	if (elt != NULL) {
+		g_queue_delete_link (lru->exp, elt->link);
+		g_hash_table_remove (lru->tbl, key);
+	}
+	else if ((gint)g_hash_table_size (lru->tbl) >= lru->maxsize) {
+		elt = g_queue_pop_head (lru->exp);
+		g_hash_table_remove (lru->tbl, elt->key);
+	}
+
+	elt = g_slice_alloc (sizeof (*elt));
+	elt->key = key;
+	elt->data = value;
+	elt->store_time = now;
+	g_queue_push_tail (lru->exp, elt);
+	elt->link = lru->exp->tail;
+	g_hash_table_insert (lru->tbl, key, elt);
+}
+
+static void
+old_lru_destroy (struct old_lru *lru)
+{
+	g_hash_table_unref (lru->tbl);
+	g_queue_free (lru->exp);
+	g_slice_free1 (sizeof (*lru), lru);
+}
+
+static void
+rspamd_lru_test_basic (void)
+{
+	rspamd_lru_hash_t *hash;
+	gint64 *keys;
+	guint i, found = 0;
+	time_t now = 1000;
+
+	keys = g_malloc (sizeof (*keys) * max_elts * 2);
+
+	for (i = 0; i < max_elts * 2; i ++) {
+		keys[i] = i;
+	}
+
+	hash = rspamd_lru_hash_new_full (max_elts, -1, NULL, NULL,
+			g_int64_hash, g_int64_equal);
+
+	for (i = 0; i < max_elts; i ++) {
+		rspamd_lru_hash_insert (hash, &keys[i], &keys[i], now, 0);
+	}
+
+	g_assert (rspamd_lru_hash_size (hash) == max_elts);
+
+	for (i = 0; i < max_elts; i ++) {
+		g_assert (rspamd_lru_hash_lookup (hash, &keys[i], now) == &keys[i]);
+	}
+
+	/* Reinsertion must not grow hash */
+	rspamd_lru_hash_insert (hash, &keys[0], &keys[1], now, 0);
+	g_assert (rspamd_lru_hash_size (hash) == max_elts);
+	g_assert (rspamd_lru_hash_lookup (hash, &keys[0], now) == &keys[1]);
+
+	/* Overflow: size is limited and recently inserted elements are here */
+	for (i = max_elts; i < max_elts * 2; i ++) {
+		rspamd_lru_hash_insert (hash, &keys[i], &keys[i], now, 0);
+		g_assert (rspamd_lru_hash_lookup (hash, &keys[i], now) == &keys[i]);
+	}
+
+	g_assert (rspamd_lru_hash_size (hash) == max_elts);
+
+	for (i = 0; i < max_elts * 2; i ++) {
+		if (rspamd_lru_hash_lookup (hash, &keys[i], now) != NULL) {
+			found ++;
+		}
+	}
+
+	g_assert (found == max_elts);
+
+	/* Expiration by ttl */
+	rspamd_lru_hash_insert (hash, &keys[0], &keys[0], now, 10);
+	g_assert (rspamd_lru_hash_lookup (hash, &keys[0], now + 5) == &keys[0]);
+	g_assert (rspamd_lru_hash_lookup (hash, &keys[0], now + 20) == NULL);
+	g_assert (rspamd_lru_hash_size (hash) == max_elts - 1);
+
+	rspamd_lru_hash_destroy (hash);
+
+	/* Unlimited hash */
+	hash = rspamd_lru_hash_new_full (-1, -1, NULL, NULL,
+			g_int64_hash, g_int64_equal);
+
+	for (i = 0; i < max_elts * 2; i ++) {
+		rspamd_lru_hash_insert (hash, &keys[i], &keys[i], now, 0);
+	}
+
+	g_assert (rspamd_lru_hash_size (hash) == max_elts * 2);
+
+	for (i = 0; i < max_elts * 2; i ++) {
+		g_assert (rspamd_lru_hash_lookup (hash, &keys[i], now) == &keys[i]);
+	}
+
+	rspamd_lru_hash_destroy (hash);
+	g_free (keys);
+}
+
+void
+rspamd_lru_test_func (void)
+{
+	rspamd_lru_hash_t *hash;
+	struct old_lru *old;
+	gint64 *keys;
+	guint i, lc, nkeys = max_elts * 2;
+	gdouble ts1, ts2;
+	time_t now = time (NULL);
+
+	rspamd_lru_test_basic ();
+
+	/* Half of lookups are misses that cause evictions */
+	keys = g_malloc (sizeof (*keys) * nkeys);
+
+	for (i = 0; i < nkeys; i ++) {
+		keys[i] = ottery_rand_uint64 ();
+	}
+
+	old = old_lru_new (max_elts);
+	ts1 = rspamd_get_ticks ();
+
+	for (lc = 0; lc < lookup_cycles; lc ++) {
+		for (i = 0; i < max_elts; i ++) {
+			gint64 *k = &keys[ottery_rand_range (nkeys - 1)];
+
+			if (old_lru_lookup (old, k, now) == NULL) {
+				old_lru_insert (old, k, k, now);
+			}
+		}
+	}
+
+	ts2 = rspamd_get_ticks ();
+	msg_info ("old lru: %ud operations in %.6f ms", max_elts * lookup_cycles,
+			(ts2 - ts1) * 1000.0);
+	old_lru_destroy (old);
+
+	hash = rspamd_lru_hash_new_full (max_elts, -1, NULL, NULL,
+			g_int64_hash, g_int64_equal);
+	ts1 = rspamd_get_ticks ();
+
+	for (lc = 0; lc < lookup_cycles; lc ++) {
+		for (i = 0; i < max_elts; i ++) {
+			gint64 *k = &keys[ottery_rand_range (nkeys - 1)];
+
+			if (rspamd_lru_hash_lookup (hash, k, now) == NULL) {
+				rspamd_lru_hash_insert (hash, k, k, now, 0);
+			}
+		}
+	}
+
+	ts2 = rspamd_get_ticks ();
+	msg_info ("flat lru: %ud operations in %.6f ms", max_elts * lookup_cycles,
+			(ts2 - ts1) * 1000.0);
+	g_assert (rspamd_lru_hash_size (hash) <= max_elts);
+	rspamd_lru_hash_destroy (hash);
+
+	g_free (keys);
+}
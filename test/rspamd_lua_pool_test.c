@@ -0,0 +1,137 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "task.h"
+#include "lua/lua_common.h"
+#include "lua/lua_thread_pool.h"
+
+static struct rspamd_config *pool_cfg = NULL;
+static struct thread_entry *suspended = NULL;
+
+/* GC is stopped, so memory allocated by symbols is never freed in between */
+static const gchar *lua_symbols =
+	"collectgarbage('stop')\n"
+	"local function alloc(n)\n"
+	"  local t = {}\n"
+	"  for i = 1, n do t[i] = string.format('%d', i) end\n"
+	"  return t\n"
+	"end\n"
+	"rspamd_config:register_symbol('TEST_YIELD', 1.0, function(task)\n"
+	"  local t = alloc(1000)\n"
+	"  test_suspend()\n"
+	"  t = alloc(1000)\n"
+	"  return false\n"
+	"end)\n"
+	"rspamd_config:register_symbol('TEST_ERROR', 1.0, function(task)\n"
+	"  local t = alloc(1000)\n"
+	"  error('test error')\n"
+	"end)\n"
+	"rspamd_config:register_symbol('TEST_GC', 1.0, function(task)\n"
+	"  collectgarbage('collect')\n"
+	"  return false\n"
+	"end)\n"
+	"test_garbage = alloc(10000)\n";
+
+static const gchar *lua_checks =
+	"local st = rspamd_config:get_symbol_lua_stats('TEST_YIELD')\n"
+	"assert(st.runs == 1 and st.cpu > 0 and st.memory > 2000 * 8)\n"
+	"st = rspamd_config:get_symbol_lua_stats('TEST_ERROR')\n"
+	"assert(st.runs == 1 and st.cpu > 0 and st.memory > 1000 * 8)\n"
+	"st = rspamd_config:get_symbol_lua_stats('TEST_GC')\n"
+	"assert(st.runs == 1 and st.memory == 0)\n"
+	"collectgarbage('restart')\n";
+
+/* Emulates async API: suspends the current coroutine until the test resumes it */
+static gint
+lua_test_suspend (lua_State *L)
+{
+	suspended = lua_thread_pool_get_running_entry (pool_cfg->lua_thread_pool, L);
+	g_assert (suspended != NULL);
+
+	return lua_yield (L, 0);
+}
+
+static void
+rspamd_lua_pool_run_symbol (struct rspamd_task *task, const gchar *symbol)
+{
+	symbol_func_t func;
+	gpointer ud;
+
+	g_assert (rspamd_symbols_cache_get_callback (task->cfg->cache, symbol,
+			&func, &ud));
+	func (task, ud);
+}
+
+static void
+rspamd_lua_pool_run_string (lua_State *L, const gchar *str)
+{
+	if (luaL_dostring (L, str) != 0) {
+		msg_err ("lua test failed: %s", lua_tostring (L, -1));
+		g_assert (0);
+	}
+}
+
+void
+rspamd_lua_pool_test_func (void)
+{
+	struct rspamd_config *cfg, **pcfg;
+	struct rspamd_task *task;
+	lua_State *L;
+
+	cfg = rspamd_config_new ();
+	pool_cfg = cfg;
+	L = cfg->lua_state;
+
+	pcfg = lua_newuserdata (L, sizeof (struct rspamd_config *));
+	rspamd_lua_setclass (L, "rspamd{config}", -1);
+	*pcfg = cfg;
+	lua_setglobal (L, "rspamd_config");
+	lua_pushcfunction (L, lua_test_suspend);
+	lua_setglobal (L, "test_suspend");
+	rspamd_lua_pool_run_string (L, lua_symbols);
+
+	task = rspamd_task_new (NULL, cfg);
+	task->s = rspamd_session_create (task->task_pool, rspamd_task_fin,
+			rspamd_task_restore, (event_finalizer_t)rspamd_task_free, task);
+
+	/* Symbol yields in the middle, so stats must include both runs */
+	rspamd_lua_pool_run_symbol (task, "TEST_YIELD");
+	g_assert (suspended != NULL);
+	g_assert (suspended->yielded);
+	g_assert (lua_thread_pool_resume (cfg->lua_thread_pool, suspended, 0) == 0);
+
+	rspamd_lua_pool_run_symbol (task, "TEST_ERROR");
+
+	/* Garbage of the main state is freed here, but usage cannot be negative */
+	rspamd_lua_pool_run_string (L, "test_garbage = nil");
+	rspamd_lua_pool_run_symbol (task, "TEST_GC");
+
+	rspamd_lua_pool_run_string (L, lua_checks);
+
+	rspamd_session_destroy (task->s);
+	rspamd_config_free (cfg);
+	pool_cfg = NULL;
+	suspended = NULL;
+}
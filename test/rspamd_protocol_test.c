@@ -0,0 +1,91 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "protocol.h"
+
+struct batch_test {
+	const gchar *body;
+	guint max_batch;
+	/* Number of messages or -1 if the body is invalid */
+	gint nmessages;
+	const gchar *first;
+	gint code;
+} batch_vec[] = {
+	{"5\nhello", 0, 1, "hello", 0},
+	{"5\r\nhello\r\n3\nfoo\n", 0, 2, "hello", 0},
+	{"\n\n1\na1\nb1\nc", 3, 3, "a", 0},
+	/* Empty bodies */
+	{"", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	{"\r\n\n\r\n", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	/* Malformed lengths */
+	{"hello", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	{"5", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	{"0\n", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	{"-1\nhello", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	{"5x\nhello", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	{"\n5\n", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	{"5\nhello3\nfoo4\n", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	/* Oversized bodies */
+	{"6\nhello", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	{"18446744073709551615\nhello", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	{"99999999999999999999999\nhello", 0, -1, NULL, RSPAMD_PROTOCOL_ERROR},
+	{"1\na1\nb1\nc", 2, -1, NULL, RSPAMD_LENGTH_ERROR},
+	{NULL, 0, 0, NULL, 0}
+};
+
+void
+rspamd_protocol_test_func (void)
+{
+	struct batch_test *t;
+	GArray *messages;
+	rspamd_ftok_t *tok;
+	GError *err;
+
+	for (t = &batch_vec[0]; t->body != NULL; t ++) {
+		err = NULL;
+		messages = rspamd_protocol_parse_batch (t->body, strlen (t->body),
+				t->max_batch, &err);
+
+		if (t->nmessages == -1) {
+			g_assert (messages == NULL);
+			g_assert (err != NULL);
+			g_assert (err->code == t->code);
+			msg_debug ("batch %s: %e", t->body, err);
+			g_error_free (err);
+		}
+		else {
+			g_assert (messages != NULL);
+			g_assert (err == NULL);
+			g_assert (messages->len == (guint)t->nmessages);
+			tok = &g_array_index (messages, rspamd_ftok_t, 0);
+			g_assert (tok->len == strlen (t->first));
+			g_assert (memcmp (tok->begin, t->first, tok->len) == 0);
+			/* Messages must point inside of the body */
+			tok = &g_array_index (messages, rspamd_ftok_t, messages->len - 1);
+			g_assert (tok->begin + tok->len <= t->body + strlen (t->body));
+			g_array_free (messages, TRUE);
+		}
+	}
+}
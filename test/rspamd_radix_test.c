@@ -25,6 +25,7 @@
 #include "rspamd.h"
 #include "radix.h"
 #include "ottery.h"
+#include "unix-std.h"
 
 const gsize max_elts = 50 * 1024;
 const gint lookup_cycles = 1 * 1024;
@@ -84,11 +85,15 @@ struct _tv {
 static void
 rspamd_radix_text_vec (void)
 {
-	radix_compressed_t *tree = radix_create_compressed ();
+	radix_compressed_t *tree = radix_create_compressed (), *img;
 	struct _tv *t = &test_vec[0];
 	struct in_addr ina;
 	struct in6_addr in6a;
+	gchar path[PATH_MAX], target[PATH_MAX];
+	struct stat st;
+	guint32 bad;
 	gulong i, val;
+	gint fd;
 
 	while (t->ip != NULL) {
 		t->addr = g_malloc (sizeof (in6a));
@@ -140,6 +145,54 @@ rspamd_radix_text_vec (void)
 		t ++;
 	}
 
+	/* Check the same vectors against the mapped image of the tree */
+	rspamd_snprintf (path, sizeof (path), "/tmp/rspamd-radix-test-%P.radix",
+			getpid ());
+	g_assert (radix_save_compressed_image (tree, path));
+	img = radix_load_compressed_image (path);
+	unlink (path);
+	g_assert (img != NULL);
+	g_assert (radix_get_size (img) == radix_get_size (tree));
+
+	i = 0;
+	t = &test_vec[0];
+	while (t->ip != NULL) {
+		val = radix_find_compressed (img, t->addr, t->len);
+		g_assert (val == ++i);
+		if (t->nip != NULL) {
+			val = radix_find_compressed (img, t->naddr, t->len);
+			g_assert (val != i);
+		}
+		t ++;
+	}
+
+	radix_destroy_compressed (img);
+
+	/* Saving over a symlink must replace the link, not write to its target */
+	rspamd_snprintf (target, sizeof (target), "%s.target", path);
+	fd = open (target, O_WRONLY | O_CREAT | O_TRUNC, 00600);
+	g_assert (fd != -1);
+	g_assert (write (fd, "test", 4) == 4);
+	close (fd);
+	g_assert (symlink (target, path) == 0);
+	g_assert (radix_save_compressed_image (tree, path));
+	g_assert (lstat (path, &st) == 0 && S_ISREG (st.st_mode));
+	g_assert (stat (target, &st) == 0 && st.st_size == 4);
+	unlink (target);
+
+	/*
+	 * Point a child of the first node far outside of the image: header is
+	 * 24 bytes, node 0 is reserved and `left` follows the 8 bytes value
+	 */
+	fd = open (path, O_RDWR);
+	g_assert (fd != -1);
+	bad = G_MAXUINT32;
+	g_assert (pwrite (fd, &bad, sizeof (bad), 24 + 24 + 8) == sizeof (bad));
+	close (fd);
+	img = radix_load_compressed_image (path);
+	unlink (path);
+	g_assert (img == NULL);
+
 	radix_destroy_compressed (tree);
 }
 
@@ -88,8 +88,19 @@ free_fuzzy_words (GArray *ar)
 	}
 }
 
+static struct rspamd_shingle *
+generate_shingles (GArray *input, const guchar *key, gboolean fast)
+{
+	if (fast) {
+		return rspamd_shingles_generate_fast (input, key, NULL);
+	}
+
+	return rspamd_shingles_generate (input, key, NULL,
+			rspamd_shingles_default_filter, NULL);
+}
+
 static void
-test_case (gsize cnt, gsize max_len, gdouble perm_factor)
+test_case (gsize cnt, gsize max_len, gdouble perm_factor, gboolean fast)
 {
 	GArray *input;
 	struct rspamd_shingle *sgl, *sgl_permuted;
@@ -100,12 +111,10 @@ test_case (gsize cnt, gsize max_len, gdouble perm_factor)
 	ottery_rand_bytes (key, sizeof (key));
 	input = generate_fuzzy_words (cnt, max_len);
 	ts1 = rspamd_get_ticks ();
-	sgl = rspamd_shingles_generate (input, key, NULL,
-			rspamd_shingles_default_filter, NULL);
+	sgl = generate_shingles (input, key, fast);
 	ts2 = rspamd_get_ticks ();
 	permute_vector (input, perm_factor);
-	sgl_permuted = rspamd_shingles_generate (input, key, NULL,
-			rspamd_shingles_default_filter, NULL);
+	sgl_permuted = generate_shingles (input, key, fast);
 
 	res = rspamd_shingles_compare (sgl, sgl_permuted);
 
@@ -122,9 +131,15 @@ void
 rspamd_shingles_test_func (void)
 {
 	//test_case (5, 100, 0.5);
-	test_case (200, 10, 0.1);
-	test_case (500, 20, 0.01);
-	test_case (5000, 20, 0.01);
-	test_case (5000, 15, 0);
-	test_case (5000, 30, 1.0);
+	test_case (200, 10, 0.1, FALSE);
+	test_case (500, 20, 0.01, FALSE);
+	test_case (5000, 20, 0.01, FALSE);
+	test_case (5000, 15, 0, FALSE);
+	test_case (5000, 30, 1.0, FALSE);
+
+	test_case (500, 20, 0.01, TRUE);
+	test_case (5000, 20, 0.01, TRUE);
+	test_case (5000, 15, 0, TRUE);
+	test_case (5000, 30, 1.0, TRUE);
+	test_case (2, 10, 0, TRUE);
 }
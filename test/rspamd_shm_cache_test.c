@@ -0,0 +1,171 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "shm_cache.h"
+#include "unix-std.h"
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+/* Cache of a single group, so all keys compete for the same slots */
+#define TEST_CACHE_ELTS 8
+#define TEST_CACHE_ELT_SIZE 64
+#define TEST_TTL 100
+
+static void
+rspamd_shm_cache_test_insert (struct rspamd_shm_cache *cache, guint num,
+		time_t now, guint ttl)
+{
+	gchar key[32], value[32];
+
+	rspamd_snprintf (key, sizeof (key), "key%ud", num);
+	rspamd_snprintf (value, sizeof (value), "value%ud", num);
+	g_assert (rspamd_shm_cache_insert (cache, key, strlen (key), value,
+			strlen (value) + 1, now, ttl));
+}
+
+/* Returns TRUE if element is found and has the expected value */
+static gboolean
+rspamd_shm_cache_test_lookup (struct rspamd_shm_cache *cache, guint num,
+		time_t now, guint *ttl)
+{
+	gchar key[32], value[32], *res;
+	gsize len = 0;
+	gboolean ret;
+
+	rspamd_snprintf (key, sizeof (key), "key%ud", num);
+	rspamd_snprintf (value, sizeof (value), "value%ud", num);
+	res = rspamd_shm_cache_lookup (cache, key, strlen (key), now, &len, ttl);
+
+	if (res == NULL) {
+		return FALSE;
+	}
+
+	ret = (len == strlen (value) + 1 && strcmp (res, value) == 0);
+	g_free (res);
+
+	return ret;
+}
+
+void
+rspamd_shm_cache_test_func (void)
+{
+	struct rspamd_shm_cache *cache;
+	gchar large[TEST_CACHE_ELT_SIZE + 1], *res;
+	guint64 hits, misses, evictions;
+	time_t now = 1000;
+	guint i, ttl;
+	gsize len;
+	pid_t pid;
+	gint status;
+
+	cache = rspamd_shm_cache_new ("test", TEST_CACHE_ELTS,
+			TEST_CACHE_ELT_SIZE);
+
+	/* Insert and lookup */
+	rspamd_shm_cache_test_insert (cache, 0, now, TEST_TTL);
+	g_assert (rspamd_shm_cache_test_lookup (cache, 0, now, &ttl));
+	g_assert_cmpuint (ttl, ==, TEST_TTL);
+	g_assert (rspamd_shm_cache_test_lookup (cache, 0, now + 10, &ttl));
+	g_assert_cmpuint (ttl, ==, TEST_TTL - 10);
+	g_assert (!rspamd_shm_cache_test_lookup (cache, 1, now, NULL));
+
+	/* Replace existing element */
+	g_assert (rspamd_shm_cache_insert (cache, "key0", 4, "other", 6, now,
+			TEST_TTL));
+	res = rspamd_shm_cache_lookup (cache, "key0", 4, now, &len, NULL);
+	g_assert (res != NULL);
+	g_assert_cmpuint (len, ==, 6);
+	g_assert_cmpstr (res, ==, "other");
+	g_free (res);
+
+	/* Expiry */
+	res = rspamd_shm_cache_lookup (cache, "key0", 4, now + TEST_TTL - 1,
+			NULL, NULL);
+	g_assert (res != NULL);
+	g_free (res);
+	g_assert (rspamd_shm_cache_lookup (cache, "key0", 4, now + TEST_TTL,
+			NULL, NULL) == NULL);
+
+	/* Too large element */
+	memset (large, 'a', sizeof (large));
+	g_assert (!rspamd_shm_cache_insert (cache, "large", 5, large,
+			sizeof (large), now, TEST_TTL));
+
+	rspamd_shm_cache_stat (cache, &hits, &misses, &evictions);
+	g_assert_cmpuint (hits, ==, 4);
+	g_assert_cmpuint (misses, ==, 2);
+	g_assert_cmpuint (evictions, ==, 0);
+
+	/* Fill the group, element with the nearest expiration is evicted */
+	for (i = 0; i < TEST_CACHE_ELTS; i ++) {
+		rspamd_shm_cache_test_insert (cache, i, now, TEST_TTL + i);
+	}
+
+	for (i = 0; i < TEST_CACHE_ELTS; i ++) {
+		g_assert (rspamd_shm_cache_test_lookup (cache, i, now, NULL));
+	}
+
+	rspamd_shm_cache_test_insert (cache, TEST_CACHE_ELTS, now, TEST_TTL * 2);
+	g_assert (!rspamd_shm_cache_test_lookup (cache, 0, now, NULL));
+
+	for (i = 1; i <= TEST_CACHE_ELTS; i ++) {
+		g_assert (rspamd_shm_cache_test_lookup (cache, i, now, NULL));
+	}
+
+	rspamd_shm_cache_stat (cache, NULL, NULL, &evictions);
+	g_assert_cmpuint (evictions, ==, 1);
+
+	/* Expired element is replaced without eviction of alive ones */
+	rspamd_shm_cache_test_insert (cache, TEST_CACHE_ELTS + 1,
+			now + TEST_TTL + 1, TEST_TTL);
+	g_assert (!rspamd_shm_cache_test_lookup (cache, 1, now, NULL));
+
+	for (i = 2; i <= TEST_CACHE_ELTS + 1; i ++) {
+		g_assert (rspamd_shm_cache_test_lookup (cache, i,
+				now + TEST_TTL + 1, NULL));
+	}
+
+	rspamd_shm_cache_stat (cache, NULL, NULL, &evictions);
+	g_assert_cmpuint (evictions, ==, 1);
+
+	/* Elements inserted by another process are visible */
+	pid = fork ();
+	g_assert (pid != -1);
+
+	if (pid == 0) {
+		rspamd_shm_cache_test_insert (cache, TEST_CACHE_ELTS * 2, now,
+				TEST_TTL * 2);
+		_exit (EXIT_SUCCESS);
+	}
+
+	while (waitpid (pid, &status, 0) == -1 && errno == EINTR);
+	g_assert (WIFEXITED (status) && WEXITSTATUS (status) == EXIT_SUCCESS);
+	g_assert (rspamd_shm_cache_test_lookup (cache, TEST_CACHE_ELTS * 2, now,
+			NULL));
+
+	rspamd_shm_cache_destroy (cache);
+}
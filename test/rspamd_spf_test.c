@@ -0,0 +1,377 @@
+/* Copyright (c) 2016, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *       * Redistributions of source code must retain the above copyright
+ *         notice, this list of conditions and the following disclaimer.
+ *       * Redistributions in binary form must reproduce the above copyright
+ *         notice, this list of conditions and the following disclaimer in the
+ *         documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "config.h"
+#include "rspamd.h"
+#include "tests.h"
+#include "spf.h"
+#include "ottery.h"
+
+#define RANDOM_ELTS 64
+#define RANDOM_CHECKS 10000
+
+/* Flattened record, elements without addresses are `all` */
+struct spf_test_elt {
+	const gchar *addr4;
+	guint mask4;
+	const gchar *addr6;
+	guint mask6;
+	spf_mech_t mech;
+};
+
+static const struct spf_test_elt test_record[] = {
+	/* Nested network after the wider one never matches */
+	{"10.0.0.0", 8, NULL, 0, SPF_FAIL},
+	{"10.1.0.0", 16, NULL, 0, SPF_PASS},
+	/* Nested network before the wider one */
+	{"172.16.5.0", 24, NULL, 0, SPF_PASS},
+	{"172.16.0.0", 12, NULL, 0, SPF_SOFT_FAIL},
+	{"172.16.5.128", 25, NULL, 0, SPF_FAIL},
+	/* Adjacent networks */
+	{"203.0.113.0", 25, NULL, 0, SPF_PASS},
+	{"203.0.113.128", 25, NULL, 0, SPF_FAIL},
+	{"203.0.114.0", 24, NULL, 0, SPF_NEUTRAL},
+	{"198.51.100.7", 32, NULL, 0, SPF_PASS},
+	/* The last addresses of both families */
+	{"255.255.255.255", 32, NULL, 0, SPF_FAIL},
+	{NULL, 0, "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff", 128, SPF_FAIL},
+	/* Element of both families, e.g. from `a` mechanism */
+	{"100.64.0.0", 10, "2001:db8:1:2::", 64, SPF_PASS},
+	{NULL, 0, "2001:db8:ff::", 48, SPF_PASS},
+	{NULL, 0, "2001:db8::", 32, SPF_SOFT_FAIL},
+	{NULL, 0, "2001:db8:1::", 48, SPF_FAIL},
+	{NULL, 0, "2001:db9::", 32, SPF_NEUTRAL},
+	{NULL, 0, "::", 1, SPF_NEUTRAL},
+	{NULL, 0, NULL, 0, SPF_FAIL},
+	/* Never matches after `all` */
+	{"192.0.2.0", 24, NULL, 0, SPF_PASS},
+};
+
+static void
+spf_test_mask (guchar *ip, gsize len, guint mask, gboolean fill)
+{
+	guint i, bits;
+
+	for (i = 0; i < len; i ++) {
+		bits = mask > i * NBBY ? MIN (mask - i * NBBY, NBBY) : 0;
+
+		if (bits < NBBY) {
+			if (fill) {
+				ip[i] |= 0xff >> bits;
+			}
+			else {
+				ip[i] &= ~(0xff >> bits);
+			}
+		}
+	}
+}
+
+static void
+spf_test_add (guchar *ip, gsize len, gint delta)
+{
+	gint i;
+
+	for (i = len - 1; i >= 0; i --) {
+		ip[i] += delta;
+
+		if ((delta > 0 && ip[i] != 0) || (delta < 0 && ip[i] != 0xff)) {
+			break;
+		}
+	}
+}
+
+static gboolean
+spf_test_prefix_match (const guchar *net, const guchar *ip, guint mask)
+{
+	guint bytes = mask / NBBY, bits = mask % NBBY;
+
+	if (memcmp (net, ip, bytes) != 0) {
+		return FALSE;
+	}
+
+	if (bits > 0) {
+		return ((net[bytes] ^ ip[bytes]) & (0xff << (NBBY - bits)) & 0xff)
+				== 0;
+	}
+
+	return TRUE;
+}
+
+/* Reference implementation: the first matching element in record order */
+static guint
+spf_test_linear (struct spf_resolved *rec, const guchar *ip, gsize len)
+{
+	struct spf_addr *addr;
+	guint i;
+
+	for (i = 0; i < rec->elts->len; i ++) {
+		addr = &g_array_index (rec->elts, struct spf_addr, i);
+
+		if (len == sizeof (addr->addr4) &&
+				(addr->flags & RSPAMD_SPF_FLAG_IPV4)) {
+			if (spf_test_prefix_match (addr->addr4, ip,
+					addr->m.dual.mask_v4)) {
+				return i;
+			}
+		}
+		else if (len == sizeof (addr->addr6) &&
+				(addr->flags & RSPAMD_SPF_FLAG_IPV6)) {
+			if (spf_test_prefix_match (addr->addr6, ip,
+					addr->m.dual.mask_v6)) {
+				return i;
+			}
+		}
+		else if (addr->flags & RSPAMD_SPF_FLAG_ANY) {
+			return i;
+		}
+	}
+
+	return G_MAXUINT;
+}
+
+static void
+spf_test_check (struct spf_resolved *rec, const guchar *ip, gsize len)
+{
+	rspamd_inet_addr_t *addr;
+	struct spf_addr *found;
+	guint expected, idx;
+
+	addr = rspamd_inet_address_new (len == sizeof (struct in_addr) ?
+			AF_INET : AF_INET6, ip);
+	found = spf_record_find_addr (rec, addr);
+	idx = found ?
+			(guint)(found - &g_array_index (rec->elts, struct spf_addr, 0)) :
+			G_MAXUINT;
+	expected = spf_test_linear (rec, ip, len);
+
+	if (idx != expected) {
+		msg_err ("%s: found element %ud, expected %ud",
+				rspamd_inet_address_to_string (addr), idx, expected);
+	}
+
+	g_assert_cmpuint (idx, ==, expected);
+	rspamd_inet_address_destroy (addr);
+}
+
+static void
+spf_test_random_addr (const guchar *base, guint base_mask, guchar *ip,
+		gsize len)
+{
+	guint i;
+
+	ottery_rand_bytes (ip, len);
+
+	for (i = 0; i < len; i ++) {
+		if (base_mask >= (i + 1) * NBBY) {
+			ip[i] = base[i];
+		}
+		else if (base_mask > i * NBBY) {
+			ip[i] = (base[i] & ~(0xff >> (base_mask - i * NBBY))) |
+					(ip[i] & (0xff >> (base_mask - i * NBBY)));
+		}
+	}
+}
+
+/* Checks the first and the last addresses of a network and its neighbours */
+static void
+spf_test_check_bounds (struct spf_resolved *rec, const guchar *net, gsize len,
+		guint mask)
+{
+	guchar ip[sizeof (struct in6_addr)];
+
+	memcpy (ip, net, len);
+	spf_test_mask (ip, len, mask, FALSE);
+	spf_test_check (rec, ip, len);
+	spf_test_add (ip, len, -1);
+	spf_test_check (rec, ip, len);
+
+	memcpy (ip, net, len);
+	spf_test_mask (ip, len, mask, TRUE);
+	spf_test_check (rec, ip, len);
+	spf_test_add (ip, len, 1);
+	spf_test_check (rec, ip, len);
+
+	spf_test_random_addr (net, mask, ip, len);
+	spf_test_check (rec, ip, len);
+}
+
+static void
+spf_test_add_elt (struct spf_resolved *rec, const guchar *addr4, guint mask4,
+		const guchar *addr6, guint mask6, spf_mech_t mech)
+{
+	struct spf_addr addr;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.mech = mech;
+	addr.flags = RSPAMD_SPF_FLAG_PARSED | RSPAMD_SPF_FLAG_VALID;
+
+	if (addr4 != NULL) {
+		memcpy (addr.addr4, addr4, sizeof (addr.addr4));
+		spf_test_mask (addr.addr4, sizeof (addr.addr4), mask4, FALSE);
+		addr.m.dual.mask_v4 = mask4;
+		addr.flags |= RSPAMD_SPF_FLAG_IPV4;
+	}
+
+	if (addr6 != NULL) {
+		memcpy (addr.addr6, addr6, sizeof (addr.addr6));
+		spf_test_mask (addr.addr6, sizeof (addr.addr6), mask6, FALSE);
+		addr.m.dual.mask_v6 = mask6;
+		addr.flags |= RSPAMD_SPF_FLAG_IPV6;
+	}
+
+	if (addr4 == NULL && addr6 == NULL) {
+		addr.flags |= RSPAMD_SPF_FLAG_ANY;
+	}
+
+	g_array_append_val (rec->elts, addr);
+}
+
+/* Index is built when a record is restored from the serialized form */
+static struct spf_resolved *
+spf_test_indexed (struct spf_resolved *rec)
+{
+	struct spf_resolved *res;
+	guchar *data;
+	gsize len;
+
+	data = spf_record_serialize (rec, &len);
+	res = spf_record_deserialize (rec->domain, data, len);
+	g_assert (res != NULL);
+	g_assert (res->index != NULL);
+	g_assert_cmpuint (res->elts->len, ==, rec->elts->len);
+	g_free (data);
+
+	return res;
+}
+
+void
+rspamd_spf_test_func (void)
+{
+	struct spf_resolved rec, *indexed;
+	struct spf_addr *addr;
+	struct in_addr in4, base4;
+	struct in6_addr in6, base6;
+	guchar ip[sizeof (struct in6_addr)];
+	guint i, mask4, mask6;
+
+	memset (&rec, 0, sizeof (rec));
+	rec.domain = (gchar *)"example.com";
+	rec.ttl = 300;
+	rec.elts = g_array_new (FALSE, FALSE, sizeof (struct spf_addr));
+
+	for (i = 0; i < G_N_ELEMENTS (test_record); i ++) {
+		if (test_record[i].addr4) {
+			g_assert (inet_pton (AF_INET, test_record[i].addr4, &in4) == 1);
+		}
+		if (test_record[i].addr6) {
+			g_assert (inet_pton (AF_INET6, test_record[i].addr6, &in6) == 1);
+		}
+
+		spf_test_add_elt (&rec,
+				test_record[i].addr4 ? (const guchar *)&in4 : NULL,
+				test_record[i].mask4,
+				test_record[i].addr6 ? (const guchar *)&in6 : NULL,
+				test_record[i].mask6,
+				test_record[i].mech);
+	}
+
+	indexed = spf_test_indexed (&rec);
+
+	for (i = 0; i < indexed->elts->len; i ++) {
+		addr = &g_array_index (indexed->elts, struct spf_addr, i);
+
+		if (addr->flags & RSPAMD_SPF_FLAG_IPV4) {
+			spf_test_check_bounds (indexed, addr->addr4, sizeof (addr->addr4),
+					addr->m.dual.mask_v4);
+		}
+		if (addr->flags & RSPAMD_SPF_FLAG_IPV6) {
+			spf_test_check_bounds (indexed, addr->addr6, sizeof (addr->addr6),
+					addr->m.dual.mask_v6);
+		}
+	}
+
+	memset (ip, 0, sizeof (ip));
+	spf_test_check (indexed, ip, sizeof (in4));
+	spf_test_check (indexed, ip, sizeof (in6));
+
+	for (i = 0; i < RANDOM_CHECKS; i ++) {
+		ottery_rand_bytes (ip, sizeof (ip));
+		spf_test_check (indexed, ip, i % 2 ? sizeof (in4) : sizeof (in6));
+	}
+
+	spf_record_unref (indexed);
+	g_array_set_size (rec.elts, 0);
+
+	/* Random networks in small spaces, so many of them are nested */
+	g_assert (inet_pton (AF_INET, "10.20.0.0", &base4) == 1);
+	g_assert (inet_pton (AF_INET6, "2001:db8::", &base6) == 1);
+
+	for (i = 0; i < RANDOM_ELTS; i ++) {
+		mask4 = 16 + ottery_rand_range (16);
+		mask6 = 32 + ottery_rand_range (96);
+		spf_test_random_addr ((const guchar *)&base4, 16,
+				(guchar *)&in4, sizeof (in4));
+		spf_test_random_addr ((const guchar *)&base6, 32,
+				(guchar *)&in6, sizeof (in6));
+
+		switch (ottery_rand_range (2)) {
+		case 0:
+			spf_test_add_elt (&rec, (const guchar *)&in4, mask4, NULL, 0,
+					SPF_PASS);
+			break;
+		case 1:
+			spf_test_add_elt (&rec, NULL, 0, (const guchar *)&in6, mask6,
+					SPF_FAIL);
+			break;
+		default:
+			spf_test_add_elt (&rec, (const guchar *)&in4, mask4,
+					(const guchar *)&in6, mask6, SPF_SOFT_FAIL);
+			break;
+		}
+	}
+
+	indexed = spf_test_indexed (&rec);
+
+	for (i = 0; i < indexed->elts->len; i ++) {
+		addr = &g_array_index (indexed->elts, struct spf_addr, i);
+
+		if (addr->flags & RSPAMD_SPF_FLAG_IPV4) {
+			spf_test_check_bounds (indexed, addr->addr4, sizeof (addr->addr4),
+					addr->m.dual.mask_v4);
+		}
+		if (addr->flags & RSPAMD_SPF_FLAG_IPV6) {
+			spf_test_check_bounds (indexed, addr->addr6, sizeof (addr->addr6),
+					addr->m.dual.mask_v6);
+		}
+	}
+
+	for (i = 0; i < RANDOM_CHECKS; i ++) {
+		spf_test_random_addr ((const guchar *)&base4, 16, ip, sizeof (in4));
+		spf_test_check (indexed, ip, sizeof (in4));
+		spf_test_random_addr ((const guchar *)&base6, 32, ip, sizeof (in6));
+		spf_test_check (indexed, ip, sizeof (in6));
+	}
+
+	spf_record_unref (indexed);
+	g_array_free (rec.elts, TRUE);
+}
@@ -2,47 +2,444 @@
 #include "rspamd.h"
 #include "tests.h"
 #include "ottery.h"
+#include "stat_internal.h"
+#include "unix-std.h"
 
-#define TEST_FILENAME "/tmp/rspamd_test.stat"
-#define HASHES_NUM 256
+#define TEST_SPAM_FILENAME "/tmp/rspamd_test_spam.stat"
+#define TEST_HAM_FILENAME "/tmp/rspamd_test_ham.stat"
+#define TEST_COMBINED_FILENAME "/tmp/rspamd_test_combined.stat"
+#define TEST_STATFILE_SIZE (10 * 1024 * 1024)
+#define TEST_RESIZE_SIZE (64 * 1024)
+#define TEST_RESIZE_MAX_SIZE (256 * 1024)
+#define TEST_PREFETCH_DISTANCE 8
+#define TOKENS_NUM 16384
+#define LOOKUP_CYCLES 10
+/* More than 75% of blocks in a statfile of TEST_RESIZE_SIZE */
+#define RESIZE_TOKENS_NUM 3200
 
-void 
-rspamd_statfile_test_func ()
+static const gchar *test_symbols[] = {"BAYES_SPAM", "BAYES_HAM"};
+static const gchar *test_files[] = {TEST_SPAM_FILENAME, TEST_HAM_FILENAME};
+
+static struct rspamd_classifier_config *
+rspamd_statfile_test_classifier (struct rspamd_config *cfg, gboolean combined,
+		gsize size, gsize max_size)
+{
+	struct rspamd_classifier_config *clcf;
+	struct rspamd_statfile_config *stcf;
+	guint i;
+
+	clcf = rspamd_config_new_classifier (cfg, NULL);
+	clcf->name = "bayes";
+	clcf->classifier = "bayes";
+	clcf->backend = "mmap";
+	clcf->tokenizer = rspamd_mempool_alloc0 (cfg->cfg_pool,
+			sizeof (*clcf->tokenizer));
+	clcf->tokenizer->name = "osb";
+
+	if (combined) {
+		clcf->opts = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (clcf->opts,
+				ucl_object_fromstring (TEST_COMBINED_FILENAME),
+				"combined_file", 0, false);
+		rspamd_mempool_add_destructor (cfg->cfg_pool,
+				(rspamd_mempool_destruct_t)ucl_object_unref, clcf->opts);
+	}
+
+	for (i = 0; i < G_N_ELEMENTS (test_symbols); i ++) {
+		stcf = rspamd_config_new_statfile (cfg, NULL);
+		stcf->symbol = (gchar *)test_symbols[i];
+		stcf->is_spam = (i == 0);
+		stcf->clcf = clcf;
+		stcf->opts = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (stcf->opts,
+				ucl_object_fromstring (test_files[i]), "filename", 0, false);
+		ucl_object_insert_key (stcf->opts,
+				ucl_object_fromint (size), "size", 0, false);
+
+		if (max_size > 0) {
+			ucl_object_insert_key (stcf->opts,
+					ucl_object_fromint (max_size), "max_size", 0, false);
+		}
+
+		rspamd_mempool_add_destructor (cfg->cfg_pool,
+				(rspamd_mempool_destruct_t)ucl_object_unref, stcf->opts);
+		clcf->statfiles = g_list_append (clcf->statfiles, stcf);
+	}
+
+	cfg->classifiers = g_list_append (cfg->classifiers, clcf);
+
+	return clcf;
+}
+
+static void
+rspamd_statfile_test_runtimes (struct rspamd_stat_backend *bk, gpointer ctx,
+		struct rspamd_task *task, struct rspamd_classifier_config *clcf,
+		struct rspamd_statfile_runtime *st_rt, gboolean learn)
+{
+	GList *cur;
+	guint i = 0;
+
+	for (cur = clcf->statfiles; cur != NULL; cur = g_list_next (cur), i ++) {
+		st_rt[i].st = cur->data;
+		st_rt[i].backend_runtime = bk->runtime (task, cur->data, learn, ctx);
+		g_assert (st_rt[i].backend_runtime != NULL);
+	}
+}
+
+/* Performs lookups in the same way as classification does */
+static gdouble
+rspamd_statfile_test_lookup (struct rspamd_stat_backend *bk, gpointer ctx,
+		struct rspamd_task *task, struct rspamd_statfile_runtime *st_rt,
+		rspamd_token_t *tokens, gboolean prefetch)
+{
+	struct rspamd_token_result res;
+	gdouble ts1, ts2;
+	guint i, j, lc;
+
+	ts1 = rspamd_get_ticks ();
+
+	for (lc = 0; lc < LOOKUP_CYCLES; lc ++) {
+		for (i = 0; i < TOKENS_NUM; i ++) {
+			for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+				if (prefetch && i + TEST_PREFETCH_DISTANCE < TOKENS_NUM) {
+					bk->prefetch_token (task,
+							&tokens[i + TEST_PREFETCH_DISTANCE],
+							st_rt[j].backend_runtime, ctx);
+				}
+
+				res.st_runtime = &st_rt[j];
+				bk->process_token (task, &tokens[i], &res, ctx);
+				g_assert (res.value == (j + 1) * (i % 7 + 1));
+			}
+		}
+	}
+
+	ts2 = rspamd_get_ticks ();
+
+	return (ts2 - ts1) * 1000.0;
+}
+
+static gsize
+rspamd_statfile_test_size (const gchar *filename)
+{
+	struct stat st;
+
+	g_assert (stat (filename, &st) != -1);
+
+	return st.st_size;
+}
+
+static void
+rspamd_statfile_test_check_tokens (struct rspamd_stat_backend *bk,
+		gpointer ctx, struct rspamd_task *task,
+		struct rspamd_statfile_runtime *st_rt, rspamd_token_t *tokens)
 {
-	/*
-	 * XXX: broken, old, need to be rewritten
-	 */
-#if 0
-	statfile_pool_t *pool;
-	rspamd_mempool_t *p;
-	stat_file_t *st;
-	uint32_t random_hashes[HASHES_NUM], i, v;
-	time_t now = time (NULL);
-	
-	p = rspamd_mempool_new (rspamd_mempool_suggest_size ());
-	umask (S_IWGRP | S_IWOTH);
-	pool = statfile_pool_new (p, TRUE);
+	struct rspamd_token_result res;
+	guint i, j;
 
-	for (i = 0; i < HASHES_NUM; i ++) {
-		random_hashes[i] = ottery_rand_uint32 ();
+	for (i = 0; i < RESIZE_TOKENS_NUM; i ++) {
+		for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+			res.st_runtime = &st_rt[j];
+			bk->process_token (task, &tokens[i], &res, ctx);
+			g_assert (res.value == (j + 1) * (i % 7 + 1));
+		}
 	}
+}
+
+/*
+ * Grows statfiles over their load limit, including a resize that starts
+ * after a crashed one and a resize that is skipped while the lock is held
+ */
+static void
+rspamd_statfile_test_resize (struct rspamd_stat_backend *bk)
+{
+	struct rspamd_config *cfg;
+	struct rspamd_classifier_config *clcf;
+	struct rspamd_statfile_runtime st_rt[G_N_ELEMENTS (test_symbols)];
+	struct rspamd_token_result res;
+	struct rspamd_task *task;
+	rspamd_token_t *tokens;
+	gsize old_sizes[G_N_ELEMENTS (test_symbols)];
+	gchar *lock, *tmp;
+	guint32 h;
+	gpointer ctx;
+	gint fd;
+	guint i, j;
 
-	/* Create new file */
-	g_assert (rspamd_mmaped_file_create (pool, TEST_FILENAME, 65535) != -1);
-	g_assert ((st = rspamd_mmaped_file_open (pool, TEST_FILENAME, 65535, FALSE)) != NULL);
-	
-	/* Get and set random blocks */
-	rspamd_mmaped_file_lock_file (pool, st);
-	for (i = 0; i < HASHES_NUM; i ++) {
-		rspamd_mmaped_file_set_block (pool, st, random_hashes[i], random_hashes[i], now, 1.0);
+	for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+		unlink (test_files[j]);
 	}
-	rspamd_mmaped_file_unlock_file (pool, st);
 
-	for (i = 0; i < HASHES_NUM; i ++) {
-		v = rspamd_mmaped_file_get_block (pool, st, random_hashes[i], random_hashes[i], now);
-		g_assert(v == 1.0);
+	/* Leftovers of a resize killed in the middle */
+	lock = g_strconcat (TEST_SPAM_FILENAME, ".lock", NULL);
+	tmp = g_strconcat (TEST_SPAM_FILENAME, ".new", NULL);
+	fd = open (lock, O_WRONLY|O_CREAT, 00600);
+	g_assert (fd != -1);
+	close (fd);
+	fd = open (tmp, O_WRONLY|O_CREAT|O_TRUNC, 00600);
+	g_assert (fd != -1);
+	g_assert (write (fd, "garbage", sizeof ("garbage") - 1) > 0);
+	close (fd);
+
+	/* Sequential hashes never collide, so no token is expired */
+	tokens = g_malloc0 (sizeof (*tokens) * RESIZE_TOKENS_NUM);
+
+	for (i = 0; i < RESIZE_TOKENS_NUM; i ++) {
+		h = i + 1;
+		memcpy (tokens[i].data, &h, sizeof (h));
+		h = i * 7 + 1;
+		memcpy (tokens[i].data + sizeof (h), &h, sizeof (h));
+		tokens[i].datalen = sizeof (guint32) * 2;
 	}
 
-	rspamd_mmaped_file_destroy (pool);
+	cfg = rspamd_config_new ();
+	clcf = rspamd_statfile_test_classifier (cfg, FALSE, TEST_RESIZE_SIZE,
+			TEST_RESIZE_MAX_SIZE);
+	ctx = bk->init (rspamd_stat_get_ctx (), cfg);
+	task = rspamd_task_new (NULL, cfg);
+	rspamd_statfile_test_runtimes (bk, ctx, task, clcf, st_rt, TRUE);
+
+	for (i = 0; i < RESIZE_TOKENS_NUM; i ++) {
+		for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+			res.st_runtime = &st_rt[j];
+			res.value = (j + 1) * (i % 7 + 1);
+			g_assert (bk->learn_token (task, &tokens[i], &res, ctx));
+		}
+	}
+
+	for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+		old_sizes[j] = rspamd_statfile_test_size (test_files[j]);
+	}
+
+#ifdef HAVE_FLOCK
+	/* Another process is resizing the statfile */
+	fd = open (lock, O_WRONLY);
+	g_assert (fd != -1);
+	g_assert (rspamd_file_lock (fd, TRUE));
+	bk->finalize_learn (task, st_rt[0].backend_runtime, ctx);
+	g_assert (rspamd_statfile_test_size (TEST_SPAM_FILENAME) == old_sizes[0]);
+	rspamd_file_unlock (fd, FALSE);
+	close (fd);
 #endif
+
+	/* Task has no event base, so resize is finished synchronously */
+	for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+		bk->finalize_learn (task, st_rt[j].backend_runtime, ctx);
+		g_assert (rspamd_statfile_test_size (test_files[j]) > old_sizes[j]);
+		g_assert (rspamd_statfile_test_size (test_files[j]) <=
+				TEST_RESIZE_MAX_SIZE);
+	}
+
+	g_assert (access (tmp, F_OK) == -1);
+	rspamd_statfile_test_check_tokens (bk, ctx, task, st_rt, tokens);
+	rspamd_task_free (task);
+	bk->close (ctx);
+
+	/* Grown statfiles are opened as is and are not reindexed back */
+	cfg = rspamd_config_new ();
+	clcf = rspamd_statfile_test_classifier (cfg, FALSE, TEST_RESIZE_SIZE,
+			TEST_RESIZE_MAX_SIZE);
+	ctx = bk->init (rspamd_stat_get_ctx (), cfg);
+	task = rspamd_task_new (NULL, cfg);
+	rspamd_statfile_test_runtimes (bk, ctx, task, clcf, st_rt, FALSE);
+	rspamd_statfile_test_check_tokens (bk, ctx, task, st_rt, tokens);
+
+	for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+		g_assert (rspamd_statfile_test_size (test_files[j]) > old_sizes[j]);
+	}
+
+	rspamd_task_free (task);
+	bk->close (ctx);
+
+	g_free (tokens);
+	g_free (lock);
+	g_free (tmp);
+
+	for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+		unlink (test_files[j]);
+		lock = g_strconcat (test_files[j], ".lock", NULL);
+		unlink (lock);
+		g_free (lock);
+	}
+}
+
+static ino_t
+rspamd_statfile_test_inode (const gchar *filename)
+{
+	struct stat st;
+
+	g_assert (stat (filename, &st) != -1);
+
+	return st.st_ino;
+}
+
+/*
+ * Two handles on the same statfile: once one of them resizes it, the other
+ * must switch to the new file instead of resizing it once again
+ */
+static void
+rspamd_statfile_test_two_handles (struct rspamd_stat_backend *bk)
+{
+	struct rspamd_config *cfg[2];
+	struct rspamd_classifier_config *clcf[2];
+	struct rspamd_statfile_runtime st_rt[2][G_N_ELEMENTS (test_symbols)];
+	struct rspamd_token_result res;
+	struct rspamd_task *task[2];
+	rspamd_token_t *tokens;
+	gpointer ctx[2];
+	gchar *lock;
+	ino_t inode;
+	guint32 h;
+	guint i, j, k;
+
+	for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+		unlink (test_files[j]);
+	}
+
+	tokens = g_malloc0 (sizeof (*tokens) * RESIZE_TOKENS_NUM);
+
+	for (i = 0; i < RESIZE_TOKENS_NUM; i ++) {
+		h = i + 1;
+		memcpy (tokens[i].data, &h, sizeof (h));
+		h = i * 7 + 1;
+		memcpy (tokens[i].data + sizeof (h), &h, sizeof (h));
+		tokens[i].datalen = sizeof (guint32) * 2;
+	}
+
+	for (k = 0; k < 2; k ++) {
+		cfg[k] = rspamd_config_new ();
+		clcf[k] = rspamd_statfile_test_classifier (cfg[k], FALSE,
+				TEST_RESIZE_SIZE, TEST_RESIZE_MAX_SIZE);
+		ctx[k] = bk->init (rspamd_stat_get_ctx (), cfg[k]);
+		task[k] = rspamd_task_new (NULL, cfg[k]);
+		rspamd_statfile_test_runtimes (bk, ctx[k], task[k], clcf[k], st_rt[k],
+				TRUE);
+	}
+
+	/* The last token is learned after the resize */
+	for (i = 0; i < RESIZE_TOKENS_NUM - 1; i ++) {
+		res.st_runtime = &st_rt[0][0];
+		res.value = i % 7 + 1;
+		g_assert (bk->learn_token (task[0], &tokens[i], &res, ctx[0]));
+	}
+
+	bk->finalize_learn (task[0], st_rt[0][0].backend_runtime, ctx[0]);
+	inode = rspamd_statfile_test_inode (TEST_SPAM_FILENAME);
+
+	/* The second handle still maps the old file, which is over its limit */
+	bk->finalize_learn (task[1], st_rt[1][0].backend_runtime, ctx[1]);
+	g_assert (rspamd_statfile_test_inode (TEST_SPAM_FILENAME) == inode);
+
+	res.st_runtime = &st_rt[0][0];
+	res.value = (RESIZE_TOKENS_NUM - 1) % 7 + 1;
+	g_assert (bk->learn_token (task[0], &tokens[RESIZE_TOKENS_NUM - 1], &res,
+			ctx[0]));
+
+	for (i = 0; i < RESIZE_TOKENS_NUM; i ++) {
+		res.st_runtime = &st_rt[1][0];
+		bk->process_token (task[1], &tokens[i], &res, ctx[1]);
+		g_assert (res.value == i % 7 + 1);
+	}
+
+	for (k = 0; k < 2; k ++) {
+		rspamd_task_free (task[k]);
+		bk->close (ctx[k]);
+	}
+
+	g_free (tokens);
+
+	for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+		unlink (test_files[j]);
+		lock = g_strconcat (test_files[j], ".lock", NULL);
+		unlink (lock);
+		g_free (lock);
+	}
+}
+
+void
+rspamd_statfile_test_func (void)
+{
+	struct rspamd_config *cfg;
+	struct rspamd_classifier_config *clcf;
+	struct rspamd_stat_backend *bk;
+	struct rspamd_statfile_runtime st_rt[G_N_ELEMENTS (test_symbols)];
+	struct rspamd_token_result res;
+	struct rspamd_task *task;
+	rspamd_token_t *tokens;
+	gpointer ctx;
+	gdouble diff_split, diff_combined;
+	guint i, j;
+
+	unlink (TEST_SPAM_FILENAME);
+	unlink (TEST_HAM_FILENAME);
+	unlink (TEST_COMBINED_FILENAME);
+
+	bk = rspamd_stat_get_backend ("mmap");
+	g_assert (bk != NULL);
+
+	tokens = g_malloc0 (sizeof (*tokens) * TOKENS_NUM);
+
+	for (i = 0; i < TOKENS_NUM; i ++) {
+		ottery_rand_bytes (tokens[i].data, sizeof (guint32) * 2);
+		tokens[i].datalen = sizeof (guint32) * 2;
+	}
+
+	/* Learn separate statfiles */
+	cfg = rspamd_config_new ();
+	clcf = rspamd_statfile_test_classifier (cfg, FALSE, TEST_STATFILE_SIZE,
+			0);
+	ctx = bk->init (rspamd_stat_get_ctx (), cfg);
+	task = rspamd_task_new (NULL, cfg);
+	rspamd_statfile_test_runtimes (bk, ctx, task, clcf, st_rt, TRUE);
+
+	for (i = 0; i < TOKENS_NUM; i ++) {
+		for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+			res.st_runtime = &st_rt[j];
+			res.value = (j + 1) * (i % 7 + 1);
+			g_assert (bk->learn_token (task, &tokens[i], &res, ctx));
+		}
+	}
+
+	for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+		for (i = 0; i <= j; i ++) {
+			bk->inc_learns (task, st_rt[j].backend_runtime, ctx);
+		}
+	}
+
+	diff_split = rspamd_statfile_test_lookup (bk, ctx, task, st_rt, tokens,
+			FALSE);
+	rspamd_task_free (task);
+	bk->close (ctx);
+
+	/* Combined statfile is converted from the separate ones on load */
+	cfg = rspamd_config_new ();
+	clcf = rspamd_statfile_test_classifier (cfg, TRUE, TEST_STATFILE_SIZE,
+			0);
+	ctx = bk->init (rspamd_stat_get_ctx (), cfg);
+	task = rspamd_task_new (NULL, cfg);
+	rspamd_statfile_test_runtimes (bk, ctx, task, clcf, st_rt, FALSE);
+
+	for (j = 0; j < G_N_ELEMENTS (test_symbols); j ++) {
+		g_assert (bk->total_learns (task, st_rt[j].backend_runtime, ctx) ==
+				j + 1);
+	}
+
+	diff_combined = rspamd_statfile_test_lookup (bk, ctx, task, st_rt, tokens,
+			TRUE);
+	rspamd_task_free (task);
+	bk->close (ctx);
+
+	msg_info ("looked up %d tokens in %d statfiles %d times: "
+			"separate files: %.3f ms, combined file with prefetch: %.3f ms",
+			TOKENS_NUM, (gint)G_N_ELEMENTS (test_symbols), LOOKUP_CYCLES,
+			diff_split, diff_combined);
+
+	g_free (tokens);
+	unlink (TEST_SPAM_FILENAME);
+	unlink (TEST_HAM_FILENAME);
+	unlink (TEST_COMBINED_FILENAME);
+	unlink (TEST_COMBINED_FILENAME ".lock");
+
+	rspamd_statfile_test_resize (bk);
+	rspamd_statfile_test_two_handles (bk);
 }
@@ -51,9 +51,16 @@ main (int argc, char **argv)
 	g_test_add_func ("/rspamd/upstream", rspamd_upstream_test_func);
 	g_test_add_func ("/rspamd/shingles", rspamd_shingles_test_func);
 	g_test_add_func ("/rspamd/http", rspamd_http_test_func);
+	g_test_add_func ("/rspamd/lua_pool", rspamd_lua_pool_test_func);
 	g_test_add_func ("/rspamd/lua", rspamd_lua_test_func);
 	g_test_add_func ("/rspamd/crypto", rspamd_cryptobox_test_func);
 	g_test_add_func ("/rspamd/cryptobox", rspamd_cryptobox_test_func);
+	g_test_add_func ("/rspamd/lru", rspamd_lru_test_func);
+	g_test_add_func ("/rspamd/counters", rspamd_counters_test_func);
+	g_test_add_func ("/rspamd/fuzzy_backend", rspamd_fuzzy_backend_test_func);
+	g_test_add_func ("/rspamd/shm_cache", rspamd_shm_cache_test_func);
+	g_test_add_func ("/rspamd/spf", rspamd_spf_test_func);
+	g_test_add_func ("/rspamd/protocol", rspamd_protocol_test_func);
 
 	g_test_run ();
 
@@ -37,6 +37,20 @@ void rspamd_http_test_func (void);
 
 void rspamd_lua_test_func (void);
 
+void rspamd_lua_pool_test_func (void);
+
 void rspamd_cryptobox_test_func (void);
 
+void rspamd_lru_test_func (void);
+
+void rspamd_counters_test_func (void);
+
+void rspamd_fuzzy_backend_test_func (void);
+
+void rspamd_shm_cache_test_func (void);
+
+void rspamd_spf_test_func (void);
+
+void rspamd_protocol_test_func (void);
+
 #endif
@@ -0,0 +1,774 @@
+/*
+ * Copyright (c) 2015, Vsevolod Stakhov
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *	 * Redistributions of source code must retain the above copyright
+ *	   notice, this list of conditions and the following disclaimer.
+ *	 * Redistributions in binary form must reproduce the above copyright
+ *	   notice, this list of conditions and the following disclaimer in the
+ *	   documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY AUTHOR ''AS IS'' AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "config.h"
+#include "rspamd.h"
+#include "util.h"
+#include "message.h"
+#include "html.h"
+#include "url.h"
+#include "task.h"
+#include "re_cache.h"
+#include "expression.h"
+#include "mime_expressions.h"
+#include "shingles.h"
+#include "cryptobox.h"
+#include "ottery.h"
+#include "libstat/stat_api.h"
+#include "libstat/tokenizers/tokenizers.h"
+#include "unix-std.h"
+#include <math.h>
+
+#ifndef RSPAMD_BENCH_CORPUS
+#define RSPAMD_BENCH_CORPUS "test/functional/messages"
+#endif
+#ifndef RSPAMD_BENCH_TLD
+#define RSPAMD_BENCH_TLD NULL
+#endif
+
+#define BENCH_SPAM_FILENAME "/tmp/rspamd_bench_spam.stat"
+#define BENCH_HAM_FILENAME "/tmp/rspamd_bench_ham.stat"
+#define BENCH_STATFILE_SIZE (10 * 1024 * 1024)
+
+static gchar *corpus_dir = RSPAMD_BENCH_CORPUS;
+static gchar *tld_file = RSPAMD_BENCH_TLD;
+static gchar *output_file = NULL;
+static guint iterations = 10;
+static gboolean no_bayes = FALSE;
+
+static GOptionEntry entries[] = {
+		{"corpus", 'd', 0, G_OPTION_ARG_FILENAME, &corpus_dir,
+				"Directory with messages (default: test/functional/messages)", NULL},
+		{"iterations", 'n', 0, G_OPTION_ARG_INT, &iterations,
+				"Number of passes over the corpus (default: 10)", NULL},
+		{"tld", 't', 0, G_OPTION_ARG_FILENAME, &tld_file,
+				"Use the specified tld file for urls extraction", NULL},
+		{"output", 'o', 0, G_OPTION_ARG_FILENAME, &output_file,
+				"Write JSON report to the specified file (default: stdout)", NULL},
+		{"no-bayes", 0, 0, G_OPTION_ARG_NONE, &no_bayes,
+				"Do not learn and run bayes classifier", NULL},
+		{NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL}
+};
+
+enum rspamd_bench_stage {
+	BENCH_STAGE_PARSE = 0,
+	BENCH_STAGE_HTML,
+	BENCH_STAGE_URLS,
+	BENCH_STAGE_TOKENIZE,
+	BENCH_STAGE_BAYES,
+	BENCH_STAGE_RE_CACHE,
+	BENCH_STAGE_EXPRESSION,
+	BENCH_STAGE_SHINGLES,
+	BENCH_STAGE_SHINGLES_FAST,
+	BENCH_STAGE_CRYPTOBOX,
+	BENCH_STAGE_MAX
+};
+
+static const gchar *stage_names[BENCH_STAGE_MAX] = {
+	[BENCH_STAGE_PARSE] = "parse",
+	[BENCH_STAGE_HTML] = "html",
+	[BENCH_STAGE_URLS] = "urls",
+	[BENCH_STAGE_TOKENIZE] = "tokenize",
+	[BENCH_STAGE_BAYES] = "bayes",
+	[BENCH_STAGE_RE_CACHE] = "re_cache",
+	[BENCH_STAGE_EXPRESSION] = "expression",
+	[BENCH_STAGE_SHINGLES] = "shingles",
+	[BENCH_STAGE_SHINGLES_FAST] = "shingles_fast",
+	[BENCH_STAGE_CRYPTOBOX] = "cryptobox",
+};
+
+/* Regexps that are matched directly via re_cache */
+static const struct {
+	enum rspamd_re_type type;
+	const gchar *header;
+	const gchar *re;
+} bench_regexps[] = {
+	{RSPAMD_RE_HEADER, "Subject", "/\\b(?:free|viagra|winner|urgent)\\b/i"},
+	{RSPAMD_RE_HEADER, "From", "/<[^@>]+@[^>]+>/"},
+	{RSPAMD_RE_ALLHEADER, NULL, "/^X-Mailer:.*(?:bulk|mass)/im"},
+	{RSPAMD_RE_MIME, NULL, "/\\bunsubscribe\\b/i"},
+	{RSPAMD_RE_MIME, NULL, "/(?:click|visit)\\s+(?:here|now)/i"},
+	{RSPAMD_RE_BODY, NULL, "/^Content-Transfer-Encoding:\\s*base64/im"},
+	{RSPAMD_RE_URL, NULL, "/\\.(?:ru|cn|biz)\\b/i"},
+};
+
+/* Expressions evaluated with mime expressions atoms */
+static const gchar *bench_expressions[] = {
+	"has_content_part('text/html') & !is_html_balanced()",
+	"has_only_html_part() | has_fake_html()",
+	"compare_parts_distance(50) & !header_exists('List-Id')",
+	"content_type_is_type('multipart') & Subject=/\\d{4,}/",
+	"header_exists('Reply-To') & !From=/\\.(?:com|org|net)>?$/i",
+};
+
+struct rspamd_bench_msg {
+	gchar *name;
+	gchar *data;
+	gsize len;
+};
+
+struct rspamd_bench_stat {
+	GArray *latencies;
+	guint64 bytes_allocated;
+	guint64 chunks_allocated;
+};
+
+struct rspamd_bench_probe {
+	gdouble ts;
+	rspamd_mempool_stat_t mst;
+};
+
+struct rspamd_bench_ctx {
+	struct rspamd_config *cfg;
+	struct event_base *ev_base;
+	GPtrArray *messages;
+	struct rspamd_bench_stat stats[BENCH_STAGE_MAX];
+	rspamd_regexp_t *regexps[G_N_ELEMENTS (bench_regexps)];
+	struct rspamd_expression *expressions[G_N_ELEMENTS (bench_expressions)];
+	guchar shingles_key[16];
+	rspamd_nm_t nm;
+	gdouble total_time;
+	guint64 total_bytes;
+	guint processed;
+	guint errors;
+};
+
+static inline void
+rspamd_bench_start (struct rspamd_bench_probe *p)
+{
+	rspamd_mempool_stat (&p->mst);
+	p->ts = rspamd_get_ticks ();
+}
+
+static inline void
+rspamd_bench_stop (struct rspamd_bench_ctx *ctx, enum rspamd_bench_stage stage,
+		struct rspamd_bench_probe *p)
+{
+	struct rspamd_bench_stat *st = &ctx->stats[stage];
+	rspamd_mempool_stat_t mst;
+	gdouble lat;
+
+	lat = (rspamd_get_ticks () - p->ts) * 1000.0;
+	rspamd_mempool_stat (&mst);
+	g_array_append_val (st->latencies, lat);
+	st->bytes_allocated += mst.bytes_allocated - p->mst.bytes_allocated;
+	st->chunks_allocated += mst.chunks_allocated - p->mst.chunks_allocated;
+}
+
+static gint
+rspamd_bench_msg_cmp (gconstpointer a, gconstpointer b)
+{
+	const struct rspamd_bench_msg *m1 = *(const struct rspamd_bench_msg **)a,
+			*m2 = *(const struct rspamd_bench_msg **)b;
+
+	return strcmp (m1->name, m2->name);
+}
+
+static GPtrArray *
+rspamd_bench_load_corpus (const gchar *dir)
+{
+	GPtrArray *res;
+	GDir *d;
+	GError *err = NULL;
+	const gchar *fname;
+	struct rspamd_bench_msg *m;
+	gchar *path;
+
+	d = g_dir_open (dir, 0, &err);
+
+	if (d == NULL) {
+		rspamd_fprintf (stderr, "cannot open corpus %s: %s\n", dir,
+				err->message);
+		g_error_free (err);
+
+		return NULL;
+	}
+
+	res = g_ptr_array_new ();
+
+	while ((fname = g_dir_read_name (d)) != NULL) {
+		path = g_build_filename (dir, fname, NULL);
+
+		if (g_file_test (path, G_FILE_TEST_IS_REGULAR)) {
+			m = g_slice_alloc0 (sizeof (*m));
+
+			if (g_file_get_contents (path, &m->data, &m->len, &err) &&
+					m->len > 0) {
+				m->name = g_strdup (fname);
+				g_ptr_array_add (res, m);
+			}
+			else {
+				if (err) {
+					rspamd_fprintf (stderr, "cannot read %s: %s\n", path,
+							err->message);
+					g_error_free (err);
+					err = NULL;
+				}
+
+				g_free (m->data);
+				g_slice_free1 (sizeof (*m), m);
+			}
+		}
+
+		g_free (path);
+	}
+
+	g_dir_close (d);
+	g_ptr_array_sort (res, rspamd_bench_msg_cmp);
+
+	return res;
+}
+
+static void
+rspamd_bench_init_bayes (struct rspamd_config *cfg)
+{
+	struct rspamd_classifier_config *clcf;
+	struct rspamd_statfile_config *stcf;
+	static const gchar *symbols[] = {"BAYES_SPAM", "BAYES_HAM"};
+	static const gchar *files[] = {BENCH_SPAM_FILENAME, BENCH_HAM_FILENAME};
+	guint i;
+
+	clcf = rspamd_config_new_classifier (cfg, NULL);
+	clcf->name = "bayes";
+	clcf->classifier = "bayes";
+	clcf->backend = "mmap";
+	clcf->tokenizer = rspamd_mempool_alloc0 (cfg->cfg_pool,
+			sizeof (*clcf->tokenizer));
+	clcf->tokenizer->name = "osb";
+
+	for (i = 0; i < G_N_ELEMENTS (symbols); i ++) {
+		unlink (files[i]);
+		stcf = rspamd_config_new_statfile (cfg, NULL);
+		stcf->symbol = (gchar *)symbols[i];
+		stcf->is_spam = (i == 0);
+		stcf->clcf = clcf;
+		stcf->opts = ucl_object_typed_new (UCL_OBJECT);
+		ucl_object_insert_key (stcf->opts,
+				ucl_object_fromstring (files[i]), "filename", 0, false);
+		ucl_object_insert_key (stcf->opts,
+				ucl_object_fromint (BENCH_STATFILE_SIZE), "size", 0, false);
+		rspamd_mempool_add_destructor (cfg->cfg_pool,
+				(rspamd_mempool_destruct_t)ucl_object_unref, stcf->opts);
+		clcf->statfiles = g_list_append (clcf->statfiles, stcf);
+	}
+
+	cfg->classifiers = g_list_append (cfg->classifiers, clcf);
+}
+
+static gboolean
+rspamd_bench_init_rules (struct rspamd_bench_ctx *ctx)
+{
+	struct rspamd_config *cfg = ctx->cfg;
+	GError *err = NULL;
+	rspamd_pk_t pk;
+	rspamd_sk_t sk;
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (bench_regexps); i ++) {
+		ctx->regexps[i] = rspamd_regexp_new (bench_regexps[i].re, NULL, &err);
+
+		if (ctx->regexps[i] == NULL) {
+			rspamd_fprintf (stderr, "cannot parse regexp %s: %s\n",
+					bench_regexps[i].re, err->message);
+			g_error_free (err);
+
+			return FALSE;
+		}
+
+		rspamd_re_cache_add (cfg->re_cache, ctx->regexps[i],
+				bench_regexps[i].type, (gpointer)bench_regexps[i].header,
+				bench_regexps[i].header ? strlen (bench_regexps[i].header) : 0);
+	}
+
+	/* Mime expressions add their regexps to the cache as well */
+	for (i = 0; i < G_N_ELEMENTS (bench_expressions); i ++) {
+		if (!rspamd_parse_expression (bench_expressions[i], 0, &mime_expr_subr,
+				cfg, cfg->cfg_pool, &err, &ctx->expressions[i])) {
+			rspamd_fprintf (stderr, "cannot parse expression %s: %s\n",
+					bench_expressions[i], err->message);
+			g_error_free (err);
+
+			return FALSE;
+		}
+	}
+
+	rspamd_re_cache_init (cfg->re_cache);
+
+	ottery_rand_bytes (ctx->shingles_key, sizeof (ctx->shingles_key));
+	rspamd_cryptobox_keypair (pk, sk);
+	rspamd_cryptobox_nm (ctx->nm, pk, sk);
+
+	return TRUE;
+}
+
+static struct rspamd_task *
+rspamd_bench_task_new (struct rspamd_bench_ctx *ctx,
+		struct rspamd_bench_msg *m)
+{
+	struct rspamd_task *task;
+
+	task = rspamd_task_new (NULL, ctx->cfg);
+	task->ev_base = ctx->ev_base;
+
+	if (!rspamd_task_load_message (task, NULL, m->data, m->len) ||
+			!rspamd_message_parse (task)) {
+		msg_err ("cannot parse message %s", m->name);
+		rspamd_task_free (task);
+
+		return NULL;
+	}
+
+	return task;
+}
+
+static void
+rspamd_bench_learn (struct rspamd_bench_ctx *ctx)
+{
+	struct rspamd_bench_msg *m;
+	struct rspamd_task *task;
+	GError *err = NULL;
+	guint i;
+
+	/* Bayes classification makes no sense with empty statfiles */
+	for (i = 0; i < ctx->messages->len; i ++) {
+		m = g_ptr_array_index (ctx->messages, i);
+		task = rspamd_bench_task_new (ctx, m);
+
+		if (task == NULL) {
+			continue;
+		}
+
+		if (rspamd_stat_learn (task, i % 2 == 0, ctx->cfg->lua_state, NULL,
+				&err) != RSPAMD_STAT_PROCESS_OK) {
+			msg_info ("cannot learn message %s: %s", m->name,
+					err ? err->message : "unknown error");
+
+			if (err) {
+				g_error_free (err);
+				err = NULL;
+			}
+		}
+
+		rspamd_task_free (task);
+	}
+}
+
+static guint
+rspamd_bench_extract_urls (rspamd_mempool_t *pool, struct mime_text_part *part)
+{
+	const gchar *p, *end, *url_start, *url_end;
+	gchar *url_str;
+	struct rspamd_url *url;
+	gint state = 0;
+	guint nurls = 0;
+
+	p = (const gchar *)part->content->data;
+	end = p + part->content->len;
+
+	while (p < end) {
+		url_str = NULL;
+
+		if (!rspamd_url_find (pool, p, end - p, &url_start, &url_end, &url_str,
+				IS_PART_HTML (part), &state) || url_end <= p) {
+			break;
+		}
+
+		if (url_str != NULL) {
+			url = rspamd_mempool_alloc0 (pool, sizeof (*url));
+
+			if (rspamd_url_parse (url, url_str, strlen (url_str), pool) ==
+					URI_ERRNO_OK) {
+				nurls ++;
+			}
+		}
+
+		p = url_end;
+	}
+
+	return nurls;
+}
+
+static void
+rspamd_bench_message (struct rspamd_bench_ctx *ctx, struct rspamd_bench_msg *m)
+{
+	struct rspamd_bench_probe p;
+	struct rspamd_task *task;
+	struct mime_text_part *part;
+	struct html_content *hc;
+	struct rspamd_shingle *sgl;
+	guchar digest[rspamd_cryptobox_HASHBYTES];
+	rspamd_nonce_t nonce;
+	rspamd_sig_t sig;
+	GError *err = NULL;
+	GArray *words;
+	gpointer copy;
+	gdouble t1;
+	guint i;
+
+	t1 = rspamd_get_ticks ();
+
+	rspamd_bench_start (&p);
+	task = rspamd_bench_task_new (ctx, m);
+
+	if (task == NULL) {
+		ctx->errors ++;
+		return;
+	}
+
+	rspamd_bench_stop (ctx, BENCH_STAGE_PARSE, &p);
+
+	rspamd_bench_start (&p);
+	for (i = 0; i < task->text_parts->len; i ++) {
+		part = g_ptr_array_index (task->text_parts, i);
+
+		if (IS_PART_HTML (part) && part->orig != NULL) {
+			hc = rspamd_mempool_alloc0 (task->task_pool, sizeof (*hc));
+			rspamd_html_process_part (task->task_pool, hc, part->orig);
+		}
+	}
+	rspamd_bench_stop (ctx, BENCH_STAGE_HTML, &p);
+
+	rspamd_bench_start (&p);
+	for (i = 0; i < task->text_parts->len; i ++) {
+		part = g_ptr_array_index (task->text_parts, i);
+
+		if (!IS_PART_EMPTY (part) && part->content != NULL) {
+			rspamd_bench_extract_urls (task->task_pool, part);
+		}
+	}
+	rspamd_bench_stop (ctx, BENCH_STAGE_URLS, &p);
+
+	rspamd_bench_start (&p);
+	for (i = 0; i < task->text_parts->len; i ++) {
+		part = g_ptr_array_index (task->text_parts, i);
+
+		if (!IS_PART_EMPTY (part) && part->content != NULL) {
+			words = rspamd_tokenize_text (part->content->data,
+					part->content->len, IS_PART_UTF (part), ctx->cfg,
+					part->urls_offset, FALSE, NULL);
+
+			if (words != NULL) {
+				g_array_free (words, TRUE);
+			}
+		}
+	}
+	rspamd_bench_stop (ctx, BENCH_STAGE_TOKENIZE, &p);
+
+	if (!no_bayes) {
+		rspamd_bench_start (&p);
+		if (rspamd_stat_classify (task, ctx->cfg->lua_state, &err) ==
+				RSPAMD_STAT_PROCESS_ERROR) {
+			msg_debug ("cannot classify %s: %s", m->name,
+					err ? err->message : "unknown error");
+		}
+		if (err) {
+			g_error_free (err);
+			err = NULL;
+		}
+		rspamd_bench_stop (ctx, BENCH_STAGE_BAYES, &p);
+	}
+
+	rspamd_bench_start (&p);
+	for (i = 0; i < G_N_ELEMENTS (bench_regexps); i ++) {
+		rspamd_re_cache_process (task, task->re_rt, ctx->regexps[i],
+				bench_regexps[i].type, (gpointer)bench_regexps[i].header,
+				bench_regexps[i].header ? strlen (bench_regexps[i].header) : 0,
+				FALSE, FALSE);
+	}
+	rspamd_bench_stop (ctx, BENCH_STAGE_RE_CACHE, &p);
+
+	rspamd_bench_start (&p);
+	for (i = 0; i < G_N_ELEMENTS (bench_expressions); i ++) {
+		rspamd_process_expression (ctx->expressions[i], 0, task);
+	}
+	rspamd_bench_stop (ctx, BENCH_STAGE_EXPRESSION, &p);
+
+	rspamd_bench_start (&p);
+	for (i = 0; i < task->text_parts->len; i ++) {
+		part = g_ptr_array_index (task->text_parts, i);
+
+		if (part->normalized_words != NULL) {
+			sgl = rspamd_shingles_generate (part->normalized_words,
+					ctx->shingles_key, task->task_pool,
+					rspamd_shingles_default_filter, NULL);
+			(void)sgl;
+		}
+	}
+	rspamd_bench_stop (ctx, BENCH_STAGE_SHINGLES, &p);
+
+	rspamd_bench_start (&p);
+	for (i = 0; i < task->text_parts->len; i ++) {
+		part = g_ptr_array_index (task->text_parts, i);
+
+		if (part->normalized_words != NULL) {
+			sgl = rspamd_shingles_generate_fast (part->normalized_words,
+					ctx->shingles_key, task->task_pool);
+			(void)sgl;
+		}
+	}
+	rspamd_bench_stop (ctx, BENCH_STAGE_SHINGLES_FAST, &p);
+
+	/* Digest of the whole message and encryption like in fuzzy or http */
+	rspamd_bench_start (&p);
+	rspamd_cryptobox_hash (digest, m->data, m->len, NULL, 0);
+	copy = rspamd_mempool_alloc (task->task_pool, m->len);
+	memcpy (copy, m->data, m->len);
+	ottery_rand_bytes (nonce, sizeof (nonce));
+	rspamd_cryptobox_encrypt_nm_inplace (copy, m->len, nonce, ctx->nm, sig);
+	rspamd_bench_stop (ctx, BENCH_STAGE_CRYPTOBOX, &p);
+
+	rspamd_task_free (task);
+
+	ctx->total_time += rspamd_get_ticks () - t1;
+	ctx->total_bytes += m->len;
+	ctx->processed ++;
+}
+
+static gint
+rspamd_bench_double_cmp (gconstpointer a, gconstpointer b)
+{
+	gdouble d1 = *(const gdouble *)a, d2 = *(const gdouble *)b;
+
+	if (d1 < d2) {
+		return -1;
+	}
+	else if (d1 > d2) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static gdouble
+rspamd_bench_percentile (GArray *sorted, gdouble pct)
+{
+	gsize idx;
+
+	if (sorted->len == 0) {
+		return 0.0;
+	}
+
+	idx = ceil (pct / 100.0 * sorted->len);
+	idx = idx > 0 ? idx - 1 : 0;
+
+	return g_array_index (sorted, gdouble, MIN (idx, sorted->len - 1));
+}
+
+static ucl_object_t *
+rspamd_bench_stage_report (struct rspamd_bench_stat *st)
+{
+	ucl_object_t *obj;
+	gdouble total = 0.0;
+	guint i;
+
+	g_array_sort (st->latencies, rspamd_bench_double_cmp);
+
+	for (i = 0; i < st->latencies->len; i ++) {
+		total += g_array_index (st->latencies, gdouble, i);
+	}
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromint (st->latencies->len),
+			"count", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (total),
+			"total_ms", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (st->latencies->len > 0 ?
+			total / st->latencies->len : 0.0),
+			"mean_ms", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamd_bench_percentile (st->latencies, 50)),
+			"p50_ms", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamd_bench_percentile (st->latencies, 90)),
+			"p90_ms", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamd_bench_percentile (st->latencies, 99)),
+			"p99_ms", 0, false);
+	ucl_object_insert_key (obj,
+			ucl_object_fromdouble (rspamd_bench_percentile (st->latencies, 100)),
+			"max_ms", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st->bytes_allocated),
+			"allocated_bytes", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromint (st->chunks_allocated),
+			"allocated_chunks", 0, false);
+
+	return obj;
+}
+
+static ucl_object_t *
+rspamd_bench_report (struct rspamd_bench_ctx *ctx)
+{
+	ucl_object_t *top, *obj;
+	guint i;
+
+	top = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (top, ucl_object_fromstring (RVERSION),
+			"version", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromstring (corpus_dir),
+			"corpus", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->messages->len),
+			"messages", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (iterations),
+			"iterations", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->processed),
+			"processed", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->errors),
+			"errors", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromint (ctx->total_bytes),
+			"bytes", 0, false);
+	ucl_object_insert_key (top, ucl_object_fromdouble (ctx->total_time),
+			"time", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (ctx->total_time > 0 ?
+			ctx->processed / ctx->total_time : 0.0),
+			"messages_per_sec", 0, false);
+	ucl_object_insert_key (obj, ucl_object_fromdouble (ctx->total_time > 0 ?
+			ctx->total_bytes / ctx->total_time / (1024.0 * 1024.0) : 0.0),
+			"mbytes_per_sec", 0, false);
+	ucl_object_insert_key (top, obj, "throughput", 0, false);
+
+	obj = ucl_object_typed_new (UCL_OBJECT);
+
+	for (i = 0; i < BENCH_STAGE_MAX; i ++) {
+		if (ctx->stats[i].latencies->len > 0) {
+			ucl_object_insert_key (obj,
+					rspamd_bench_stage_report (&ctx->stats[i]),
+					stage_names[i], 0, false);
+		}
+	}
+
+	ucl_object_insert_key (top, obj, "stages", 0, false);
+
+	return top;
+}
+
+int
+main (int argc, char **argv)
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	struct rspamd_bench_ctx ctx;
+	struct rspamd_bench_msg *m;
+	ucl_object_t *report;
+	guchar *out;
+	FILE *f;
+	guint i, j;
+
+	context = g_option_context_new (
+			"rspamd-bench - run messages corpus through rspamd hot paths");
+	g_option_context_set_summary (context,
+			"Summary:\n  Rspamd benchmark "
+					RVERSION
+					"\n  Release id: "
+					RID);
+	g_option_context_add_main_entries (context, entries, NULL);
+
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		rspamd_fprintf (stderr, "option parsing failed: %s\n", error->message);
+		g_error_free (error);
+		exit (1);
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+	ctx.messages = rspamd_bench_load_corpus (corpus_dir);
+
+	if (ctx.messages == NULL || ctx.messages->len == 0) {
+		rspamd_fprintf (stderr, "no messages found in %s\n", corpus_dir);
+		exit (1);
+	}
+
+	ctx.cfg = rspamd_config_new ();
+	ctx.cfg->libs_ctx = rspamd_init_libs ();
+	rspamd_url_init (tld_file);
+	ctx.ev_base = event_init ();
+
+	if (!no_bayes) {
+		rspamd_bench_init_bayes (ctx.cfg);
+	}
+
+	rspamd_stat_init (ctx.cfg);
+
+	if (!rspamd_bench_init_rules (&ctx)) {
+		exit (1);
+	}
+
+	for (i = 0; i < BENCH_STAGE_MAX; i ++) {
+		ctx.stats[i].latencies = g_array_sized_new (FALSE, FALSE,
+				sizeof (gdouble), ctx.messages->len * iterations);
+	}
+
+	if (!no_bayes) {
+		rspamd_bench_learn (&ctx);
+	}
+
+	for (j = 0; j < iterations; j ++) {
+		for (i = 0; i < ctx.messages->len; i ++) {
+			m = g_ptr_array_index (ctx.messages, i);
+			rspamd_bench_message (&ctx, m);
+		}
+	}
+
+	report = rspamd_bench_report (&ctx);
+	out = ucl_object_emit (report, UCL_EMIT_JSON);
+
+	if (output_file) {
+		f = fopen (output_file, "w");
+
+		if (f == NULL) {
+			rspamd_fprintf (stderr, "cannot open %s: %s\n", output_file,
+					strerror (errno));
+			exit (1);
+		}
+
+		rspamd_fprintf (f, "%s\n", out);
+		fclose (f);
+	}
+	else {
+		rspamd_printf ("%s\n", out);
+	}
+
+	free (out);
+	ucl_object_unref (report);
+
+	for (i = 0; i < BENCH_STAGE_MAX; i ++) {
+		g_array_free (ctx.stats[i].latencies, TRUE);
+	}
+
+	for (i = 0; i < ctx.messages->len; i ++) {
+		m = g_ptr_array_index (ctx.messages, i);
+		g_free (m->name);
+		g_free (m->data);
+		g_slice_free1 (sizeof (*m), m);
+	}
+
+	g_ptr_array_free (ctx.messages, TRUE);
+
+	if (!no_bayes) {
+		rspamd_stat_close ();
+		unlink (BENCH_SPAM_FILENAME);
+		unlink (BENCH_HAM_FILENAME);
+	}
+
+	return 0;
+}